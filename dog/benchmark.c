@@ -17,6 +17,7 @@
 #include "dog.h"
 #include "sheep.h"
 #include "work.h"
+#include "fec.h"
 
 static struct sd_option benchmark_options[] = {
 	{'w', "workqueue", true, "specify workqueue type"},
@@ -24,10 +25,17 @@ static struct sd_option benchmark_options[] = {
 	{'t', "total", true, "a number of total operation (e.g. I/O request)"},
 	{'n', "nr-threads", true, "a number of worker threads"
 	 " (only used for fixed workqueue)"},
+	{'s', "spin", true, "a number of loops each work spins"
+	 " (only used for workqueue benchmark)"},
+	{'c', "copies", true, "specify the erasure code scheme x:y"
+	 " (only used for ec benchmark)"},
 	{ 0, NULL, false, NULL },
 };
 
 #define DEFAULT_TOTAL 1000
+#define DEFAULT_WQ_TOTAL 1000000
+#define DEFAULT_SPIN 1000
+#define DEFAULT_EC_TOTAL 100
 #define WQ_TYPE_LEN 32
 
 static struct benchmark_cmd_data {
@@ -35,8 +43,44 @@ static struct benchmark_cmd_data {
 	bool force;
 	int total;
 	int nr_threads;
+	int spin;
+	uint8_t copy_policy;
 } benchmark_cmd_data;
 
+static const char * const wq_type_names[] = {
+	[WQ_ORDERED] = "ordered",
+	[WQ_DYNAMIC] = "dynamic",
+	[WQ_FIXED] = "fixed",
+	[WQ_STEALING] = "stealing",
+};
+
+static int parse_wq_type(const char *name, enum wq_thread_control *type)
+{
+	for (int i = 0; i < ARRAY_SIZE(wq_type_names); i++) {
+		if (!strcmp(name, wq_type_names[i])) {
+			*type = i;
+			return 0;
+		}
+	}
+
+	sd_err("unknown workqueue type: %s", name);
+	sd_err("assumed workqueue types: ordered, dynamic, fixed, stealing");
+	return -1;
+}
+
+static struct work_queue *benchmark_create_wq(enum wq_thread_control type)
+{
+	int nr_threads = 1;
+
+	if (benchmark_cmd_data.nr_threads)
+		nr_threads = benchmark_cmd_data.nr_threads;
+
+	if (type == WQ_FIXED)
+		return create_fixed_work_queue("benchmark", nr_threads);
+	else
+		return create_work_queue("benchmark", type);
+}
+
 struct benchmark_io_work {
 	struct work work;
 
@@ -86,38 +130,17 @@ static int benchmark_io(int argc, char **argv)
 	int nr_objects, buf_len;
 	uint64_t obj_index = 0, offset = 0;
 	char *buf;
-	int nr_threads = 1;
 
 	if (!benchmark_cmd_data.force)
 		confirm("Caution! benchmark io command will erase all data of"
 			" target VDI.\n Are you sure you want to continue?"
 			" [yes/no]");
 
-	if (strlen(benchmark_cmd_data.workqueue_type) != 0) {
-		if (!strcmp("ordered", benchmark_cmd_data.workqueue_type))
-			wq_type = WQ_ORDERED;
-		else if (!strcmp("dynamic",
-				 benchmark_cmd_data.workqueue_type))
-			wq_type = WQ_DYNAMIC;
-		else if (!strcmp("fixed",
-				 benchmark_cmd_data.workqueue_type))
-			wq_type = WQ_FIXED;
-		else {
-			sd_err("unknown workqueue type: %s",
-			       benchmark_cmd_data.workqueue_type);
-			sd_err("assumed workqueue types:"
-			       " ordered, dynamic");
-			return EXIT_SYSFAIL;
-		}
-	}
-
-	if (benchmark_cmd_data.nr_threads)
-		nr_threads = benchmark_cmd_data.nr_threads;
+	if (strlen(benchmark_cmd_data.workqueue_type) != 0 &&
+	    parse_wq_type(benchmark_cmd_data.workqueue_type, &wq_type) < 0)
+		return EXIT_SYSFAIL;
 
-	if (wq_type != WQ_FIXED)
-		wq = create_work_queue("benchmark", wq_type);
-	else
-		wq = create_fixed_work_queue("benchmark", nr_threads);
+	wq = benchmark_create_wq(wq_type);
 	if (!wq) {
 		sd_err("failed to create work queue");
 		return EXIT_SYSFAIL;
@@ -170,6 +193,269 @@ static int benchmark_io(int argc, char **argv)
 	return 0;
 }
 
+struct benchmark_wq_work {
+	struct work work;
+	int spin;
+};
+
+static void benchmark_wq_main(struct work *work)
+{
+	free(container_of(work, struct benchmark_wq_work, work));
+}
+
+static void benchmark_wq_worker(struct work *work)
+{
+	struct benchmark_wq_work *w;
+	volatile int i;
+
+	w = container_of(work, struct benchmark_wq_work, work);
+	for (i = 0; i < w->spin; i++)
+		;
+}
+
+static double benchmark_wq_run(enum wq_thread_control type, int total,
+			       int spin)
+{
+	struct timespec start, end;
+	struct work_queue *wq;
+
+	wq = benchmark_create_wq(type);
+	if (!wq) {
+		sd_err("failed to create work queue");
+		return -1;
+	}
+
+	start = get_time_tick();
+	for (int i = 0; i < total; i++) {
+		struct benchmark_wq_work *w = xzalloc(sizeof(*w));
+
+		w->spin = spin;
+		w->work.fn = benchmark_wq_worker;
+		w->work.done = benchmark_wq_main;
+		queue_work(wq, &w->work);
+	}
+	work_queue_wait(wq);
+	end = get_time_tick();
+
+	return get_time_interval(&start, &end);
+}
+
+/*
+ * Measure the overhead of the work queues themselves with short works which
+ * just spin, and compare the thread controls.
+ */
+static int benchmark_workqueue(int argc, char **argv)
+{
+	enum wq_thread_control types[ARRAY_SIZE(wq_type_names)];
+	int nr_types = 0, total = DEFAULT_WQ_TOTAL, spin = DEFAULT_SPIN;
+	double elapsed;
+
+	if (strlen(benchmark_cmd_data.workqueue_type) != 0) {
+		if (parse_wq_type(benchmark_cmd_data.workqueue_type,
+				  types) < 0)
+			return EXIT_SYSFAIL;
+		nr_types = 1;
+	} else {
+		for (int i = 0; i < ARRAY_SIZE(wq_type_names); i++)
+			types[nr_types++] = i;
+	}
+
+	if (benchmark_cmd_data.total != 0)
+		total = benchmark_cmd_data.total;
+	if (benchmark_cmd_data.spin != 0)
+		spin = benchmark_cmd_data.spin;
+
+	printf("%-10s %12s %14s\n", "Type", "Elapsed(s)", "Works/s");
+	for (int i = 0; i < nr_types; i++) {
+		elapsed = benchmark_wq_run(types[i], total, spin);
+		if (elapsed < 0)
+			return EXIT_SYSFAIL;
+		printf("%-10s %12.3f %14.0f\n", wq_type_names[types[i]],
+		       elapsed, total / elapsed);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static const char * const fec_kernel_names[] = {
+	"scalar", "ssse3", "avx2", "avx512",
+};
+
+struct benchmark_ec_data {
+	struct fec *ctx;
+	int d, p;
+	size_t strip_size;	/* of a data object */
+	uint8_t *strips[SD_MAX_COPIES];
+	char *out;
+	int idx[SD_EC_MAX_STRIP];	/* strips to decode from */
+	int lost;
+};
+
+/* The way the gateway encoded before, one SD_EC_DATA_STRIPE_SIZE at a time */
+static void benchmark_ec_encode_per_stripe(struct benchmark_ec_data *e)
+{
+	size_t len = SD_EC_DATA_STRIPE_SIZE / e->d;
+
+	for (size_t off = 0; off < e->strip_size; off += len) {
+		const uint8_t *ds[e->d];
+		uint8_t *ps[e->p];
+
+		for (int i = 0; i < e->d; i++)
+			ds[i] = e->strips[i] + off;
+		for (int i = 0; i < e->p; i++)
+			ps[i] = e->strips[e->d + i] + off;
+		ec_encode(e->ctx, ds, ps, len);
+	}
+}
+
+static void benchmark_ec_encode(struct benchmark_ec_data *e)
+{
+	int pidx[e->p];
+
+	for (int i = 0; i < e->p; i++)
+		pidx[i] = e->d + i;
+	fec_encode(e->ctx, (const uint8_t * const *)e->strips,
+		   e->strips + e->d, pidx, e->p, e->strip_size);
+}
+
+#if defined __x86_64__ && defined(ENABLE_ISAL)
+static void benchmark_ec_encode_isa(struct benchmark_ec_data *e)
+{
+	ec_encode(e->ctx, (const uint8_t **)e->strips, e->strips + e->d,
+		  e->strip_size);
+}
+#endif
+
+/* The way fec_decode_buffer() decoded before, one stripe at a time */
+static void benchmark_ec_decode_per_stripe(struct benchmark_ec_data *e)
+{
+	size_t len = SD_EC_DATA_STRIPE_SIZE / e->d;
+
+	for (size_t off = 0; off < e->strip_size; off += len) {
+		const uint8_t *in[e->d];
+
+		for (int i = 0; i < e->d; i++)
+			in[i] = e->strips[e->idx[i]] + off;
+		ec_decode(e->ctx, in, e->idx, (uint8_t *)e->out + off,
+			  e->lost);
+	}
+}
+
+static void benchmark_ec_decode(struct benchmark_ec_data *e)
+{
+	uint8_t *in[e->d];
+
+	for (int i = 0; i < e->d; i++)
+		in[i] = e->strips[e->idx[i]];
+	fec_decode_buffer(e->ctx, in, e->idx, e->out, e->lost,
+			  e->strip_size * e->d);
+}
+
+#if defined __x86_64__ && defined(ENABLE_ISAL)
+static void benchmark_ec_decode_isa(struct benchmark_ec_data *e)
+{
+	uint8_t *in[e->d];
+
+	for (int i = 0; i < e->d; i++)
+		in[i] = e->strips[e->idx[i]];
+	isa_decode_buffer(e->ctx, in, e->idx, e->out, e->lost,
+			  e->strip_size * e->d);
+}
+#endif
+
+static void benchmark_ec_run(struct benchmark_ec_data *e, const char *op,
+			     const char *path,
+			     void (*fn)(struct benchmark_ec_data *), int total)
+{
+	struct timespec start, end;
+	double elapsed;
+
+	start = get_time_tick();
+	for (int i = 0; i < total; i++)
+		fn(e);
+	end = get_time_tick();
+
+	elapsed = get_time_interval(&start, &end);
+	printf("%-8s %-12s %12.3f %12.1f\n", op, path, elapsed,
+	       (double)SD_DATA_OBJ_SIZE * total / elapsed / 1024 / 1024);
+}
+
+/*
+ * Measure the erasure coding of data objects in memory.  The per-stripe paths
+ * are the old ones which code SD_EC_DATA_STRIPE_SIZE at a time, the others
+ * code the whole strips at once with each GF(2^8) kernel the CPU supports.
+ */
+static int benchmark_ec(int argc, char **argv)
+{
+	struct benchmark_ec_data e = {};
+	uint8_t policy = benchmark_cmd_data.copy_policy;
+	const char *selected;
+	int total = DEFAULT_EC_TOTAL, dp, i;
+
+	if (!policy)
+		parse_copy("4:2", &policy);
+	if (benchmark_cmd_data.total != 0)
+		total = benchmark_cmd_data.total;
+
+	init_fec();
+	selected = fec_kernel_name();
+
+	dp = ec_policy_to_dp(policy, &e.d, &e.p);
+	e.ctx = ec_init(e.d, dp);
+	e.strip_size = SD_DATA_OBJ_SIZE / e.d;
+	for (i = 0; i < dp; i++) {
+		e.strips[i] = xvalloc(e.strip_size);
+		for (size_t j = 0; j < e.strip_size; j++)
+			e.strips[i][j] = random();
+	}
+	e.out = xvalloc(e.strip_size);
+
+	/* Lose the first data strip and decode it with the first parity */
+	e.lost = 0;
+	for (i = 0; i < e.d - 1; i++)
+		e.idx[i] = i + 1;
+	e.idx[e.d - 1] = e.d;
+
+	printf("%d:%d, %s kernel is selected\n", e.d, e.p, selected);
+	printf("%-8s %-12s %12s %12s\n", "Op", "Path", "Elapsed(s)", "MB/s");
+
+	fec_set_kernel("scalar");
+	benchmark_ec_run(&e, "encode", "per-stripe",
+			 benchmark_ec_encode_per_stripe, total);
+	for (i = 0; i < ARRAY_SIZE(fec_kernel_names); i++) {
+		if (fec_set_kernel(fec_kernel_names[i]) < 0)
+			continue;
+		benchmark_ec_run(&e, "encode", fec_kernel_names[i],
+				 benchmark_ec_encode, total);
+	}
+#if defined __x86_64__ && defined(ENABLE_ISAL)
+	benchmark_ec_run(&e, "encode", "isa-l", benchmark_ec_encode_isa,
+			 total);
+#endif
+
+	fec_set_kernel("scalar");
+	benchmark_ec_run(&e, "decode", "per-stripe",
+			 benchmark_ec_decode_per_stripe, total);
+	for (i = 0; i < ARRAY_SIZE(fec_kernel_names); i++) {
+		if (fec_set_kernel(fec_kernel_names[i]) < 0)
+			continue;
+		benchmark_ec_run(&e, "decode", fec_kernel_names[i],
+				 benchmark_ec_decode, total);
+	}
+#if defined __x86_64__ && defined(ENABLE_ISAL)
+	benchmark_ec_run(&e, "decode", "isa-l", benchmark_ec_decode_isa,
+			 total);
+#endif
+	fec_set_kernel(selected);
+
+	for (i = 0; i < dp; i++)
+		free(e.strips[i]);
+	free(e.out);
+	ec_destroy(e.ctx);
+
+	return EXIT_SUCCESS;
+}
+
 static int benchmark_parser(int ch, const char *opt)
 {
 	switch (ch) {
@@ -186,6 +472,16 @@ static int benchmark_parser(int ch, const char *opt)
 	case 'n':
 		benchmark_cmd_data.nr_threads = atoi(opt);
 		break;
+	case 's':
+		benchmark_cmd_data.spin = atoi(opt);
+		break;
+	case 'c':
+		if (!parse_copy(opt, &benchmark_cmd_data.copy_policy) ||
+		    !benchmark_cmd_data.copy_policy) {
+			sd_err("Invalid erasure code scheme %s", opt);
+			return -1;
+		}
+		break;
 	default:
 		sd_err("unknown option: %c", ch);
 		return -1;
@@ -197,6 +493,10 @@ static int benchmark_parser(int ch, const char *opt)
 static struct subcommand benchmark_cmd[] = {
 	{"io", "<vdiname>", "aprhTfwtn", "benchmark I/O performance",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG, benchmark_io, benchmark_options},
+	{"workqueue", NULL, "hwtns", "benchmark the work queue implementations",
+	 NULL, 0, benchmark_workqueue, benchmark_options},
+	{"ec", NULL, "htc", "benchmark the erasure coding kernels",
+	 NULL, 0, benchmark_ec, benchmark_options},
 	{NULL,},
 };
 
@@ -423,6 +423,13 @@ static void do_load_object(struct work *work)
 			goto error;
 	}
 
+	/*
+	 * The VDIs are registered with the default erasure stripe size, so the
+	 * data objects are restored in the default layout.
+	 */
+	if (is_vdi_obj(sw->entry.oid))
+		((struct sd_inode *)buffer)->ec_stripe_shift = 0;
+
 	if (dog_write_object(sw->entry.oid, 0, buffer, size, 0, 0,
 			     sw->entry.nr_copies, sw->entry.copy_policy,
 			     true, true) != 0)
@@ -14,6 +14,8 @@
 static struct node_cmd_data {
 	bool all_nodes;
 	bool recovery_progress;
+	bool zone_traffic;
+	bool blocked;
 	bool watch;
 	bool local;
 	bool force;
@@ -183,6 +185,90 @@ static int node_recovery_progress(void)
 	return result < 0 ? EXIT_SYSFAIL : EXIT_SUCCESS;
 }
 
+/* Format the recovery rate and its budget, e.g. "12.5/100" */
+static const char *recovery_rate_to_str(char *buf, size_t len, double rate,
+					uint32_t budget)
+{
+	if (budget)
+		snprintf(buf, len, "%.1f/%"PRIu32, rate, budget);
+	else
+		snprintf(buf, len, "%.1f/-", rate);
+	return buf;
+}
+
+static void print_zone_traffic(int idx, const struct recovery_state *state)
+{
+	for (uint32_t i = 0; i < state->nr_zones; i++) {
+		const struct recovery_zone_traffic *t = state->zones + i;
+
+		if (raw_output)
+			printf("%d %"PRIu32" %"PRIu64"\n", idx, t->zone,
+			       t->bytes);
+		else
+			printf("%4d%11"PRIu32"%12s\n", idx, t->zone,
+			       strnumber(t->bytes));
+	}
+
+	if (!state->other_zone_bytes)
+		return;
+	if (raw_output)
+		printf("%d - %"PRIu64"\n", idx, state->other_zone_bytes);
+	else
+		printf("%4d%11s%12s\n", idx, "others",
+		       strnumber(state->other_zone_bytes));
+}
+
+static void print_blocked_requests(int idx, const struct recovery_state *state)
+{
+	uint64_t avg = state->nr_blocked ?
+		state->blocked_time / state->nr_blocked : 0;
+
+	if (raw_output)
+		printf("%d %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n", idx,
+		       state->nr_blocked, state->blocked_time,
+		       state->max_blocked_time, state->nr_promoted);
+	else
+		printf("%4d%10"PRIu64"%11.1f%11.1f%11"PRIu64"\n", idx,
+		       state->nr_blocked, (double)avg / 1000,
+		       (double)state->max_blocked_time / 1000,
+		       state->nr_promoted);
+}
+
+/* Print the recovery state of each node, whether in recovery or not */
+static int node_recovery_stats(const char *header,
+			       void (*print)(int,
+					     const struct recovery_state *))
+{
+	struct sd_node *n;
+	int ret, i = 0;
+
+	if (!raw_output)
+		printf("%s\n", header);
+
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		struct sd_req req;
+		struct sd_rsp *rsp = (struct sd_rsp *)&req;
+		struct recovery_state state;
+
+		memset(&state, 0, sizeof(state));
+
+		sd_init_req(&req, SD_OP_STAT_RECOVERY);
+		req.data_length = sizeof(state);
+
+		ret = dog_exec_req(&n->nid, &req, &state);
+		if (ret < 0)
+			return EXIT_SYSFAIL;
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_err("%s", sd_strerror(rsp->result));
+			return EXIT_FAILURE;
+		}
+
+		print(i++, &state);
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static int node_recovery_info(int argc, char **argv)
 {
 	struct sd_node *n;
@@ -190,11 +276,21 @@ static int node_recovery_info(int argc, char **argv)
 
 	if (node_cmd_data.recovery_progress)
 		return node_recovery_progress();
+	/* bytes each node has recovered from each zone */
+	if (node_cmd_data.zone_traffic)
+		return node_recovery_stats("  Id       Zone   Recovered",
+					   print_zone_traffic);
+	/* client requests which waited for the recovery on each node */
+	if (node_cmd_data.blocked)
+		return node_recovery_stats("  Id   Blocked    Avg(ms)    Max(ms)"
+					   "   Promoted",
+					   print_blocked_requests);
 
 	if (!raw_output) {
 		printf("Nodes In Recovery:\n");
 		printf("  Id   Host:Port         V-Nodes       Zone"
-		       "       Progress\n");
+		       "       Progress    MB/s(budget)  IOPS(budget)"
+		       "  Yields\n");
 	}
 
 	rb_for_each_entry(n, &sd_nroot, rb) {
@@ -218,16 +314,28 @@ static int node_recovery_info(int argc, char **argv)
 		if (state.in_recovery) {
 			const char *host = addr_to_str(n->nid.addr,
 						       n->nid.port);
+			char bw[32], iops[32];
+
 			if (raw_output)
-				printf("%d %s %d %d %"PRIu64" %"PRIu64"\n", i,
-				       host, n->nr_vnodes,
+				printf("%d %s %d %d %"PRIu64" %"PRIu64
+				       " %"PRIu64" %"PRIu32" %"PRIu32" %"PRIu32
+				       " %"PRIu32"\n", i, host, n->nr_vnodes,
 				       n->zone, state.nr_finished,
-				       state.nr_total);
+				       state.nr_total, state.bandwidth,
+				       state.max_bandwidth, state.iops,
+				       state.max_iops, state.nr_yields);
 			else
-				printf("%4d   %-20s%5d%11d%11.1f%%\n", i, host,
+				printf("%4d   %-20s%5d%11d%11.1f%%%16s%14s%8"
+				       PRIu32"\n", i, host,
 				       n->nr_vnodes, n->zone,
 				       100 * (float)state.nr_finished
-				       / state.nr_total);
+				       / state.nr_total,
+				       recovery_rate_to_str(bw, sizeof(bw),
+					(double)state.bandwidth / 1048576,
+					state.max_bandwidth),
+				       recovery_rate_to_str(iops, sizeof(iops),
+					state.iops, state.max_iops),
+				       state.nr_yields);
 		}
 		i++;
 	}
@@ -235,6 +343,28 @@ static int node_recovery_info(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+/* Get or set the recovery throttling of the node */
+static int exec_recovery_throttling(int opcode,
+				    struct recovery_throttling *rthrottling)
+{
+	struct sd_req req;
+	struct sd_rsp *rsp = (struct sd_rsp *)&req;
+	int ret;
+
+	sd_init_req(&req, opcode);
+	if (opcode == SD_OP_SET_RECOVERY)
+		req.flags = SD_FLAG_CMD_WRITE;
+	req.data_length = sizeof(*rthrottling);
+
+	ret = dog_exec_req(&sd_nid, &req, rthrottling);
+	if (ret < 0 || rsp->result != SD_RES_SUCCESS) {
+		sd_err("Failed to execute request");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int node_recovery_set(int argc, char **argv)
 {
 	char *p;
@@ -248,6 +378,12 @@ static int node_recovery_set(int argc, char **argv)
 		exit(EXIT_USAGE);
 	}
 
+	/* keep the recovery window */
+	if (exec_recovery_throttling(SD_OP_GET_RECOVERY, rthrottling) < 0) {
+		free(rthrottling);
+		return -1;
+	}
+
 	/* clear errno before calling strtol */
 	errno = 0;
 
@@ -342,6 +478,17 @@ static int node_recovery_get(int argc, char **argv)
 	case EXIT_SUCCESS:
 		sd_info("max (%"PRIu32"), interval (%"PRIu64")",
 		 rthrottling.max_exec_count, rthrottling.queue_work_interval);
+		if (rthrottling.window)
+			sd_info("window (%"PRIu32"), latency (%"PRIu32" us)",
+				rthrottling.window,
+				rthrottling.target_latency);
+		else
+			sd_info("window (default), latency (%"PRIu32" us)",
+				rthrottling.target_latency);
+		sd_info("bandwidth (%"PRIu32" MB/s), iops (%"PRIu32"), disk"
+			" bandwidth (%"PRIu32" MB/s), yield (%"PRIu32")",
+			rthrottling.max_bandwidth, rthrottling.max_iops,
+			rthrottling.disk_bandwidth, rthrottling.yield_depth);
 		break;
 	default:
 		sd_err("unknown return code: %d", ret);
@@ -351,6 +498,64 @@ static int node_recovery_get(int argc, char **argv)
 	return ret;
 }
 
+static int node_recovery_set_window(int argc, char **argv)
+{
+	struct recovery_throttling rthrottling;
+	uint32_t window, latency = 0;
+
+	window = str_to_u32(argv[optind]);
+	if (errno != 0) {
+		sd_err("Invalid window (%s)", argv[optind]);
+		exit(EXIT_USAGE);
+	}
+	if (argv[++optind]) {
+		latency = str_to_u32(argv[optind]);
+		if (errno != 0) {
+			sd_err("Invalid latency (%s)", argv[optind]);
+			exit(EXIT_USAGE);
+		}
+	}
+
+	if (exec_recovery_throttling(SD_OP_GET_RECOVERY, &rthrottling) < 0)
+		return EXIT_FAILURE;
+
+	rthrottling.window = window;
+	rthrottling.target_latency = latency;
+	if (exec_recovery_throttling(SD_OP_SET_RECOVERY, &rthrottling) < 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+static int node_recovery_set_qos(int argc, char **argv)
+{
+	struct recovery_throttling rthrottling;
+	const char *names[] = { "bandwidth", "iops", "disk bandwidth",
+				"yield depth" };
+	uint32_t budgets[ARRAY_SIZE(names)] = {};
+
+	for (int i = 0; i < ARRAY_SIZE(names) && argv[optind]; i++) {
+		budgets[i] = str_to_u32(argv[optind]);
+		if (errno != 0) {
+			sd_err("Invalid %s (%s)", names[i], argv[optind]);
+			exit(EXIT_USAGE);
+		}
+		optind++;
+	}
+
+	if (exec_recovery_throttling(SD_OP_GET_RECOVERY, &rthrottling) < 0)
+		return EXIT_FAILURE;
+
+	rthrottling.max_bandwidth = budgets[0];
+	rthrottling.max_iops = budgets[1];
+	rthrottling.disk_bandwidth = budgets[2];
+	rthrottling.yield_depth = budgets[3];
+	if (exec_recovery_throttling(SD_OP_SET_RECOVERY, &rthrottling) < 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
 static struct sd_node *idx_to_node(struct rb_root *nroot, int idx)
 {
 	struct sd_node *n = rb_entry(rb_first(nroot), struct sd_node, rb);
@@ -410,6 +615,30 @@ static int node_kill(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static void print_journal_stat(const struct sd_stat *stat)
+{
+	/* journaling is disabled */
+	if (!stat->j.payload_bytes)
+		return;
+
+	printf("%s%s\t%s\t%.2f\n",
+	       raw_output ? "" : "Journal\tWritten\tPayload\tWR/Payload\n\t",
+	       strnumber(stat->j.written_bytes),
+	       strnumber(stat->j.payload_bytes),
+	       (double)stat->j.written_bytes / stat->j.payload_bytes);
+}
+
+static void print_pool_stat(const struct sd_stat *stat)
+{
+	const struct s_mempool *pool = &stat->pool;
+
+	printf("%s%"PRIu64"\t%"PRIu64"\t%.2f%%\t%"PRIu64"\t%s\n",
+	       raw_output ? "" : "Pool\tAlloc\tHit\tHit%\tRelease\tCached\n\t",
+	       pool->alloc_nr, pool->hit_nr,
+	       pool->alloc_nr ? (double)pool->hit_nr * 100 / pool->alloc_nr : 0,
+	       pool->release_nr, strnumber(pool->cached_bytes));
+}
+
 static int node_stat(int argc, char **argv)
 {
 	struct sd_req hdr;
@@ -462,6 +691,8 @@ again:
 		       strnumber(stat.r.peer_total_tx - last.r.peer_total_tx),
 		       strnumber_raw(stat.r.peer_total_nr -
 				     last.r.peer_total_nr, true));
+		print_journal_stat(&stat);
+		print_pool_stat(&stat);
 		last = stat;
 		sleep(1);
 		goto again;
@@ -484,6 +715,8 @@ again:
 		       stat.r.peer_total_remove_nr, 0UL,
 		       strnumber(stat.r.peer_total_rx),
 		       strnumber(stat.r.peer_total_tx));
+		print_journal_stat(&stat);
+		print_pool_stat(&stat);
 	}
 
 	return EXIT_SUCCESS;
@@ -631,6 +864,12 @@ static int node_parser(int ch, const char *opt)
 	case 'P':
 		node_cmd_data.recovery_progress = true;
 		break;
+	case 'z':
+		node_cmd_data.zone_traffic = true;
+		break;
+	case 'b':
+		node_cmd_data.blocked = true;
+		break;
 	case 'w':
 		node_cmd_data.watch = true;
 		break;
@@ -648,6 +887,8 @@ static int node_parser(int ch, const char *opt)
 static struct sd_option node_options[] = {
 	{'A', "all", false, "show md information of all the nodes"},
 	{'P', "progress", false, "show progress of recovery in the node"},
+	{'z', "zone", false, "show recovered bytes per zone of the sources"},
+	{'b', "blocked", false, "show client requests blocked by recovery"},
 	{'w', "watch", false, "watch the stat every second"},
 	{'l', "local", false, "issue request to local node"},
 	{'f', "force", false, "ignore the confirmation"},
@@ -655,12 +896,22 @@ static struct sd_option node_options[] = {
 };
 
 static struct subcommand node_recovery_cmd[] = {
-	{"info", NULL, "aphPrT", "show recovery information of nodes (default)",
+	{"info", NULL, "aphPrTzb",
+	 "show recovery information of nodes (default)",
 	 NULL, CMD_NEED_NODELIST, node_recovery_info, node_options},
 	{"set-throttle", "<max> <interval>", NULL, "set new throttling", NULL,
 	 CMD_NEED_ARG|CMD_NEED_NODELIST, node_recovery_set, node_options},
 	{"get-throttle", NULL, NULL, "get current throttling", NULL,
 	 CMD_NEED_NODELIST, node_recovery_get, node_options},
+	{"set-window", "<window> [<latency>]", NULL,
+	 "set the max objects recovered in parallel and the client I/O latency"
+	 " (us) to keep", NULL,
+	 CMD_NEED_ARG|CMD_NEED_NODELIST, node_recovery_set_window,
+	 node_options},
+	{"set-qos", "<MB/s> [<iops> [<disk MB/s> [<yield depth>]]]", NULL,
+	 "set the recovery budgets of the node, 0 for unlimited", NULL,
+	 CMD_NEED_ARG|CMD_NEED_NODELIST, node_recovery_set_qos,
+	 node_options},
 	{NULL},
 };
 
@@ -848,12 +1099,13 @@ static int node_format(int argc, char **argv)
 	}
 	store_name = argv[optind];
 
-	if (strcmp(store_name, "plain") && strcmp(store_name, "tree")) {
+	if (strcmp(store_name, "plain") && strcmp(store_name, "tree") &&
+	    strcmp(store_name, "pack") && strcmp(store_name, "raw")) {
 		/*
 		 * FIXME: store names should be macro defined in somewhere
 		 * suitable
 		 */
-		sd_err("expected store format: plain, tree");
+		sd_err("expected store format: plain, tree, pack, raw");
 		return EXIT_SYSFAIL;
 	}
 
@@ -50,6 +50,8 @@ static struct sd_option vdi_options[] = {
 	 "reclamation during VDI deletion"},
 	{'I', "reclamation-interval", true, "specify how long (unit: second)"
 	 "in reclamation loop during VDI deletion"},
+	{'S', "ec-stripe", true, "specify the data stripe size of erasure\n"
+	 "                          coded VDI (512 to 64K, power of 2)"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -74,6 +76,7 @@ static struct vdi_cmd_data {
 	bool reduce_identical_snapshots;
 	int nr_batched_reclamation;
 	int reclamation_interval;
+	uint8_t ec_stripe_shift;
 } vdi_cmd_data = { ~0, };
 
 struct get_vdi_info {
@@ -534,6 +537,8 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 	hdr.vdi.copy_policy = copy_policy;
 	hdr.vdi.store_policy = store_policy;
 	hdr.vdi.block_size_shift = block_size_shift;
+	/* zero lets a snapshot or a clone share the stripe size of the base */
+	hdr.vdi.ec_stripe_shift = vdi_cmd_data.ec_stripe_shift;
 
 	ret = dog_exec_req(&sd_nid, &hdr, buf);
 	if (ret < 0)
@@ -621,6 +626,13 @@ static int vdi_create(int argc, char **argv)
 		return EXIT_USAGE;
 	}
 
+	if (vdi_cmd_data.ec_stripe_shift && vdi_cmd_data.nr_copies &&
+	    !vdi_cmd_data.copy_policy) {
+		sd_err("Stripe size can be specified only for erasure coded "
+		       "VDI");
+		return EXIT_USAGE;
+	}
+
 	ret = do_vdi_create(vdiname, size, 0, &vid, false,
 			    vdi_cmd_data.nr_copies, vdi_cmd_data.copy_policy,
 			    vdi_cmd_data.store_policy,
@@ -2970,7 +2982,7 @@ static struct subcommand vdi_cmd[] = {
 	{"check", "<vdiname>", "seaphT", "check and repair image's consistency",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_check, vdi_options},
-	{"create", "<vdiname> <size>", "PycaphrvzT", "create an image",
+	{"create", "<vdiname> <size>", "PycaphrvzST", "create an image",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_create, vdi_options},
 	{"snapshot", "<vdiname>", "saphrvTR", "create a snapshot",
@@ -3035,6 +3047,8 @@ static int vdi_parser(int ch, const char *opt)
 {
 	char *p;
 	uint8_t block_size_shift;
+	uint64_t stripe_size;
+	int shift;
 
 	switch (ch) {
 	case 'P':
@@ -3137,6 +3151,21 @@ static int vdi_parser(int ch, const char *opt)
 	case 'R':
 		vdi_cmd_data.reduce_identical_snapshots = true;
 		break;
+	case 'S':
+		if (option_parse_size(opt, &stripe_size) < 0)
+			exit(EXIT_FAILURE);
+		for (shift = SD_EC_MIN_STRIPE_SHIFT;
+		     shift <= SD_EC_MAX_STRIPE_SHIFT; shift++)
+			if (stripe_size == (UINT64_C(1) << shift))
+				break;
+		if (shift > SD_EC_MAX_STRIPE_SHIFT) {
+			sd_err("Stripe size must be a power of 2 between %d"
+			       " and %d", 1 << SD_EC_MIN_STRIPE_SHIFT,
+			       1 << SD_EC_MAX_STRIPE_SHIFT);
+			exit(EXIT_FAILURE);
+		}
+		vdi_cmd_data.ec_stripe_shift = shift;
+		break;
 	case 'B':
 		vdi_cmd_data.nr_batched_reclamation = strtol(opt, &p, 10);
 		if (opt == p) {
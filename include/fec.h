@@ -75,6 +75,8 @@ struct fec {
 };
 
 void init_fec(void);
+const char *fec_kernel_name(void);
+int fec_set_kernel(const char *name);
 /*
  * param d the number of blocks required to reconstruct
  * param dp the total number of blocks created
@@ -124,6 +126,25 @@ void fec_decode(const struct fec *code,
 #define SD_EC_DATA_STRIPE_SIZE (512) /* 512 Byte */
 #define SD_EC_MAX_STRIP (16)
 
+/*
+ * A VDI can have a larger data stripe, which has to be a power of two between
+ * SD_EC_DATA_STRIPE_SIZE and 64KB
+ */
+#define SD_EC_MIN_STRIPE_SHIFT 9
+#define SD_EC_MAX_STRIPE_SHIFT 16
+
+static inline bool ec_stripe_shift_valid(uint8_t shift)
+{
+	return shift == 0 || (SD_EC_MIN_STRIPE_SHIFT <= shift &&
+			      shift <= SD_EC_MAX_STRIPE_SHIFT);
+}
+
+/* Data stripe size of the VDI whose inode has 'shift' as ec_stripe_shift */
+static inline uint32_t ec_stripe_size(uint8_t shift)
+{
+	return shift ? UINT32_C(1) << shift : SD_EC_DATA_STRIPE_SIZE;
+}
+
 static inline int ec_policy_to_dp(uint8_t policy, int *d, int *p)
 {
 	int ed = 0, ep = 0;
@@ -169,9 +190,14 @@ static inline struct fec *ec_init(int d, int dp)
  *
  * @ds: data strips to generate parity strips
  * @ps: parity strips to return
+ * @len: length of each strip
+ *
+ * Every byte offset is coded independently, so the strips of consecutive
+ * stripes can be encoded by one call as long as they are laid out in the same
+ * way as the strips are stored.
  */
 static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
-			     uint8_t *ps[])
+			     uint8_t *ps[], size_t len)
 {
 	int p = ctx->dp - ctx->d;
 
@@ -183,14 +209,47 @@ static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
 #endif
 
 #if defined __x86_64__ && defined(ENABLE_ISAL)
-		ec_encode_data(SD_EC_DATA_STRIPE_SIZE / ctx->d, ctx->d, p,
-				   ctx->ec_tbl, (unsigned char **)ds, ps);
+		ec_encode_data(len, ctx->d, p, ctx->ec_tbl,
+			       (unsigned char **)ds, ps);
 #else
-		fec_encode(ctx, ds, ps, pidx, p, SD_EC_DATA_STRIPE_SIZE /
-			   ctx->d);
+		fec_encode(ctx, ds, ps, pidx, p, len);
 #endif
 }
 
+/*
+ * Split 'nr_stripe' consecutive data stripes of 'buf' into the data strips
+ * 'ds' and generate the parity strips 'ps' of all of them by one call
+ *
+ * Each strip buffer receives 'nr_stripe' strips of stripe_size / d bytes, in
+ * the same layout as the strip is stored.
+ */
+static inline void ec_encode_stripes(struct fec *ctx, const char *buf,
+				     uint32_t stripe_size, int nr_stripe,
+				     uint8_t *ds[], uint8_t *ps[])
+{
+	uint32_t strip_size = stripe_size / ctx->d;
+
+	for (int i = 0; i < nr_stripe; i++)
+		for (int j = 0; j < ctx->d; j++)
+			memcpy(ds[j] + strip_size * i,
+			       buf + stripe_size * i + strip_size * j,
+			       strip_size);
+
+	ec_encode(ctx, (const uint8_t **)ds, ps, strip_size * nr_stripe);
+}
+
+/* Assemble 'nr_stripe' data stripes into 'buf' from the 'd' data strips */
+static inline void ec_gather_stripes(int d, uint8_t *const ds[], char *buf,
+				     uint32_t stripe_size, int nr_stripe)
+{
+	uint32_t strip_size = stripe_size / d;
+
+	for (int i = 0; i < nr_stripe; i++)
+		for (int j = 0; j < d; j++)
+			memcpy(buf + stripe_size * i + strip_size * j,
+			       ds[j] + strip_size * i, strip_size);
+}
+
 /*
  * This function takes input strips and return the lost strip
  *
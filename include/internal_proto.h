@@ -24,7 +24,7 @@
 #include "rbtree.h"
 #include "fec.h"
 
-#define SD_SHEEP_PROTO_VER 0x0a
+#define SD_SHEEP_PROTO_VER 0x0b
 
 #define SD_DEFAULT_COPIES 3
 /*
@@ -115,10 +115,16 @@
 #define SD_OP_SET_RECOVERY      0xCB
 #define SD_OP_SET_VNODES 0xCC
 #define SD_OP_GET_VNODES 0xCD
+#define SD_OP_GET_DIRTY_LOG	0xCE
+#define SD_OP_GET_BLOCK_HASH	0xCF
+#define SD_OP_GET_OBJ_LIST_PAGE	0xD0
+#define SD_OP_GET_OBJ_LIST_DELTA	0xD1
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
 #define SD_FLAG_CMD_WILDCARD 0x0100
+#define SD_FLAG_CMD_PARITY_DELTA 0x0200 /* XOR the data into the strip */
+#define SD_FLAG_CMD_NOWAIT   0x0400 /* fail instead of waiting for recovery */
 
 /* flags for VDI attribute operations */
 #define SD_FLAG_CMD_CREAT    0x0100
@@ -328,11 +334,44 @@ enum rw_state {
 	RW_NOTIFY_COMPLETION, /* the thread is notifying recovery completion */
 };
 
+#define SD_RECOVERY_ZONES	16
+
+struct recovery_zone_traffic {
+	uint32_t zone;
+	uint32_t __pad;
+	uint64_t bytes;
+};
+
 struct recovery_state {
 	uint8_t in_recovery;
 	enum rw_state state;
 	uint64_t nr_finished;
 	uint64_t nr_total;
+
+	/* recovery rate in the last second and the budgets (0: unlimited) */
+	uint64_t bandwidth;	/* bytes per second */
+	uint32_t iops;
+	uint32_t max_bandwidth;	/* MB/s */
+	uint32_t max_iops;
+	uint32_t nr_yields;	/* pauses for the foreground I/Os */
+
+	/* bytes recovered from each zone since the node started */
+	uint32_t nr_zones;
+	struct recovery_zone_traffic zones[SD_RECOVERY_ZONES];
+	uint64_t other_zone_bytes; /* from the zones beyond the table */
+
+	/* client requests which waited for the recovery, see struct sd_stat */
+	uint64_t nr_blocked;
+	uint64_t blocked_time;	/* us */
+	uint64_t max_blocked_time;
+	uint64_t nr_promoted;
+};
+
+/* A change of the object list, see SD_OP_GET_OBJ_LIST_DELTA */
+struct objlist_delta {
+	uint64_t oid;
+	uint8_t removed;
+	uint8_t __pad[7];
 };
 
 #define CACHE_MAX	1024
@@ -367,7 +406,30 @@ struct sd_stat {
 		uint64_t peer_total_remove_nr;
 		uint64_t peer_total_read_nr;
 		uint64_t peer_total_write_nr;
+		uint64_t gway_io_done_nr; /* nr of finished reads and writes */
+		uint64_t gway_io_latency; /* total latency of them in us */
 	} r;
+	struct s_fd_cache {
+		uint64_t hit_nr; /* lookups served by a cached object fd */
+		uint64_t miss_nr;
+		uint64_t evict_nr; /* nr of fds closed by the LRU */
+	} fdc;
+	struct s_journal {
+		uint64_t payload_bytes; /* data of the journaled writes */
+		uint64_t written_bytes; /* bytes written to the journal */
+	} j;
+	struct s_mempool {
+		uint64_t alloc_nr; /* nr of allocations from the pools */
+		uint64_t hit_nr; /* allocations served by cached objects */
+		uint64_t release_nr; /* nr of objects freed to the system */
+		uint64_t cached_bytes;
+	} pool;
+	struct s_recovery {
+		uint64_t blocked_nr; /* nr of waits for the object recovery */
+		uint64_t blocked_time; /* total time of them in us */
+		uint64_t blocked_max; /* longest wait in us */
+		uint64_t promoted_nr; /* objects recovered ahead of the order */
+	} rcvy;
 };
 
 void sd_inode_stat(const struct sd_inode *inode, uint64_t *, uint64_t *);
@@ -421,7 +483,8 @@ struct vdi_state {
 	uint8_t deleted;
 	uint8_t copy_policy;
 	uint8_t block_size_shift;
-	uint8_t __pad[3];
+	uint8_t ec_stripe_shift;
+	uint8_t __pad[2];
 	uint32_t parent_vid;
 
 	uint32_t lock_state;
@@ -61,6 +61,10 @@ int tx(struct connection *conn, enum conn_state next_state);
 int connect_to(const char *name, int port);
 int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	     bool (*need_retry)(uint32_t), uint32_t, uint32_t);
+int send_req_zerocopy(int sockfd, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool (*need_retry)(uint32_t), uint32_t,
+		      uint32_t, uint32_t *nr_pending);
+int reap_zerocopy(int sockfd, uint32_t *nr_pending, int timeout);
 int exec_req(int sockfd, struct sd_req *hdr, void *,
 	     bool (*need_retry)(uint32_t), uint32_t, uint32_t);
 int do_read(int sockfd, void *buf, uint32_t len,
@@ -79,6 +83,7 @@ int set_snd_timeout(int fd);
 int set_rcv_timeout(int fd);
 int get_local_addr(uint8_t *bytes);
 bool inetaddr_is_valid(char *addr);
+int do_writev(int sockfd, struct iovec *iov, int iovcnt, uint32_t max_count);
 int do_writev2(int fd, void *hdr, size_t hdr_len, void *body, size_t body_len);
 
 /* for typical usage of do_writev2() */
@@ -27,9 +27,29 @@ struct sd_vnode {
 	uint64_t hash;
 };
 
+/* A vnode on the flat hash ring, see struct vnode_table */
+struct vnode_slot {
+	const struct sd_vnode *vnode;
+	uint32_t zone;
+	int32_t next_zone;	/* next slot in another zone, -1 if none */
+};
+
+/*
+ * Flat copy of the vnode ring sorted by hash.  The hashes are kept apart from
+ * the slots so that the binary search touches as few cache lines as possible,
+ * and ->next_zone lets the replica placement skip a run of vnodes in a zone
+ * which already has a copy at once.
+ */
+struct vnode_table {
+	int nr;
+	uint64_t *hashes;
+	struct vnode_slot *slots;
+};
+
 struct vnode_info {
 	struct rb_root vroot;
 	struct rb_root nroot;
+	struct vnode_table vtable;
 	int nr_nodes;
 	int nr_zones;
 	refcnt_t refcnt;
@@ -117,6 +137,126 @@ static inline void oid_to_nodes(uint64_t oid, struct rb_root *root,
 		nodes[i] = vnodes[i]->node;
 }
 
+static inline void build_vnode_table(struct vnode_table *t,
+				     struct rb_root *vroot)
+{
+	struct sd_vnode *v;
+	int i = 0, nr = 0;
+
+	rb_for_each_entry(v, vroot, rb)
+		nr++;
+
+	t->nr = nr;
+	t->hashes = xmalloc(sizeof(*t->hashes) * nr);
+	t->slots = xmalloc(sizeof(*t->slots) * nr);
+	rb_for_each_entry(v, vroot, rb) {
+		t->hashes[i] = v->hash;
+		t->slots[i].vnode = v;
+		t->slots[i].zone = v->node->zone;
+		t->slots[i].next_zone = -1;
+		i++;
+	}
+
+	/* the second lap fixes up the runs which wrap around the ring */
+	for (i = 2 * nr - 1; i >= 0; i--) {
+		int cur = i % nr, next = (cur + 1) % nr;
+
+		if (t->slots[next].zone != t->slots[cur].zone)
+			t->slots[cur].next_zone = next;
+		else
+			t->slots[cur].next_zone = t->slots[next].next_zone;
+	}
+}
+
+static inline void free_vnode_table(struct vnode_table *t)
+{
+	free(t->hashes);
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+/* Same placement as oid_to_vnodes(), but with the flat vnode table */
+static inline void vtable_oid_to_vnodes(uint64_t oid,
+					const struct vnode_table *t,
+					int nr_copies,
+					const struct sd_vnode **vnodes)
+{
+	uint64_t hval = sd_hash_oid(oid);
+	uint32_t zones[SD_MAX_COPIES];
+	int lo = 0, hi = t->nr, pos, walked = 0;
+
+	/* the first vnode whose hash is not less than hval */
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (t->hashes[mid] < hval)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	pos = lo == t->nr ? 0 : lo;
+
+	vnodes[0] = t->slots[pos].vnode;
+	zones[0] = t->slots[pos].zone;
+	for (int i = 1; i < nr_copies; i++) {
+		int next = pos + 1 == t->nr ? 0 : pos + 1;
+
+		walked++;
+		for (int j = 0; j < i; j++) {
+			if (zones[j] != t->slots[next].zone)
+				continue;
+			/* skip the rest of the vnodes in this zone */
+			pos = t->slots[next].next_zone;
+			if (unlikely(pos < 0))
+				panic("can't find a valid vnode");
+			/* a whole lap around the ring */
+			walked += (pos - next + t->nr) % t->nr;
+			if (unlikely(walked >= t->nr))
+				panic("can't find a valid vnode");
+			next = pos;
+			j = -1;
+		}
+		pos = next;
+		vnodes[i] = t->slots[pos].vnode;
+		zones[i] = t->slots[pos].zone;
+	}
+}
+
+/*
+ * The placement helpers for a vnode_info, which use its flat vnode table if
+ * it has been built
+ */
+static inline void vinfo_oid_to_vnodes(uint64_t oid, struct vnode_info *vinfo,
+				       int nr_copies,
+				       const struct sd_vnode **vnodes)
+{
+	if (vinfo->vtable.nr)
+		vtable_oid_to_vnodes(oid, &vinfo->vtable, nr_copies, vnodes);
+	else
+		oid_to_vnodes(oid, &vinfo->vroot, nr_copies, vnodes);
+}
+
+static inline const struct sd_node *
+vinfo_oid_to_node(uint64_t oid, struct vnode_info *vinfo, int copy_idx)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(oid, vinfo, copy_idx + 1, vnodes);
+
+	return vnodes[copy_idx]->node;
+}
+
+static inline void vinfo_oid_to_nodes(uint64_t oid, struct vnode_info *vinfo,
+				      int nr_copies,
+				      const struct sd_node **nodes)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(oid, vinfo, nr_copies, vnodes);
+	for (int i = 0; i < nr_copies; i++)
+		nodes[i] = vnodes[i]->node;
+}
+
 static inline const char *sd_strerror(int err)
 {
 	static const char *descs[256] = {
@@ -163,6 +163,8 @@ struct sd_req {
 			uint8_t		block_size_shift;
 			uint32_t	snapid;
 			uint32_t        type;
+			uint8_t		ec_stripe_shift;
+			uint8_t		reserved[3];
 		} vdi;
 
 		/* sheepdog-internal */
@@ -185,6 +187,7 @@ struct sd_req {
 						    /* others mean true */
 			uint8_t		copy_policy;
 			uint8_t		block_size_shift;
+			uint8_t		ec_stripe_shift;
 		} vdi_state;
 		struct {
 			uint64_t	oid;
@@ -321,6 +324,8 @@ struct sd_inode_0_8 {
  *
  * users of the released area:
  * - uint32_t btree_counter
+ * - uint8_t ec_stripe_shift (the last word, the least likely to have been used
+ *   by an old child VDI ID)
  */
 #define OLD_MAX_CHILDREN 1024U
 
@@ -333,6 +338,13 @@ struct recovery_throttling {
 	uint32_t max_exec_count;
 	uint64_t queue_work_interval;
 	bool throttling;
+	uint32_t window;	/* max objects in recovery, 0 for the default */
+	uint32_t target_latency; /* client I/O latency in us, 0 to ignore */
+	/* recovery budgets, 0 for unlimited */
+	uint32_t max_bandwidth;	/* MB/s of the node */
+	uint32_t max_iops;	/* objects per second of the node */
+	uint32_t disk_bandwidth; /* MB/s of each disk */
+	uint32_t yield_depth;	/* pause while more foreground I/Os queued */
 };
 
 struct sd_inode {
@@ -352,7 +364,9 @@ struct sd_inode {
 	uint32_t parent_vdi_id;
 
 	uint32_t btree_counter;
-	uint32_t __unused[OLD_MAX_CHILDREN - 1];
+	uint32_t __unused[OLD_MAX_CHILDREN - 2];
+	uint8_t  ec_stripe_shift; /* 0 means SD_EC_DATA_STRIPE_SIZE */
+	uint8_t  __pad[3];
 
 	uint32_t data_vdi_id[SD_INODE_DATA_INDEX];
 	struct generation_reference gref[SD_INODE_DATA_INDEX];
@@ -145,6 +145,7 @@ void make_path(char *path, size_t size, size_t nr_segs, const char **segs);
 
 void find_zero_blocks(const void *buf, uint64_t *poffset, uint32_t *plen);
 void trim_zero_blocks(void *buf, uint64_t *poffset, uint32_t *plen);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
 
 /* a type safe version of qsort() */
 #define xqsort(base, nmemb, compar)					\
@@ -26,6 +26,7 @@ enum wq_thread_control {
 	WQ_ORDERED, /* Only 1 thread created for work queue */
 	WQ_DYNAMIC, /* # of threads proportional to nr_nodes created */
 	WQ_FIXED, /* Fixed # of threads created */
+	WQ_STEALING, /* One thread per core, per-thread queues with stealing */
 };
 
 static inline bool is_main_thread(void)
@@ -65,6 +66,7 @@ struct work_queue *create_ordered_work_queue(const char *name);
 struct work_queue *create_fixed_work_queue(const char *name, int nr_threads);
 void queue_work(struct work_queue *q, struct work *work);
 bool work_queue_empty(struct work_queue *q);
+size_t work_queue_length(struct work_queue *q);
 int wq_trace_init(void);
 void set_max_dynamic_threads(size_t nr_max);
 
@@ -108,6 +108,12 @@ static uint8_t modnn(int x)
  */
 static uint8_t gf_mul_table[256][256];
 
+/*
+ * gf_nibble_table[c] holds c * x for x in 0..15 in the first half and
+ * c * (x << 4) in the second half, for the SIMD kernels of addmul()
+ */
+static uint8_t gf_nibble_table[256][32];
+
 #define gf_mul(x, y) gf_mul_table[x][y]
 
 #define USE_GF_MULC register uint8_t *__gf_mulc_
@@ -135,6 +141,12 @@ static void _init_mul_table(void)
 
 	for (j = 0; j < 256; j++)
 		gf_mul_table[0][j] = gf_mul_table[j][0] = 0;
+
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 16; j++) {
+			gf_nibble_table[i][j] = gf_mul_table[i][j];
+			gf_nibble_table[i][16 + j] = gf_mul_table[i][j << 4];
+		}
 }
 
 #define NEW_GF_MATRIX(rows, cols) \
@@ -211,7 +223,7 @@ static void generate_gf(void)
  */
 #define addmul(dst, src, c, sz)                 \
 	if (c != 0)				\
-		_addmul1(dst, src, c, sz)
+		fec_kernel->addmul(dst, src, c, sz)
 
 #define UNROLL 16               /* 1, 4, 8, 16 */
 static void _addmul1(register uint8_t *dst,
@@ -252,6 +264,172 @@ static void _addmul1(register uint8_t *dst,
 		GF_ADDMULC(*dst, *src);
 }
 
+/*
+ * SIMD kernels of addmul()
+ *
+ * c * x = c * (x & 0x0f) ^ c * (x & 0xf0) in GF(2^8), so a byte shuffle over
+ * the two 16 byte tables of c multiplies a whole vector of x at once.  The
+ * widest kernel the CPU supports is chosen at runtime by init_fec().  The
+ * bytes which don't fill a vector are left to _addmul1().
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static void addmul_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+			 size_t sz)
+{
+	const __m128i lo = _mm_loadu_si128((const __m128i *)gf_nibble_table[c]);
+	const __m128i hi =
+		_mm_loadu_si128((const __m128i *)(gf_nibble_table[c] + 16));
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 16 <= sz; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+		__m128i h = _mm_shuffle_epi8(hi,
+			_mm_and_si128(_mm_srli_epi64(s, 4), mask));
+
+		d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+	_addmul1(dst + i, src + i, c, sz - i);
+}
+
+__attribute__((target("avx2")))
+static void addmul_avx2(uint8_t *dst, const uint8_t *src, uint8_t c,
+			size_t sz)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)gf_nibble_table[c]));
+	const __m256i hi = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)(gf_nibble_table[c] + 16)));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 32 <= sz; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+		__m256i h = _mm256_shuffle_epi8(hi,
+			_mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+
+		d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+		_mm256_storeu_si256((__m256i *)(dst + i), d);
+	}
+	_addmul1(dst + i, src + i, c, sz - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void addmul_avx512(uint8_t *dst, const uint8_t *src, uint8_t c,
+			  size_t sz)
+{
+	const __m512i lo = _mm512_broadcast_i32x4(
+		_mm_loadu_si128((const __m128i *)gf_nibble_table[c]));
+	const __m512i hi = _mm512_broadcast_i32x4(
+		_mm_loadu_si128((const __m128i *)(gf_nibble_table[c] + 16)));
+	const __m512i mask = _mm512_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 64 <= sz; i += 64) {
+		__m512i s = _mm512_loadu_si512(src + i);
+		__m512i d = _mm512_loadu_si512(dst + i);
+		__m512i l = _mm512_shuffle_epi8(lo, _mm512_and_si512(s, mask));
+		__m512i h = _mm512_shuffle_epi8(hi,
+			_mm512_and_si512(_mm512_srli_epi64(s, 4), mask));
+
+		d = _mm512_xor_si512(d, _mm512_xor_si512(l, h));
+		_mm512_storeu_si512(dst + i, d);
+	}
+	_addmul1(dst + i, src + i, c, sz - i);
+}
+
+/* The OS has to save the vector registers on context switches, too */
+static bool xstate_enabled(uint64_t mask)
+{
+	if (!cpu_has_osxsave)
+		return false;
+
+	return (xgetbv(XCR_XFEATURE_ENABLED_MASK) & mask) == mask;
+}
+
+static bool ssse3_usable(void)
+{
+	return cpu_has_ssse3;
+}
+
+static bool avx2_usable(void)
+{
+	return cpu_has_avx2 && xstate_enabled(XSTATE_SSE | XSTATE_YMM);
+}
+
+static bool avx512_usable(void)
+{
+	return cpu_has_avx512f && cpu_has_avx512bw &&
+		xstate_enabled(XSTATE_SSE | XSTATE_YMM | XSTATE_OPMASK |
+			       XSTATE_ZMM_Hi256 | XSTATE_Hi16_ZMM);
+}
+#endif
+
+struct fec_kernel {
+	const char *name;
+	void (*addmul)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t sz);
+	bool (*supported)(void);
+};
+
+/* In order of preference */
+static const struct fec_kernel fec_kernels[] = {
+#if defined(__x86_64__) && defined(__GNUC__)
+	{ "avx512", addmul_avx512, avx512_usable },
+	{ "avx2", addmul_avx2, avx2_usable },
+	{ "ssse3", addmul_ssse3, ssse3_usable },
+#endif
+	{ "scalar", _addmul1, NULL },
+};
+
+static const struct fec_kernel *fec_kernel =
+	fec_kernels + ARRAY_SIZE(fec_kernels) - 1;
+
+const char *fec_kernel_name(void)
+{
+	return fec_kernel->name;
+}
+
+/*
+ * Switch the kernel of the GF(2^8) arithmetic, mainly for benchmarks.  Return
+ * -1 if the kernel is unknown or not supported by the CPU.
+ */
+int fec_set_kernel(const char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(fec_kernels); i++) {
+		const struct fec_kernel *k = fec_kernels + i;
+
+		if (strcmp(k->name, name))
+			continue;
+		if (k->supported && !k->supported())
+			return -1;
+		fec_kernel = k;
+		return 0;
+	}
+
+	return -1;
+}
+
+static void select_fec_kernel(void)
+{
+	for (int i = 0; i < ARRAY_SIZE(fec_kernels); i++) {
+		const struct fec_kernel *k = fec_kernels + i;
+
+		if (!k->supported || k->supported()) {
+			fec_kernel = k;
+			break;
+		}
+	}
+	sd_debug("%s kernel is selected", fec_kernel->name);
+}
+
 /* computes C = AB where A is dp*d, B is d*m, C is dp*m */
 static void _matmul(uint8_t *a, uint8_t *b, uint8_t *c, unsigned dp, unsigned d,
 		    unsigned m)
@@ -440,6 +618,7 @@ void init_fec(void)
 {
 	generate_gf();
 	_init_mul_table();
+	select_fec_kernel();
 }
 
 /*
@@ -691,28 +870,43 @@ void ec_decode(struct fec *ctx, const uint8_t *input[], const int inidx[],
 		goto out;
 
 	/* Fill the parity strip */
-	ec_encode(ctx, dp, p);
+	ec_encode(ctx, dp, p, strip_size);
 	for (i = 0; i < ep; i++)
 		dp[ed + i] = p[i];
 out:
 	memcpy(output, dp[idx], strip_size);
 }
 
+/*
+ * Reconstruct the strip 'idx' of an object from the 'd' strips in 'input'.
+ *
+ * Every byte offset of the strips is decoded with the same coefficients, so
+ * the decode matrix is built once and the whole strips are processed at once
+ * instead of stripe by stripe.
+ */
 void fec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 		      char *buf, int idx, uint32_t object_size)
 {
-	int i, j, d = ctx->d;
-	size_t strip_size = SD_EC_DATA_STRIPE_SIZE / d;
-	uint32_t nr_stripe_per_object = object_size / SD_EC_DATA_STRIPE_SIZE;
-
-	for (i = 0; i < nr_stripe_per_object; i++) {
-		const uint8_t *in[d];
-		uint8_t out[strip_size];
-
-		for (j = 0; j < d; j++)
-			in[j] = input[j] + strip_size * i;
-		ec_decode(ctx, in, in_idx, out, idx);
-		memcpy(buf + strip_size * i, out, strip_size);
+	int i, d = ctx->d;
+	size_t len = object_size / d;
+	uint8_t m[d * d], coef[d];
+	uint8_t *out = (uint8_t *)buf;
+
+	for (i = 0; i < d; i++)
+		memcpy(m + i * d, ctx->enc_matrix + in_idx[i] * d, d);
+	_invert_mat(m, d);
+
+	if (idx < d)
+		memcpy(coef, m + idx * d, d);
+	else
+		_matmul(ctx->enc_matrix + idx * d, m, coef, 1, d, d);
+
+	for (size_t off = 0; off < len; off += STRIDE) {
+		size_t stride = min(len - off, (size_t)STRIDE);
+
+		memset(out + off, 0, stride);
+		for (i = 0; i < d; i++)
+			addmul(out + off, input[i] + off, coef[i], stride);
 	}
 }
 
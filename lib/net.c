@@ -20,6 +20,8 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -33,6 +35,16 @@
 #include "event.h"
 #include "net.h"
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY		60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY		0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY	5
+#endif
+
 int conn_tx_off(struct connection *conn)
 {
 	conn->events &= ~EPOLLOUT;
@@ -259,13 +271,17 @@ static void forward_iov(struct msghdr *msg, int len)
 }
 
 
-static int do_write(int sockfd, struct msghdr *msg, int len,
-		    bool (*need_retry)(uint32_t), uint32_t epoch,
-		    uint32_t max_count)
+/*
+ * If MSG_ZEROCOPY is in 'flags', 'nr_zc' is incremented for every sendmsg()
+ * call which will be reported in the error queue of the socket.
+ */
+static int __do_write(int sockfd, struct msghdr *msg, int len, int flags,
+		      uint32_t *nr_zc, bool (*need_retry)(uint32_t),
+		      uint32_t epoch, uint32_t max_count)
 {
 	int ret, repeat = max_count;
 rewrite:
-	ret = sendmsg(sockfd, msg, 0);
+	ret = sendmsg(sockfd, msg, flags);
 	if (ret < 0) {
 		if (errno == EINTR)
 			goto rewrite;
@@ -278,11 +294,19 @@ rewrite:
 			repeat--;
 			goto rewrite;
 		}
+		/* Out of the optmem to pin the pages, copy them instead */
+		if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+			flags &= ~MSG_ZEROCOPY;
+			goto rewrite;
+		}
 
 		sd_err("failed to write to socket: %m");
 		return 1;
 	}
 
+	if (flags & MSG_ZEROCOPY)
+		(*nr_zc)++;
+
 	len -= ret;
 	if (len) {
 		forward_iov(msg, ret);
@@ -292,6 +316,33 @@ rewrite:
 	return 0;
 }
 
+static int do_write(int sockfd, struct msghdr *msg, int len,
+		    bool (*need_retry)(uint32_t), uint32_t epoch,
+		    uint32_t max_count)
+{
+	return __do_write(sockfd, msg, len, 0, NULL, need_retry, epoch,
+			  max_count);
+}
+
+/*
+ * Write all the buffers of 'iov' with as few system calls as possible.  The
+ * contents of 'iov' are modified while writing.
+ */
+int do_writev(int sockfd, struct iovec *iov, int iovcnt, uint32_t max_count)
+{
+	struct msghdr msg;
+	int len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	return do_write(sockfd, &msg, len, NULL, 0, max_count);
+}
+
 int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	     bool (*need_retry)(uint32_t epoch), uint32_t epoch,
 	     uint32_t max_count)
@@ -324,6 +375,136 @@ int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	return ret;
 }
 
+/*
+ * Same as send_req(), but the data is sent with MSG_ZEROCOPY so that the kernel
+ * transmits the pages of 'data' instead of copying them into the socket
+ * buffer.  'nr_pending' is incremented by the number of the completion
+ * notifications to be expected; 'data' must be kept intact until
+ * reap_zerocopy() collects all of them.
+ *
+ * If the socket doesn't support zerocopy, this falls back to copying.
+ */
+int send_req_zerocopy(int sockfd, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool (*need_retry)(uint32_t epoch),
+		      uint32_t epoch, uint32_t max_count, uint32_t *nr_pending)
+{
+	int ret, opt = 1, flags = MSG_ZEROCOPY;
+	struct msghdr msg;
+	struct iovec iov;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &opt,
+		       sizeof(opt)) < 0) {
+		sd_debug("zerocopy is not supported, %m");
+		flags = 0;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	/* The header is too small to be worth pinning */
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(*hdr);
+	ret = __do_write(sockfd, &msg, sizeof(*hdr), wlen ? MSG_MORE : 0,
+			 NULL, need_retry, epoch, max_count);
+	if (ret)
+		goto err;
+
+	if (wlen) {
+		msg.msg_iov = &iov;
+		iov.iov_base = data;
+		iov.iov_len = wlen;
+		ret = __do_write(sockfd, &msg, wlen, flags, nr_pending,
+				 need_retry, epoch, max_count);
+		if (ret)
+			goto err;
+	}
+
+	return 0;
+err:
+	sd_err("failed to send request %x, %d: %m", hdr->opcode, wlen);
+	return -1;
+}
+
+/*
+ * Collect the MSG_ZEROCOPY completion notifications from the error queue of
+ * the socket and decrement 'nr_pending' accordingly.
+ *
+ * If 'timeout' is zero, return as soon as the error queue is empty.
+ * Otherwise, wait up to 'timeout' milliseconds for every pending notification.
+ * Return -1 on timeout or if the socket has a real error.
+ */
+int reap_zerocopy(int sockfd, uint32_t *nr_pending, int timeout)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct pollfd pfd;
+	bool woken = false;
+	int ret;
+
+	while (*nr_pending > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ret = recvmsg(sockfd, &msg, MSG_ERRQUEUE);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				sd_err("failed to read the error queue: %m");
+				return -1;
+			}
+			if (timeout == 0)
+				break;
+			/*
+			 * POLLERR without a queued notification means that
+			 * the connection itself is broken.
+			 */
+			if (woken) {
+				sd_err("connection is broken while waiting "
+				       "for zerocopy completion");
+				return -1;
+			}
+
+			pfd.fd = sockfd;
+			pfd.events = 0;
+			ret = poll(&pfd, 1, timeout);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0) {
+				sd_err("failed to wait for zerocopy completion"
+				       ", %s", ret ? strerror(errno) :
+				       "timeout");
+				return -1;
+			}
+			woken = true;
+			continue;
+		}
+		woken = false;
+
+		cm = CMSG_FIRSTHDR(&msg);
+		if (!cm) {
+			sd_err("no control message in the error queue");
+			return -1;
+		}
+		serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+		    serr->ee_errno != 0) {
+			sd_err("unexpected error queue message, origin %d, %s",
+			       serr->ee_origin, strerror(serr->ee_errno));
+			return -1;
+		}
+
+		/* [ee_info, ee_data] is the range of the completed calls */
+		*nr_pending -= serr->ee_data - serr->ee_info + 1;
+	}
+
+	return 0;
+}
+
 int exec_req(int sockfd, struct sd_req *hdr, void *data,
 	     bool (*need_retry)(uint32_t epoch), uint32_t epoch,
 	     uint32_t max_count)
@@ -638,6 +638,35 @@ void trim_zero_blocks(void *buf, uint64_t *poffset, uint32_t *plen)
 		memmove(p, p + *poffset - orig_offset, *plen);
 }
 
+/* CRC-32C (Castagnoli), the reflected polynomial 0x82F63B78 */
+static uint32_t crc32c_table[256];
+
+static void __attribute__((constructor)) crc32c_init_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+		crc32c_table[i] = crc;
+	}
+}
+
+/*
+ * Calculate the CRC-32C of 'buf'.  Pass 0 as 'crc' for the first buffer and
+ * the previous result to continue the calculation over multiple buffers.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
 char *xstrdup(const char *s)
 {
 	char *ret;
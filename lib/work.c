@@ -47,6 +47,39 @@ static size_t max_dynamic_threads = 0;
  */
 #define WQ_PROTECTION_PERIOD 1000 /* ms */
 
+/*
+ * Work stealing queues (WQ_STEALING)
+ *
+ * Every worker owns a bounded lock-free ring.  queue_work() puts the work into
+ * the ring of the calling worker, or into the rings in the round-robin order
+ * if the caller isn't a worker of the queue, and falls back to the mutex
+ * protected pending list only if the ring is full.  An idle worker steals from
+ * the rings of the other workers before going to sleep, so the pending_lock
+ * and the condition variable are touched only when a worker has nothing to do.
+ *
+ * The rings are the bounded MPMC queues by Dmitry Vyukov; each slot has a
+ * sequence number which tells whether it is free for the producer at 'head'
+ * or filled for the consumer at 'tail'.
+ */
+#define WQ_RING_SIZE 256 /* must be a power of 2 */
+
+struct wq_slot {
+	unsigned long seq;
+	struct work *work;
+};
+
+struct wq_ring {
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	struct wq_slot slots[WQ_RING_SIZE];
+};
+
+struct wq_worker {
+	struct wq_info *wi;
+	int idx;
+	struct wq_ring ring;
+};
+
 struct wq_info {
 	const char *name;
 
@@ -69,8 +102,20 @@ struct wq_info {
 	/* we cannot shrink work queue till this time */
 	uint64_t tm_end_of_protection;
 	enum wq_thread_control tc;
+
+	/* set when finished_list gets non-empty, cleared by the main thread */
+	uatomic_bool has_finished;
+
+	/* for WQ_STEALING, protected by uatomic primitives */
+	struct wq_worker *workers;
+	size_t nr_workers;
+	unsigned long next_worker;
+	unsigned long nr_sleeping;
+	unsigned long nr_overflow;
 };
 
+static __thread struct wq_worker *current_worker;
+
 static int efd;
 static LIST_HEAD(wq_info_list);
 static size_t nr_nodes = 1;
@@ -78,6 +123,7 @@ static size_t (*wq_get_nr_nodes)(void);
 static size_t nr_cores = 1;
 
 static void *worker_routine(void *arg);
+static void *stealing_worker_routine(void *arg);
 
 #ifdef HAVE_TRACE
 
@@ -219,6 +265,7 @@ static inline uint64_t wq_get_roof(struct wq_info *wi)
 		}
 		break;
 	case WQ_FIXED:
+	case WQ_STEALING:
 		nr = wi->nr_threads;
 		break;
 	default:
@@ -237,7 +284,7 @@ static size_t wq_need_grow(struct wq_info *wi)
 {
 	size_t roof = 0;
 
-	if (wi->tc == WQ_FIXED)
+	if (wi->tc == WQ_FIXED || wi->tc == WQ_STEALING)
 		return 0;
 
 	/* do not need to grow if there are enough threads */
@@ -259,7 +306,7 @@ static size_t wq_need_grow(struct wq_info *wi)
  */
 static bool wq_need_shrink(struct wq_info *wi)
 {
-	if (wi->tc == WQ_FIXED)
+	if (wi->tc == WQ_FIXED || wi->tc == WQ_STEALING)
 		return false;
 
 	if (uatomic_read(&wi->nr_queued_work) < wi->nr_threads / 2)
@@ -289,6 +336,93 @@ static int create_worker_threads(struct wq_info *wi, size_t nr_threads)
 	return 0;
 }
 
+static bool wq_ring_push(struct wq_ring *r, struct work *work)
+{
+	unsigned long pos = uatomic_read(&r->head), seq;
+	struct wq_slot *slot;
+	long diff;
+
+	for (;;) {
+		slot = r->slots + (pos & (WQ_RING_SIZE - 1));
+		seq = uatomic_read(&slot->seq);
+		cmm_smp_rmb();
+		diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			if (uatomic_cmpxchg(&r->head, pos, pos + 1) == pos)
+				break;
+		} else if (diff < 0)
+			return false; /* full */
+
+		pos = uatomic_read(&r->head);
+	}
+
+	slot->work = work;
+	cmm_smp_wmb();
+	uatomic_set(&slot->seq, pos + 1);
+
+	return true;
+}
+
+static struct work *wq_ring_pop(struct wq_ring *r)
+{
+	unsigned long pos = uatomic_read(&r->tail), seq;
+	struct wq_slot *slot;
+	struct work *work;
+	long diff;
+
+	for (;;) {
+		slot = r->slots + (pos & (WQ_RING_SIZE - 1));
+		seq = uatomic_read(&slot->seq);
+		cmm_smp_rmb();
+		diff = (long)seq - (long)(pos + 1);
+		if (diff == 0) {
+			if (uatomic_cmpxchg(&r->tail, pos, pos + 1) == pos)
+				break;
+		} else if (diff < 0)
+			return NULL; /* empty */
+
+		pos = uatomic_read(&r->tail);
+	}
+
+	work = slot->work;
+	cmm_smp_mb();
+	uatomic_set(&slot->seq, pos + WQ_RING_SIZE);
+
+	return work;
+}
+
+static inline bool wq_ring_empty(struct wq_ring *r)
+{
+	return uatomic_read(&r->head) == uatomic_read(&r->tail);
+}
+
+static void queue_stealing_work(struct wq_info *wi, struct work *work)
+{
+	struct wq_worker *worker = current_worker;
+	unsigned long idx;
+
+	/* Keep the work on the local worker if it queues more work */
+	if (!worker || worker->wi != wi) {
+		idx = uatomic_add_return(&wi->next_worker, 1);
+		worker = wi->workers + idx % wi->nr_workers;
+	}
+
+	if (!wq_ring_push(&worker->ring, work)) {
+		sd_mutex_lock(&wi->pending_lock);
+		list_add_tail(&work->w_list, &wi->q.pending_list);
+		uatomic_inc(&wi->nr_overflow);
+		sd_mutex_unlock(&wi->pending_lock);
+	}
+
+	/* pairs with the barrier in stealing_worker_sleep() */
+	cmm_smp_mb();
+	if (uatomic_read(&wi->nr_sleeping)) {
+		sd_mutex_lock(&wi->pending_lock);
+		sd_cond_signal(&wi->pending_cond);
+		sd_mutex_unlock(&wi->pending_lock);
+	}
+}
+
 void queue_work(struct work_queue *q, struct work *work)
 {
 	struct wq_info *wi = container_of(q, struct wq_info, q);
@@ -297,6 +431,11 @@ void queue_work(struct work_queue *q, struct work *work)
 	tracepoint(work, queue_work, wi, work);
 
 	uatomic_inc(&wi->nr_queued_work);
+	if (wi->tc == WQ_STEALING) {
+		queue_stealing_work(wi, work);
+		return;
+	}
+
 	sd_mutex_lock(&wi->pending_lock);
 
 	new_nr_threads = wq_need_grow(wi);
@@ -321,7 +460,11 @@ static void worker_thread_request_done(int fd, int events, void *data)
 	eventfd_xread(fd);
 
 	list_for_each_entry(wi, &wq_info_list, list) {
+		if (!uatomic_is_true(&wi->has_finished))
+			continue;
+
 		sd_mutex_lock(&wi->finished_lock);
+		uatomic_set_false(&wi->has_finished);
 		list_splice_init(&wi->finished_list, &list);
 		sd_mutex_unlock(&wi->finished_lock);
 
@@ -337,6 +480,26 @@ static void worker_thread_request_done(int fd, int events, void *data)
 	}
 }
 
+/*
+ * Pass the finished work to the main thread.  The event fd is written only
+ * when the finished list gets non-empty, so a burst of completions costs one
+ * wakeup of the main thread.
+ */
+static void finish_work(struct wq_info *wi, struct work *work)
+{
+	bool kick;
+
+	sd_mutex_lock(&wi->finished_lock);
+	kick = list_empty(&wi->finished_list);
+	list_add_tail(&work->w_list, &wi->finished_list);
+	if (kick)
+		uatomic_set_true(&wi->has_finished);
+	sd_mutex_unlock(&wi->finished_lock);
+
+	if (kick)
+		eventfd_xwrite(efd, 1);
+}
+
 static void *worker_routine(void *arg)
 {
 	struct wq_info *wi = arg;
@@ -376,16 +539,144 @@ retest:
 		if (work->fn)
 			work->fn(work);
 
-		sd_mutex_lock(&wi->finished_lock);
-		list_add_tail(&work->w_list, &wi->finished_list);
-		sd_mutex_unlock(&wi->finished_lock);
+		finish_work(wi, work);
+	}
 
-		eventfd_xwrite(efd, 1);
+	pthread_exit(NULL);
+}
+
+static struct work *steal_work(struct wq_worker *worker)
+{
+	struct wq_info *wi = worker->wi;
+	struct work *work;
+
+	for (size_t i = 1; i < wi->nr_workers; i++) {
+		struct wq_worker *victim;
+
+		victim = wi->workers + (worker->idx + i) % wi->nr_workers;
+		work = wq_ring_pop(&victim->ring);
+		if (work)
+			return work;
+	}
+
+	return NULL;
+}
+
+static struct work *pop_overflow_work(struct wq_info *wi)
+{
+	struct work *work = NULL;
+
+	if (!uatomic_read(&wi->nr_overflow))
+		return NULL;
+
+	sd_mutex_lock(&wi->pending_lock);
+	if (!list_empty(&wi->q.pending_list)) {
+		work = list_first_entry(&wi->q.pending_list, struct work,
+					w_list);
+		list_del(&work->w_list);
+		uatomic_dec(&wi->nr_overflow);
+	}
+	sd_mutex_unlock(&wi->pending_lock);
+
+	return work;
+}
+
+static bool stealing_work_pending(struct wq_info *wi)
+{
+	if (uatomic_read(&wi->nr_overflow))
+		return true;
+
+	for (size_t i = 0; i < wi->nr_workers; i++)
+		if (!wq_ring_empty(&wi->workers[i].ring))
+			return true;
+
+	return false;
+}
+
+static void stealing_worker_sleep(struct wq_info *wi)
+{
+	sd_mutex_lock(&wi->pending_lock);
+	uatomic_inc(&wi->nr_sleeping);
+	/*
+	 * Pairs with the barrier in queue_stealing_work(); either the
+	 * producer sees us sleeping or we see its work.
+	 */
+	cmm_smp_mb();
+	if (!stealing_work_pending(wi))
+		sd_cond_wait(&wi->pending_cond, &wi->pending_lock);
+	uatomic_dec(&wi->nr_sleeping);
+	sd_mutex_unlock(&wi->pending_lock);
+}
+
+static void *stealing_worker_routine(void *arg)
+{
+	struct wq_worker *worker = arg;
+	struct wq_info *wi = worker->wi;
+	struct work *work;
+	int tid = gettid();
+
+	set_thread_name(wi->name, true);
+	current_worker = worker;
+
+	trace_set_tid_map(tid);
+	while (true) {
+		work = wq_ring_pop(&worker->ring);
+		if (!work)
+			work = steal_work(worker);
+		if (!work)
+			work = pop_overflow_work(wi);
+		if (!work) {
+			stealing_worker_sleep(wi);
+			continue;
+		}
+
+		tracepoint(work, do_work, wi, work);
+
+		if (work->fn)
+			work->fn(work);
+
+		finish_work(wi, work);
 	}
 
 	pthread_exit(NULL);
 }
 
+static int create_stealing_workers(struct wq_info *wi, size_t nr)
+{
+	pthread_t thread;
+	int ret;
+
+	wi->workers = xcalloc(nr, sizeof(*wi->workers));
+	wi->nr_workers = nr;
+	for (size_t i = 0; i < nr; i++) {
+		struct wq_worker *worker = wi->workers + i;
+
+		worker->wi = wi;
+		worker->idx = i;
+		for (int j = 0; j < WQ_RING_SIZE; j++)
+			worker->ring.slots[j].seq = j;
+	}
+
+	for (size_t i = 0; i < nr; i++) {
+		ret = pthread_create(&thread, NULL, stealing_worker_routine,
+				     wi->workers + i);
+		if (ret != 0) {
+			sd_err("failed to create worker thread: %m");
+			if (i == 0) {
+				free(wi->workers);
+				return -1;
+			}
+			/* the running workers refer to wi */
+			panic("failed to create a work stealing queue: %s",
+			      wi->name);
+		}
+		wi->nr_threads++;
+		sd_debug("create thread %s %zu", wi->name, wi->nr_threads);
+	}
+
+	return 0;
+}
+
 int init_work_queue(size_t (*get_nr_nodes)(void))
 {
 	int ret;
@@ -429,7 +720,11 @@ struct work_queue *create_work_queue(const char *name,
 	sd_init_mutex(&wi->finished_lock);
 	sd_init_mutex(&wi->pending_lock);
 
-	if (tc != WQ_FIXED) {
+	if (tc == WQ_STEALING) {
+		ret = create_stealing_workers(wi, nr_cores);
+		if (ret < 0)
+			goto destroy_threads;
+	} else if (tc != WQ_FIXED) {
 		ret = create_worker_threads(wi, 1);
 		if (ret < 0)
 			goto destroy_threads;
@@ -479,6 +774,14 @@ bool work_queue_empty(struct work_queue *q)
 	return uatomic_read(&wi->nr_queued_work) == 0;
 }
 
+/* Return the number of the works queued or running in the queue */
+size_t work_queue_length(struct work_queue *q)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	return uatomic_read(&wi->nr_queued_work);
+}
+
 void set_max_dynamic_threads(size_t nr_max)
 {
 	max_dynamic_threads = nr_max;
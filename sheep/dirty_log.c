@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Dirty object log
+ *
+ * Every node remembers which objects it was asked to write or remove in the
+ * last DIRTY_LOG_EPOCHS epochs.  When a node rejoins the cluster after a short
+ * outage, its objects are moved to the stale directory at the epoch it left.
+ * The union of the logs of all the nodes which have been in the cluster since
+ * then tells which of those stale replicas might have missed updates; the rest
+ * of them can be linked back without comparing them with the remote copies.
+ *
+ * The log is kept only in memory, so it covers the writes since the node
+ * joined the cluster.  An epoch which saw more than DIRTY_LOG_MAX_OBJS objects
+ * is marked as overflowed and the log doesn't answer for it.  Writes are
+ * recorded when the peer requests arrive, so the log is a superset of the
+ * objects actually updated.  The objects stored by recovery are recorded as
+ * well.
+ *
+ * The log is accessed only in the main thread.
+ */
+
+#include "sheep_priv.h"
+
+#define DIRTY_LOG_EPOCHS	64
+#define DIRTY_LOG_MIN_SLOTS	1024
+#define DIRTY_LOG_MAX_OBJS	(1024 * 1024)	/* per epoch */
+
+struct dirty_epoch {
+	uint32_t epoch;
+	bool overflowed;
+	bool has_zero;		/* oid 0 marks an empty slot */
+
+	uint64_t nr;
+	uint64_t size;		/* number of the slots, a power of two */
+	uint64_t *slots;
+};
+
+static struct dirty_epoch dirty_epochs[DIRTY_LOG_EPOCHS];
+
+/* The oldest epoch whose writes are all in the log, 0 if not started */
+static uint32_t log_start;
+
+static void dirty_epoch_reset(struct dirty_epoch *de, uint32_t epoch)
+{
+	free(de->slots);
+	memset(de, 0, sizeof(*de));
+	de->epoch = epoch;
+}
+
+static bool dirty_epoch_insert(uint64_t *slots, uint64_t size, uint64_t oid)
+{
+	uint64_t i = sd_hash_oid(oid) & (size - 1);
+
+	while (slots[i]) {
+		if (slots[i] == oid)
+			return false;
+		i = (i + 1) & (size - 1);
+	}
+	slots[i] = oid;
+	return true;
+}
+
+static void dirty_epoch_grow(struct dirty_epoch *de)
+{
+	uint64_t size = de->size ? de->size * 2 : DIRTY_LOG_MIN_SLOTS;
+	uint64_t *slots = xcalloc(size, sizeof(*slots));
+
+	for (uint64_t i = 0; i < de->size; i++)
+		if (de->slots[i])
+			dirty_epoch_insert(slots, size, de->slots[i]);
+
+	free(de->slots);
+	de->slots = slots;
+	de->size = size;
+}
+
+/* Start logging the writes from 'epoch' on */
+main_fn void dirty_log_init(uint32_t epoch)
+{
+	if (log_start)
+		return;
+
+	log_start = epoch;
+	sd_debug("dirty object log starts at epoch %"PRIu32, epoch);
+}
+
+main_fn void dirty_log_record(uint64_t oid, uint32_t epoch)
+{
+	struct dirty_epoch *de = dirty_epochs + epoch % DIRTY_LOG_EPOCHS;
+
+	if (!log_start || epoch < log_start)
+		return;
+
+	if (de->epoch != epoch) {
+		if (de->epoch > epoch)
+			/* too old to be logged */
+			return;
+		if (de->epoch)
+			log_start = max(log_start, de->epoch + 1);
+		dirty_epoch_reset(de, epoch);
+	}
+
+	if (de->overflowed)
+		return;
+
+	if (!oid) {
+		de->has_zero = true;
+		return;
+	}
+
+	/* keep the load factor below 1/2 */
+	if ((de->nr + 1) * 2 > de->size)
+		dirty_epoch_grow(de);
+	if (!dirty_epoch_insert(de->slots, de->size, oid))
+		return;
+
+	if (++de->nr > DIRTY_LOG_MAX_OBJS) {
+		sd_info("too many dirty objects at epoch %"PRIu32, epoch);
+		dirty_epoch_reset(de, epoch);
+		de->overflowed = true;
+	}
+}
+
+/* Sort the object list and remove the duplicates, return the new length */
+size_t sort_uniq_oids(uint64_t *oids, size_t nr)
+{
+	size_t n = 0;
+
+	xqsort(oids, nr, oid_cmp);
+	for (size_t i = 0; i < nr; i++)
+		if (n == 0 || oids[n - 1] != oids[i])
+			oids[n++] = oids[i];
+
+	return n;
+}
+
+/*
+ * Copy the sorted list of the objects written since 'from' epoch to 'oids',
+ * which can hold 'nr_max' objects.
+ */
+main_fn int dirty_log_get(uint32_t from, uint64_t *oids, size_t nr_max,
+			  size_t *nr_oids)
+{
+	size_t nr = 0, total = 0;
+
+	if (!log_start || from < log_start)
+		return SD_RES_NOT_FOUND;
+
+	for (int i = 0; i < DIRTY_LOG_EPOCHS; i++) {
+		struct dirty_epoch *de = dirty_epochs + i;
+
+		if (de->epoch < from)
+			continue;
+		if (de->overflowed)
+			return SD_RES_NOT_FOUND;
+		total += de->nr + (de->has_zero ? 1 : 0);
+	}
+
+	if (total > nr_max)
+		return SD_RES_BUFFER_SMALL;
+
+	for (int i = 0; i < DIRTY_LOG_EPOCHS; i++) {
+		struct dirty_epoch *de = dirty_epochs + i;
+
+		if (de->epoch < from)
+			continue;
+		if (de->has_zero)
+			oids[nr++] = 0;
+		for (uint64_t j = 0; j < de->size; j++)
+			if (de->slots[j])
+				oids[nr++] = de->slots[j];
+	}
+
+	*nr_oids = sort_uniq_oids(oids, nr);
+	return SD_RES_SUCCESS;
+}
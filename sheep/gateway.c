@@ -23,15 +23,9 @@ static inline void gateway_init_fwd_hdr(struct sd_req *fwd, struct sd_req *hdr)
 	fwd->proto_ver = SD_SHEEP_PROTO_VER;
 }
 
-struct req_iter {
-	uint8_t *buf;
-	uint32_t wlen;
-	uint32_t dlen;
-	uint64_t off;
-};
-
 static struct req_iter *prepare_replication_requests(struct request *req,
-						     int *nr)
+						     int *nr_reqs,
+						     int *nr_to_send)
 {
 	int nr_copies = get_req_copy_number(req);
 	void *data = req->data;
@@ -41,16 +35,17 @@ static struct req_iter *prepare_replication_requests(struct request *req,
 
 	sd_debug("%016"PRIx64, req->rq.obj.oid);
 
-	reqs = zalloc(sizeof(*reqs) * nr_copies);
+	reqs = mempool_zalloc(req_iter_pool);
 	if(unlikely(!reqs))
 		return NULL;
 
-	*nr = nr_copies;
+	*nr_reqs = *nr_to_send = nr_copies;
 	for (int i = 0; i < nr_copies; i++) {
 		reqs[i].buf = data;
 		reqs[i].dlen = len;
 		reqs[i].off = off;
 		reqs[i].wlen = len;
+		reqs[i].idx = i;
 	}
 	return reqs;
 }
@@ -58,12 +53,13 @@ static struct req_iter *prepare_replication_requests(struct request *req,
 /*
  * Make sure we don't overwrite the existing data for misaligned write
  *
- * If either offset or length of request isn't aligned to
- * SD_EC_DATA_STRIPE_SIZE, we have to read the unaligned blocks before write.
- * This kind of write amplification indeed slow down the write operation with
- * extra read overhead.
+ * If either offset or length of request isn't aligned to the data stripe size
+ * of the VDI, we have to read the unaligned blocks before write.  This kind of
+ * write amplification indeed slow down the write operation with extra read
+ * overhead.
  */
-static void *init_erasure_buffer(struct request *req, int buf_len)
+static void *init_erasure_buffer(struct request *req, uint32_t stripe_size,
+				 int buf_len)
 {
 	char *buf;
 	uint32_t len = req->rq.data_length;
@@ -71,11 +67,11 @@ static void *init_erasure_buffer(struct request *req, int buf_len)
 	uint64_t oid = req->rq.obj.oid;
 	int opcode = req->rq.opcode;
 	struct sd_req hdr;
-	uint64_t head = round_down(off, SD_EC_DATA_STRIPE_SIZE);
-	uint64_t tail = round_down(off + len, SD_EC_DATA_STRIPE_SIZE);
+	uint64_t head = round_down(off, stripe_size);
+	uint64_t tail = round_down(off + len, stripe_size);
 	int ret;
 
-	buf = valloc(buf_len);
+	buf = alloc_data_buffer(buf_len);
 	if(unlikely(!buf))
 		return NULL;
 	memset(buf, 0, buf_len);
@@ -83,86 +79,314 @@ static void *init_erasure_buffer(struct request *req, int buf_len)
 	if (opcode != SD_OP_WRITE_OBJ)
 		goto out;
 
-	if (off % SD_EC_DATA_STRIPE_SIZE) {
+	if (off % stripe_size) {
 		/* Read head */
 		sd_init_req(&hdr, SD_OP_READ_OBJ);
 		hdr.obj.oid = oid;
-		hdr.data_length = SD_EC_DATA_STRIPE_SIZE;
+		hdr.data_length = stripe_size;
 		hdr.obj.offset = head;
 		ret = exec_local_req(&hdr, buf);
 		if (ret != SD_RES_SUCCESS) {
-			free(buf);
+			free_data_buffer(buf, buf_len);
 			return NULL;
 		}
 	}
 
-	if ((len + off) % SD_EC_DATA_STRIPE_SIZE && tail - head > 0) {
+	if ((len + off) % stripe_size && tail - head > 0) {
 		/* Read tail */
 		sd_init_req(&hdr, SD_OP_READ_OBJ);
 		hdr.obj.oid = oid;
-		hdr.data_length = SD_EC_DATA_STRIPE_SIZE;
+		hdr.data_length = stripe_size;
 		hdr.obj.offset = tail;
 		ret = exec_local_req(&hdr, buf + tail - head);
 		if (ret != SD_RES_SUCCESS) {
-			free(buf);
+			free_data_buffer(buf, buf_len);
 			return NULL;
 		}
 	}
 out:
-	memcpy(buf + off % SD_EC_DATA_STRIPE_SIZE, req->data, len);
+	memcpy(buf + off % stripe_size, req->data, len);
 	return buf;
 }
 
+static void free_erasure_requests(struct req_iter *reqs, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		free_data_buffer(reqs[i].buf, reqs[i].dlen);
+	mempool_free(req_iter_pool, reqs);
+}
+
+/*
+ * Parity delta write
+ *
+ * A write which covers no whole stripe would read the rest of the stripes
+ * through the gateway and rewrite all the strips of them.  Because the code is
+ * linear, the parity strips can be updated instead as
+ *
+ *   P' = P ^ encode(D' ^ D)
+ *
+ * where only the data strips touched by the write have a non-zero delta.  So
+ * we read the old data of the touched strips from their holders, write the
+ * new data to them and let the holders of the parity strips XOR the encoded
+ * delta into their strips.  The untouched data strips are not accessed at all.
+ *
+ * Within a strip file, the bytes of a write which covers no whole stripe are
+ * contiguous, so every touched strip needs one read and one write.
+ */
+static bool can_write_parity_delta(struct request *req, uint32_t stripe_size,
+				   int edp)
+{
+	uint64_t off = req->rq.obj.offset;
+	uint32_t len = req->rq.data_length;
+
+	if (req->rq.opcode != SD_OP_WRITE_OBJ || req->ec_full_stripe)
+		return false;
+
+	/* all the strips have to be updated together */
+	if (get_req_copy_number(req) < edp)
+		return false;
+
+	return len > 0 && round_up(off, stripe_size) + stripe_size > off + len;
+}
+
+/* Byte range of the data strip 'idx' touched by the write, in the strip file */
+static bool strip_write_range(struct request *req, uint32_t stripe_size,
+			      uint32_t strip_size, int idx, uint64_t *start,
+			      uint64_t *end)
+{
+	uint64_t off = req->rq.obj.offset;
+	uint64_t wend = off + req->rq.data_length;
+	uint64_t first = off / stripe_size;
+	uint64_t last = DIV_ROUND_UP(wend, stripe_size);
+	bool touched = false;
+
+	for (uint64_t k = first; k < last; k++) {
+		uint64_t s = k * stripe_size + idx * strip_size;
+		uint64_t lo = max(s, off), hi = min(s + strip_size, wend);
+
+		if (lo >= hi)
+			continue;
+		lo = lo - s + k * strip_size;
+		hi = hi - s + k * strip_size;
+		if (!touched) {
+			*start = lo;
+			touched = true;
+		}
+		*end = hi;
+	}
+
+	return touched;
+}
+
+static int read_old_strip(struct request *req, const struct sd_node *target,
+			  int idx, void *buf, uint32_t len, uint64_t off)
+{
+	struct sd_req hdr;
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	hdr.opcode = SD_OP_READ_PEER;
+	hdr.flags = 0;
+	hdr.data_length = len;
+	hdr.obj.offset = off;
+	hdr.obj.ec_index = idx;
+	hdr.obj.copy_policy = req->rq.obj.copy_policy;
+
+	return sheep_exec_req(&target->nid, &hdr, buf);
+}
+
+/*
+ * Prepare the data strips touched by the write and the parity deltas.  The
+ * requests to send come first, the untouched data strips are moved behind
+ * them and 'target_nodes' are reordered in the same way.  Return NULL if the
+ * old data can't be read, the caller falls back to the full stripe write.
+ */
+static struct req_iter *
+prepare_parity_delta_requests(struct request *req,
+			      const struct sd_node **target_nodes,
+			      struct fec *ctx, uint32_t stripe_size, int ed,
+			      int ep, int *nr_reqs, int *nr_to_send)
+{
+	uint64_t oid = req->rq.obj.oid;
+	uint64_t off = req->rq.obj.offset;
+	uint32_t strip_size = stripe_size / ed;
+	uint64_t start[ed], end[ed], dstart = UINT64_MAX, dend = 0;
+	const struct sd_node *nodes[ed + ep];
+	const uint8_t *ds[ed];
+	uint8_t *ps[ep], *delta = NULL, *old = NULL;
+	struct req_iter *reqs;
+	int i, j, nr = 0, nr_untouched = 0, untouched[ed], ret;
+	uint32_t dlen;
+
+	reqs = mempool_zalloc(req_iter_pool);
+	if (unlikely(!reqs))
+		return NULL;
+
+	for (i = 0; i < ed; i++) {
+		if (!strip_write_range(req, stripe_size, strip_size, i,
+				       start + i, end + i)) {
+			untouched[nr_untouched++] = i;
+			continue;
+		}
+		dstart = min(dstart, start[i]);
+		dend = max(dend, end[i]);
+		reqs[nr++].idx = i;
+	}
+	for (i = 0; i < nr_untouched; i++)
+		reqs[nr + ep + i].idx = untouched[i];
+	dlen = dend - dstart;
+
+	delta = alloc_data_buffer(dlen * ed);
+	old = alloc_data_buffer(dlen);
+	if (unlikely(!delta || !old))
+		goto err;
+	memset(delta, 0, dlen * ed);
+
+	/* Fill the new data and the delta of the touched data strips */
+	for (i = 0; i < nr; i++) {
+		struct req_iter *ri = reqs + i;
+		uint32_t len;
+		uint8_t *d;
+
+		j = ri->idx;
+		len = end[j] - start[j];
+		ri->buf = alloc_data_buffer(len);
+		if (unlikely(!ri->buf))
+			goto err;
+		ri->dlen = ri->wlen = len;
+		ri->off = start[j];
+
+		/* the touched part of each stripe, in the strip file order */
+		for (uint64_t o = start[j]; o < end[j];) {
+			uint64_t k = o / strip_size, x = o % strip_size;
+			uint64_t obj_off = k * stripe_size + j * strip_size + x;
+			uint32_t n = min(end[j] - o, strip_size - x);
+
+			memcpy(ri->buf + o - start[j],
+			       (char *)req->data + obj_off - off, n);
+			o += n;
+		}
+
+		ret = read_old_strip(req, target_nodes[j], j, old, len,
+				     start[j]);
+		if (ret != SD_RES_SUCCESS) {
+			sd_debug("failed to read strip %d of %016"PRIx64", %s",
+				 j, oid, sd_strerror(ret));
+			goto err;
+		}
+
+		d = delta + j * dlen + start[j] - dstart;
+		for (uint32_t x = 0; x < len; x++)
+			d[x] = old[x] ^ ri->buf[x];
+	}
+
+	for (i = 0; i < ep; i++) {
+		struct req_iter *ri = reqs + nr + i;
+
+		ri->buf = alloc_data_buffer(dlen);
+		if (unlikely(!ri->buf))
+			goto err;
+		ri->dlen = ri->wlen = dlen;
+		ri->off = dstart;
+		ri->idx = ed + i;
+		ri->parity_delta = true;
+		ps[i] = ri->buf;
+	}
+	for (i = 0; i < ed; i++)
+		ds[i] = delta + i * dlen;
+	ec_encode(ctx, ds, ps, dlen);
+
+	for (i = 0; i < ed + ep; i++)
+		nodes[i] = target_nodes[reqs[i].idx];
+	memcpy(target_nodes, nodes, sizeof(nodes));
+
+	sd_debug("%016"PRIx64", %d data strips, strip offset %"PRIu64
+		 ", len %"PRIu32, oid, nr, dstart, dlen);
+	*nr_reqs = ed + ep;
+	*nr_to_send = nr + ep;
+	free_data_buffer(delta, dlen * ed);
+	free_data_buffer(old, dlen);
+	return reqs;
+err:
+	free_data_buffer(delta, dlen * ed);
+	free_data_buffer(old, dlen);
+	free_erasure_requests(reqs, ed + ep);
+	return NULL;
+}
+
 /*
  * We spread data strips of req along with its parity strips onto replica for
  * write operation. For read we only need to prepare data strip buffers.
  */
-static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
+static struct req_iter *
+prepare_erasure_requests(struct request *req,
+			 const struct sd_node **target_nodes, int *nr_reqs,
+			 int *nr_to_send)
 {
 	uint32_t len = req->rq.data_length;
 	uint64_t off = req->rq.obj.offset;
 	int opcode = req->rq.opcode;
-	int start = off / SD_EC_DATA_STRIPE_SIZE;
-	int end = DIV_ROUND_UP(off + len, SD_EC_DATA_STRIPE_SIZE), i, j;
+	uint32_t stripe_size = get_vdi_ec_stripe_size(
+		oid_to_vid(req->rq.obj.oid));
+	int start = off / stripe_size;
+	int end = DIV_ROUND_UP(off + len, stripe_size), i;
 	int nr_stripe = end - start;
 	struct fec *ctx;
-	int strip_size, nr_to_send;
+	int strip_size, nr;
 	struct req_iter *reqs;
-	char *p, *buf = NULL;
+	char *buf = NULL;
+	uint8_t *strips[SD_MAX_COPIES];
 	uint8_t policy = req->rq.obj.copy_policy ?:
 		get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
 	int ed = 0, ep = 0, edp;
 
 	edp = ec_policy_to_dp(policy, &ed, &ep);
 	ctx = ec_init(ed, edp);
-	*nr = nr_to_send = (opcode == SD_OP_READ_OBJ) ? ed : edp;
-	strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
-	reqs = zalloc(sizeof(*reqs) * nr_to_send);
+
+	req->parity_delta = false;
+	if (can_write_parity_delta(req, stripe_size, edp)) {
+		reqs = prepare_parity_delta_requests(req, target_nodes, ctx,
+						     stripe_size, ed, ep,
+						     nr_reqs, nr_to_send);
+		if (reqs) {
+			req->parity_delta = true;
+			goto out;
+		}
+	}
+
+	*nr_reqs = *nr_to_send = nr = (opcode == SD_OP_READ_OBJ) ? ed : edp;
+	strip_size = stripe_size / ed;
+	reqs = mempool_zalloc(req_iter_pool);
 	if(unlikely(!reqs))
 		goto out;
 
 	sd_debug("start %d, end %d, send %d, off %"PRIu64 ", len %"PRIu32,
-		 start, end, nr_to_send, off, len);
+		 start, end, nr, off, len);
 
-	for (i = 0; i < nr_to_send; i++) {
+	for (i = 0; i < nr; i++) {
 		int l = strip_size * nr_stripe;
 
-		reqs[i].buf = malloc(l);
+		reqs[i].buf = alloc_data_buffer(l);
 		if(!reqs[i].buf) {
 			sd_err("failed to init request buffer %016"PRIx64,
 			       req->rq.obj.oid);
-			for(j = 0; j < i; j++)
-				free(reqs[j].buf);
+			free_erasure_requests(reqs, i);
 			reqs = NULL;
 			goto out;
 		}
 		reqs[i].dlen = l;
 		reqs[i].off = start * strip_size;
+		reqs[i].idx = i;
 		switch (opcode) {
 		case SD_OP_CREATE_AND_WRITE_OBJ:
 		case SD_OP_WRITE_OBJ:
 			reqs[i].wlen = l;
 			break;
+#ifndef HAVE_ACCELIO
+		case SD_OP_READ_OBJ:
+			/* A strip in recovery is rebuilt from the parity */
+			reqs[i].nowait = true;
+			break;
+#endif
 		default:
 			break;
 		}
@@ -171,35 +395,26 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 	if (opcode != SD_OP_WRITE_OBJ && opcode != SD_OP_CREATE_AND_WRITE_OBJ)
 		goto out; /* Read and remove operation */
 
-	p = buf = init_erasure_buffer(req, SD_EC_DATA_STRIPE_SIZE * nr_stripe);
-	if (!buf) {
-		sd_err("failed to init erasure buffer %016"PRIx64,
-		       req->rq.obj.oid);
-		for (i = 0; i < nr_to_send; i++)
-			free(reqs[i].buf);
-		free(reqs);
-		reqs = NULL;
-		goto out;
+	/* Aligned writes are encoded directly from the request buffer */
+	if (off % stripe_size || len % stripe_size) {
+		buf = init_erasure_buffer(req, stripe_size,
+					  stripe_size * nr_stripe);
+		if (!buf) {
+			sd_err("failed to init erasure buffer %016"PRIx64,
+			       req->rq.obj.oid);
+			free_erasure_requests(reqs, nr);
+			reqs = NULL;
+			goto out;
+		}
 	}
-	for (i = 0; i < nr_stripe; i++) {
-		const uint8_t *ds[ed];
-		uint8_t *ps[ep];
-
-		for (j = 0; j < ed; j++)
-			ds[j] = reqs[j].buf + strip_size * i;
-
-		for (j = 0; j < ep; j++)
-			ps[j] = reqs[ed + j].buf + strip_size * i;
 
-		for (j = 0; j < ed; j++)
-			memcpy((uint8_t *)ds[j], p + j * strip_size,
-			       strip_size);
-		ec_encode(ctx, ds, ps);
-		p += SD_EC_DATA_STRIPE_SIZE;
-	}
+	for (i = 0; i < edp; i++)
+		strips[i] = reqs[i].buf;
+	ec_encode_stripes(ctx, buf ?: req->data, stripe_size, nr_stripe,
+			  strips, strips + ed);
 out:
 	ec_destroy(ctx);
-	free(buf);
+	free_data_buffer(buf, stripe_size * nr_stripe);
 
 	return reqs;
 }
@@ -211,63 +426,97 @@ bool is_erasure_oid(uint64_t oid)
 		get_vdi_copy_policy(oid_to_vid(oid)) > 0;
 }
 
-/* Prepare request iterator and buffer for each replica */
-static struct req_iter *prepare_requests(struct request *req, int *nr)
+/*
+ * Prepare request iterator and buffer for each replica
+ *
+ * All the 'nr_reqs' entries have to be released with finish_requests() and
+ * the first 'nr_to_send' entries of them are sent to the same entries of
+ * 'target_nodes', which might be reordered.
+ */
+static struct req_iter *prepare_requests(struct request *req,
+					 const struct sd_node **target_nodes,
+					 int *nr_reqs, int *nr_to_send)
 {
 	if (is_erasure_oid(req->rq.obj.oid))
-		return prepare_erasure_requests(req, nr);
+		return prepare_erasure_requests(req, target_nodes, nr_reqs,
+						nr_to_send);
+	else
+		return prepare_replication_requests(req, nr_reqs, nr_to_send);
+}
+
+/* Set up the forwarded header for the request iterator */
+static inline void req_iter_fill_hdr(struct sd_req *hdr, struct request *req,
+				     const struct req_iter *ri)
+{
+	hdr->data_length = ri->dlen;
+	hdr->obj.offset = ri->off;
+	hdr->obj.ec_index = ri->idx;
+	hdr->obj.copy_policy = req->rq.obj.copy_policy;
+	if (ri->parity_delta)
+		hdr->flags |= SD_FLAG_CMD_PARITY_DELTA;
 	else
-		return prepare_replication_requests(req, nr);
+		hdr->flags &= ~SD_FLAG_CMD_PARITY_DELTA;
+	if (ri->nowait)
+		hdr->flags |= SD_FLAG_CMD_NOWAIT;
+	else
+		hdr->flags &= ~SD_FLAG_CMD_NOWAIT;
 }
 
 static void finish_requests(struct request *req, struct req_iter *reqs,
-			    int nr_to_send)
+			    int nr_reqs)
 {
 	uint64_t oid = req->rq.obj.oid;
 	uint32_t len = req->rq.data_length;
 	uint64_t off = req->rq.obj.offset;
 	int opcode = req->rq.opcode;
-	int start = off / SD_EC_DATA_STRIPE_SIZE;
-	int end = DIV_ROUND_UP(off + len, SD_EC_DATA_STRIPE_SIZE), i, j;
-	int nr_stripe = end - start;
+	uint32_t stripe_size;
+	int start, end, nr_stripe, i;
 
 	if (!is_erasure_oid(oid))
 		goto out;
 
-	sd_debug("start %d, end %d, send %d, off %"PRIu64 ", len %"PRIu32,
-		 start, end, nr_to_send, off, len);
+	stripe_size = get_vdi_ec_stripe_size(oid_to_vid(oid));
+	start = off / stripe_size;
+	end = DIV_ROUND_UP(off + len, stripe_size);
+	nr_stripe = end - start;
+	sd_debug("start %d, end %d, nr %d, off %"PRIu64 ", len %"PRIu32,
+		 start, end, nr_reqs, off, len);
 
 	/* We need to assemble the data strips into the req buffer for read */
 	if (opcode == SD_OP_READ_OBJ) {
-		char *p, *buf;
+		char *buf;
+		uint8_t *strips[SD_MAX_COPIES];
 		uint8_t policy = req->rq.obj.copy_policy ?:
 			get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
-		int ed = 0, strip_size;
+		int ed = 0;
 
-		buf = malloc(SD_EC_DATA_STRIPE_SIZE * nr_stripe);
-		if(unlikely(!buf)) {
-			goto out;
+		ec_policy_to_dp(policy, &ed, NULL);
+		for (i = 0; i < ed; i++)
+			strips[i] = reqs[i].buf;
+
+		/* Aligned reads are assembled directly in the request buffer */
+		if (off % stripe_size == 0 && len % stripe_size == 0) {
+			ec_gather_stripes(ed, strips, req->data, stripe_size,
+					  nr_stripe);
+			req->rp.data_length = req->rq.data_length;
+			goto free;
 		}
 
-		ec_policy_to_dp(policy, &ed, NULL);
-		strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
-
-		p = buf;
-		for (i = 0; i < nr_stripe; i++) {
-			for (j = 0; j < nr_to_send; j++) {
-				memcpy(p, reqs[j].buf + strip_size * i,
-				       strip_size);
-				p += strip_size;
-			}
+		buf = alloc_data_buffer(stripe_size * nr_stripe);
+		if(unlikely(!buf)) {
+			goto free;
 		}
-		memcpy(req->data, buf + off % SD_EC_DATA_STRIPE_SIZE, len);
+
+		ec_gather_stripes(ed, strips, buf, stripe_size, nr_stripe);
+		memcpy(req->data, buf + off % stripe_size, len);
 		req->rp.data_length = req->rq.data_length;
-		free(buf);
+		free_data_buffer(buf, stripe_size * nr_stripe);
 	}
-	for (i = 0; i < nr_to_send; i++)
-		free(reqs[i].buf);
+free:
+	for (i = 0; i < nr_reqs; i++)
+		free_data_buffer(reqs[i].buf, reqs[i].dlen);
 out:
-	free(reqs);
+	mempool_free(req_iter_pool, reqs);
 }
 
 /*
@@ -288,7 +537,7 @@ static int gateway_replication_read(struct request *req)
 
 	nr_copies = get_req_copy_number(req);
 
-	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(oid, req->vinfo, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (!vnode_is_local(v))
@@ -336,7 +585,9 @@ struct forward_info_entry {
 	struct pollfd pfd;
 	const struct node_id *nid;
 	struct sockfd *sfd;
-	void *buf;
+	struct req_iter *ri;
+	/* number of outstanding MSG_ZEROCOPY completions */
+	uint32_t nr_zc;
 };
 
 struct forward_info {
@@ -352,15 +603,28 @@ static inline void forward_info_update(struct forward_info *fi, int pos)
 		sizeof(struct forward_info_entry) * (fi->nr_sent - pos));
 }
 
-static inline void finish_one_entry(struct forward_info *fi, int i)
+static inline void finish_one_entry_err(struct forward_info *fi, int i)
 {
-	sockfd_cache_put(fi->ent[i].nid, fi->ent[i].sfd);
+	sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
 	forward_info_update(fi, i);
 }
 
-static inline void finish_one_entry_err(struct forward_info *fi, int i)
+static inline void finish_one_entry(struct forward_info *fi, int i)
 {
-	sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
+	struct forward_info_entry *ent = fi->ent + i;
+
+	/*
+	 * The next user of the cached socket must not see our zerocopy
+	 * completions in the error queue, and the buffer must not be freed
+	 * before the kernel releases it.
+	 */
+	if (ent->nr_zc &&
+	    reap_zerocopy(ent->pfd.fd, &ent->nr_zc, 1000 * POLL_TIMEOUT) < 0) {
+		finish_one_entry_err(fi, i);
+		return;
+	}
+
+	sockfd_cache_put(ent->nid, ent->sfd);
 	forward_info_update(fi, i);
 }
 
@@ -432,6 +696,19 @@ again:
 	}
 
 	nr_sent = fi->nr_sent;
+
+	/* Zerocopy completions in the error queue are reported as POLLERR */
+	for (i = 0; i < nr_sent; i++) {
+		struct forward_info_entry *ent = fi->ent + i;
+		uint32_t nr_zc = ent->nr_zc;
+
+		if (!nr_zc || !(pi.pfds[i].revents & POLLERR))
+			continue;
+		if (reap_zerocopy(ent->pfd.fd, &ent->nr_zc, 0) == 0 &&
+		    ent->nr_zc < nr_zc)
+			pi.pfds[i].revents &= ~POLLERR;
+	}
+
 	for (i = 0; i < nr_sent; i++)
 		if (pi.pfds[i].revents & POLLIN)
 			break;
@@ -455,7 +732,8 @@ again:
 			struct forward_info_entry *ent;
 
 			ent = forward_info_find(fi, pi.pfds[i].fd);
-			if (do_read(pi.pfds[i].fd, ent->buf, rsp->data_length,
+			if (do_read(pi.pfds[i].fd, ent->ri->buf,
+				    rsp->data_length,
 				    sheep_need_retry, req->rq.epoch,
 				    MAX_RETRY_COUNT)) {
 				sd_err("remote node might have gone away");
@@ -470,6 +748,7 @@ again:
 			       sd_strerror(ret));
 			err_ret = ret;
 		}
+		fi->ent[i].ri->result = ret;
 		finish_one_entry(fi, i);
 	}
 out:
@@ -489,74 +768,91 @@ static inline void forward_info_init(struct forward_info *fi, size_t nr_to_send)
 
 static inline void
 forward_info_advance(struct forward_info *fi, const struct node_id *nid,
-		     struct sockfd *sfd, void *buf)
+		     struct sockfd *sfd, struct req_iter *ri, uint32_t nr_zc)
 {
 	fi->ent[fi->nr_sent].nid = nid;
 	fi->ent[fi->nr_sent].pfd.fd = sfd->fd;
 	fi->ent[fi->nr_sent].pfd.events = POLLIN;
 	fi->ent[fi->nr_sent].sfd = sfd;
-	fi->ent[fi->nr_sent].buf = buf;
+	fi->ent[fi->nr_sent].ri = ri;
+	fi->ent[fi->nr_sent].nr_zc = nr_zc;
 	fi->nr_sent++;
 }
 
-#endif	/* HAVE_ACCELIO */
-
-static int gateway_forward_request(struct request *req)
+/* Return error code if any one of the forwarded requests fails */
+static int mux_forward_result(struct request *req, struct mux_req *mreqs,
+			      int nr)
 {
-	int i, err_ret = SD_RES_SUCCESS;
-	uint64_t oid = req->rq.obj.oid;
-	struct sd_req hdr;
-	const struct sd_node *target_nodes[SD_MAX_NODES];
-	int nr_copies = get_req_copy_number(req), nr_reqs, nr_to_send = 0;
-	struct req_iter *reqs = NULL;
+	int i, ret, err_ret = SD_RES_SUCCESS;
 
-#ifdef HAVE_ACCELIO
-	struct xio_context *ctx;
-	struct xio_forward_info xio_fi;
-#else
-	unsigned wlen;
-	int ret;
-	struct forward_info fi;
-#endif
+	for (i = 0; i < nr; i++) {
+		if (mreqs[i].result != SD_RES_SUCCESS) {
+			sd_err("remote node might have gone away");
+			err_ret = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+		ret = mreqs[i].rsp.result;
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("fail %016"PRIx64", %s", req->rq.obj.oid,
+			       sd_strerror(ret));
+			err_ret = ret;
+		}
+	}
 
-	sd_debug("%016"PRIx64, oid);
+	return err_ret;
+}
 
-	gateway_init_fwd_hdr(&hdr, &req->rq);
-	oid_to_nodes(oid, &req->vinfo->vroot, nr_copies, target_nodes);
-#ifndef HAVE_ACCELIO
-	forward_info_init(&fi, nr_copies);
-#endif
-	reqs = prepare_requests(req, &nr_to_send);
-	if (!reqs)
-		return SD_RES_NETWORK_ERROR;
+/* Forward the request over the multiplexed peer connections */
+static int mux_forward_request(struct request *req, struct sd_req *hdr,
+			       const struct sd_node **target_nodes,
+			       struct req_iter *reqs, int nr_to_send)
+{
+	struct mux_req mreqs[SD_MAX_COPIES];
+	struct mux_waiter w;
+	int i;
 
-	/*
-	 * For replication, we send number of available zones copies.
-	 *
-	 * For erasure, we need at least number of data strips to send to avoid
-	 * overflow of target_nodes.
-	 */
-	nr_reqs = nr_to_send;
-	if (nr_to_send > nr_copies) {
-		uint8_t policy = req->rq.obj.copy_policy ?:
-			get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
-		int ds;
-		/* Only for erasure code, nr_to_send might > nr_copies */
-		ec_policy_to_dp(policy, &ds, NULL);
-		if (nr_copies < ds) {
-			sd_err("There isn't enough copies(%d) to send out (%d)",
-			       nr_copies, nr_to_send);
-			err_ret = SD_RES_SYSTEM_ERROR;
-			goto out;
-		}
-		nr_to_send = ds;
+	mux_waiter_init(&w);
+	for (i = 0; i < nr_to_send; i++) {
+		req_iter_fill_hdr(hdr, req, reqs + i);
+
+		mreqs[i].buf = reqs[i].buf;
+		mreqs[i].buflen = reqs[i].dlen;
+		mux_submit_wait(&target_nodes[i]->nid, &w, mreqs + i, hdr,
+				reqs[i].buf, reqs[i].wlen);
 	}
+	mux_wait(&w, mreqs, nr_to_send, req->rq.epoch);
 
-#ifndef HAVE_ACCELIO
+	for (i = 0; i < nr_to_send; i++)
+		if (mreqs[i].result == SD_RES_SUCCESS)
+			reqs[i].result = mreqs[i].rsp.result;
+	return mux_forward_result(req, mreqs, nr_to_send);
+}
+
+/*
+ * Send the first 'nr_to_send' requests of 'reqs' to the same entries of
+ * 'target_nodes' in parallel and wait for all of them.  The result of each
+ * request is stored in its iterator.
+ */
+static int forward_requests(struct request *req, struct sd_req *hdr,
+			    const struct sd_node **target_nodes,
+			    struct req_iter *reqs, int nr_to_send)
+{
+	int i, ret, err_ret = SD_RES_SUCCESS;
+	struct forward_info fi;
+	unsigned wlen;
+
+	for (i = 0; i < nr_to_send; i++)
+		reqs[i].result = SD_RES_NETWORK_ERROR;
 
+	if (sys->mux_conns)
+		return mux_forward_request(req, hdr, target_nodes, reqs,
+					   nr_to_send);
+
+	forward_info_init(&fi, nr_to_send);
 	for (i = 0; i < nr_to_send; i++) {
 		struct sockfd *sfd;
 		const struct node_id *nid;
+		uint32_t nr_zc = 0;
 
 		nid = &target_nodes[i]->nid;
 		sfd = sockfd_cache_get(nid);
@@ -565,21 +861,29 @@ static int gateway_forward_request(struct request *req)
 			break;
 		}
 
-		hdr.data_length = reqs[i].dlen;
+		req_iter_fill_hdr(hdr, req, reqs + i);
 		wlen = reqs[i].wlen;
-		hdr.obj.offset = reqs[i].off;
-		hdr.obj.ec_index = i;
-		hdr.obj.copy_policy = req->rq.obj.copy_policy;
-		ret = send_req(sfd->fd, &hdr, reqs[i].buf, wlen,
-			       sheep_need_retry, req->rq.epoch,
-			       MAX_RETRY_COUNT);
+		/*
+		 * For large writes, let the kernel transmit the pages of the
+		 * buffer instead of copying the payload for every target.
+		 */
+		if (sys->zerocopy_threshold &&
+		    wlen >= sys->zerocopy_threshold)
+			ret = send_req_zerocopy(sfd->fd, hdr, reqs[i].buf,
+						wlen, sheep_need_retry,
+						req->rq.epoch, MAX_RETRY_COUNT,
+						&nr_zc);
+		else
+			ret = send_req(sfd->fd, hdr, reqs[i].buf, wlen,
+				       sheep_need_retry, req->rq.epoch,
+				       MAX_RETRY_COUNT);
 		if (ret) {
 			sockfd_cache_del_node(nid);
 			err_ret = SD_RES_NETWORK_ERROR;
 			sd_debug("fail %d", ret);
 			break;
 		}
-		forward_info_advance(&fi, nid, sfd, reqs[i].buf);
+		forward_info_advance(&fi, nid, sfd, reqs + i, nr_zc);
 	}
 
 	sd_debug("nr_sent %d, err %x", fi.nr_sent, err_ret);
@@ -589,6 +893,167 @@ static int gateway_forward_request(struct request *req)
 			err_ret = ret;
 	}
 
+	return err_ret;
+}
+
+/*
+ * Rebuild the data strips which couldn't be read for a read request.
+ *
+ * The requests to the data holders are marked not to wait for recovery, so
+ * the same strip range is fetched from as many parity holders as data strips
+ * are missing and only the requested stripes are decoded.  The degraded read
+ * thus costs about the request size, whereas waiting for the recovery means
+ * rebuilding the whole object.  If the parity strips can't make up for the
+ * missing ones, read the data strips again and wait for their recovery.
+ */
+static int gateway_degraded_read(struct request *req, struct sd_req *hdr,
+				 const struct sd_node **target_nodes,
+				 struct req_iter *reqs, int *nr_reqs, int err)
+{
+	uint8_t policy = req->rq.obj.copy_policy ?:
+		get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
+	int ed = 0, edp, i, j, n, next, nr_holders, nr_lost = 0, nr_good;
+	int lost[SD_EC_MAX_STRIP], in_idx[SD_EC_MAX_STRIP];
+	uint8_t *input[SD_EC_MAX_STRIP];
+	struct fec *ctx;
+
+	edp = ec_policy_to_dp(policy, &ed, NULL);
+	nr_holders = min(edp, get_req_copy_number(req));
+	for (i = 0; i < ed; i++) {
+		switch (reqs[i].result) {
+		case SD_RES_SUCCESS:
+			break;
+		case SD_RES_NO_OBJ:
+		case SD_RES_NETWORK_ERROR:
+		case SD_RES_EIO:
+			lost[nr_lost++] = i;
+			break;
+		default:
+			/* e.g. epoch mismatch, the request has to be retried */
+			return err;
+		}
+	}
+	if (!nr_lost)
+		return err;
+
+	nr_good = ed - nr_lost;
+	for (next = ed; nr_good < ed && next < nr_holders; next += n) {
+		n = min(ed - nr_good, nr_holders - next);
+		for (i = next; i < next + n; i++) {
+			reqs[i].buf = alloc_data_buffer(reqs[0].dlen);
+			if (unlikely(!reqs[i].buf))
+				return SD_RES_NO_MEM;
+			reqs[i].dlen = reqs[0].dlen;
+			reqs[i].off = reqs[0].off;
+			reqs[i].idx = i;
+			*nr_reqs = i + 1;
+		}
+		forward_requests(req, hdr, target_nodes + next, reqs + next,
+				 n);
+		for (i = next; i < next + n; i++)
+			if (reqs[i].result == SD_RES_SUCCESS)
+				nr_good++;
+	}
+
+	if (nr_good < ed) {
+		sd_debug("%016"PRIx64", wait for recovery", req->rq.obj.oid);
+		for (i = 0; i < ed; i++)
+			reqs[i].nowait = false;
+		return forward_requests(req, hdr, target_nodes, reqs, ed);
+	}
+
+	for (i = 0, j = 0; j < ed; i++) {
+		if (reqs[i].result != SD_RES_SUCCESS)
+			continue;
+		input[j] = reqs[i].buf;
+		in_idx[j++] = i;
+	}
+
+	ctx = ec_init(ed, edp);
+	for (i = 0; i < nr_lost; i++)
+		ec_decode_buffer(ctx, input, in_idx, (char *)reqs[lost[i]].buf,
+				 lost[i], reqs[0].dlen * ed);
+	ec_destroy(ctx);
+
+	sd_debug("%016"PRIx64", rebuilt %d strips at %"PRIu64", len %"PRIu32,
+		 req->rq.obj.oid, nr_lost, reqs[0].off, reqs[0].dlen);
+	return SD_RES_SUCCESS;
+}
+
+#endif	/* HAVE_ACCELIO */
+
+/*
+ * Prepare the requests to the target nodes of the object.  On success, the
+ * first 'nr_to_send' entries of 'reqs' are to be sent, and all 'nr_reqs' of
+ * them must be released with finish_requests().
+ */
+static int prepare_forward_requests(struct request *req,
+				    const struct sd_node **target_nodes,
+				    struct req_iter **reqs, int *nr_reqs,
+				    int *nr_to_send)
+{
+	int nr_copies = get_req_copy_number(req);
+
+	vinfo_oid_to_nodes(req->rq.obj.oid, req->vinfo, nr_copies,
+			   target_nodes);
+	*nr_reqs = *nr_to_send = 0;
+	*reqs = prepare_requests(req, target_nodes, nr_reqs, nr_to_send);
+	if (!*reqs)
+		return SD_RES_NETWORK_ERROR;
+
+	/*
+	 * For replication, we send number of available zones copies.
+	 *
+	 * For erasure, we need at least number of data strips to send to avoid
+	 * overflow of target_nodes.
+	 */
+	if (*nr_to_send > nr_copies) {
+		uint8_t policy = req->rq.obj.copy_policy ?:
+			get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
+		int ds;
+		/* Only for erasure code, nr_to_send might > nr_copies */
+		ec_policy_to_dp(policy, &ds, NULL);
+		if (nr_copies < ds) {
+			sd_err("There isn't enough copies(%d) to send out (%d)",
+			       nr_copies, *nr_to_send);
+			finish_requests(req, *reqs, *nr_reqs);
+			return SD_RES_SYSTEM_ERROR;
+		}
+		*nr_to_send = ds;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int gateway_forward_request(struct request *req)
+{
+	int err_ret = SD_RES_SUCCESS;
+	uint64_t oid = req->rq.obj.oid;
+	struct sd_req hdr;
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	int nr_reqs, nr_to_send;
+	struct req_iter *reqs = NULL;
+
+#ifdef HAVE_ACCELIO
+	struct xio_context *ctx;
+	struct xio_forward_info xio_fi;
+	int i;
+#endif
+
+	sd_debug("%016"PRIx64, oid);
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	err_ret = prepare_forward_requests(req, target_nodes, &reqs, &nr_reqs,
+					   &nr_to_send);
+	if (err_ret != SD_RES_SUCCESS)
+		return err_ret;
+#ifndef HAVE_ACCELIO
+	err_ret = forward_requests(req, &hdr, target_nodes, reqs, nr_to_send);
+	if (err_ret != SD_RES_SUCCESS && req->rq.opcode == SD_OP_READ_OBJ &&
+	    is_erasure_oid(oid))
+		err_ret = gateway_degraded_read(req, &hdr, target_nodes, reqs,
+						&nr_reqs, err_ret);
+	goto out;
 #else  /* HAVE_ACCELIO */
 
 	ctx = xio_context_create(NULL, 0, -1);
@@ -613,10 +1078,7 @@ static int gateway_forward_request(struct request *req)
 		conn = sd_xio_gw_create_connection(ctx, session, fi_entry);
 		fi_entry->conn = conn;
 
-		hdr.data_length = reqs[i].dlen;
-		hdr.obj.offset = reqs[i].off;
-		hdr.obj.ec_index = i;
-		hdr.obj.copy_policy = req->rq.obj.copy_policy;
+		req_iter_fill_hdr(&hdr, req, reqs + i);
 
 		copied_hdr = zalloc(sizeof(*copied_hdr));
 		if(unlikely(!copied_hdr)) {
@@ -778,15 +1240,9 @@ static void async_update_obj_refcnt_done(struct work *work)
 	free(w);
 }
 
-int gateway_write_obj(struct request *req)
+static int check_writable(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
-	int ret;
-	struct sd_req *hdr = &req->rq;
-	uint32_t *vids = NULL, *new_vids = req->data;
-	struct generation_reference *refs = NULL, *zeroed_refs = NULL;
-	struct update_obj_refcnt_work *refcnt_work;
-	size_t nr_vids = hdr->data_length / sizeof(*vids);
 
 	if ((req->rq.flags & SD_FLAG_CMD_TGT) &&
 	    is_refresh_required(oid_to_vid(oid))) {
@@ -797,6 +1253,23 @@ int gateway_write_obj(struct request *req)
 	if (oid_is_readonly(oid))
 		return SD_RES_READONLY;
 
+	return SD_RES_SUCCESS;
+}
+
+int gateway_write_obj(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	int ret;
+	struct sd_req *hdr = &req->rq;
+	uint32_t *vids = NULL, *new_vids = req->data;
+	struct generation_reference *refs = NULL, *zeroed_refs = NULL;
+	struct update_obj_refcnt_work *refcnt_work;
+	size_t nr_vids = hdr->data_length / sizeof(*vids);
+
+	ret = check_writable(req);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
 	if (is_data_vid_update(hdr)) {
 		invalidate_other_nodes(oid_to_vid(oid));
 
@@ -930,16 +1403,11 @@ out:
 
 int gateway_create_and_write_obj(struct request *req)
 {
-	uint64_t oid = req->rq.obj.oid;
-
-	if ((req->rq.flags & SD_FLAG_CMD_TGT) &&
-	    is_refresh_required(oid_to_vid(oid))) {
-		sd_debug("refresh is required: %016"PRIx64, oid);
-		return SD_RES_INODE_INVALIDATED;
-	}
+	int ret;
 
-	if (oid_is_readonly(oid))
-		return SD_RES_READONLY;
+	ret = check_writable(req);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 
 	if (req->rq.flags & SD_FLAG_CMD_COW)
 		return gateway_handle_cow(req);
@@ -956,3 +1424,281 @@ int gateway_decref_object(struct request *req)
 {
 	return gateway_forward_request(req);
 }
+
+#ifndef HAVE_ACCELIO
+
+/*
+ * Asynchronous gateway writes
+ *
+ * gateway_forward_request() occupies a worker thread until the last replica
+ * responds.  With the multiplexed peer connections, a plain object write is
+ * instead run as a small state machine:
+ *
+ *  1. a gateway worker checks the request, prepares the strips and submits
+ *     them to the targets, and returns without waiting,
+ *  2. the reader threads of the connections complete the replicas and the
+ *     last one passes the request to the main thread through an eventfd and
+ *  3. the main thread collects the results and ends the request with the
+ *     usual done function, so the retry logic of gateway_op_done() applies.
+ *
+ * The worker holds an extra reference of nr_pending until its done function
+ * runs in the main thread, so a request never completes before it is
+ * submitted.  Instead of the poll() timeout of wait_forward_request(), a
+ * watchdog timer shuts down the connections of the requests which are stuck
+ * for too long.
+ */
+
+struct gateway_async {
+	struct request *req;
+	work_func_t end_io;
+
+	/* set by the submitting worker */
+	int result;
+	struct req_iter *reqs;
+	int nr_reqs;
+	int nr_to_send;
+
+	struct sd_mutex lock;
+	int nr_pending;		/* protected by lock */
+
+	/* accessed only in the main thread */
+	bool inflight;
+	bool aborted;
+	int nr_ticks;
+	struct list_node inflight_list;
+
+	struct list_node done_list;
+	struct mux_req mreqs[SD_MAX_COPIES];
+};
+
+static int async_efd;
+static struct sd_mutex async_done_lock = SD_MUTEX_INITIALIZER;
+static LIST_HEAD(async_done_list);
+
+static LIST_HEAD(async_inflight_list);
+static struct timer async_watchdog;
+static bool async_watchdog_armed;
+
+static main_fn void gateway_async_end(struct gateway_async *ga)
+{
+	struct request *req = ga->req;
+	work_func_t end_io = ga->end_io;
+
+	if (ga->result == SD_RES_SUCCESS) {
+		ga->result = mux_forward_result(req, ga->mreqs,
+						ga->nr_to_send);
+		finish_requests(req, ga->reqs, ga->nr_reqs);
+	}
+	req->rp.result = ga->result;
+
+	if (ga->inflight)
+		list_del(&ga->inflight_list);
+	sd_destroy_mutex(&ga->lock);
+	free(ga);
+	req->gw_async = NULL;
+
+	end_io(&req->work);
+}
+
+/* Drop a reference of nr_pending and return true if it was the last one */
+static bool gateway_async_put(struct gateway_async *ga, struct mux_req *mreq)
+{
+	bool last;
+
+	sd_mutex_lock(&ga->lock);
+	if (mreq)
+		mreq->completed = true;
+	last = --ga->nr_pending == 0;
+	sd_mutex_unlock(&ga->lock);
+
+	return last;
+}
+
+static void gateway_async_done(struct mux_req *mreq)
+{
+	struct gateway_async *ga = mreq->private;
+
+	if (!gateway_async_put(ga, mreq))
+		return;
+
+	sd_mutex_lock(&async_done_lock);
+	list_add_tail(&ga->done_list, &async_done_list);
+	sd_mutex_unlock(&async_done_lock);
+
+	eventfd_xwrite(async_efd, 1);
+}
+
+static main_fn void gateway_async_done_handler(int fd, int events, void *data)
+{
+	struct gateway_async *ga;
+	LIST_HEAD(list);
+
+	eventfd_xread(fd);
+
+	sd_mutex_lock(&async_done_lock);
+	list_splice_init(&async_done_list, &list);
+	sd_mutex_unlock(&async_done_lock);
+
+	list_for_each_entry(ga, &list, done_list) {
+		list_del(&ga->done_list);
+		gateway_async_end(ga);
+	}
+}
+
+static main_fn void gateway_async_watchdog(void *arg)
+{
+	struct gateway_async *ga;
+
+	async_watchdog_armed = false;
+
+	list_for_each_entry(ga, &async_inflight_list, inflight_list) {
+		/* the request might be submitted just before this tick */
+		if (ga->aborted || ga->nr_ticks++ == 0)
+			continue;
+
+		/*
+		 * If IO NIC is down, epoch isn't incremented, so we can't retry
+		 * for ever.
+		 */
+		if (sheep_need_retry(ga->req->rq.epoch) &&
+		    ga->nr_ticks <= MAX_RETRY_COUNT + 1) {
+			sd_warn("%016"PRIx64" is not completed in %d seconds, "
+				"disks of some nodes or network is busy",
+				ga->req->rq.obj.oid,
+				(ga->nr_ticks - 1) * POLL_TIMEOUT);
+			continue;
+		}
+
+		sd_mutex_lock(&ga->lock);
+		for (int i = 0; i < ga->nr_to_send; i++)
+			if (!ga->mreqs[i].completed)
+				mux_req_abort(ga->mreqs + i);
+		sd_mutex_unlock(&ga->lock);
+		ga->aborted = true;
+	}
+
+	if (!list_empty(&async_inflight_list)) {
+		add_timer(&async_watchdog, 1000 * POLL_TIMEOUT);
+		async_watchdog_armed = true;
+	}
+}
+
+static worker_fn void gateway_async_submit_work(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	struct gateway_async *ga = req->gw_async;
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	struct req_iter *reqs;
+	struct sd_req hdr;
+	int i;
+
+	ga->result = check_writable(req);
+	if (ga->result != SD_RES_SUCCESS)
+		return;
+
+	ga->result = prepare_forward_requests(req, target_nodes, &ga->reqs,
+					      &ga->nr_reqs, &ga->nr_to_send);
+	if (ga->result != SD_RES_SUCCESS)
+		return;
+	reqs = ga->reqs;
+
+	sd_mutex_lock(&ga->lock);
+	ga->nr_pending += ga->nr_to_send;
+	sd_mutex_unlock(&ga->lock);
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	for (i = 0; i < ga->nr_to_send; i++) {
+		struct mux_req *mreq = ga->mreqs + i;
+
+		req_iter_fill_hdr(&hdr, req, reqs + i);
+
+		mreq->buf = reqs[i].buf;
+		mreq->buflen = reqs[i].dlen;
+		mreq->done = gateway_async_done;
+		mreq->private = ga;
+		mreq->completed = false;
+		mux_submit(&target_nodes[i]->nid, mreq, &hdr, reqs[i].buf,
+			   reqs[i].wlen);
+	}
+}
+
+static main_fn void gateway_async_submit_done(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	struct gateway_async *ga = req->gw_async;
+
+	if (gateway_async_put(ga, NULL)) {
+		gateway_async_end(ga);
+		return;
+	}
+
+	ga->inflight = true;
+	list_add_tail(&ga->inflight_list, &async_inflight_list);
+	if (!async_watchdog_armed) {
+		add_timer(&async_watchdog, 1000 * POLL_TIMEOUT);
+		async_watchdog_armed = true;
+	}
+}
+
+/*
+ * Switch the gateway request to the asynchronous path if it is a write which
+ * needs nothing but forwarding.  The caller queues the work as usual.
+ */
+main_fn void setup_async_gateway_request(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct gateway_async *ga;
+
+	if (!async_efd)
+		return;
+
+	switch (hdr->opcode) {
+	case SD_OP_WRITE_OBJ:
+		/* the update of the reference counts needs more round trips */
+		if (is_data_vid_update(hdr))
+			return;
+		break;
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		if (hdr->flags & SD_FLAG_CMD_COW)
+			return;
+		break;
+	default:
+		return;
+	}
+
+	ga = xzalloc(sizeof(*ga));
+	ga->req = req;
+	ga->end_io = req->work.done;
+	ga->nr_pending = 1;
+	sd_init_mutex(&ga->lock);
+	INIT_LIST_NODE(&ga->inflight_list);
+	INIT_LIST_NODE(&ga->done_list);
+	req->gw_async = ga;
+
+	req->work.fn = gateway_async_submit_work;
+	req->work.done = gateway_async_submit_done;
+}
+
+int gateway_async_init(void)
+{
+	async_efd = eventfd(0, EFD_NONBLOCK);
+	if (async_efd < 0) {
+		sd_err("failed to create event fd: %m");
+		async_efd = 0;
+		return -1;
+	}
+
+	if (register_event(async_efd, gateway_async_done_handler, NULL)) {
+		sd_err("failed to register event fd");
+		close(async_efd);
+		async_efd = 0;
+		return -1;
+	}
+
+	async_watchdog.callback = gateway_async_watchdog;
+	async_watchdog.data = NULL;
+
+	return 0;
+}
+
+#endif	/* HAVE_ACCELIO */
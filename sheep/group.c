@@ -96,6 +96,7 @@ void put_vnode_info(struct vnode_info *vnode_info)
 {
 	if (vnode_info) {
 		if (refcount_dec(&vnode_info->refcnt) == 0) {
+			free_vnode_table(&vnode_info->vtable);
 			rb_destroy(&vnode_info->vroot, struct sd_vnode, rb);
 			rb_destroy(&vnode_info->nroot, struct sd_node, rb);
 			free(vnode_info);
@@ -154,6 +155,7 @@ struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
 		disks_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
 	else
 		nodes_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
+	build_vnode_table(&vnode_info->vtable, &vnode_info->vroot);
 	vnode_info->nr_zones = get_zones_nr_from(&vnode_info->nroot);
 	refcount_set(&vnode_info->refcnt, 1);
 	return vnode_info;
@@ -516,6 +518,7 @@ retry:
 					vs[i].snapshot, vs[i].copy_policy,
 					vs[i].block_size_shift,
 					vs[i].parent_vid);
+		set_vdi_ec_stripe_shift(vs[i].vid, vs[i].ec_stripe_shift);
 	}
 out:
 	free(vs);
@@ -656,6 +659,11 @@ static void setup_backend_store(const struct cluster_info *cinfo)
 		if (!sd_store)
 			panic("backend store %s not supported", cinfo->default_store);
 
+		/* this node joins the formatted cluster for the first time */
+		ret = sd_store->format();
+		if (ret != SD_RES_SUCCESS)
+			panic("failed to format store");
+
 		ret = sd_store->init();
 		if (ret != SD_RES_SUCCESS)
 			panic("failed to initialize store");
@@ -667,6 +675,7 @@ static void setup_backend_store(const struct cluster_info *cinfo)
 	 */
 	if (xlfind(&sys->this_node, cinfo->nodes, cinfo->nr_nodes,
 		   node_cmp) == NULL) {
+		sys->purge_epoch = get_latest_epoch();
 		ret = sd_store->purge_obj();
 		if (ret != SD_RES_SUCCESS)
 			panic("can't remove stale objects");
@@ -935,6 +944,8 @@ static void update_cluster_info(const struct cluster_info *cinfo,
 
 	if (node_is_local(joined)) {
 		sockfd_cache_add_group(nroot);
+		/* the writes of the older epochs didn't reach this node */
+		dirty_log_init(cinfo->epoch + 1);
 
 		if (0 < cinfo->epoch && cinfo->status == SD_STATUS_OK) {
 			struct vnode_info *members = grab_vnode_info(
@@ -1311,6 +1322,7 @@ main_fn void sd_leave_handler(const struct sd_node *left,
 	put_vnode_info(old_vnode_info);
 
 	sockfd_cache_del_node(&left->nid);
+	mux_del_node(&left->nid);
 
 	remove_node_from_participants(&left->nid);
 }
@@ -11,6 +11,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/uio.h>
+
 #include "sheep_priv.h"
 
 struct journal_file {
@@ -18,9 +20,13 @@ struct journal_file {
 	off_t pos;
 	int commit_fd;
 	uatomic_bool in_commit;
+	/* batches older than this have to be flushed before commit */
+	uint64_t commit_seq;
 };
 
 /*
+ * Version 1 format, which is only replayed now
+ *
  * CAUTION: This definition of struct journal_descriptor must be same
  * to the definition in tests/dynamorio/journaling/journaling.c. We
  * have to update the definition in the DR client definition if we
@@ -49,18 +55,95 @@ struct journal_descriptor {
 #define JF_STORE 0
 #define JF_REMOVE_OBJ 2
 
+/*
+ * Version 2 format
+ *
+ * The version 1 descriptor takes 512 bytes per write, which doubles the
+ * journal bandwidth for small writes.  In version 2, entries consisting of a
+ * compact descriptor and the payload are packed back to back into 4KB
+ * aligned records.  A partially written record is detected by the CRC of the
+ * record instead of the end marker.
+ */
+#define JOURNAL_FORMAT_VERSION 2
+#define JOURNAL_RECORD_MAGIC 0xfee1900e
+#define JOURNAL_RECORD_ALIGN 4096
+
+struct journal_record {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t size; /* including the header and padding */
+	uint32_t nr_entries;
+	uint32_t crc; /* crc32c of the record calculated with crc = 0 */
+	uint32_t pad;
+} __packed;
+
+/* followed by 'size' bytes of payload */
+struct journal_entry {
+	uint64_t oid;
+	uint64_t offset;
+	uint32_t size;
+	uint16_t flag;
+	uint8_t create;
+	uint8_t ec_index;
+} __packed;
+
+/*
+ * Group commit
+ *
+ * Journal entries are not written to the journal file one by one.  Writers
+ * copy their entries into a ring of preallocated aligned batch buffers, and
+ * the first writer which finds no flush in progress becomes the leader: it
+ * seals the batches filled so far, writes them with a single pwritev() and
+ * issues one fdatasync() for all of them.  The other writers sleep until the
+ * batch holding their entry is on the disk.
+ *
+ * Entries bigger than JOURNAL_DIRECT_SIZE don't benefit from batching and are
+ * written directly.
+ */
+#define JOURNAL_BATCH_SIZE (4 * 1024 * 1024)
+#define JOURNAL_NR_BATCHES 4
+#define JOURNAL_DIRECT_SIZE (JOURNAL_BATCH_SIZE / 4)
+
+/* A batch is written as a single record */
+struct journal_batch {
+	char *buf;
+	size_t len;
+	int fd;
+	off_t offset;
+	uint32_t nr_entries;
+	uint64_t payload; /* bytes of the payload of the entries */
+	int nr_copying; /* number of writers copying their entries */
+};
+
+/* Objects which have to be synced when the journal file is committed */
+struct journal_dirty_obj {
+	struct rb_node node;
+	uint64_t oid;
+	uint8_t ec_index;
+};
+
 static const char *jfile_name[2] = { "journal_file0", "journal_file1", };
 static int jfile_fds[2];
 static size_t jfile_size;
 
 static struct journal_file jfile;
 static struct sd_mutex jfile_lock = SD_MUTEX_INITIALIZER;
+static struct sd_cond jfile_cond = SD_COND_INITIALIZER;
+
+/* The following variables are protected by jfile_lock */
+static struct journal_batch batches[JOURNAL_NR_BATCHES];
+static uint64_t fill_seq;	/* sequence number of the batch being filled */
+static uint64_t flushed_seq;	/* batches older than this are on the disk */
+static bool flushing;
+static bool journal_broken;
+static struct rb_root dirty_objs[2] = { RB_ROOT, RB_ROOT };
 
 static struct work_queue *commit_wq;
 
 static int create_journal_file(const char *root, const char *name)
 {
-	int fd, flags = O_DSYNC | O_RDWR | O_TRUNC | O_CREAT | O_DIRECT;
+	int fd, flags = O_RDWR | O_TRUNC | O_CREAT | O_DIRECT;
 	char path[PATH_MAX];
 
 	snprintf(path, sizeof(path), "%s/%s", root, name);
@@ -133,35 +216,58 @@ static bool journal_entry_full_write(struct journal_descriptor *jd)
 	return true;
 }
 
-static int replay_journal_entry(struct journal_descriptor *jd)
+static uint32_t journal_record_crc(const struct journal_record *rec)
+{
+	const size_t crc_off = offsetof(struct journal_record, crc);
+	const char *p = (const char *)rec;
+	uint32_t crc, zero = 0;
+
+	crc = crc32c(0, p, crc_off);
+	crc = crc32c(crc, &zero, sizeof(zero));
+	p += crc_off + sizeof(zero);
+	return crc32c(crc, p, rec->size - crc_off - sizeof(zero));
+}
+
+static int replay_journal_entry(const struct journal_entry *je,
+				const char *data)
 {
 	char path[PATH_MAX];
 	ssize_t size;
 	uint32_t object_size = 0;
 	int fd, flags = O_WRONLY, ret = 0;
-	void *buf = NULL;
-	char *p = (char *)jd;
 
-	snprintf(path, PATH_MAX, "%s/%016"PRIx64,
-		 md_get_object_dir(jd->oid), jd->oid);
+	if (is_erasure_oid(je->oid))
+		snprintf(path, PATH_MAX, "%s/%016"PRIx64"_%d",
+			 md_get_object_dir(je->oid), je->oid, je->ec_index);
+	else
+		snprintf(path, PATH_MAX, "%s/%016"PRIx64,
+			 md_get_object_dir(je->oid), je->oid);
 
-	if (jd->flag == JF_REMOVE_OBJ) {
+	/*
+	 * The journal is replayed before the object indexes are loaded, so
+	 * have the disk scanned rather than trust an index which misses this
+	 * change.
+	 */
+	if (je->flag == JF_REMOVE_OBJ || je->create)
+		obj_index_discard(md_get_object_dir(je->oid));
+
+	if (je->flag == JF_REMOVE_OBJ) {
 		sd_info("%s (remove)", path);
 		unlink(path);
 
 		return 0;
 	}
 
-	if (jd->flag != JF_STORE) {
+	if (je->flag != JF_STORE) {
 		sd_emerg("flag is not JF_STORE, the journaling file is broken."
 		      " please remove the journaling file and restart sheep daemon");
 		return -1;
 	}
 
-	sd_info("%s, size %" PRIu64 ", off %" PRIu64 ", %d", path, jd->size,
-		jd->offset, jd->create);
+	sd_info("%s, size %" PRIu32 ", off %" PRIu64 ", %d", path, je->size,
+		je->offset, je->create);
 
-	if (jd->create)
+	if (je->create)
 		flags |= O_CREAT;
 
 	fd = open(path, flags, sd_def_fmode);
@@ -169,33 +275,81 @@ static int replay_journal_entry(struct journal_descriptor *jd)
 		sd_err("open %m");
 		return -1;
 	}
-	if (jd->create) {
-		object_size = get_vdi_object_size(oid_to_vid(jd->oid));
+	if (je->create) {
+		object_size = get_vdi_object_size(oid_to_vid(je->oid));
 		ret = prealloc(fd, object_size);
 		if (ret < 0)
 			goto out;
 	}
-	buf = xmalloc(jd->size);
-	p += JOURNAL_DESC_SIZE;
-	memcpy(buf, p, jd->size);
-	size = xpwrite(fd, buf, jd->size, jd->offset);
-	if (size != jd->size) {
-		sd_err("write %zd, size %" PRIu64 ", errno %m", size, jd->size);
+	size = xpwrite(fd, data, je->size, je->offset);
+	if (size != je->size) {
+		sd_err("write %zd, size %" PRIu32 ", errno %m", size, je->size);
 		ret = -1;
 		goto out;
 	}
 out:
-	free(buf);
 	close(fd);
 	return ret;
 }
 
+/* Replay a version 1 entry and return the size of it */
+static ssize_t replay_journal_descriptor(struct journal_descriptor *jd)
+{
+	struct journal_entry je = {
+		.oid = jd->oid,
+		.offset = jd->offset,
+		.size = jd->size,
+		.flag = jd->flag,
+		.create = jd->create,
+	};
+
+	/* We skip partial write because it is not acked back to VM */
+	if (journal_entry_full_write(jd) &&
+	    replay_journal_entry(&je, (char *)jd + JOURNAL_DESC_SIZE) < 0)
+		return -1;
+
+	return JOURNAL_META_SIZE + round_up(jd->size, SECTOR_SIZE);
+}
+
+/* Replay a version 2 record and return the size of it */
+static ssize_t replay_journal_record(struct journal_record *rec, size_t len)
+{
+	const char *p = (const char *)(rec + 1), *end;
+
+	if (len < sizeof(*rec) || rec->size < sizeof(*rec) ||
+	    rec->size > len || rec->size % JOURNAL_RECORD_ALIGN != 0) {
+		/* broken header, search for the next valid one */
+		return SECTOR_SIZE;
+	}
+
+	/* We skip partial write because it is not acked back to VM */
+	if (journal_record_crc(rec) != rec->crc)
+		return rec->size;
+
+	end = (const char *)rec + rec->size;
+	for (uint32_t i = 0; i < rec->nr_entries; i++) {
+		const struct journal_entry *je = (const struct journal_entry *)p;
+
+		if (end - p < (ptrdiff_t)sizeof(*je) ||
+		    je->size > end - p - sizeof(*je)) {
+			sd_emerg("record at %p has a broken entry", rec);
+			return -1;
+		}
+		p += sizeof(*je);
+		if (replay_journal_entry(je, p) < 0)
+			return -1;
+		p += je->size;
+	}
+
+	return rec->size;
+}
+
 static int do_recover(int fd)
 {
-	struct journal_descriptor *jd;
 	void *map;
 	char *p, *end;
 	struct stat st;
+	ssize_t size;
 
 	if (fstat(fd, &st) < 0) {
 		sd_err("fstat %m");
@@ -220,21 +374,23 @@ static int do_recover(int fd)
 	}
 
 	end = (char *)map + st.st_size;
-	for (p = map; p < end;) {
-		jd = (struct journal_descriptor *)p;
-		if (jd->magic != JOURNAL_DESC_MAGIC) {
+	for (p = map; p < end; p += size) {
+		switch (*(uint32_t *)p) {
+		case JOURNAL_DESC_MAGIC:
+			size = replay_journal_descriptor(
+				(struct journal_descriptor *)p);
+			break;
+		case JOURNAL_RECORD_MAGIC:
+			size = replay_journal_record((struct journal_record *)p,
+						     end - p);
+			break;
+		default:
 			/* Empty area */
-			p += SECTOR_SIZE;
-			continue;
+			size = SECTOR_SIZE;
+			break;
 		}
-		/* We skip partial write because it is not acked back to VM */
-		if (!journal_entry_full_write(jd))
-			goto skip;
-
-		if (replay_journal_entry(jd) < 0)
+		if (size < 0)
 			return -1;
-skip:
-		p += JOURNAL_META_SIZE + round_up(jd->size, SECTOR_SIZE);
 	}
 	munmap(map, st.st_size);
 	/* Do a final sync() to assure data is reached to the disk */
@@ -289,6 +445,9 @@ int journal_file_init(const char *path, size_t size, bool skip)
 	fd = create_journal_file(path, jfile_name[1]);
 	jfile_fds[1] = fd;
 
+	for (int i = 0; i < JOURNAL_NR_BATCHES; i++)
+		batches[i].buf = xvalloc(JOURNAL_BATCH_SIZE);
+
 	commit_wq = create_ordered_work_queue("journal commit");
 	if (!commit_wq) {
 		sd_err("error at creating a workqueue for journal data commit");
@@ -321,24 +480,104 @@ static inline bool jfile_enough_space(size_t size)
 	return (jfile.pos + size) < jfile_size;
 }
 
-static struct sd_mutex journal_commit_mutex = SD_MUTEX_INITIALIZER;
+static inline struct journal_batch *seq_to_batch(uint64_t seq)
+{
+	return batches + (seq % JOURNAL_NR_BATCHES);
+}
+
+/*
+ * All the batches are sealed and wait for being flushed.  The slot of
+ * fill_seq then holds the oldest unflushed batch, not a batch being filled.
+ *
+ * Must be called with jfile_lock held.
+ */
+static inline bool journal_ring_full(void)
+{
+	return fill_seq - flushed_seq >= JOURNAL_NR_BATCHES;
+}
+
+/*
+ * Seal the batch being filled so that no more entries are appended to it.
+ * This has to be done before anything else is placed after the batch in the
+ * journal file, or the next batched entry would overwrite it.
+ *
+ * Must be called with jfile_lock held.
+ */
+static void journal_seal_batch(void)
+{
+	if (!journal_ring_full() && seq_to_batch(fill_seq)->len > 0)
+		fill_seq++;
+}
+
+static inline int jfile_index(int fd)
+{
+	return fd == jfile_fds[0] ? 0 : 1;
+}
+
+static int dirty_obj_cmp(const struct journal_dirty_obj *a,
+			 const struct journal_dirty_obj *b)
+{
+	int ret = intcmp(a->oid, b->oid);
+
+	if (ret == 0)
+		ret = intcmp(a->ec_index, b->ec_index);
+	return ret;
+}
+
+/* Must be called with jfile_lock held */
+static void journal_mark_dirty(uint64_t oid, uint8_t ec_index)
+{
+	struct journal_dirty_obj *obj = xzalloc(sizeof(*obj));
+
+	obj->oid = oid;
+	obj->ec_index = ec_index;
+	if (rb_insert(dirty_objs + jfile_index(jfile.fd), obj, node,
+		      dirty_obj_cmp))
+		free(obj);
+}
 
 /*
- * We rely on the kernel's page cache to cache data objects to 1) boost read
- * performance 2) simplify read path so that data committing is simply a
- * sync() operation and We do it in a dedicated thread to avoid blocking
- * the writer by switch back and forth between two journal files.
+ * Instead of a whole system sync(), only the objects written since the last
+ * switch are synced.  We still rely on the kernel's page cache to cache data
+ * objects to 1) boost read performance 2) simplify read path, and we do it in
+ * a dedicated thread to avoid blocking the writer by switch back and forth
+ * between two journal files.
  */
 static void journal_commit_data_work(struct work *work)
 {
-	sync();
+	struct rb_root *dirty = dirty_objs + jfile_index(jfile.commit_fd);
+	struct journal_dirty_obj *obj;
+	int ret;
+
+	/* The batches for the old journal file must reach the disk first */
+	sd_mutex_lock(&jfile_lock);
+	while (flushed_seq < jfile.commit_seq)
+		sd_cond_wait(&jfile_cond, &jfile_lock);
+	sd_mutex_unlock(&jfile_lock);
+
+	rb_for_each_entry(obj, dirty, node) {
+		ret = sd_store->sync(obj->oid, obj->ec_index);
+		/* the object was removed after it had been written */
+		if (ret == SD_RES_NO_OBJ)
+			continue;
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to sync %016"PRIx64", fall back to sync()",
+			       obj->oid);
+			sync();
+			break;
+		}
+	}
+	rb_destroy(dirty, struct journal_dirty_obj, node);
 
 	if (unlikely(xftruncate(jfile.commit_fd, 0) < 0))
 		panic("truncate %m");
 	if (unlikely(prealloc(jfile.commit_fd, jfile_size) < 0))
 		panic("prealloc %m");
 
-	sd_mutex_unlock(&journal_commit_mutex);
+	sd_mutex_lock(&jfile_lock);
+	uatomic_set_false(&jfile.in_commit);
+	sd_cond_broadcast(&jfile_cond);
+	sd_mutex_unlock(&jfile_lock);
 }
 
 static void journal_commit_data_done(struct work *work)
@@ -346,23 +585,30 @@ static void journal_commit_data_done(struct work *work)
 	free(work);
 }
 
+/* Must be called with jfile_lock held */
 static void switch_journal_file(void)
 {
 	int old = jfile.fd;
 	struct work *w;
 
-	if (sd_mutex_trylock(&journal_commit_mutex) == EBUSY) {
+	if (uatomic_is_true(&jfile.in_commit)) {
 		sd_err("journal file in committing, you might need"
 		       " enlarge jfile size");
-		sd_mutex_lock(&journal_commit_mutex);
+		while (uatomic_is_true(&jfile.in_commit))
+			sd_cond_wait(&jfile_cond, &jfile_lock);
 	}
 
+	/* Seal the batch for the old journal file */
+	journal_seal_batch();
+
 	if (old == jfile_fds[0])
 		jfile.fd = jfile_fds[1];
 	else
 		jfile.fd = jfile_fds[0];
 	jfile.commit_fd = old;
+	jfile.commit_seq = fill_seq;
 	jfile.pos = 0;
+	uatomic_set_true(&jfile.in_commit);
 
 	w = xzalloc(sizeof(*w));
 	w->fn = journal_commit_data_work;
@@ -370,33 +616,208 @@ static void switch_journal_file(void)
 	queue_work(commit_wq, w);
 }
 
-static int journal_file_write(struct journal_descriptor *jd, const char *buf)
+static void journal_fill_entry(char *p, const struct journal_entry *je,
+			       const char *buf)
+{
+	memcpy(p, je, sizeof(*je));
+	if (je->size)
+		memcpy(p + sizeof(*je), buf, je->size);
+}
+
+/*
+ * Fill the header of the record which has 'len' bytes of entries and pad it
+ * to the record alignment.  Return the size of the record.
+ */
+static size_t journal_finish_record(char *buf, size_t len,
+				    uint32_t nr_entries)
+{
+	struct journal_record *rec = (struct journal_record *)buf;
+	size_t size = round_up(len, JOURNAL_RECORD_ALIGN);
+
+	memset(buf + len, 0, size - len);
+	rec->magic = JOURNAL_RECORD_MAGIC;
+	rec->version = JOURNAL_FORMAT_VERSION;
+	rec->reserved = 0;
+	rec->size = size;
+	rec->nr_entries = nr_entries;
+	rec->pad = 0;
+	rec->crc = journal_record_crc(rec);
+
+	return size;
+}
+
+static int journal_pwritev(int fd, const struct iovec *iov, int iovcnt,
+			   off_t offset, size_t len)
+{
+	ssize_t written;
+
+	do {
+		written = pwritev(fd, iov, iovcnt, offset);
+	} while (written < 0 && (errno == EINTR || errno == EAGAIN));
+
+	if (unlikely(written != len)) {
+		sd_err("failed, written %zd, len %zu, %m", written, len);
+		return -1;
+	}
+
+	if (unlikely(fdatasync(fd) < 0)) {
+		sd_err("fdatasync %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write all the filled batches and wait for them to reach the disk.  The
+ * leader is called with jfile_lock held and releases it during the I/O.
+ */
+static void journal_flush_batches(void)
 {
-	uint32_t marker = JOURNAL_END_MARKER;
-	int ret = SD_RES_SUCCESS;
-	uint64_t size = jd->size;
-	ssize_t written, rusize = round_up(size, SECTOR_SIZE),
-		wsize = JOURNAL_META_SIZE + rusize;
+	struct iovec iov[JOURNAL_NR_BATCHES];
+	uint64_t seq, start = flushed_seq, end, payload = 0;
+	bool failed = false;
+
+	flushing = true;
+	journal_seal_batch();
+	end = fill_seq;
+
+	for (seq = start; seq < end; seq++)
+		while (seq_to_batch(seq)->nr_copying > 0)
+			sd_cond_wait(&jfile_cond, &jfile_lock);
+	sd_mutex_unlock(&jfile_lock);
+
+	for (seq = start; seq < end;) {
+		struct journal_batch *b = seq_to_batch(seq);
+		int fd = b->fd, nr = 0;
+		off_t offset = b->offset;
+		size_t len = 0;
+
+		/* Coalesce the batches contiguous in the same journal file */
+		do {
+			iov[nr].iov_base = b->buf;
+			iov[nr].iov_len = journal_finish_record(b->buf, b->len,
+								b->nr_entries);
+			len += iov[nr].iov_len;
+			payload += b->payload;
+			nr++;
+			b = seq_to_batch(++seq);
+		} while (seq < end && b->fd == fd &&
+			 b->offset == offset + len);
+
+		if (journal_pwritev(fd, iov, nr, offset, len) < 0)
+			failed = true;
+		uatomic_add(&sys->stat.j.written_bytes, len);
+	}
+	uatomic_add(&sys->stat.j.payload_bytes, payload);
+
+	sd_mutex_lock(&jfile_lock);
+	for (seq = start; seq < end; seq++)
+		seq_to_batch(seq)->len = 0;
+	flushed_seq = end;
+	/* FIXME: teach journal file handle EIO gracefully */
+	if (failed)
+		journal_broken = true;
+	flushing = false;
+	sd_cond_broadcast(&jfile_cond);
+}
+
+static int journal_write_batched(const struct journal_entry *je,
+				 const char *buf)
+{
+	size_t esize = sizeof(*je) + je->size;
+	struct journal_batch *b;
+	uint64_t seq;
+	char *p;
+	int ret;
+
+	sd_mutex_lock(&jfile_lock);
+again:
+	/* Wait for the oldest batch to be flushed if the ring is full */
+	if (journal_ring_full()) {
+		sd_cond_wait(&jfile_cond, &jfile_lock);
+		goto again;
+	}
+	b = seq_to_batch(fill_seq);
+	if (b->len == 0) {
+		/* Start a new record at the end of the journal file */
+		if (!jfile_enough_space(round_up(sizeof(struct journal_record) +
+						 esize, JOURNAL_RECORD_ALIGN))) {
+			switch_journal_file();
+			goto again;
+		}
+		b->fd = jfile.fd;
+		b->offset = jfile.pos;
+		b->len = sizeof(struct journal_record);
+		b->nr_entries = 0;
+		b->payload = 0;
+	} else if (b->len + esize > JOURNAL_BATCH_SIZE ||
+		   b->offset + round_up(b->len + esize, JOURNAL_RECORD_ALIGN)
+		   >= jfile_size) {
+		fill_seq++;
+		goto again;
+	}
+
+	p = b->buf + b->len;
+	b->len += esize;
+	b->nr_entries++;
+	b->payload += je->size;
+	b->nr_copying++;
+	/* The batch being filled is always at the end of the journal file */
+	jfile.pos = b->offset + round_up(b->len, JOURNAL_RECORD_ALIGN);
+	seq = fill_seq;
+	if (je->flag == JF_STORE)
+		journal_mark_dirty(je->oid, je->ec_index);
+	sd_mutex_unlock(&jfile_lock);
+
+	journal_fill_entry(p, je, buf);
+
+	sd_mutex_lock(&jfile_lock);
+	if (--b->nr_copying == 0 && flushing)
+		sd_cond_broadcast(&jfile_cond);
+
+	while (flushed_seq <= seq) {
+		if (flushing)
+			sd_cond_wait(&jfile_cond, &jfile_lock);
+		else
+			journal_flush_batches();
+	}
+	ret = journal_broken ? SD_RES_EIO : SD_RES_SUCCESS;
+	sd_mutex_unlock(&jfile_lock);
+
+	return ret;
+}
+
+static int journal_write_direct(const struct journal_entry *je,
+				const char *buf)
+{
+	size_t len = sizeof(struct journal_record) + sizeof(*je) + je->size,
+	       wsize = round_up(len, JOURNAL_RECORD_ALIGN);
+	struct iovec iov;
 	off_t woff;
-	char *wbuffer, *p;
+	int fd, ret = SD_RES_SUCCESS;
+	char *wbuffer;
 
 	sd_mutex_lock(&jfile_lock);
+	/*
+	 * The batch being filled is at the end of the journal file and grows
+	 * with jfile.pos, so it must not take any more entries once this one
+	 * is placed after it.
+	 */
+	journal_seal_batch();
 	if (!jfile_enough_space(wsize))
 		switch_journal_file();
 	woff = jfile.pos;
+	fd = jfile.fd;
 	jfile.pos += wsize;
+	if (je->flag == JF_STORE)
+		journal_mark_dirty(je->oid, je->ec_index);
 	sd_mutex_unlock(&jfile_lock);
 
-	p = wbuffer = xvalloc(wsize);
-	memcpy(p, jd, JOURNAL_DESC_SIZE);
-	p += JOURNAL_DESC_SIZE;
-	memcpy(p, buf, size);
-	p += size;
-	if (size < rusize) {
-		memset(p, 0, rusize - size);
-		p += rusize - size;
-	}
-	memcpy(p, &marker, JOURNAL_MARKER_SIZE);
+	wbuffer = xvalloc(wsize);
+	journal_fill_entry(wbuffer + sizeof(struct journal_record), je, buf);
+	journal_finish_record(wbuffer, len, 1);
+
 	/*
 	 * Concurrent writes with the same FD is okay because we don't have any
 	 * critical sections that need lock inside kernel write path, since we
@@ -404,47 +825,59 @@ static int journal_file_write(struct journal_descriptor *jd, const char *buf)
 	 *
 	 * Feel free to correct me If I am wrong.
 	 */
-	written = xpwrite(jfile.fd, wbuffer, wsize, woff);
-	if (unlikely(written != wsize)) {
-		sd_err("failed, written %zd, len %zd", written, wsize);
+	iov.iov_base = wbuffer;
+	iov.iov_len = wsize;
+	if (journal_pwritev(fd, &iov, 1, woff, wsize) < 0)
 		/* FIXME: teach journal file handle EIO gracefully */
 		ret = SD_RES_EIO;
-		goto out;
-	}
-out:
+	uatomic_add(&sys->stat.j.written_bytes, wsize);
+	uatomic_add(&sys->stat.j.payload_bytes, je->size);
+
 	free(wbuffer);
 	return ret;
 }
 
-int journal_write_store(uint64_t oid, const char *buf, size_t size,
-			off_t offset, bool create)
+static int journal_file_write(const struct journal_entry *je, const char *buf)
 {
-	struct journal_descriptor jd = {
-		.magic = JOURNAL_DESC_MAGIC,
-		.flag = JF_STORE,
+	size_t len = sizeof(struct journal_record) + sizeof(*je) + je->size;
+
+	if (len > JOURNAL_DIRECT_SIZE)
+		return journal_write_direct(je, buf);
+
+	return journal_write_batched(je, buf);
+}
+
+int journal_write_store(uint64_t oid, uint8_t ec_index, const char *buf,
+			size_t size, off_t offset, bool create)
+{
+	struct journal_entry je = {
+		.oid = oid,
 		.offset = offset,
 		.size = size,
+		.flag = JF_STORE,
 		.create = create,
-		.oid = oid,
+		.ec_index = ec_index,
 	};
 
-	return journal_file_write(&jd, buf);
+	return journal_file_write(&je, buf);
 }
 
 int journal_remove_object(uint64_t oid)
 {
-	struct journal_descriptor jd = {
-		.magic = JOURNAL_DESC_MAGIC,
-		.flag = JF_REMOVE_OBJ,
-		.size = 0,
+	struct journal_entry je = {
 		.oid = oid,
+		.size = 0,
+		.flag = JF_REMOVE_OBJ,
 	};
 
-	return journal_file_write(&jd, NULL);
+	return journal_file_write(&je, NULL);
 }
 
 static __attribute__((used)) void journal_c_build_bug_ons(void)
 {
 	/* never called, only for checking BUILD_BUG_ON()s */
 	BUILD_BUG_ON(sizeof(struct journal_descriptor) != JOURNAL_DESC_SIZE);
+	BUILD_BUG_ON(sizeof(struct journal_record) != 24);
+	BUILD_BUG_ON(sizeof(struct journal_entry) != 24);
+	BUILD_BUG_ON(JOURNAL_BATCH_SIZE % JOURNAL_RECORD_ALIGN != 0);
 }
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Object pools for the request path
+ *
+ * Every client request used to allocate a struct request and its data buffer
+ * and the gateway allocated the replica iterators and the erasure strip
+ * buffers again, so that the I/O path did several malloc/free pairs per
+ * request, most of them in different threads.
+ *
+ * A pool hands out objects of one fixed size.  Each thread keeps a small
+ * cache of free objects per pool, which is accessed without any lock.  When
+ * the cache of a thread runs empty, it takes a batch of objects from the
+ * shared depot of the pool and when it overflows (e.g. buffers allocated in
+ * a worker are freed in the main thread), it gives back a batch to the depot.
+ * Objects are returned to the system only when the depot is full or the
+ * cached bytes of all the pools exceed MEMPOOL_MAX_CACHED.
+ *
+ * Page aligned data buffers are served by size classes from 4KB up to
+ * SD_DATA_OBJ_SIZE by powers of two.  Larger buffers bypass the pools.
+ */
+
+#include "sheep_priv.h"
+
+#define MEMPOOL_MAX_POOLS	32
+
+#define BUFFER_MIN_SHIFT	12	/* 4KB */
+#define BUFFER_MAX_SHIFT	22	/* SD_DATA_OBJ_SIZE */
+#define NR_BUFFER_CLASSES	(BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1)
+
+/* Bounds of the cached objects per pool, in bytes and in objects */
+#define TCACHE_BYTES		(1024 * 1024)
+#define TCACHE_MAX_OBJS		64
+#define DEPOT_BYTES		(16 * 1024 * 1024)
+#define DEPOT_MAX_OBJS		1024
+
+/* Bound of the cached bytes of all the pools and threads */
+#define MEMPOOL_MAX_CACHED	(256 * 1024 * 1024)
+
+/* A free object links to the next free one with its first word */
+struct pool_obj {
+	struct pool_obj *next;
+};
+
+struct mempool {
+	const char *name;
+	size_t size;
+	int idx;
+	uint32_t tcache_max;
+	uint32_t depot_max;
+
+	struct sd_mutex lock;
+	struct pool_obj *depot;
+	uint32_t nr_depot;
+};
+
+struct pool_tcache {
+	struct pool_obj *head;
+	uint32_t nr;
+};
+
+struct mempool *request_pool, *req_iter_pool;
+
+static struct mempool *pools[MEMPOOL_MAX_POOLS];
+static int nr_pools;
+static struct mempool *buffer_pools[NR_BUFFER_CLASSES];
+
+static __thread struct pool_tcache *tcaches;
+static pthread_key_t tcache_key;
+
+static inline uint32_t nr_objs(size_t bytes, size_t size, uint32_t max_objs)
+{
+	size_t nr = bytes / size;
+
+	if (nr < 2)
+		return 2;
+	return nr > max_objs ? max_objs : nr;
+}
+
+static void *obj_alloc(struct mempool *pool)
+{
+	uatomic_inc(&sys->stat.pool.alloc_nr);
+	if (pool->size >= (size_t)getpagesize())
+		return valloc(pool->size);
+	else
+		return malloc(pool->size);
+}
+
+static void obj_release(struct pool_obj *obj)
+{
+	uatomic_inc(&sys->stat.pool.release_nr);
+	free(obj);
+}
+
+/* Move up to 'nr' objects from the depot to the thread cache */
+static void depot_get(struct mempool *pool, struct pool_tcache *tc, int nr)
+{
+	struct pool_obj *obj;
+
+	sd_mutex_lock(&pool->lock);
+	while (nr-- > 0 && pool->depot) {
+		obj = pool->depot;
+		pool->depot = obj->next;
+		pool->nr_depot--;
+
+		obj->next = tc->head;
+		tc->head = obj;
+		tc->nr++;
+	}
+	sd_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Move 'nr' objects from the thread cache to the depot and release the ones
+ * which don't fit.
+ */
+static void depot_put(struct mempool *pool, struct pool_tcache *tc, int nr)
+{
+	struct pool_obj *obj, *release = NULL;
+	int nr_release = 0;
+
+	sd_mutex_lock(&pool->lock);
+	while (nr-- > 0 && tc->head) {
+		obj = tc->head;
+		tc->head = obj->next;
+		tc->nr--;
+
+		if (pool->nr_depot < pool->depot_max) {
+			obj->next = pool->depot;
+			pool->depot = obj;
+			pool->nr_depot++;
+		} else {
+			obj->next = release;
+			release = obj;
+			nr_release++;
+		}
+	}
+	sd_mutex_unlock(&pool->lock);
+
+	uatomic_sub(&sys->stat.pool.cached_bytes, nr_release * pool->size);
+	while (release) {
+		obj = release;
+		release = obj->next;
+		obj_release(obj);
+	}
+}
+
+/* Called at the exit of a thread to hand its cached objects to the depots */
+static void tcache_destroy(void *arg)
+{
+	struct pool_tcache *caches = arg;
+
+	for (int i = 0; i < nr_pools; i++)
+		depot_put(pools[i], caches + i, caches[i].nr);
+
+	free(caches);
+	tcaches = NULL;
+}
+
+static struct pool_tcache *get_tcache(struct mempool *pool)
+{
+	if (unlikely(!tcaches)) {
+		tcaches = xcalloc(MEMPOOL_MAX_POOLS, sizeof(*tcaches));
+		pthread_setspecific(tcache_key, tcaches);
+	}
+
+	return tcaches + pool->idx;
+}
+
+/* Allocate an object from the pool.  The object is not zeroed. */
+void *mempool_alloc(struct mempool *pool)
+{
+	struct pool_tcache *tc = get_tcache(pool);
+	struct pool_obj *obj;
+
+	if (!tc->head) {
+		depot_get(pool, tc, pool->tcache_max / 2);
+		if (!tc->head)
+			return obj_alloc(pool);
+	}
+
+	obj = tc->head;
+	tc->head = obj->next;
+	tc->nr--;
+
+	uatomic_inc(&sys->stat.pool.alloc_nr);
+	uatomic_inc(&sys->stat.pool.hit_nr);
+	uatomic_sub(&sys->stat.pool.cached_bytes, pool->size);
+
+	return obj;
+}
+
+void *mempool_zalloc(struct mempool *pool)
+{
+	void *obj = mempool_alloc(pool);
+
+	if (obj)
+		memset(obj, 0, pool->size);
+	return obj;
+}
+
+void mempool_free(struct mempool *pool, void *p)
+{
+	struct pool_tcache *tc = get_tcache(pool);
+	struct pool_obj *obj = p;
+
+	if (!obj)
+		return;
+
+	if (uatomic_read(&sys->stat.pool.cached_bytes) + pool->size >
+	    MEMPOOL_MAX_CACHED) {
+		obj_release(obj);
+		return;
+	}
+
+	obj->next = tc->head;
+	tc->head = obj;
+	tc->nr++;
+	uatomic_add(&sys->stat.pool.cached_bytes, pool->size);
+
+	if (tc->nr > pool->tcache_max)
+		depot_put(pool, tc, tc->nr - pool->tcache_max / 2);
+}
+
+static struct mempool *buffer_pool(size_t len)
+{
+	int shift = BUFFER_MIN_SHIFT;
+
+	if (len > (1UL << BUFFER_MAX_SHIFT))
+		return NULL;
+
+	while ((1UL << shift) < len)
+		shift++;
+
+	return buffer_pools[shift - BUFFER_MIN_SHIFT];
+}
+
+/*
+ * Allocate a page aligned buffer of at least 'len' bytes.  The buffer must be
+ * released with free_data_buffer() and the same 'len'.
+ */
+void *alloc_data_buffer(size_t len)
+{
+	struct mempool *pool = buffer_pool(len);
+
+	if (!pool)
+		return valloc(len);
+
+	return mempool_alloc(pool);
+}
+
+void free_data_buffer(void *buf, size_t len)
+{
+	struct mempool *pool;
+
+	if (!buf)
+		return;
+
+	pool = buffer_pool(len);
+	if (!pool)
+		free(buf);
+	else
+		mempool_free(pool, buf);
+}
+
+/* Pools can be created only before the process goes multi-threaded */
+struct mempool *mempool_create(const char *name, size_t size)
+{
+	struct mempool *pool;
+
+	if (nr_pools == MEMPOOL_MAX_POOLS)
+		panic("too many memory pools");
+
+	pool = xzalloc(sizeof(*pool));
+	pool->name = name;
+	pool->size = max(size, sizeof(struct pool_obj));
+	pool->idx = nr_pools;
+	pool->tcache_max = nr_objs(TCACHE_BYTES, pool->size, TCACHE_MAX_OBJS);
+	pool->depot_max = nr_objs(DEPOT_BYTES, pool->size, DEPOT_MAX_OBJS);
+	sd_init_mutex(&pool->lock);
+
+	pools[nr_pools++] = pool;
+	sd_debug("%s, size %zu, thread cache %"PRIu32", depot %"PRIu32,
+		 name, pool->size, pool->tcache_max, pool->depot_max);
+
+	return pool;
+}
+
+void mempool_init(void)
+{
+	static char names[NR_BUFFER_CLASSES][16];
+	int ret;
+
+	ret = pthread_key_create(&tcache_key, tcache_destroy);
+	if (ret)
+		panic("failed to create a thread key, %s", strerror(ret));
+
+	for (int i = 0; i < NR_BUFFER_CLASSES; i++) {
+		snprintf(names[i], sizeof(names[i]), "buffer-%luk",
+			 (1UL << (BUFFER_MIN_SHIFT + i)) / 1024);
+		buffer_pools[i] = mempool_create(names[i],
+						 1UL << (BUFFER_MIN_SHIFT + i));
+	}
+
+	request_pool = mempool_create("request", sizeof(struct request));
+	req_iter_pool = mempool_create("req_iter",
+				       sizeof(struct req_iter) * SD_MAX_COPIES);
+}
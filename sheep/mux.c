@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Multiplexed peer connections
+ *
+ * The sockfd cache lends a whole connection to every in-flight request, so the
+ * number of the connections to a node grows with the queue depth.  With the
+ * multiplexed transport, the requests to a node share a fixed number of
+ * connections instead.  The peer already serves pipelined requests on one
+ * connection and echoes sd_req.id in the response, so each request is tagged
+ * with an id unique within its connection and a dedicated reader thread per
+ * connection matches the responses to the pending requests, completing them in
+ * whatever order they arrive.
+ *
+ * A connection which fails to send or receive is shut down.  Its reader thread
+ * then fails all the requests pending on it with SD_RES_NETWORK_ERROR, and the
+ * next request to the node makes a new connection.
+ */
+
+#include "sheep_priv.h"
+
+#define MUX_HASH_SIZE	64
+
+struct mux_conn {
+	struct node_id nid;
+	int fd;
+	int slot;
+	refcnt_t refcnt;
+
+	/* serializes the requests written to the socket */
+	struct sd_mutex send_lock;
+
+	/* protects the fields below */
+	struct sd_mutex lock;
+	bool dead;
+	uint32_t next_id;
+	struct hlist_head pending[MUX_HASH_SIZE];
+};
+
+struct mux_node {
+	struct rb_node rb;
+	struct node_id nid;
+	uint32_t next;
+	struct mux_conn **conns;
+};
+
+static struct rb_root mux_nodes = RB_ROOT;
+static struct sd_mutex mux_lock = SD_MUTEX_INITIALIZER;
+
+static int mux_node_cmp(const struct mux_node *a, const struct mux_node *b)
+{
+	return node_id_cmp(&a->nid, &b->nid);
+}
+
+static struct mux_node *mux_node_search(const struct node_id *nid)
+{
+	struct mux_node key = { .nid = *nid };
+
+	return rb_search(&mux_nodes, &key, rb, mux_node_cmp);
+}
+
+static void mux_conn_put(struct mux_conn *conn)
+{
+	if (refcount_dec(&conn->refcnt) > 0)
+		return;
+
+	close(conn->fd);
+	free(conn);
+}
+
+static void mux_complete(struct mux_req *mreq, int result)
+{
+	mreq->result = result;
+	mreq->done(mreq);
+}
+
+/* Make the reader thread fail everything pending on the connection */
+static void mux_conn_shutdown(struct mux_conn *conn)
+{
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+/* Called by the reader thread when the connection is broken */
+static void mux_conn_kill(struct mux_conn *conn)
+{
+	struct mux_node *node;
+	struct mux_req *mreq;
+	struct hlist_node *n;
+	struct hlist_head failed;
+
+	sd_mutex_lock(&mux_lock);
+	node = mux_node_search(&conn->nid);
+	if (node && node->conns[conn->slot] == conn) {
+		node->conns[conn->slot] = NULL;
+		mux_conn_put(conn);
+	}
+	sd_mutex_unlock(&mux_lock);
+
+	INIT_HLIST_HEAD(&failed);
+	sd_mutex_lock(&conn->lock);
+	conn->dead = true;
+	for (int i = 0; i < MUX_HASH_SIZE; i++)
+		hlist_for_each_entry(mreq, n, conn->pending + i, hash) {
+			hlist_del(&mreq->hash);
+			hlist_add_head(&mreq->hash, &failed);
+		}
+	sd_mutex_unlock(&conn->lock);
+
+	hlist_for_each_entry(mreq, n, &failed, hash)
+		mux_complete(mreq, SD_RES_NETWORK_ERROR);
+}
+
+static struct mux_req *mux_conn_claim(struct mux_conn *conn, uint32_t id)
+{
+	struct mux_req *mreq, *ret = NULL;
+	struct hlist_node *n;
+
+	sd_mutex_lock(&conn->lock);
+	hlist_for_each_entry(mreq, n, conn->pending + id % MUX_HASH_SIZE,
+			     hash) {
+		if (mreq->id == id) {
+			hlist_del(&mreq->hash);
+			ret = mreq;
+			break;
+		}
+	}
+	sd_mutex_unlock(&conn->lock);
+
+	return ret;
+}
+
+/* Drop the response data which doesn't fit in the buffer of the request */
+static int mux_discard(int fd, uint32_t len)
+{
+	char buf[4096];
+	uint32_t n;
+
+	while (len > 0) {
+		n = min(len, (uint32_t)sizeof(buf));
+		if (do_read(fd, buf, n, NULL, 0, 0))
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void *mux_reader(void *arg)
+{
+	struct mux_conn *conn = arg;
+	struct mux_req *mreq;
+	struct sd_rsp rsp;
+	uint32_t len;
+
+	pthread_detach(pthread_self());
+
+	for (;;) {
+		if (do_read(conn->fd, &rsp, sizeof(rsp), NULL, 0, 0))
+			break;
+
+		mreq = mux_conn_claim(conn, rsp.id);
+		if (!mreq) {
+			sd_err("unexpected response id %"PRIu32" from %s",
+			       rsp.id, node_id_to_str(&conn->nid));
+			break;
+		}
+
+		memcpy(&mreq->rsp, &rsp, sizeof(rsp));
+		len = min(rsp.data_length, mreq->buflen);
+		if ((len && do_read(conn->fd, mreq->buf, len, NULL, 0, 0)) ||
+		    mux_discard(conn->fd, rsp.data_length - len) < 0) {
+			mux_complete(mreq, SD_RES_NETWORK_ERROR);
+			break;
+		}
+		mreq->rsp.data_length = len;
+		mux_complete(mreq, SD_RES_SUCCESS);
+	}
+
+	mux_conn_kill(conn);
+	mux_conn_put(conn);
+
+	return NULL;
+}
+
+static int mux_connect(const struct node_id *nid)
+{
+	struct timeval timeout = { 0 };
+	int fd = -1;
+
+	if (nid->io_port) {
+		fd = connect_to_addr(nid->io_addr, nid->io_port);
+		if (fd < 0)
+			sd_err("fallback to non-io connection");
+	}
+	if (fd < 0)
+		fd = connect_to_addr(nid->addr, nid->port);
+	if (fd < 0)
+		return -1;
+
+	/*
+	 * The reader thread sleeps on the idle connection, so don't time out
+	 * the reads.  The waiters have their own timeout, and keepalive
+	 * detects a dead peer.
+	 */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		       sizeof(timeout)) < 0 || set_keepalive(fd) < 0) {
+		sd_err("failed to set up connection to %s, %m",
+		       node_id_to_str(nid));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static struct mux_conn *mux_conn_create(const struct node_id *nid, int slot)
+{
+	struct mux_conn *conn;
+	int fd;
+
+	fd = mux_connect(nid);
+	if (fd < 0)
+		return NULL;
+
+	conn = xzalloc(sizeof(*conn));
+	conn->nid = *nid;
+	conn->fd = fd;
+	conn->slot = slot;
+	refcount_set(&conn->refcnt, 1);
+	sd_init_mutex(&conn->send_lock);
+	sd_init_mutex(&conn->lock);
+	for (int i = 0; i < MUX_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(conn->pending + i);
+
+	return conn;
+}
+
+/* Must be called with mux_lock held */
+static struct mux_node *mux_node_get(const struct node_id *nid)
+{
+	struct mux_node *node;
+
+	node = mux_node_search(nid);
+	if (node)
+		return node;
+
+	node = xzalloc(sizeof(*node));
+	node->nid = *nid;
+	node->conns = xcalloc(sys->mux_conns, sizeof(*node->conns));
+	rb_insert(&mux_nodes, node, rb, mux_node_cmp);
+
+	return node;
+}
+
+/* Return a referenced connection to the node in the round-robin order */
+static struct mux_conn *mux_conn_get(const struct node_id *nid)
+{
+	struct mux_node *node;
+	struct mux_conn *conn, *new;
+	sd_thread_t reader;
+	int slot, ret;
+
+	sd_mutex_lock(&mux_lock);
+	node = mux_node_get(nid);
+	slot = node->next++ % sys->mux_conns;
+	conn = node->conns[slot];
+	if (conn)
+		refcount_inc(&conn->refcnt);
+	sd_mutex_unlock(&mux_lock);
+
+	if (conn)
+		return conn;
+
+	new = mux_conn_create(nid, slot);
+	if (!new)
+		return NULL;
+
+	sd_mutex_lock(&mux_lock);
+	node = mux_node_get(nid);
+	conn = node->conns[slot];
+	if (conn) {
+		/* somebody else has connected in the meantime */
+		refcount_inc(&conn->refcnt);
+		sd_mutex_unlock(&mux_lock);
+		mux_conn_put(new);
+		return conn;
+	}
+
+	/* one reference for the table and one for the reader thread */
+	refcount_inc(&new->refcnt);
+	refcount_inc(&new->refcnt);
+	ret = sd_thread_create("mux", &reader, mux_reader, new);
+	if (ret) {
+		sd_mutex_unlock(&mux_lock);
+		sd_err("failed to create reader thread, %s", strerror(ret));
+		close(new->fd);
+		free(new);
+		return NULL;
+	}
+	node->conns[slot] = new;
+	sd_mutex_unlock(&mux_lock);
+
+	return new;
+}
+
+/*
+ * Send a request to the node.  The response header is stored in mreq->rsp and
+ * its data in mreq->buf, up to mreq->buflen bytes, and then mreq->done() is
+ * called with mreq->result set to the result of the transport.
+ *
+ * mreq->done() is called either from the reader thread or, if the request
+ * can't be sent at all, from the caller before this returns.  It must not
+ * block on another multiplexed request.
+ */
+void mux_submit(const struct node_id *nid, struct mux_req *mreq,
+		struct sd_req *hdr, void *data, uint32_t wlen)
+{
+	struct mux_conn *conn;
+	int ret;
+
+	INIT_HLIST_NODE(&mreq->hash);
+	mreq->conn = NULL;
+
+	conn = mux_conn_get(nid);
+	if (!conn) {
+		mux_complete(mreq, SD_RES_NETWORK_ERROR);
+		return;
+	}
+
+	sd_mutex_lock(&conn->lock);
+	if (conn->dead) {
+		sd_mutex_unlock(&conn->lock);
+		mux_conn_put(conn);
+		mux_complete(mreq, SD_RES_NETWORK_ERROR);
+		return;
+	}
+	mreq->id = conn->next_id++;
+	mreq->conn = conn;
+	hlist_add_head(&mreq->hash, conn->pending + mreq->id % MUX_HASH_SIZE);
+	sd_mutex_unlock(&conn->lock);
+
+	hdr->id = mreq->id;
+	sd_mutex_lock(&conn->send_lock);
+	ret = send_req(conn->fd, hdr, data, wlen, sheep_need_retry, hdr->epoch,
+		       MAX_RETRY_COUNT);
+	sd_mutex_unlock(&conn->send_lock);
+	/*
+	 * A partially sent request corrupts the stream, so the reader has to
+	 * fail the connection together with this request.
+	 */
+	if (ret)
+		mux_conn_shutdown(conn);
+
+	mux_conn_put(conn);
+}
+
+/*
+ * Abort an incomplete request by shutting down its connection.  The caller
+ * must make sure that mreq->done() isn't called concurrently, which keeps the
+ * connection alive.
+ */
+void mux_req_abort(struct mux_req *mreq)
+{
+	mux_conn_shutdown(mreq->conn);
+}
+
+static void mux_waiter_done(struct mux_req *mreq)
+{
+	struct mux_waiter *w = mreq->private;
+
+	sd_mutex_lock(&w->lock);
+	mreq->completed = true;
+	if (--w->nr_pending == 0)
+		sd_cond_signal(&w->cond);
+	sd_mutex_unlock(&w->lock);
+}
+
+void mux_waiter_init(struct mux_waiter *w)
+{
+	sd_init_mutex(&w->lock);
+	sd_cond_init(&w->cond);
+	w->nr_pending = 0;
+}
+
+/* Submit a request whose completion is waited for with mux_wait() */
+void mux_submit_wait(const struct node_id *nid, struct mux_waiter *w,
+		     struct mux_req *mreq, struct sd_req *hdr, void *data,
+		     uint32_t wlen)
+{
+	mreq->done = mux_waiter_done;
+	mreq->private = w;
+	mreq->completed = false;
+
+	sd_mutex_lock(&w->lock);
+	w->nr_pending++;
+	sd_mutex_unlock(&w->lock);
+
+	mux_submit(nid, mreq, hdr, data, wlen);
+}
+
+/*
+ * Wait for the completion of all the requests submitted with 'w'.
+ *
+ * As wait_forward_request() does, we keep waiting while the epoch is
+ * unchanged, and then shut down the connections of the stuck requests so that
+ * their reader threads fail them.
+ */
+void mux_wait(struct mux_waiter *w, struct mux_req *mreqs, int nr,
+	      uint32_t epoch)
+{
+	int repeat = MAX_RETRY_COUNT;
+	bool shut = false;
+
+	sd_mutex_lock(&w->lock);
+	while (w->nr_pending > 0) {
+		if (shut) {
+			sd_cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+		if (sd_cond_wait_timeout(&w->cond, &w->lock,
+					 POLL_TIMEOUT) != ETIMEDOUT)
+			continue;
+
+		if (sheep_need_retry(epoch) && repeat) {
+			repeat--;
+			sd_warn("wait timeout %d, disks of some nodes or "
+				"network is busy. Going to wait again",
+				w->nr_pending);
+			continue;
+		}
+
+		for (int i = 0; i < nr; i++)
+			if (!mreqs[i].completed)
+				mux_req_abort(mreqs + i);
+		shut = true;
+	}
+	sd_mutex_unlock(&w->lock);
+
+	sd_destroy_cond(&w->cond);
+	sd_destroy_mutex(&w->lock);
+}
+
+/*
+ * Same as exec_req(), but through the multiplexed connections.  Return
+ * SD_RES_SUCCESS if the response is received, and the response header is
+ * copied to 'hdr'.
+ */
+int mux_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
+{
+	struct mux_waiter w;
+	struct mux_req mreq = {};
+	uint32_t wlen = 0;
+
+	if (hdr->flags & SD_FLAG_CMD_WRITE) {
+		wlen = hdr->data_length;
+		if (hdr->flags & SD_FLAG_CMD_PIGGYBACK)
+			mreq.buflen = hdr->data_length;
+	} else
+		mreq.buflen = hdr->data_length;
+	mreq.buf = buf;
+
+	mux_waiter_init(&w);
+	mux_submit_wait(nid, &w, &mreq, hdr, buf, wlen);
+	mux_wait(&w, &mreq, 1, hdr->epoch);
+
+	if (mreq.result == SD_RES_SUCCESS)
+		memcpy(hdr, &mreq.rsp, sizeof(mreq.rsp));
+
+	return mreq.result;
+}
+
+/* Close all the connections to the node which has left the cluster */
+void mux_del_node(const struct node_id *nid)
+{
+	struct mux_node *node;
+
+	sd_mutex_lock(&mux_lock);
+	node = mux_node_search(nid);
+	if (!node) {
+		sd_mutex_unlock(&mux_lock);
+		return;
+	}
+	rb_erase(&node->rb, &mux_nodes);
+	sd_mutex_unlock(&mux_lock);
+
+	for (int i = 0; i < sys->mux_conns; i++) {
+		struct mux_conn *conn = node->conns[i];
+
+		if (!conn)
+			continue;
+		mux_conn_shutdown(conn);
+		mux_conn_put(conn);
+	}
+	free(node->conns);
+	free(node);
+}
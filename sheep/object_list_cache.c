@@ -13,18 +13,45 @@
 
 #include "sheep_priv.h"
 
-struct objlist_cache_entry {
+/*
+ * The object list is split into shards by the hash of the VDI id, so that the
+ * objects of a VDI are in the same shard and the writers of the different
+ * VDIs don't contend for a lock.  A shard keeps its oids in sorted chunks of
+ * OBJLIST_CHUNK_SIZE, which costs about 10 bytes per object instead of a
+ * malloc'ed rb node.
+ *
+ * Every change bumps the global version and is recorded in the log of the
+ * shard, so that the readers can fetch only the changes since the version
+ * they have seen, see get_obj_list_delta().
+ */
+#define OBJLIST_SHARD_BITS	6
+#define NR_OBJLIST_SHARDS	(1U << OBJLIST_SHARD_BITS)
+#define OBJLIST_CHUNK_SIZE	256
+#define OBJLIST_LOG_SIZE	1024	/* changes per shard */
+
+struct objlist_chunk {
+	uint32_t nr;
+	uint64_t oids[OBJLIST_CHUNK_SIZE];
+};
+
+struct objlist_change {
+	uint64_t version;
 	uint64_t oid;
-	struct rb_node node;
+	bool removed;
 };
 
-struct objlist_cache {
-	int tree_version;
-	int buf_version;
-	int cache_size;
-	uint64_t *buf;
-	struct rb_root root;
+struct objlist_shard {
 	struct sd_rw_lock lock;
+	uint64_t nr_oids;
+
+	/* sorted by oid, none of them is empty */
+	uint32_t nr_chunks;
+	uint32_t max_chunks;
+	struct objlist_chunk **chunks;
+
+	struct objlist_change *log;
+	uint64_t log_head;	/* nr of the changes ever logged */
+	uint64_t log_floor;	/* the changes after it are all in the log */
 };
 
 struct objlist_deletion_work {
@@ -32,123 +59,391 @@ struct objlist_deletion_work {
 	struct work work;
 };
 
-static struct objlist_cache obj_list_cache = {
-	.tree_version	= 1,
-	.root		= RB_ROOT,
-	.lock		= SD_RW_LOCK_INITIALIZER,
+static struct objlist_shard objlist_shards[NR_OBJLIST_SHARDS] = {
+	[0 ... NR_OBJLIST_SHARDS - 1] = { .lock = SD_RW_LOCK_INITIALIZER },
 };
 
-static int objlist_cache_cmp(const struct objlist_cache_entry *a,
-			     const struct objlist_cache_entry *b)
+static uint64_t objlist_version;
+
+static inline struct objlist_shard *vid_to_shard(uint32_t vid)
 {
-	return intcmp(a->oid, b->oid);
+	return objlist_shards + hash_64(vid, OBJLIST_SHARD_BITS);
 }
 
-static struct objlist_cache_entry *objlist_cache_rb_insert(struct rb_root *root,
-		struct objlist_cache_entry *new)
+static inline struct objlist_shard *oid_to_shard(uint64_t oid)
 {
-	return rb_insert(root, new, node, objlist_cache_cmp);
+	return vid_to_shard(oid_to_vid(oid));
 }
 
-static int objlist_cache_rb_remove(struct rb_root *root, uint64_t oid)
+static inline uint64_t chunk_last(const struct objlist_chunk *chunk)
 {
-	struct objlist_cache_entry *entry,  key = { .oid = oid  };
+	return chunk->oids[chunk->nr - 1];
+}
 
-	entry = rb_search(root, &key, node, objlist_cache_cmp);
-	if (!entry)
-		return -1;
+/* Index of the first oid not less than 'oid' in the chunk */
+static uint32_t chunk_lower_bound(const struct objlist_chunk *chunk,
+				  uint64_t oid)
+{
+	uint32_t lo = 0, hi = chunk->nr;
 
-	rb_erase(&entry->node, root);
-	free(entry);
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
 
-	return 0;
+		if (chunk->oids[mid] < oid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
-void objlist_cache_remove(uint64_t oid)
+/* Index of the first chunk whose last oid is not less than 'oid' */
+static uint32_t shard_lower_bound(const struct objlist_shard *shard,
+				  uint64_t oid)
 {
-	sd_write_lock(&obj_list_cache.lock);
-	if (!objlist_cache_rb_remove(&obj_list_cache.root, oid)) {
-		obj_list_cache.cache_size--;
-		obj_list_cache.tree_version++;
+	uint32_t lo = 0, hi = shard->nr_chunks;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (chunk_last(shard->chunks[mid]) < oid)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	sd_rw_unlock(&obj_list_cache.lock);
+	return lo;
 }
 
-int objlist_cache_insert(uint64_t oid)
+static void shard_insert_chunk(struct objlist_shard *shard, uint32_t idx,
+			       struct objlist_chunk *chunk)
+{
+	if (shard->nr_chunks == shard->max_chunks) {
+		shard->max_chunks = max(shard->max_chunks * 2, 16U);
+		shard->chunks = xrealloc(shard->chunks, shard->max_chunks *
+					 sizeof(*shard->chunks));
+	}
+	memmove(shard->chunks + idx + 1, shard->chunks + idx,
+		(shard->nr_chunks - idx) * sizeof(*shard->chunks));
+	shard->chunks[idx] = chunk;
+	shard->nr_chunks++;
+}
+
+static void shard_remove_chunk(struct objlist_shard *shard, uint32_t idx)
+{
+	free(shard->chunks[idx]);
+	memmove(shard->chunks + idx, shard->chunks + idx + 1,
+		(shard->nr_chunks - idx - 1) * sizeof(*shard->chunks));
+	shard->nr_chunks--;
+}
+
+static void shard_log(struct objlist_shard *shard, uint64_t oid, bool removed)
+{
+	struct objlist_change *change;
+
+	if (!shard->log)
+		shard->log = xcalloc(OBJLIST_LOG_SIZE, sizeof(*shard->log));
+
+	change = shard->log + shard->log_head % OBJLIST_LOG_SIZE;
+	if (shard->log_head >= OBJLIST_LOG_SIZE)
+		shard->log_floor = change->version;
+	change->version = uatomic_add_return(&objlist_version, 1);
+	change->oid = oid;
+	change->removed = removed;
+	shard->log_head++;
+}
+
+/* Return false if the oid is already in the shard */
+static bool shard_insert(struct objlist_shard *shard, uint64_t oid)
 {
-	struct objlist_cache_entry *entry, *p;
+	struct objlist_chunk *chunk, *new;
+	uint32_t idx, pos;
+
+	if (!shard->nr_chunks) {
+		chunk = xmalloc(sizeof(*chunk));
+		chunk->nr = 1;
+		chunk->oids[0] = oid;
+		shard_insert_chunk(shard, 0, chunk);
+		goto out;
+	}
+
+	idx = shard_lower_bound(shard, oid);
+	if (idx == shard->nr_chunks)
+		idx--;
+	chunk = shard->chunks[idx];
+	pos = chunk_lower_bound(chunk, oid);
+	if (pos < chunk->nr && chunk->oids[pos] == oid)
+		return false;
+
+	if (chunk->nr == OBJLIST_CHUNK_SIZE) {
+		/* split the chunk into halves */
+		new = xmalloc(sizeof(*new));
+		new->nr = OBJLIST_CHUNK_SIZE / 2;
+		memcpy(new->oids, chunk->oids + OBJLIST_CHUNK_SIZE / 2,
+		       new->nr * sizeof(uint64_t));
+		chunk->nr = OBJLIST_CHUNK_SIZE / 2;
+		shard_insert_chunk(shard, idx + 1, new);
+		if (pos > chunk->nr) {
+			chunk = new;
+			pos -= OBJLIST_CHUNK_SIZE / 2;
+		}
+	}
 
-	entry = xzalloc(sizeof(*entry));
-	entry->oid = oid;
-	rb_init_node(&entry->node);
+	memmove(chunk->oids + pos + 1, chunk->oids + pos,
+		(chunk->nr - pos) * sizeof(uint64_t));
+	chunk->oids[pos] = oid;
+	chunk->nr++;
+out:
+	shard->nr_oids++;
+	shard_log(shard, oid, false);
+	return true;
+}
 
-	sd_write_lock(&obj_list_cache.lock);
-	p = objlist_cache_rb_insert(&obj_list_cache.root, entry);
-	if (p)
-		free(entry);
-	else {
-		obj_list_cache.cache_size++;
-		obj_list_cache.tree_version++;
+/* Remove the oids in [first, last] from the shard and return the number */
+static uint64_t shard_remove_range(struct objlist_shard *shard,
+				   uint64_t first, uint64_t last)
+{
+	uint32_t idx = shard_lower_bound(shard, first);
+	uint64_t nr = 0;
+
+	while (idx < shard->nr_chunks) {
+		struct objlist_chunk *chunk = shard->chunks[idx];
+		uint32_t pos = chunk_lower_bound(chunk, first), end = pos;
+
+		while (end < chunk->nr && chunk->oids[end] <= last) {
+			sd_debug("delete object entry %016"PRIx64,
+				 chunk->oids[end]);
+			shard_log(shard, chunk->oids[end], true);
+			end++;
+		}
+		if (end == pos)
+			break;
+
+		memmove(chunk->oids + pos, chunk->oids + end,
+			(chunk->nr - end) * sizeof(uint64_t));
+		chunk->nr -= end - pos;
+		nr += end - pos;
+		if (!chunk->nr)
+			shard_remove_chunk(shard, idx);
+		else if (pos < chunk->nr)
+			break;
+		else
+			idx++;
 	}
-	sd_rw_unlock(&obj_list_cache.lock);
+
+	shard->nr_oids -= nr;
+	return nr;
+}
+
+static void read_lock_all_shards(void)
+{
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++)
+		sd_read_lock(&objlist_shards[i].lock);
+}
+
+static void unlock_all_shards(void)
+{
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++)
+		sd_rw_unlock(&objlist_shards[i].lock);
+}
+
+void objlist_cache_remove(uint64_t oid)
+{
+	struct objlist_shard *shard = oid_to_shard(oid);
+
+	sd_write_lock(&shard->lock);
+	shard_remove_range(shard, oid, oid);
+	sd_rw_unlock(&shard->lock);
+}
+
+int objlist_cache_insert(uint64_t oid)
+{
+	struct objlist_shard *shard = oid_to_shard(oid);
+
+	sd_write_lock(&shard->lock);
+	shard_insert(shard, oid);
+	sd_rw_unlock(&shard->lock);
 
 	return 0;
 }
 
-int get_obj_list(const struct sd_req *hdr, struct sd_rsp *rsp, void *data)
+/* A position in a shard */
+struct objlist_cursor {
+	const struct objlist_shard *shard;
+	uint32_t idx;
+	uint32_t pos;
+};
+
+static inline uint64_t cursor_oid(const struct objlist_cursor *c)
 {
-	int nr = 0, ret = SD_RES_SUCCESS;
-	struct objlist_cache_entry *entry;
-	uint64_t *newbuf = NULL;
-
-	/* first try getting the cached buffer with only a read lock held */
-	sd_read_lock(&obj_list_cache.lock);
-	if (obj_list_cache.tree_version == obj_list_cache.buf_version)
-		goto ready;
-
-	/* if that fails grab a write lock for the usually necessary update */
-	sd_rw_unlock(&obj_list_cache.lock);
-	sd_write_lock(&obj_list_cache.lock);
-	if (obj_list_cache.tree_version == obj_list_cache.buf_version)
-		goto ready;
-
-	/* Update obj_list_cache.buf indirectly to keep previous pointer */
-	newbuf = realloc(obj_list_cache.buf,
-			 obj_list_cache.cache_size * sizeof(uint64_t));
-	if (!newbuf && errno == ENOMEM) {
-		sd_err("Failed to allocate memory for object list");
-		ret = SD_RES_NO_MEM;
-		goto out;
+	return c->shard->chunks[c->idx]->oids[c->pos];
+}
+
+static void cursor_sift_down(struct objlist_cursor *heap, int nr, int i)
+{
+	for (;;) {
+		int min = i, l = 2 * i + 1, r = 2 * i + 2;
+		struct objlist_cursor tmp;
+
+		if (l < nr && cursor_oid(heap + l) < cursor_oid(heap + min))
+			min = l;
+		if (r < nr && cursor_oid(heap + r) < cursor_oid(heap + min))
+			min = r;
+		if (min == i)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
 	}
+}
+
+/*
+ * Merge the shards into 'oids' in ascending order, starting from the first
+ * oid not less than 'from'.  The caller must hold the locks of all the shards.
+ */
+static size_t merge_shards(uint64_t from, uint64_t *oids, size_t nr_max)
+{
+	struct objlist_cursor heap[NR_OBJLIST_SHARDS];
+	int nr_heap = 0;
+	size_t nr = 0;
 
-	obj_list_cache.buf_version = obj_list_cache.tree_version;
-	obj_list_cache.buf = newbuf;
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++) {
+		const struct objlist_shard *shard = objlist_shards + i;
+		uint32_t idx = shard_lower_bound(shard, from);
 
-	rb_for_each_entry(entry, &obj_list_cache.root, node) {
-		obj_list_cache.buf[nr++] = entry->oid;
+		if (idx == shard->nr_chunks)
+			continue;
+		heap[nr_heap].shard = shard;
+		heap[nr_heap].idx = idx;
+		heap[nr_heap].pos = chunk_lower_bound(shard->chunks[idx], from);
+		nr_heap++;
 	}
+	for (int i = nr_heap / 2 - 1; i >= 0; i--)
+		cursor_sift_down(heap, nr_heap, i);
+
+	while (nr_heap && nr < nr_max) {
+		struct objlist_cursor *c = heap;
+
+		oids[nr++] = cursor_oid(c);
+		if (++c->pos == c->shard->chunks[c->idx]->nr) {
+			c->pos = 0;
+			if (++c->idx == c->shard->nr_chunks)
+				*c = heap[--nr_heap];
+		}
+		cursor_sift_down(heap, nr_heap, 0);
+	}
+
+	return nr;
+}
+
+/*
+ * Copy the whole object list in ascending order.  rsp->obj.offset is set to
+ * the version of the list for the following get_obj_list_delta().
+ */
+int get_obj_list(const struct sd_req *hdr, struct sd_rsp *rsp, void *data)
+{
+	uint64_t version = uatomic_read(&objlist_version), nr = 0;
+	int ret = SD_RES_SUCCESS;
+
+	read_lock_all_shards();
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++)
+		nr += objlist_shards[i].nr_oids;
 
-ready:
-	if (hdr->data_length < obj_list_cache.cache_size * sizeof(uint64_t)) {
+	if (hdr->data_length < nr * sizeof(uint64_t)) {
 		sd_err("GET_OBJ_LIST buffer too small");
 		ret = SD_RES_BUFFER_SMALL;
 		goto out;
 	}
 
-	rsp->data_length = obj_list_cache.cache_size * sizeof(uint64_t);
-	memcpy(data, obj_list_cache.buf, rsp->data_length);
-
+	rsp->data_length = merge_shards(0, data, nr) * sizeof(uint64_t);
+	rsp->obj.offset = version;
 out:
-	sd_rw_unlock(&obj_list_cache.lock);
+	unlock_all_shards();
 	return ret;
 }
 
+/*
+ * Copy the oids starting from hdr->obj.oid in ascending order, as many as
+ * the buffer can hold.  The list ends when the page is not full.
+ */
+int get_obj_list_page(const struct sd_req *hdr, struct sd_rsp *rsp, void *data)
+{
+	size_t nr, nr_max = hdr->data_length / sizeof(uint64_t);
+
+	read_lock_all_shards();
+	nr = merge_shards(hdr->obj.oid, data, nr_max);
+	unlock_all_shards();
+
+	rsp->data_length = nr * sizeof(uint64_t);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Copy the changes of the object list since the version hdr->obj.offset, and
+ * set rsp->obj.offset to the current version.  The changes of an object are
+ * in the order they were made.  Return SD_RES_NOT_FOUND if some of the
+ * changes are no longer logged; the caller has to fetch the whole list then.
+ */
+int get_obj_list_delta(const struct sd_req *hdr, struct sd_rsp *rsp,
+		       void *data)
+{
+	uint64_t since = hdr->obj.offset, version;
+	size_t nr = 0, nr_max = hdr->data_length / sizeof(struct objlist_delta);
+	struct objlist_delta *delta = data;
+
+	/* the changes up to this version are in the logs when we lock them */
+	version = uatomic_read(&objlist_version);
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++) {
+		struct objlist_shard *shard = objlist_shards + i;
+		uint64_t head;
+		int ret = SD_RES_SUCCESS;
+
+		sd_read_lock(&shard->lock);
+		if (since < shard->log_floor) {
+			ret = SD_RES_NOT_FOUND;
+			goto unlock;
+		}
+
+		head = shard->log_head;
+		for (uint64_t j = head - min(head, (uint64_t)OBJLIST_LOG_SIZE);
+		     j < head; j++) {
+			const struct objlist_change *change =
+				shard->log + j % OBJLIST_LOG_SIZE;
+
+			if (change->version <= since ||
+			    change->version > version)
+				continue;
+			if (nr == nr_max) {
+				ret = SD_RES_BUFFER_SMALL;
+				goto unlock;
+			}
+			delta[nr].oid = change->oid;
+			delta[nr].removed = change->removed;
+			nr++;
+		}
+unlock:
+		sd_rw_unlock(&shard->lock);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	rsp->data_length = nr * sizeof(*delta);
+	rsp->obj.offset = version;
+	return SD_RES_SUCCESS;
+}
+
+/* The object spaces of a VDI except the VDI object */
+static const uint64_t objlist_vdi_spaces[] = {
+	0, VMSTATE_BIT, VDI_ATTR_BIT, VDI_BTREE_BIT, LEDGER_BIT,
+};
+
 static void objlist_deletion_work(struct work *work)
 {
 	struct objlist_deletion_work *ow =
 		container_of(work, struct objlist_deletion_work, work);
-	struct objlist_cache_entry *entry;
-	uint32_t vid = ow->vid, entry_vid;
+	uint32_t vid = ow->vid;
+	struct objlist_shard *shard = vid_to_shard(vid);
+	uint64_t base = vid_to_data_oid(vid, 0), nr = 0;
 
 	/*
 	 * Before reclaiming the cache belonging to the VDI just deleted,
@@ -163,21 +458,17 @@ static void objlist_deletion_work(struct work *work)
 		return;
 	}
 
-	sd_write_lock(&obj_list_cache.lock);
-	rb_for_each_entry(entry, &obj_list_cache.root, node) {
-		entry_vid = oid_to_vid(entry->oid);
-		if (entry_vid != vid)
-			continue;
+	/* VDI objects cannot be removed even after we delete images. */
+	sd_write_lock(&shard->lock);
+	for (int i = 0; i < ARRAY_SIZE(objlist_vdi_spaces); i++) {
+		uint64_t first = objlist_vdi_spaces[i] | base;
 
-		/* VDI objects cannot be removed even after we delete images. */
-		if (is_vdi_obj(entry->oid))
-			continue;
-
-		sd_debug("delete object entry %016" PRIx64, entry->oid);
-		rb_erase(&entry->node, &obj_list_cache.root);
-		free(entry);
+		nr += shard_remove_range(shard, first,
+					 first + MAX_DATA_OBJS - 1);
 	}
-	sd_rw_unlock(&obj_list_cache.lock);
+	sd_rw_unlock(&shard->lock);
+
+	sd_debug("deleted %"PRIu64" object entries of %"PRIx32, nr, vid);
 }
 
 static void objlist_deletion_done(struct work *work)
@@ -210,15 +501,21 @@ int objlist_cache_cleanup(uint32_t vid)
 
 void objlist_cache_format(void)
 {
-	sd_write_lock(&obj_list_cache.lock);
-	rb_destroy(&obj_list_cache.root, struct objlist_cache_entry, node);
-	INIT_RB_ROOT(&obj_list_cache.root);
-	obj_list_cache.tree_version = 1;
-	obj_list_cache.buf_version = 0;
-	if (NULL != obj_list_cache.buf) {
-		free(obj_list_cache.buf);
-		obj_list_cache.buf = NULL;
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++) {
+		struct objlist_shard *shard = objlist_shards + i;
+
+		sd_write_lock(&shard->lock);
+		for (uint32_t j = 0; j < shard->nr_chunks; j++)
+			free(shard->chunks[j]);
+		free(shard->chunks);
+		free(shard->log);
+		shard->chunks = NULL;
+		shard->log = NULL;
+		shard->nr_chunks = shard->max_chunks = 0;
+		shard->nr_oids = 0;
+		shard->log_head = 0;
+		/* the changes before the format are lost */
+		shard->log_floor = uatomic_read(&objlist_version);
+		sd_rw_unlock(&shard->lock);
 	}
-	obj_list_cache.cache_size = 0;
-	sd_rw_unlock(&obj_list_cache.lock);
 }
@@ -94,6 +94,7 @@ static int cluster_new_vdi(struct request *req)
 		.store_policy = hdr->vdi.store_policy,
 		.nr_copies = hdr->vdi.copies,
 		.block_size_shift = hdr->vdi.block_size_shift,
+		.ec_stripe_shift = hdr->vdi.ec_stripe_shift,
 		.time = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000,
 	};
 
@@ -109,6 +110,14 @@ static int cluster_new_vdi(struct request *req)
 	if (!hdr->vdi.block_size_shift)
 		iocb.block_size_shift = sys->cinfo.block_size_shift;
 
+	/* Snapshots and clones share the layout of their base VDI */
+	if (!iocb.copy_policy)
+		iocb.ec_stripe_shift = 0;
+	else if (!hdr->vdi.ec_stripe_shift && iocb.base_vid)
+		iocb.ec_stripe_shift = get_vdi_ec_stripe_shift(iocb.base_vid);
+	else if (!ec_stripe_shift_valid(iocb.ec_stripe_shift))
+		return SD_RES_INVALID_PARMS;
+
 	if (hdr->data_length != SD_MAX_VDI_LEN)
 		return SD_RES_INVALID_PARMS;
 
@@ -459,8 +468,12 @@ static int local_stat_sheep(struct request *req)
 static int local_stat_recovery(const struct sd_req *req, struct sd_rsp *rsp,
 			       void *data, const struct sd_node *sender)
 {
-	get_recovery_state(data);
-	rsp->data_length = sizeof(struct recovery_state);
+	struct recovery_state state;
+
+	/* older dog sends a smaller buffer */
+	get_recovery_state(&state);
+	rsp->data_length = min(req->data_length, (uint32_t)sizeof(state));
+	memcpy(data, &state, rsp->data_length);
 
 	return SD_RES_SUCCESS;
 }
@@ -548,6 +561,16 @@ static int local_get_obj_list(struct request *req)
 	return get_obj_list(&req->rq, &req->rp, req->data);
 }
 
+static int local_get_obj_list_page(struct request *req)
+{
+	return get_obj_list_page(&req->rq, &req->rp, req->data);
+}
+
+static int local_get_obj_list_delta(struct request *req)
+{
+	return get_obj_list_delta(&req->rq, &req->rp, req->data);
+}
+
 static int local_get_epoch(struct request *req)
 {
 	uint32_t epoch = req->rq.obj.tgt_epoch;
@@ -682,6 +705,8 @@ static int cluster_notify_vdi_add(const struct sd_req *req, struct sd_rsp *rsp,
 	add_vdi_state(req->vdi_state.new_vid, req->vdi_state.copies, false,
 		      req->vdi_state.copy_policy,
 		      req->vdi_state.block_size_shift, req->vdi_state.old_vid);
+	set_vdi_ec_stripe_shift(req->vdi_state.new_vid,
+				req->vdi_state.ec_stripe_shift);
 
 	return SD_RES_SUCCESS;
 }
@@ -862,11 +887,52 @@ static int local_get_hash(struct request *request)
 				  rsp->hash.digest);
 }
 
+static int local_get_dirty_log(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data, const struct sd_node *sender)
+{
+	size_t nr_oids;
+	int ret;
+
+	ret = dirty_log_get(req->obj.tgt_epoch, data,
+			    req->data_length / sizeof(uint64_t), &nr_oids);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	rsp->data_length = nr_oids * sizeof(uint64_t);
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_block_hash(struct request *request)
+{
+	struct sd_req *req = &request->rq;
+	struct sd_rsp *rsp = &request->rp;
+	uint64_t oid = req->obj.oid;
+	uint32_t length = get_store_objsize(oid);
+	uint32_t nr_blocks = DIV_ROUND_UP(length, SD_DELTA_BLOCK_SIZE);
+	struct siocb iocb = {};
+	int ret;
+
+	if (req->data_length < nr_blocks * SHA1_DIGEST_SIZE)
+		return SD_RES_BUFFER_SMALL;
+
+	iocb.epoch = req->obj.tgt_epoch;
+	iocb.length = length;
+	iocb.wildcard = !!(req->flags & SD_FLAG_CMD_WILDCARD);
+	ret = get_block_hash(oid, &iocb, request->data);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	rsp->data_length = nr_blocks * SHA1_DIGEST_SIZE;
+	return SD_RES_SUCCESS;
+}
+
 static int local_sd_stat(const struct sd_req *req, struct sd_rsp *rsp,
 			 void *data, const struct sd_node *sender)
 {
-	memcpy(data, &sys->stat, sizeof(struct sd_stat));
-	rsp->data_length = sizeof(struct sd_stat);
+	/* older dog sends a smaller buffer */
+	rsp->data_length = min(req->data_length,
+			       (uint32_t)sizeof(struct sd_stat));
+	memcpy(data, &sys->stat, rsp->data_length);
 	return SD_RES_SUCCESS;
 }
 
@@ -995,6 +1061,46 @@ out:
 	return ret;
 }
 
+/*
+ * Parity deltas of the concurrent writes to a stripe must not interleave
+ * between the read and the write of the parity strip.
+ */
+#define PARITY_DELTA_LOCKS 64
+
+static struct sd_mutex parity_delta_locks[PARITY_DELTA_LOCKS] = {
+	[0 ... PARITY_DELTA_LOCKS - 1] = SD_MUTEX_INITIALIZER
+};
+
+/* XOR the encoded delta of the data strips into the parity strip */
+static int peer_write_parity_delta(uint64_t oid, struct siocb *iocb)
+{
+	struct sd_mutex *lock;
+	uint8_t *delta = iocb->buf, *buf;
+	int ret;
+
+	buf = alloc_data_buffer(iocb->length);
+	if (!buf)
+		return SD_RES_NO_MEM;
+
+	lock = parity_delta_locks + sd_hash_oid(oid) % PARITY_DELTA_LOCKS;
+	sd_mutex_lock(lock);
+	iocb->buf = buf;
+	ret = sd_store->read(oid, iocb);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read parity strip %"PRIu8" of %016"PRIx64,
+		       iocb->ec_index, oid);
+		goto out;
+	}
+
+	for (uint32_t i = 0; i < iocb->length; i++)
+		buf[i] ^= delta[i];
+	ret = sd_store->write(oid, iocb);
+out:
+	sd_mutex_unlock(lock);
+	free_data_buffer(buf, iocb->length);
+	return ret;
+}
+
 static int peer_write_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
@@ -1008,6 +1114,9 @@ static int peer_write_obj(struct request *req)
 	iocb.ec_index = hdr->obj.ec_index;
 	iocb.copy_policy = hdr->obj.copy_policy;
 
+	if (hdr->flags & SD_FLAG_CMD_PARITY_DELTA)
+		return peer_write_parity_delta(oid, &iocb);
+
 	return sd_store->write(oid, &iocb);
 }
 
@@ -1204,8 +1313,8 @@ int peer_decref_object(struct request *req)
 		sd_mutex_unlock(&lock);
 		locked = false;
 
-		oid_to_nodes(ledger_oid, &req->vinfo->vroot, nr_copies,
-			     (const struct sd_node **)nodes);
+		vinfo_oid_to_nodes(ledger_oid, req->vinfo, nr_copies,
+				   (const struct sd_node **)nodes);
 
 		if (!node_cmp(&sys->this_node, nodes[0])) {
 			/* only first one node needs to remove the object */
@@ -1411,23 +1520,32 @@ static int local_get_recovery(struct request *req)
 {
 	struct recovery_throttling rthrottling;
 
+	/* older dog sends a smaller buffer */
 	rthrottling = get_recovery();
-	memcpy(req->data, &rthrottling, sizeof(rthrottling));
-	req->rp.data_length = sizeof(rthrottling);
+	req->rp.data_length = min(req->rq.data_length,
+				  (uint32_t)sizeof(rthrottling));
+	memcpy(req->data, &rthrottling, req->rp.data_length);
 
 	return SD_RES_SUCCESS;
 }
 
 static int local_set_recovery(struct request *req)
 {
-	struct recovery_throttling *rthrottling;
-
-	rthrottling = xmalloc(sizeof(struct recovery_throttling));
+	struct recovery_throttling rthrottling = get_recovery();
+	uint32_t len = min(req->rq.data_length, (uint32_t)sizeof(rthrottling));
 
-	memcpy(rthrottling, req->data, sizeof(struct recovery_throttling));
-	set_recovery(rthrottling);
+	/*
+	 * Older dog sends a smaller structure, so keep the current settings
+	 * which it doesn't know about.  'window' is placed in what was the
+	 * padding at the end of the original structure, so it has to be
+	 * ignored too unless 'target_latency' is there.
+	 */
+	if (len <= offsetof(struct recovery_throttling, target_latency))
+		len = min(len, (uint32_t)offsetof(struct recovery_throttling,
+						  window));
+	memcpy(&rthrottling, req->data, len);
+	set_recovery(&rthrottling);
 
-	free(rthrottling);
 	return SD_RES_SUCCESS;
 }
 
@@ -1677,6 +1795,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_get_obj_list,
 	},
 
+	[SD_OP_GET_OBJ_LIST_PAGE] = {
+		.name = "GET_OBJ_LIST_PAGE",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_obj_list_page,
+	},
+
+	[SD_OP_GET_OBJ_LIST_DELTA] = {
+		.name = "GET_OBJ_LIST_DELTA",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_obj_list_delta,
+	},
+
 	[SD_OP_GET_EPOCH] = {
 		.name = "GET_EPOCH",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1763,6 +1893,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_get_hash,
 	},
 
+	[SD_OP_GET_DIRTY_LOG] = {
+		.name = "GET_DIRTY_LOG",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_get_dirty_log,
+	},
+
+	[SD_OP_GET_BLOCK_HASH] = {
+		.name = "GET_BLOCK_HASH",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_block_hash,
+	},
+
 	[SD_OP_STAT] = {
 		.name = "STAT",
 		.type = SD_OP_TYPE_LOCAL,
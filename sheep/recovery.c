@@ -30,6 +30,11 @@ struct recovery_list_work {
 
 	uint64_t count;
 	uint64_t *oids;
+
+	/* objects written since dirty_from, 0 if unknown */
+	uint32_t dirty_from;
+	uint64_t nr_dirty;
+	uint64_t *dirty_oids;
 };
 
 /* for recovering objects */
@@ -42,8 +47,21 @@ struct recovery_obj_work {
 	/* local replica in the stale directory */
 	uint32_t local_epoch;
 	uint8_t local_sha1[SHA1_DIGEST_SIZE];
+	bool local_differs;
+
+	/* the dirty object list of the recovery, see local_replica_clean() */
+	uint32_t dirty_from;
+	uint64_t nr_dirty;
+	uint64_t *dirty_oids;
 
 	bool wildcard;
+
+	/* the fetched object is written by the write stage of the pipeline */
+	bool pipeline;
+	struct siocb iocb;
+
+	/* the object is stored locally, which has to be logged as a write */
+	bool stored;
 };
 
 /*
@@ -58,6 +76,7 @@ struct recovery_info {
 	uint32_t tgt_epoch;
 	uint64_t done;
 	uint64_t next;
+	uint64_t prio_end;	/* ->oids[next, prio_end) are promoted */
 
 	/*
 	 * true when automatic recovery is disabled
@@ -69,6 +88,11 @@ struct recovery_info {
 	uint64_t count;
 	uint64_t *oids;
 
+	/* objects written since dirty_from on the other nodes, 0 if unknown */
+	uint32_t dirty_from;
+	uint64_t nr_dirty;
+	uint64_t *dirty_oids;
+
 	struct vnode_info *old_vinfo;
 	struct vnode_info *cur_vinfo;
 
@@ -82,6 +106,16 @@ struct recovery_info {
 	bool wildcard;
 
 	bool cancel;		/* for avoiding disk full by recovery */
+
+	uint32_t nr_yields;	/* pauses for the foreground I/Os */
+
+	uint32_t window;	/* max objects being fetched */
+	uint32_t nr_writing;	/* objects in the write stage */
+
+	/* client I/O stats at the last adaptation of the window */
+	uint64_t adapt_time;
+	uint64_t adapt_io_nr;
+	uint64_t adapt_io_latency;
 };
 
 struct recovery_timer {
@@ -93,12 +127,70 @@ static struct recovery_info *next_rinfo;
 static main_thread(struct recovery_info *) current_rinfo;
 
 static void queue_recovery_work(struct recovery_info *rinfo);
+static void recovery_qos_pause(struct recovery_info *rinfo, uint64_t delay);
 static void free_recovery_obj_work(struct recovery_obj_work *row);
 
 /* Dynamically grown list buffer default as 4M (2T storage) */
 #define DEFAULT_LIST_BUFFER_SIZE (UINT64_C(1) << 22)
 static size_t list_buffer_size = DEFAULT_LIST_BUFFER_SIZE;
 
+/* Interval to adapt the recovery window to the client I/O latency */
+#define RECOVERY_ADAPT_INTERVAL	(UINT64_C(1000000000))	/* 1 second */
+
+/*
+ * Statistics of the source nodes, indexed by the hash of the node id.  A
+ * collision only makes the choice of the source less accurate.  The moving
+ * average of the latency is updated without a lock, so a concurrent update
+ * might be lost.
+ */
+#define NR_RECOVERY_SOURCES	256
+struct recovery_source {
+	uint32_t load;		/* number of the objects being fetched */
+	uint32_t latency;	/* moving average of the fetch time in us */
+};
+static struct recovery_source sources[NR_RECOVERY_SOURCES];
+
+/* Recovered bytes per zone of the source nodes */
+static struct sd_mutex zone_traffic_lock = SD_MUTEX_INITIALIZER;
+static struct recovery_zone_traffic zone_traffic[SD_RECOVERY_ZONES];
+static uint32_t nr_zone_traffic;
+static uint64_t other_zone_bytes;
+
+/*
+ * Recovery budgets
+ *
+ * Before an object is fetched, the bandwidth and IOPS budgets of the node and
+ * the bandwidth budget of the disk the object goes to are charged.  Each is a
+ * token bucket refilled at its rate and holding up to one second worth of
+ * tokens.  A bucket may go into debt by one object, so an object larger than
+ * the budget of a second still makes progress.  The disk buckets are indexed
+ * by the hash of the disk path; a collision makes the budget stricter.
+ *
+ * The buckets are accessed only in the main thread.
+ */
+#define NSEC_PER_SEC		UINT64_C(1000000000)
+#define NR_DISK_BUCKETS		64
+/* Pause while the foreground I/Os are queued beyond the yield depth */
+#define RECOVERY_YIELD_DELAY	(NSEC_PER_SEC / 100)	/* 10 ms */
+
+struct token_bucket {
+	double tokens;
+	uint64_t last;		/* time of the last refill in ns */
+};
+
+static struct token_bucket bandwidth_bucket, iops_bucket;
+static struct token_bucket disk_buckets[NR_DISK_BUCKETS];
+static bool qos_timer_pending;
+
+/* recovery rate reported by get_recovery_state() */
+static struct {
+	uint64_t start;
+	uint64_t bytes;
+	uint64_t objs;
+	uint64_t bandwidth;	/* bytes per second in the last second */
+	uint32_t iops;
+} qos_stat;
+
 static int obj_cmp(const uint64_t *oid1, const uint64_t *oid2)
 {
 	return intcmp(*oid1, *oid2);
@@ -209,7 +301,7 @@ again:
 		else
 			goto rollback;
 	}
-	node = oid_to_node(oid, &old->vroot, idx);
+	node = vinfo_oid_to_node(oid, old, idx);
 	sd_debug("%016"PRIx64" epoch %"PRIu32" tgt %"PRIu32" idx %d, %s",
 		 oid, epoch, tgt_epoch, idx, node_to_str(node));
 	if (invalid_node(node, rw->cur_vinfo))
@@ -250,6 +342,246 @@ done:
 	return buf;
 }
 
+static inline struct recovery_source *node_source(const struct sd_node *n)
+{
+	uint64_t hval = sd_hash(&n->nid, offsetof(typeof(n->nid), io_addr));
+
+	return sources + hval % NR_RECOVERY_SOURCES;
+}
+
+static uint64_t source_fetch_begin(const struct sd_node *n)
+{
+	uatomic_inc(&node_source(n)->load);
+	return clock_get_time();
+}
+
+static void account_zone_traffic(uint32_t zone, uint64_t bytes)
+{
+	uint32_t i;
+
+	sd_mutex_lock(&zone_traffic_lock);
+	for (i = 0; i < nr_zone_traffic; i++)
+		if (zone_traffic[i].zone == zone)
+			break;
+
+	if (i < nr_zone_traffic)
+		zone_traffic[i].bytes += bytes;
+	else if (nr_zone_traffic < SD_RECOVERY_ZONES) {
+		zone_traffic[nr_zone_traffic].zone = zone;
+		zone_traffic[nr_zone_traffic++].bytes = bytes;
+	} else
+		other_zone_bytes += bytes;
+	sd_mutex_unlock(&zone_traffic_lock);
+}
+
+/* Account the fetch of 'bytes' from the node which started at 'start' */
+static void source_fetch_end(const struct sd_node *n, uint64_t start,
+			     uint64_t bytes)
+{
+	struct recovery_source *s = node_source(n);
+	uint32_t us = (clock_get_time() - start) / 1000, avg;
+
+	uatomic_dec(&s->load);
+	if (!bytes)
+		return;
+
+	avg = uatomic_read(&s->latency);
+	uatomic_set(&s->latency, avg ? avg - avg / 8 + us / 8 : us);
+	account_zone_traffic(n->zone, bytes);
+}
+
+/* Expected time to get an object from the node, 0 if not known yet */
+static uint64_t source_cost(const struct sd_node *n)
+{
+	struct recovery_source *s = node_source(n);
+
+	return (uint64_t)uatomic_read(&s->latency) *
+		(uatomic_read(&s->load) + 1);
+}
+
+/*
+ * The local node comes first because it can link the stale replica, then the
+ * nodes in the same zone to keep recovery off the links between the zones,
+ * then the nodes expected to serve the object first.  Nodes not tried yet
+ * come before the measured ones of the same zone.
+ */
+static int source_cmp(const struct sd_node *a, const struct sd_node *b)
+{
+	bool a_local_zone = a->zone == sys->this_node.zone;
+	bool b_local_zone = b->zone == sys->this_node.zone;
+
+	if (node_is_local(a) != node_is_local(b))
+		return node_is_local(a) ? -1 : 1;
+
+	if (a_local_zone != b_local_zone)
+		return a_local_zone ? -1 : 1;
+
+	return intcmp(source_cost(a), source_cost(b));
+}
+
+/* Sort the source nodes of an object in the order to try */
+static void sort_recovery_sources(const struct sd_node **nodes, int nr)
+{
+	for (int i = 1; i < nr; i++) {
+		const struct sd_node *n = nodes[i];
+		int j;
+
+		for (j = i; j > 0 && source_cmp(nodes[j - 1], n) > 0; j--)
+			nodes[j] = nodes[j - 1];
+		nodes[j] = n;
+	}
+}
+
+/*
+ * Store the recovered object.  In the pipelined recovery, the write is left
+ * to the write stage so that the worker can go on to fetch the next object.
+ * The buffer of 'iocb' is freed either way.
+ */
+static int write_recovered_object(struct recovery_obj_work *row,
+				  struct siocb *iocb)
+{
+	int ret;
+
+	if (row->pipeline) {
+		row->iocb = *iocb;
+		return SD_RES_SUCCESS;
+	}
+
+	ret = sd_store->create_and_write(row->oid, iocb);
+	free(iocb->buf);
+	return ret;
+}
+
+static void block_hash_buffer(uint8_t *buf, uint32_t len, uint8_t *digest)
+{
+	for (uint32_t off = 0; off < len; off += SD_DELTA_BLOCK_SIZE) {
+		get_buffer_sha1(buf + off,
+				min(len - off, (uint32_t)SD_DELTA_BLOCK_SIZE),
+				digest);
+		digest += SHA1_DIGEST_SIZE;
+	}
+}
+
+/*
+ * Calculate the SHA1 digest of each SD_DELTA_BLOCK_SIZE block of the object
+ * read with 'iocb'.
+ */
+int get_block_hash(uint64_t oid, const struct siocb *iocb, uint8_t *digest)
+{
+	struct siocb rd = *iocb;
+	int ret;
+
+	rd.buf = xvalloc(iocb->length);
+	ret = sd_store->read(oid, &rd);
+	if (ret == SD_RES_SUCCESS)
+		block_hash_buffer(rd.buf, rd.length, digest);
+	free(rd.buf);
+
+	return ret;
+}
+
+/*
+ * Return true if no node has written the object since the epoch of the local
+ * stale replica, i.e. the replica can be used without comparing it with the
+ * remote one.
+ */
+static bool local_replica_clean(struct recovery_obj_work *row)
+{
+	if (!row->dirty_from || row->local_epoch < row->dirty_from)
+		return false;
+
+	return !xbsearch(&row->oid, row->dirty_oids, row->nr_dirty, obj_cmp);
+}
+
+/*
+ * Read the blocks of the object which differ from the local stale replica
+ * from the targeted node.  On success, 'buf' holds the whole object.
+ */
+static int recover_object_delta(struct recovery_obj_work *row,
+				const struct sd_node *node, uint32_t tgt_epoch,
+				bool wildcard, void *buf, uint32_t len)
+{
+	uint64_t oid = row->oid;
+	uint32_t nr_blocks = DIV_ROUND_UP(len, SD_DELTA_BLOCK_SIZE);
+	uint32_t hash_len = nr_blocks * SHA1_DIGEST_SIZE;
+	uint8_t *local = xmalloc(hash_len), *remote = xmalloc(hash_len);
+	struct siocb iocb = {};
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint64_t fetched = 0, start;
+	uint32_t i, j;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_GET_BLOCK_HASH);
+	if (wildcard)
+		hdr.flags = SD_FLAG_CMD_WILDCARD;
+	hdr.data_length = hash_len;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = tgt_epoch;
+	ret = sheep_exec_req(&node->nid, &hdr, remote);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (rsp->data_length != hash_len) {
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	iocb.epoch = row->local_epoch;
+	iocb.buf = buf;
+	iocb.length = len;
+	ret = sd_store->read(oid, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	block_hash_buffer(buf, len, local);
+
+	for (i = 0; i < nr_blocks; i = j) {
+		uint64_t off = (uint64_t)i * SD_DELTA_BLOCK_SIZE;
+		uint32_t rlen;
+
+		j = i + 1;
+		if (memcmp(local + i * SHA1_DIGEST_SIZE,
+			   remote + i * SHA1_DIGEST_SIZE, SHA1_DIGEST_SIZE) == 0)
+			continue;
+
+		/* read the run of the differing blocks at once */
+		while (j < nr_blocks &&
+		       memcmp(local + j * SHA1_DIGEST_SIZE,
+			      remote + j * SHA1_DIGEST_SIZE, SHA1_DIGEST_SIZE))
+			j++;
+		rlen = min((uint64_t)j * SD_DELTA_BLOCK_SIZE, (uint64_t)len) -
+			off;
+
+		sd_init_req(&hdr, SD_OP_READ_PEER);
+		hdr.epoch = row->base.epoch;
+		hdr.flags = SD_FLAG_CMD_RECOVERY;
+		if (wildcard)
+			hdr.flags |= SD_FLAG_CMD_WILDCARD;
+		hdr.data_length = rlen;
+		hdr.obj.oid = oid;
+		hdr.obj.tgt_epoch = tgt_epoch;
+		hdr.obj.offset = off;
+
+		start = source_fetch_begin(node);
+		ret = sheep_exec_req(&node->nid, &hdr, (char *)buf + off);
+		source_fetch_end(node, start,
+				 ret == SD_RES_SUCCESS ? rsp->data_length : 0);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		if (rsp->data_length != rlen) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+		fetched += rlen;
+	}
+
+	sd_debug("read %"PRIu64" of %"PRIu32" bytes of %016"PRIx64" from %s",
+		 fetched, len, oid, node_to_str(node));
+out:
+	free(local);
+	free(remote);
+	return ret;
+}
+
 /*
  * Read object from targeted node and store it in the local node.
  *
@@ -264,6 +596,7 @@ static int recover_object_from(struct recovery_obj_work *row,
 	uint32_t local_epoch = row->local_epoch;
 	uint8_t *sha1 = row->local_sha1;
 	uint32_t epoch = row->base.epoch;
+	uint64_t start;
 	int ret;
 	unsigned rlen;
 	void *buf = NULL;
@@ -271,8 +604,17 @@ static int recover_object_from(struct recovery_obj_work *row,
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	struct siocb iocb = { 0 };
 
+	/* nobody has written the object since we left */
+	if (local_epoch > 0 && local_replica_clean(row)) {
+		sd_debug("use clean local replica at epoch %d", local_epoch);
+		ret = sd_store->link(oid, local_epoch);
+		if (ret == SD_RES_SUCCESS)
+			return ret;
+		row->local_epoch = local_epoch = 0;
+	}
+
 	/* compare sha1 hash value first */
-	if (local_epoch > 0) {
+	if (local_epoch > 0 && !row->local_differs) {
 		sd_init_req(&hdr, SD_OP_GET_HASH);
 		hdr.obj.oid = oid;
 		hdr.obj.tgt_epoch = tgt_epoch;
@@ -286,8 +628,8 @@ static int recover_object_from(struct recovery_obj_work *row,
 			if (ret == SD_RES_SUCCESS)
 				return ret;
 		} else {
-			/* Non-identical, bury the mind */
-			row->local_epoch = 0;
+			/* Non-identical, read only the differing blocks */
+			row->local_differs = true;
 		}
 	}
 
@@ -301,6 +643,26 @@ static int recover_object_from(struct recovery_obj_work *row,
 	rlen = get_store_objsize(oid);
 	buf = xvalloc(rlen);
 
+	if (local_epoch > 0) {
+		ret = recover_object_delta(row, node, tgt_epoch, wildcard, buf,
+					   rlen);
+		switch (ret) {
+		case SD_RES_SUCCESS:
+			iocb.epoch = epoch;
+			iocb.length = rlen;
+			iocb.buf = buf;
+			return write_recovered_object(row, &iocb);
+		case SD_RES_NO_OBJ:
+		case SD_RES_OLD_NODE_VER:
+			free(buf);
+			return ret;
+		default:
+			sd_debug("failed to read the delta of %016"PRIx64", %s",
+				 oid, sd_strerror(ret));
+			break;
+		}
+	}
+
 	/* recover from remote replica */
 	sd_init_req(&hdr, SD_OP_READ_PEER);
 	hdr.epoch = epoch;
@@ -311,17 +673,20 @@ static int recover_object_from(struct recovery_obj_work *row,
 	hdr.obj.oid = oid;
 	hdr.obj.tgt_epoch = tgt_epoch;
 
+	start = source_fetch_begin(node);
 	ret = sheep_exec_req(&node->nid, &hdr, buf);
-	if (ret == SD_RES_SUCCESS) {
-		iocb.epoch = epoch;
-		iocb.length = rsp->data_length;
-		iocb.offset = rsp->obj.offset;
-		iocb.buf = buf;
-		ret = sd_store->create_and_write(oid, &iocb);
+	source_fetch_end(node, start,
+			 ret == SD_RES_SUCCESS ? rsp->data_length : 0);
+	if (ret != SD_RES_SUCCESS) {
+		free(buf);
+		return ret;
 	}
 
-	free(buf);
-	return ret;
+	iocb.epoch = epoch;
+	iocb.length = rsp->data_length;
+	iocb.offset = rsp->obj.offset;
+	iocb.buf = buf;
+	return write_recovered_object(row, &iocb);
 }
 
 static int recover_object_from_replica(struct recovery_obj_work *row,
@@ -330,34 +695,22 @@ static int recover_object_from_replica(struct recovery_obj_work *row,
 {
 	uint64_t oid = row->oid;
 	uint32_t epoch = row->base.epoch;
-	int nr_copies, ret = SD_RES_SUCCESS, start = 0;
+	int nr_copies, nr = 0, ret = SD_RES_SUCCESS;
 	bool fully_replicated = true;
+	const struct sd_node *nodes[SD_MAX_COPIES];
 
 	nr_copies = get_obj_copy_number(oid, old->nr_zones);
-
-	/* find local node first to try to recover from local */
-	for (int i = 0; i < nr_copies; i++) {
-		const struct sd_vnode *vnode;
-
-		vnode = oid_to_vnode(oid, &old->vroot, i);
-
-		if (vnode_is_local(vnode)) {
-			start = i;
-			break;
-		}
-	}
-
-	/* Let's do a breadth-first search */
 	for (int i = 0; i < nr_copies; i++) {
-		const struct sd_node *node;
-		int idx = (i + start) % nr_copies;
-
-		node = oid_to_node(oid, &old->vroot, idx);
+		const struct sd_node *node = vinfo_oid_to_node(oid, old, i);
 
 		if (invalid_node(node, row->base.cur_vinfo))
 			continue;
+		nodes[nr++] = node;
+	}
+	sort_recovery_sources(nodes, nr);
 
-		ret = recover_object_from(row, node, tgt_epoch, false);
+	for (int i = 0; i < nr; i++) {
+		ret = recover_object_from(row, nodes[i], tgt_epoch, false);
 		switch (ret) {
 		case SD_RES_SUCCESS:
 			sd_debug("recovered oid %016"PRIx64" from %d to epoch %d",
@@ -538,7 +891,7 @@ uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid)
 		return SD_MAX_COPIES;
 
 	for (idx = 0; idx < m; idx++) {
-		const struct sd_node *n = oid_to_node(oid, &vinfo->vroot, idx);
+		const struct sd_node *n = vinfo_oid_to_node(oid, vinfo, idx);
 		if (node_is_local(n))
 			return idx;
 	}
@@ -587,8 +940,7 @@ static int recover_erasure_object(struct recovery_obj_work *row)
 	iocb.offset = 0;
 	iocb.buf = buf;
 	iocb.ec_index = idx;
-	ret = sd_store->create_and_write(oid, &iocb);
-	free(buf);
+	ret = write_recovered_object(row, &iocb);
 out:
 	return ret;
 }
@@ -637,6 +989,8 @@ static void recover_object_work(struct work *work)
 	ret = do_recover_object(row);
 	if (ret != 0)
 		sd_err("failed to recover object %016"PRIx64, oid);
+	/* a pipelined object is stored by the write stage */
+	row->stored = ret == 0 && !row->iocb.buf;
 }
 
 bool node_in_recovery(void)
@@ -652,6 +1006,8 @@ static void direct_recover_object_main(struct work *work)
 						struct recovery_obj_work,
 						base);
 
+	if (row->stored)
+		dirty_log_record(row->oid, rw->epoch);
 	wakeup_requests_on_oid(row->oid);
 	free_recovery_obj_work(row);
 }
@@ -679,6 +1035,79 @@ static inline void direct_queue_recovery_work(uint64_t oid)
 	queue_work(sys->recovery_wqueue, &rw->work);
 }
 
+/* Number of the following objects of a VDI promoted on a client access */
+#define RECOVERY_READAHEAD	16
+
+static inline bool is_metadata_obj(uint64_t oid)
+{
+	return is_vdi_obj(oid) || is_vdi_btree_obj(oid) ||
+		is_ledger_object(oid);
+}
+
+/*
+ * Move the inode, btree and ledger objects to the head of the list, keeping
+ * the order of the rest.  No data of a VDI can be accessed without its inode
+ * and btree, and the removal of the shared objects needs the ledgers.
+ */
+static void prioritize_metadata(struct recovery_info *rinfo)
+{
+	uint64_t nr = 0, pos = rinfo->count, *meta;
+
+	for (uint64_t i = 0; i < rinfo->count; i++)
+		if (is_metadata_obj(rinfo->oids[i]))
+			nr++;
+	rinfo->prio_end = nr;
+	if (!nr || nr == rinfo->count)
+		return;
+
+	meta = xmalloc(nr * sizeof(*meta));
+	for (uint64_t i = rinfo->count, m = nr; i-- > 0;) {
+		uint64_t oid = rinfo->oids[i];
+
+		if (is_metadata_obj(oid))
+			meta[--m] = oid;
+		else
+			rinfo->oids[--pos] = oid;
+	}
+	memcpy(rinfo->oids, meta, nr * sizeof(*meta));
+	free(meta);
+	sd_debug("%"PRIu64" metadata objects go first", nr);
+}
+
+/*
+ * A client waits for the data object, so it will likely access the following
+ * objects of the VDI soon.  Move them after the objects promoted before so
+ * that the recovery reaches them first.
+ */
+static void promote_hot_objects(struct recovery_info *rinfo, uint64_t oid)
+{
+	uint64_t idx = data_oid_to_idx(oid), nr = 0;
+	uint32_t vid = oid_to_vid(oid);
+
+	if (!is_data_obj(oid))
+		return;
+
+	rinfo->prio_end = max(rinfo->prio_end, rinfo->next);
+	for (uint64_t i = rinfo->prio_end;
+	     i < rinfo->count && nr < RECOVERY_READAHEAD; i++) {
+		uint64_t hot = rinfo->oids[i];
+
+		if (!is_data_obj(hot) || oid_to_vid(hot) != vid ||
+		    data_oid_to_idx(hot) <= idx ||
+		    data_oid_to_idx(hot) > idx + RECOVERY_READAHEAD)
+			continue;
+
+		rinfo->oids[i] = rinfo->oids[rinfo->prio_end];
+		rinfo->oids[rinfo->prio_end++] = hot;
+		nr++;
+	}
+
+	if (nr)
+		sd_debug("promote %"PRIu64" objects after %016"PRIx64, nr,
+			 oid);
+	sys->stat.rcvy.promoted_nr += nr;
+}
+
 main_fn bool oid_in_recovery(uint64_t oid)
 {
 	struct recovery_info *rinfo = main_thread_get(current_rinfo);
@@ -729,8 +1158,10 @@ main_fn bool oid_in_recovery(uint64_t oid)
 		 * FIXME: do we need more efficient yet complex data structure?
 		 */
 		if (xlfind(&oid, rinfo->oids + rinfo->next,
-			   rinfo->count - rinfo->next + 1, oid_cmp))
+			   rinfo->count - rinfo->next + 1, oid_cmp)) {
+			promote_hot_objects(rinfo, oid);
 			break;
+		}
 
 		/*
 		 * Newly created object after prepare_object_list() might not be
@@ -759,6 +1190,7 @@ static void free_recovery_list_work(struct recovery_list_work *rlw)
 	put_vnode_info(rlw->base.cur_vinfo);
 	put_vnode_info(rlw->base.old_vinfo);
 	free(rlw->oids);
+	free(rlw->dirty_oids);
 	free(rlw);
 }
 
@@ -774,6 +1206,7 @@ static void free_recovery_info(struct recovery_info *rinfo)
 	put_vnode_info(rinfo->cur_vinfo);
 	put_vnode_info(rinfo->old_vinfo);
 	free(rinfo->oids);
+	free(rinfo->dirty_oids);
 	for (int i = 0; i < rinfo->max_epoch; i++)
 		put_vnode_info(rinfo->vinfo_array[i]);
 	free(rinfo->vinfo_array);
@@ -845,6 +1278,10 @@ static inline void finish_recovery(struct recovery_info *rinfo)
 	uint32_t recovered_epoch = rinfo->epoch;
 	main_thread_set(current_rinfo, NULL);
 
+	/* the stale replicas of the rejoin are all taken care of */
+	if (!rinfo->cancel)
+		sys->purge_epoch = 0;
+
 	wakeup_all_requests();
 
 	if (rinfo->notify_complete) {
@@ -857,8 +1294,99 @@ static inline void finish_recovery(struct recovery_info *rinfo)
 	sd_debug("recovery complete: new epoch %"PRIu32, recovered_epoch);
 }
 
+/*
+ * Refill the bucket at 'rate' per second and return the time in ns until it
+ * has tokens again, 0 if the budget is not used up.
+ */
+static uint64_t token_bucket_wait(struct token_bucket *tb, uint64_t rate,
+				  uint64_t now)
+{
+	if (!rate)
+		return 0;
+
+	if (tb->last)
+		tb->tokens += (double)(now - tb->last) * rate / NSEC_PER_SEC;
+	else
+		tb->tokens = rate;
+	tb->tokens = min(tb->tokens, (double)rate);
+	tb->last = now;
+
+	if (tb->tokens > 0)
+		return 0;
+	return (uint64_t)(-tb->tokens * NSEC_PER_SEC / rate) + 1;
+}
+
+static inline void token_bucket_charge(struct token_bucket *tb,
+				       uint64_t rate, uint64_t nr)
+{
+	if (rate)
+		tb->tokens -= nr;
+}
+
+static struct token_bucket *disk_bucket(uint64_t oid)
+{
+	const char *dir = md_get_object_dir(oid);
+
+	return disk_buckets + sd_hash(dir, strlen(dir)) % NR_DISK_BUCKETS;
+}
+
+static size_t foreground_queue_depth(void)
+{
+	return work_queue_length(sys->gateway_wqueue) +
+		work_queue_length(sys->io_wqueue) +
+		work_queue_length(sys->peer_wqueue);
+}
+
+static void qos_stat_update(uint64_t now, uint64_t bytes, uint64_t objs)
+{
+	if (now - qos_stat.start >= NSEC_PER_SEC) {
+		bool last = now - qos_stat.start < 2 * NSEC_PER_SEC;
+
+		qos_stat.bandwidth = last ? qos_stat.bytes : 0;
+		qos_stat.iops = last ? qos_stat.objs : 0;
+		qos_stat.start = now;
+		qos_stat.bytes = 0;
+		qos_stat.objs = 0;
+	}
+	qos_stat.bytes += bytes;
+	qos_stat.objs += objs;
+}
+
+/*
+ * Charge the budgets for recovering the object.  Return 0 if the object can
+ * be fetched now, otherwise the time in ns to wait for.
+ */
+static uint64_t recovery_qos_admit(struct recovery_info *rinfo, uint64_t oid)
+{
+	const struct recovery_throttling *rt = &sys->rthrottling;
+	uint64_t bandwidth = (uint64_t)rt->max_bandwidth * 1024 * 1024;
+	uint64_t disk_bandwidth = (uint64_t)rt->disk_bandwidth * 1024 * 1024;
+	uint64_t size = get_store_objsize(oid), now = clock_get_time(), wait;
+	struct token_bucket *disk = disk_bucket(oid);
+
+	if (rt->yield_depth && foreground_queue_depth() > rt->yield_depth) {
+		rinfo->nr_yields++;
+		return RECOVERY_YIELD_DELAY;
+	}
+
+	wait = token_bucket_wait(&bandwidth_bucket, bandwidth, now);
+	wait = max(wait, token_bucket_wait(&iops_bucket, rt->max_iops, now));
+	wait = max(wait, token_bucket_wait(disk, disk_bandwidth, now));
+	if (wait)
+		return wait;
+
+	token_bucket_charge(&bandwidth_bucket, bandwidth, size);
+	token_bucket_charge(&iops_bucket, rt->max_iops, 1);
+	token_bucket_charge(disk, disk_bandwidth, size);
+	qos_stat_update(now, size, 1);
+
+	return 0;
+}
+
 static void recover_next_object(struct recovery_info *rinfo)
 {
+	uint64_t wait;
+
 	if (run_next_rw())
 		return;
 
@@ -873,6 +1401,12 @@ static void recover_next_object(struct recovery_info *rinfo)
 	if (rinfo->next >= rinfo->count)
 		return;
 
+	wait = recovery_qos_admit(rinfo, rinfo->oids[rinfo->next]);
+	if (wait) {
+		recovery_qos_pause(rinfo, wait);
+		return;
+	}
+
 	/* Try recover next object */
 	queue_recovery_work(rinfo);
 	rinfo->next++;
@@ -973,6 +1507,138 @@ static void recover_next_object_delay(void *arg)
 		recover_next_object(rinfo);
 }
 
+static uint32_t default_recovery_window(void)
+{
+	/* We choose md_nr_disks() * 2 objects, no rationale. */
+	return md_nr_disks() * 2;
+}
+
+static inline uint32_t max_recovery_window(void)
+{
+	return sys->rthrottling.window ?: default_recovery_window();
+}
+
+/*
+ * Adapt the recovery window to the latency of the client I/Os in the last
+ * interval: halve the window when the average latency exceeds the target,
+ * widen it by one object otherwise.  Without a target or client I/Os, the
+ * recovery runs at the full window.
+ */
+static void adapt_recovery_window(struct recovery_info *rinfo)
+{
+	uint32_t target = sys->rthrottling.target_latency;
+	uint32_t max_window = max_recovery_window(), window = rinfo->window;
+	uint64_t now = clock_get_time(), nr, latency;
+
+	if (now - rinfo->adapt_time < RECOVERY_ADAPT_INTERVAL &&
+	    window && window <= max_window)
+		return;
+
+	nr = sys->stat.r.gway_io_done_nr - rinfo->adapt_io_nr;
+	latency = sys->stat.r.gway_io_latency - rinfo->adapt_io_latency;
+	rinfo->adapt_time = now;
+	rinfo->adapt_io_nr = sys->stat.r.gway_io_done_nr;
+	rinfo->adapt_io_latency = sys->stat.r.gway_io_latency;
+
+	if (!target || !nr)
+		window = max_window;
+	else if (latency / nr > target)
+		window = max(window / 2, 1U);
+	else
+		window = min(window + 1, max_window);
+
+	if (window != rinfo->window)
+		sd_debug("recovery window %"PRIu32" -> %"PRIu32", client I/O"
+			 " latency %"PRIu64" us", rinfo->window, window,
+			 nr ? latency / nr : 0);
+	rinfo->window = window;
+}
+
+/*
+ * Keep the window of objects being fetched full.  The objects in the write
+ * stage don't count, but they are bounded by the window as well so that the
+ * fetched data don't pile up in memory.
+ */
+static void fill_recovery_window(struct recovery_info *rinfo)
+{
+	uint64_t next;
+
+	while (rinfo->next - rinfo->done - rinfo->nr_writing < rinfo->window &&
+	       rinfo->nr_writing < rinfo->window) {
+		next = rinfo->next;
+		recover_next_object(rinfo);
+		/* the recovery might be superseded or suspended */
+		if (main_thread_get(current_rinfo) != rinfo ||
+		    rinfo->next == next)
+			break;
+	}
+}
+
+static void recovery_qos_resume(void *arg)
+{
+	struct recovery_info *rinfo = main_thread_get(current_rinfo);
+
+	qos_timer_pending = false;
+	if (!rinfo || rinfo->state != RW_RECOVER_OBJ)
+		return;
+	if (!rinfo->throttling && !sys->rthrottling.throttling)
+		fill_recovery_window(rinfo);
+}
+
+/*
+ * Retry the recovery after 'delay' ns.  With throttling, the throttling timer
+ * retries it instead.
+ */
+static void recovery_qos_pause(struct recovery_info *rinfo, uint64_t delay)
+{
+	static struct recovery_timer rt = {
+		.callback = recovery_qos_resume,
+	};
+
+	if (qos_timer_pending || rinfo->throttling ||
+	    sys->rthrottling.throttling)
+		return;
+
+	qos_timer_pending = true;
+	add_recovery_timer(&rt, DIV_ROUND_UP(delay, 1000000));
+}
+
+static void recover_object_write_work(struct work *work)
+{
+	struct recovery_work *rw = container_of(work, struct recovery_work,
+						work);
+	struct recovery_obj_work *row = container_of(rw,
+						     struct recovery_obj_work,
+						     base);
+	int ret;
+
+	ret = sd_store->create_and_write(row->oid, &row->iocb);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to recover object %016"PRIx64, row->oid);
+	row->stored = ret == SD_RES_SUCCESS;
+	free(row->iocb.buf);
+	row->iocb.buf = NULL;
+}
+
+static void finish_object_recovery(struct recovery_obj_work *row);
+
+static void recover_object_write_main(struct work *work)
+{
+	struct recovery_work *rw = container_of(work, struct recovery_work,
+						work);
+	struct recovery_obj_work *row = container_of(rw,
+						     struct recovery_obj_work,
+						     base);
+	struct recovery_info *rinfo = main_thread_get(current_rinfo);
+
+	rinfo->nr_writing--;
+	finish_object_recovery(row);
+}
+
+/*
+ * The fetch of an object is done.  Pass the object to the write stage if
+ * there is data to be written and fetch the next one in the meantime.
+ */
 static void recover_object_main(struct work *work)
 {
 	struct recovery_work *rw = container_of(work, struct recovery_work,
@@ -982,6 +1648,32 @@ static void recover_object_main(struct work *work)
 						     base);
 	struct recovery_info *rinfo = main_thread_get(current_rinfo);
 
+	if (!row->iocb.buf) {
+		finish_object_recovery(row);
+		return;
+	}
+
+	rinfo->nr_writing++;
+	rw->work.fn = recover_object_write_work;
+	rw->work.done = recover_object_write_main;
+	queue_work(sys->recovery_wqueue, &rw->work);
+
+	if (!rinfo->throttling && !sys->rthrottling.throttling)
+		fill_recovery_window(rinfo);
+}
+
+static void finish_object_recovery(struct recovery_obj_work *row)
+{
+	struct recovery_info *rinfo = main_thread_get(current_rinfo);
+
+	/*
+	 * Another node rejoining later decides from the dirty logs whether
+	 * its stale replica is up to date, so the copies made by recovery
+	 * count as writes too.
+	 */
+	if (row->stored)
+		dirty_log_record(row->oid, row->base.epoch);
+
 	/* ->oids[done, next] is out of order since finish order is random */
 	if (rinfo->oids[rinfo->done] != row->oid) {
 		uint64_t *p = xlfind(&row->oid, rinfo->oids + rinfo->done,
@@ -1008,9 +1700,10 @@ static void recover_object_main(struct work *work)
 	if (rinfo->done >= rinfo->count)
 		goto finish_recovery;
 
-	if (!rinfo->throttling && !sys->rthrottling.throttling)
-		recover_next_object(rinfo);
-	else if (!rinfo->throttling && sys->rthrottling.throttling) {
+	if (!rinfo->throttling && !sys->rthrottling.throttling) {
+		adapt_recovery_window(rinfo);
+		fill_recovery_window(rinfo);
+	} else if (!rinfo->throttling && sys->rthrottling.throttling) {
 		static struct recovery_timer rt = {
 			.callback = recover_next_object_delay,
 			.data = &rt,
@@ -1046,9 +1739,10 @@ static void finish_object_list(struct work *work)
 	 *    this node. Speedy recovery not only improve data reliability but
 	 *    also cause less writing blocking on the lost data.
 	 *
-	 * We choose md_nr_disks() * 2 threads for recovery, no rationale.
+	 * Without throttling, a window of objects are recovered at once, see
+	 * fill_recovery_window().
 	 */
-	uint32_t nr_threads = md_nr_disks() * 2;
+	uint32_t nr_threads = default_recovery_window();
 
 	if (rinfo->cancel) {
 		finish_recovery(rinfo);
@@ -1059,7 +1753,12 @@ static void finish_object_list(struct work *work)
 	rinfo->count = rlw->count;
 	rinfo->oids = rlw->oids;
 	rlw->oids = NULL;
+	rinfo->dirty_from = rlw->dirty_from;
+	rinfo->nr_dirty = rlw->nr_dirty;
+	rinfo->dirty_oids = rlw->dirty_oids;
+	rlw->dirty_oids = NULL;
 	free_recovery_list_work(rlw);
+	prioritize_metadata(rinfo);
 
 	if (run_next_rw())
 		return;
@@ -1069,23 +1768,210 @@ static void finish_object_list(struct work *work)
 		return;
 	}
 
+	if (!rinfo->throttling) {
+		rinfo->window = max_recovery_window();
+		rinfo->adapt_time = clock_get_time();
+		rinfo->adapt_io_nr = sys->stat.r.gway_io_done_nr;
+		rinfo->adapt_io_latency = sys->stat.r.gway_io_latency;
+		fill_recovery_window(rinfo);
+		return;
+	}
+
 	for (uint32_t i = 0; i < nr_threads; i++) {
-		if (rinfo->throttling) {
-			static struct recovery_timer rt = {
-				.callback = recover_next_object_delay,
-				.data = &rt,
-			};
-			add_recovery_timer(&rt, rinfo->queue_work_interval);
-		} else
-			recover_next_object(rinfo);
+		static struct recovery_timer rt = {
+			.callback = recover_next_object_delay,
+			.data = &rt,
+		};
+		add_recovery_timer(&rt, rinfo->queue_work_interval);
 	}
+}
 
-	return;
+/* Size of a page of the object list fetched from a node at once */
+#define OBJ_LIST_PAGE_SIZE	(UINT64_C(1) << 20)
+
+/* The sorted object list of a node, fetched page by page */
+struct obj_list_stream {
+	const struct sd_node *node;
+	uint32_t epoch;
+
+	uint64_t *buf;
+	size_t nr;
+	size_t pos;
+
+	uint64_t cursor;	/* the first oid of the next page */
+	bool eof;
+};
+
+/*
+ * Merge the object lists of all the nodes into one sorted list without
+ * duplicates.  'heap' is a min-heap of the streams keyed by their next oid.
+ */
+struct obj_list_merger {
+	struct obj_list_stream *streams;
+	int *heap;
+	int heap_len;
+
+	uint64_t last;
+	bool started;
+};
+
+/*
+ * Fetch the whole object list at once from a node which doesn't know the
+ * paged request, i.e. an older sheep, and skip the oids before the cursor.
+ */
+static int obj_list_stream_fill_all(struct obj_list_stream *s)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	size_t buf_size = OBJ_LIST_PAGE_SIZE;
+	int ret;
+
+retry:
+	sd_init_req(&hdr, SD_OP_GET_OBJ_LIST);
+	hdr.data_length = buf_size;
+	hdr.epoch = s->epoch;
+	ret = sheep_exec_req(&s->node->nid, &hdr, s->buf);
+	if (ret == SD_RES_BUFFER_SMALL) {
+		buf_size *= 2;
+		s->buf = xrealloc(s->buf, buf_size);
+		goto retry;
+	}
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	s->nr = sort_uniq_oids(s->buf, rsp->data_length / sizeof(uint64_t));
+	while (s->pos < s->nr && s->buf[s->pos] < s->cursor)
+		s->pos++;
+	s->eof = true;
+
+	return SD_RES_SUCCESS;
 }
 
-/* Fetch the object list from all the nodes in the cluster */
-static uint64_t *fetch_object_list(struct sd_node *e, uint32_t epoch,
-				   size_t *nr_oids)
+static bool obj_list_stream_fill(struct obj_list_stream *s)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	s->pos = s->nr = 0;
+	if (s->eof)
+		return false;
+
+	sd_init_req(&hdr, SD_OP_GET_OBJ_LIST_PAGE);
+	hdr.data_length = OBJ_LIST_PAGE_SIZE;
+	hdr.epoch = s->epoch;
+	hdr.obj.oid = s->cursor;
+	ret = sheep_exec_req(&s->node->nid, &hdr, s->buf);
+	/* older sheep answers an unknown opcode with SD_RES_INVALID_PARMS */
+	if (ret == SD_RES_NO_SUPPORT || ret == SD_RES_INVALID_PARMS) {
+		sd_info("%s has no paged object list",
+			addr_to_str(s->node->nid.addr, s->node->nid.port));
+		ret = obj_list_stream_fill_all(s);
+		if (ret == SD_RES_SUCCESS)
+			return s->pos < s->nr;
+	}
+	if (ret != SD_RES_SUCCESS) {
+		sd_alert("cannot get object list from %s",
+			 addr_to_str(s->node->nid.addr, s->node->nid.port));
+		sd_alert("some objects may be not recovered at epoch %d",
+			 s->epoch);
+		s->eof = true;
+		return false;
+	}
+
+	s->nr = rsp->data_length / sizeof(uint64_t);
+	if (s->nr < OBJ_LIST_PAGE_SIZE / sizeof(uint64_t) ||
+	    s->buf[s->nr - 1] == UINT64_MAX)
+		s->eof = true;
+	else
+		s->cursor = s->buf[s->nr - 1] + 1;
+
+	return s->nr > 0;
+}
+
+static inline uint64_t merger_head(struct obj_list_merger *m, int i)
+{
+	struct obj_list_stream *s = m->streams + m->heap[i];
+
+	return s->buf[s->pos];
+}
+
+static void merger_sift_down(struct obj_list_merger *m, int i)
+{
+	for (;;) {
+		int min = i, l = 2 * i + 1, r = 2 * i + 2, tmp;
+
+		if (l < m->heap_len && merger_head(m, l) < merger_head(m, min))
+			min = l;
+		if (r < m->heap_len && merger_head(m, r) < merger_head(m, min))
+			min = r;
+		if (min == i)
+			return;
+
+		tmp = m->heap[i];
+		m->heap[i] = m->heap[min];
+		m->heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void obj_list_merger_init(struct obj_list_merger *m,
+				 const struct sd_node *nodes, int nr_nodes,
+				 uint32_t epoch)
+{
+	memset(m, 0, sizeof(*m));
+	m->streams = xcalloc(nr_nodes, sizeof(*m->streams));
+	m->heap = xcalloc(nr_nodes, sizeof(*m->heap));
+
+	for (int i = 0; i < nr_nodes; i++) {
+		struct obj_list_stream *s = m->streams + i;
+
+		s->node = nodes + i;
+		s->epoch = epoch;
+		s->buf = xmalloc(OBJ_LIST_PAGE_SIZE);
+		if (obj_list_stream_fill(s))
+			m->heap[m->heap_len++] = i;
+	}
+
+	for (int i = m->heap_len / 2 - 1; i >= 0; i--)
+		merger_sift_down(m, i);
+}
+
+/* Get the next oid of the merged list, return false at the end of it */
+static bool obj_list_merger_next(struct obj_list_merger *m, uint64_t *oid)
+{
+	while (m->heap_len) {
+		struct obj_list_stream *s = m->streams + m->heap[0];
+		uint64_t next = s->buf[s->pos++];
+
+		if (s->pos == s->nr && !obj_list_stream_fill(s))
+			m->heap[0] = m->heap[--m->heap_len];
+		merger_sift_down(m, 0);
+
+		if (m->started && next == m->last)
+			continue;
+
+		m->started = true;
+		m->last = next;
+		*oid = next;
+		return true;
+	}
+
+	return false;
+}
+
+static void obj_list_merger_destroy(struct obj_list_merger *m,
+				    int nr_nodes)
+{
+	for (int i = 0; i < nr_nodes; i++)
+		free(m->streams[i].buf);
+	free(m->streams);
+	free(m->heap);
+}
+
+/* Fetch the objects written since 'from' epoch from the node */
+static uint64_t *fetch_dirty_log(struct sd_node *e, uint32_t from,
+				 size_t *nr_oids)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -1093,12 +1979,10 @@ static uint64_t *fetch_object_list(struct sd_node *e, uint32_t epoch,
 	uint64_t *buf = xmalloc(buf_size);
 	int ret;
 
-	sd_debug("%s", addr_to_str(e->nid.addr, e->nid.port));
-
 retry:
-	sd_init_req(&hdr, SD_OP_GET_OBJ_LIST);
+	sd_init_req(&hdr, SD_OP_GET_DIRTY_LOG);
 	hdr.data_length = buf_size;
-	hdr.epoch = epoch;
+	hdr.obj.tgt_epoch = from;
 	ret = sheep_exec_req(&e->nid, &hdr, buf);
 
 	switch (ret) {
@@ -1109,53 +1993,129 @@ retry:
 		buf = xrealloc(buf, buf_size);
 		goto retry;
 	default:
-		sd_alert("cannot get object list from %s",
-			 addr_to_str(e->nid.addr, e->nid.port));
-		sd_alert("some objects may be not recovered at epoch %d",
-			 epoch);
+		sd_info("%s has no dirty object log since epoch %"PRIu32", %s",
+			node_to_str(e), from, sd_strerror(ret));
 		free(buf);
 		return NULL;
 	}
 
 	*nr_oids = rsp->data_length / sizeof(uint64_t);
-	sd_debug("%zu", *nr_oids);
 	return buf;
 }
 
-/* Screen out objects that don't belong to this node */
-static void screen_object_list(struct recovery_list_work *rlw,
-			       uint64_t *oids, size_t nr_oids)
+/*
+ * Return the nodes which were in the cluster at any epoch between 'from' and
+ * 'to', or NULL if the node list of any of the epochs is unknown.
+ */
+static struct sd_node *get_nodes_since(uint32_t from, uint32_t to,
+				       struct vnode_info *cur_vinfo,
+				       int *nr_nodes)
+{
+	struct sd_node *buf = xmalloc(sizeof(*buf) * SD_MAX_NODES);
+	struct sd_node *nodes = NULL;
+	int nr = 0;
+
+	for (uint32_t epoch = from; epoch <= to; epoch++) {
+		int nr_epoch = get_nodes_epoch(epoch, cur_vinfo, buf,
+					       sizeof(*buf) * SD_MAX_NODES);
+
+		if (nr_epoch <= 0) {
+			sd_info("no node list of epoch %"PRIu32, epoch);
+			free(nodes);
+			nodes = NULL;
+			goto out;
+		}
+
+		for (int i = 0; i < nr_epoch; i++) {
+			if (xlfind(buf + i, nodes, nr, node_cmp))
+				continue;
+			nodes = xrealloc(nodes, sizeof(*nodes) * (nr + 1));
+			nodes[nr++] = buf[i];
+		}
+	}
+	*nr_nodes = nr;
+out:
+	free(buf);
+	return nodes;
+}
+
+/*
+ * Collect the objects written since the local replicas were moved to the
+ * stale directory on rejoin.  Every node which has been in the cluster since
+ * then has to answer, including the ones which left in the meantime, because
+ * nobody else knows what they received.  If any node can't, every stale
+ * replica is compared with the remote one as before.
+ */
+static void prepare_dirty_list(struct recovery_list_work *rlw)
 {
 	struct recovery_work *rw = &rlw->base;
-	const struct sd_vnode *vnodes[SD_MAX_COPIES];
-	uint64_t old_count = rlw->count;
-	uint64_t nr_objs;
-	uint64_t i, j;
+	uint32_t from = sys->purge_epoch;
+	size_t nr = 0, size = list_buffer_size / sizeof(uint64_t);
+	struct sd_node *nodes;
+	uint64_t *dirty;
+	int nr_nodes;
 
-	for (i = 0; i < nr_oids; i++) {
-		if (xbsearch(&oids[i], rlw->oids, old_count, obj_cmp))
-			/* the object is already scheduled to be recovered */
-			continue;
+	if (!from)
+		return;
+
+	nodes = get_nodes_since(from, rw->epoch, rw->cur_vinfo, &nr_nodes);
+	if (!nodes)
+		return;
 
-		nr_objs = get_obj_copy_number(oids[i], rw->cur_vinfo->nr_zones);
+	dirty = xmalloc(size * sizeof(uint64_t));
+	for (int i = 0; i < nr_nodes; i++) {
+		size_t nr_oids;
+		uint64_t *oids;
 
-		oid_to_vnodes(oids[i], &rw->cur_vinfo->vroot, nr_objs, vnodes);
-		for (j = 0; j < nr_objs; j++) {
-			if (!vnode_is_local(vnodes[j]))
-				continue;
+		/* this node was not in the cluster */
+		if (node_is_local(nodes + i))
+			continue;
 
-			rlw->oids[rlw->count++] = oids[i];
-			/* enlarge the list buffer if full */
-			if (rlw->count == list_buffer_size / sizeof(uint64_t)) {
-				list_buffer_size *= 2;
-				rlw->oids = xrealloc(rlw->oids,
-						     list_buffer_size);
-			}
-			break;
+		oids = fetch_dirty_log(nodes + i, from, &nr_oids);
+		if (!oids) {
+			free(dirty);
+			goto out;
 		}
+
+		if (nr + nr_oids > size) {
+			size = max(size * 2, nr + nr_oids);
+			dirty = xrealloc(dirty, size * sizeof(uint64_t));
+		}
+		memcpy(dirty + nr, oids, nr_oids * sizeof(uint64_t));
+		nr += nr_oids;
+		free(oids);
 	}
 
-	xqsort(rlw->oids, rlw->count, obj_cmp);
+	rlw->dirty_from = from;
+	rlw->nr_dirty = sort_uniq_oids(dirty, nr);
+	rlw->dirty_oids = dirty;
+	sd_info("%"PRIu64" objects were written since epoch %"PRIu32,
+		rlw->nr_dirty, from);
+out:
+	free(nodes);
+}
+
+/* Add the object to the list if it belongs to this node */
+static void screen_object(struct recovery_list_work *rlw, uint64_t oid)
+{
+	struct recovery_work *rw = &rlw->base;
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	int nr_objs;
+
+	nr_objs = get_obj_copy_number(oid, rw->cur_vinfo->nr_zones);
+	vinfo_oid_to_vnodes(oid, rw->cur_vinfo, nr_objs, vnodes);
+	for (int i = 0; i < nr_objs; i++) {
+		if (!vnode_is_local(vnodes[i]))
+			continue;
+
+		rlw->oids[rlw->count++] = oid;
+		/* enlarge the list buffer if full */
+		if (rlw->count == list_buffer_size / sizeof(uint64_t)) {
+			list_buffer_size *= 2;
+			rlw->oids = xrealloc(rlw->oids, list_buffer_size);
+		}
+		return;
+	}
 }
 
 static int vnode_to_node_idx(struct sd_vnode *vnode, int nr_nodes,
@@ -1170,76 +2130,39 @@ static int vnode_to_node_idx(struct sd_vnode *vnode, int nr_nodes,
 	return -1;		/* never executed */
 }
 
-struct seen_object_entry {
-	uint64_t oid;
-	struct rb_node node;
-};
-
-static int seen_object_cmp(const struct seen_object_entry *a,
-			   const struct seen_object_entry *b)
-{
-	return intcmp(a->oid, b->oid);
-}
-
 static bool check_diskfull_possibility(uint32_t epoch, struct vnode_info *vinfo,
 				       int nr_nodes, struct sd_node *nodes)
 {
-	uint64_t **oids_per_node;
-	size_t *nr_oids;
+	struct obj_list_merger merger;
 	uint64_t *required_space_per_node;
 	const struct sd_vnode *vnodes[SD_MAX_COPIES];
 	bool ret = false;
-	struct rb_root seen_objects = RB_ROOT;
+	uint64_t oid;
 
-	oids_per_node = xcalloc(nr_nodes, sizeof(uint64_t *));
-	nr_oids = xcalloc(nr_nodes, sizeof(size_t));
 	required_space_per_node = xcalloc(nr_nodes, sizeof(uint64_t));
 
-	for (int i = 0; i < nr_nodes; i++)
-		oids_per_node[i] = fetch_object_list(&nodes[i], epoch,
-						     &nr_oids[i]);
-
-	for (int i = 0; i < nr_nodes; i++) {
-		uint64_t *oids = oids_per_node[i];
+	obj_list_merger_init(&merger, nodes, nr_nodes, epoch);
+	while (obj_list_merger_next(&merger, &oid)) {
+		int nr_objs;
 
-		for (int j = 0; j < nr_oids[i]; j++) {
-			int nr_objs = get_obj_copy_number(oids[j],
-							  vinfo->nr_zones);
-			struct seen_object_entry *key;
+		/*
+		 * TODO: current calculation doesn't consider about space
+		 * consumption by metadata objects e.g. inode, ledger
+		 */
+		if (!is_data_obj(oid))
+			continue;
 
-			key = xzalloc(sizeof(*key));
-			key->oid = oids[j];
+		nr_objs = get_obj_copy_number(oid, vinfo->nr_zones);
+		vinfo_oid_to_vnodes(oid, vinfo, nr_objs, vnodes);
+		for (int i = 0; i < nr_objs; i++) {
+			int node_idx = vnode_to_node_idx(
+				(struct sd_vnode *)vnodes[i], nr_nodes, nodes);
 
-			if (rb_search(&seen_objects, key, node,
-				      seen_object_cmp) != NULL) {
-				free(key);
-				continue;
-			}
-			rb_insert(&seen_objects, key, node, seen_object_cmp);
-
-			oid_to_vnodes(oids[j], &vinfo->vroot, nr_objs, vnodes);
-
-			for (int k = 0; k < nr_objs; k++) {
-				int node_idx = vnode_to_node_idx(
-					(struct sd_vnode *)vnodes[k],
-					nr_nodes, nodes);
-
-				/*
-				 * TODO: current calculation doesn't consider
-				 * about space consumption by metadata objects
-				 * e.g. inode, ledger
-				 */
-				if (!is_data_obj(oids[j]))
-					continue;
-
-				required_space_per_node[node_idx] +=
-					get_vdi_object_size(
-						oid_to_vid(oids[j]));
-			}
+			required_space_per_node[node_idx] +=
+				get_vdi_object_size(oid_to_vid(oid));
 		}
 	}
-
-	rb_destroy(&seen_objects, struct seen_object_entry, node);
+	obj_list_merger_destroy(&merger, nr_nodes);
 
 	for (int i = 0; i < nr_nodes; i++) {
 		if (nodes[i].space < required_space_per_node[i]) {
@@ -1252,18 +2175,20 @@ static bool check_diskfull_possibility(uint32_t epoch, struct vnode_info *vinfo,
 			 " during next recovery (%"PRIu64")",
 			 node_to_str(&nodes[i]),
 			 nodes[i].space, required_space_per_node[i]);
-
-		free(oids_per_node[i]);
 	}
 
-	free(oids_per_node);
-	free(nr_oids);
 	free(required_space_per_node);
 
 	return ret;
 }
 
-/* Prepare the object list that belongs to this node */
+/*
+ * Prepare the object list that belongs to this node
+ *
+ * The sorted object lists of all the nodes are merged as they are fetched
+ * page by page, so the list of this node is built in order without holding
+ * the whole lists of the other nodes.
+ */
 static void prepare_object_list(struct work *work)
 {
 	struct recovery_work *rw = container_of(work, struct recovery_work,
@@ -1272,9 +2197,9 @@ static void prepare_object_list(struct work *work)
 						      struct recovery_list_work,
 						      base);
 	int nr_nodes = rw->cur_vinfo->nr_nodes;
-	int start = random() % nr_nodes, i, end = nr_nodes;
-	uint64_t *oids;
+	struct obj_list_merger merger;
 	struct sd_node *nodes;
+	uint64_t oid;
 
 	if (node_is_gateway_only())
 		return;
@@ -1295,29 +2220,17 @@ static void prepare_object_list(struct work *work)
 		goto out;
 	}
 
-again:
-	/* We need to start at random node for better load balance */
-	for (i = start; i < end; i++) {
-		size_t nr_oids;
-		struct sd_node *node = nodes + i;
+	prepare_dirty_list(rlw);
 
+	obj_list_merger_init(&merger, nodes, nr_nodes, rw->epoch);
+	while (obj_list_merger_next(&merger, &oid)) {
 		if (uatomic_read(&next_rinfo)) {
 			sd_debug("go to the next recovery");
-			goto out;
+			break;
 		}
-
-		oids = fetch_object_list(node, rw->epoch, &nr_oids);
-		if (!oids)
-			continue;
-		screen_object_list(rlw, oids, nr_oids);
-		free(oids);
-	}
-
-	if (start != 0) {
-		end = start;
-		start = 0;
-		goto again;
+		screen_object(rlw, oid);
 	}
+	obj_list_merger_destroy(&merger, nr_nodes);
 
 	sd_debug("%"PRIu64, rlw->count);
 out:
@@ -1398,6 +2311,10 @@ static void queue_recovery_work(struct recovery_info *rinfo)
 		row = xzalloc(sizeof(*row));
 		row->oid = rinfo->oids[rinfo->next];
 		row->wildcard = rinfo->wildcard;
+		row->pipeline = true;
+		row->dirty_from = rinfo->dirty_from;
+		row->nr_dirty = rinfo->nr_dirty;
+		row->dirty_oids = rinfo->dirty_oids;
 
 		rw = &row->base;
 		rw->work.fn = recover_object_work;
@@ -1428,6 +2345,17 @@ void get_recovery_state(struct recovery_state *state)
 
 	memset(state, 0, sizeof(*state));
 
+	sd_mutex_lock(&zone_traffic_lock);
+	state->nr_zones = nr_zone_traffic;
+	memcpy(state->zones, zone_traffic, sizeof(zone_traffic));
+	state->other_zone_bytes = other_zone_bytes;
+	sd_mutex_unlock(&zone_traffic_lock);
+
+	state->nr_blocked = sys->stat.rcvy.blocked_nr;
+	state->blocked_time = sys->stat.rcvy.blocked_time;
+	state->max_blocked_time = sys->stat.rcvy.blocked_max;
+	state->nr_promoted = sys->stat.rcvy.promoted_nr;
+
 	if (!rinfo) {
 		state->in_recovery = 0;
 		return;
@@ -1437,6 +2365,13 @@ void get_recovery_state(struct recovery_state *state)
 	state->state = rinfo->state;
 	state->nr_finished = rinfo->done;
 	state->nr_total = rinfo->count;
+
+	qos_stat_update(clock_get_time(), 0, 0);
+	state->bandwidth = qos_stat.bandwidth;
+	state->iops = qos_stat.iops;
+	state->max_bandwidth = sys->rthrottling.max_bandwidth;
+	state->max_iops = sys->rthrottling.max_iops;
+	state->nr_yields = rinfo->nr_yields;
 }
 
 void set_recovery(struct recovery_throttling *rthrottling)
@@ -1444,6 +2379,12 @@ void set_recovery(struct recovery_throttling *rthrottling)
 	sys->rthrottling.max_exec_count = rthrottling->max_exec_count;
 	sys->rthrottling.queue_work_interval =
 				 rthrottling->queue_work_interval;
+	sys->rthrottling.window = rthrottling->window;
+	sys->rthrottling.target_latency = rthrottling->target_latency;
+	sys->rthrottling.max_bandwidth = rthrottling->max_bandwidth;
+	sys->rthrottling.max_iops = rthrottling->max_iops;
+	sys->rthrottling.disk_bandwidth = rthrottling->disk_bandwidth;
+	sys->rthrottling.yield_depth = rthrottling->yield_depth;
 	if (rthrottling->max_exec_count > 0 &&
 	 rthrottling->queue_work_interval > 0)
 		sys->rthrottling.throttling = true;
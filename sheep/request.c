@@ -20,6 +20,14 @@
 #define TRACEPOINT_DEFINE
 #include "request_tp.h"
 
+/* Receive buffer of a client and max nr of requests parsed per wakeup */
+#define CLIENT_RX_BUF_SIZE	(64 * 1024)
+#define CLIENT_RX_BATCH		64
+
+/* Max nr of responses and their data coalesced into one write */
+#define CLIENT_TX_BATCH		64
+#define CLIENT_TX_BATCH_BYTES	(1024 * 1024)
+
 static void del_requeue_request(struct request *req)
 {
 	list_del(&req->request_list);
@@ -33,7 +41,7 @@ static bool is_access_local(struct request *req, uint64_t oid)
 	int i;
 
 	nr_copies = get_req_copy_number(req);
-	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(oid, req->vinfo, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		if (vnode_is_local(obj_vnodes[i]))
 			return true;
@@ -92,6 +100,28 @@ static inline void sleep_on_wait_queue(struct request *req)
 	list_add_tail(&req->request_list, &sys->req_wait_queue);
 }
 
+static inline void sleep_on_recovery(struct request *req)
+{
+	if (!req->blocked_time)
+		req->blocked_time = clock_get_time();
+	sleep_on_wait_queue(req);
+}
+
+/* Account the time the request waited for the recovery of its object */
+static main_fn void stat_request_unblocked(struct request *req)
+{
+	uint64_t wait;
+
+	if (!req->blocked_time)
+		return;
+
+	wait = (clock_get_time() - req->blocked_time) / 1000;
+	req->blocked_time = 0;
+	sys->stat.rcvy.blocked_nr++;
+	sys->stat.rcvy.blocked_time += wait;
+	sys->stat.rcvy.blocked_max = max(sys->stat.rcvy.blocked_max, wait);
+}
+
 static void gateway_op_done(struct work *work)
 {
 	struct request *req = container_of(work, struct request, work);
@@ -104,6 +134,7 @@ static void gateway_op_done(struct work *work)
 			 * Gateway of this node is expected to process this
 			 * request later when epoch is lifted.
 			 */
+			req->ec_full_stripe = true;
 			sleep_on_wait_queue(req);
 			return;
 		}
@@ -131,9 +162,22 @@ static void gateway_op_done(struct work *work)
 		break;
 	}
 
+	/*
+	 * A parity delta might have been applied to some strips only.  The
+	 * retry of the client would compute a new delta against the half
+	 * updated stripes, so rewrite the whole stripes once before failing.
+	 */
+	if (req->parity_delta && req->rp.result != SD_RES_SUCCESS) {
+		sd_debug("parity delta write of %016"PRIx64" failed, %s",
+			 hdr->obj.oid, sd_strerror(req->rp.result));
+		goto retry;
+	}
+
 	put_request(req);
 	return;
 retry:
+	/* make the parity consistent again, see above */
+	req->ec_full_stripe = true;
 	requeue_request(req);
 }
 
@@ -198,8 +242,19 @@ static bool request_in_recovery(struct request *req)
 		return false;
 
 	if (oid_in_recovery(req->local_oid)) {
+		/*
+		 * The gateway rather rebuilds the requested range of the
+		 * strip from the other strips than waits for the recovery of
+		 * the whole object.
+		 */
+		if (req->rq.flags & SD_FLAG_CMD_NOWAIT) {
+			sd_debug("%016"PRIx64" in recovery", req->local_oid);
+			req->rp.result = SD_RES_NO_OBJ;
+			put_request(req);
+			return true;
+		}
 		sd_debug("%016"PRIx64" wait on oid", req->local_oid);
-		sleep_on_wait_queue(req);
+		sleep_on_recovery(req);
 		return true;
 	}
 	return false;
@@ -254,6 +309,7 @@ void wakeup_requests_on_oid(uint64_t oid)
 		if (req->local_oid != oid)
 			continue;
 		sd_debug("retry %016" PRIx64, req->local_oid);
+		stat_request_unblocked(req);
 		del_requeue_request(req);
 	}
 	list_splice_init(&pending_list, &sys->req_wait_queue);
@@ -268,6 +324,7 @@ void wakeup_all_requests(void)
 
 	list_for_each_entry(req, &pending_list, request_list) {
 		sd_debug("%016"PRIx64, req->rq.obj.oid);
+		stat_request_unblocked(req);
 		del_requeue_request(req);
 	}
 }
@@ -285,9 +342,23 @@ static void queue_peer_request(struct request *req)
 	if (req->rq.flags & SD_FLAG_CMD_RECOVERY)
 		req->rq.epoch = req->rq.obj.tgt_epoch;
 
+	switch (req->rq.opcode) {
+	case SD_OP_WRITE_PEER:
+	case SD_OP_CREATE_AND_WRITE_PEER:
+	case SD_OP_REMOVE_PEER:
+	case SD_OP_DECREF_PEER:
+		dirty_log_record(req->rq.obj.oid, req->rq.epoch);
+		break;
+	}
+
 	req->work.fn = do_process_work;
 	req->work.done = io_op_done;
 
+#ifdef HAVE_LIBURING
+	if (queue_uring_request(req))
+		return;
+#endif
+
 	if (req->rq.opcode == SD_OP_REMOVE_PEER)
 		queue_work(sys->remove_peer_wqueue, &req->work);
 	else
@@ -335,6 +406,9 @@ static void queue_gateway_request(struct request *req)
 
 	req->work.fn = do_process_work;
 	req->work.done = gateway_op_done;
+#ifndef HAVE_ACCELIO
+	setup_async_gateway_request(req);
+#endif
 
 	if (hdr->opcode == SD_OP_REMOVE_OBJ)
 		queue_work(sys->remove_wqueue, &req->work);
@@ -393,10 +467,12 @@ static main_fn inline void stat_request_begin(struct request *req)
 
 		switch (hdr->opcode) {
 		case SD_OP_READ_OBJ:
+			req->start_time = clock_get_time();
 			sys->stat.r.gway_total_read_nr++;
 			break;
 		case SD_OP_WRITE_OBJ:
 		case SD_OP_CREATE_AND_WRITE_OBJ:
+			req->start_time = clock_get_time();
 			sys->stat.r.gway_total_write_nr++;
 			break;
 		case SD_OP_DISCARD_OBJ:
@@ -419,8 +495,16 @@ static main_fn inline void stat_request_end(struct request *req)
 
 	if (is_peer_op(req->op))
 		sys->stat.r.peer_active_nr--;
-	else if (is_gateway_op(req->op))
+	else if (is_gateway_op(req->op)) {
 		sys->stat.r.gway_active_nr--;
+		/* the recovery adapts its speed to the latency */
+		if (req->start_time) {
+			sys->stat.r.gway_io_done_nr++;
+			sys->stat.r.gway_io_latency +=
+				(clock_get_time() - req->start_time) / 1000;
+			req->start_time = 0;
+		}
+	}
 	else if (hdr->opcode == SD_OP_FLUSH_VDI)
 		sys->stat.r.gway_active_nr--;
 }
@@ -511,12 +595,15 @@ void requeue_request(struct request *req)
 }
 
 static void clear_client_info(struct client_info *ci);
+static void client_tx_start(struct client_info *ci);
 
 static struct request *alloc_local_request(void *data, int data_length)
 {
 	struct request *req;
 
-	req = xzalloc(sizeof(struct request));
+	req = mempool_zalloc(request_pool);
+	if (!req)
+		panic("Out of memory");
 	if (data_length) {
 		req->data_length = data_length;
 		req->data = data;
@@ -532,7 +619,7 @@ static struct request *alloc_local_request(void *data, int data_length)
 static void free_local_request(struct request *req)
 {
 	put_vnode_info(req->vinfo);
-	free(req);
+	mempool_free(request_pool, req);
 }
 
 static void submit_local_request(struct request *req)
@@ -655,15 +742,15 @@ struct request *alloc_request(struct client_info *ci, uint32_t data_length)
 {
 	struct request *req;
 
-	req = zalloc(sizeof(struct request));
+	req = mempool_zalloc(request_pool);
 	if (!req)
 		return NULL;
 
 	if (data_length) {
 		req->data_length = data_length;
-		req->data = valloc(data_length);
+		req->data = alloc_data_buffer(data_length);
 		if (!req->data) {
-			free(req);
+			mempool_free(request_pool, req);
 			return NULL;
 		}
 	}
@@ -684,8 +771,8 @@ void free_request(struct request *req)
 
 	refcount_dec(&req->ci->refcnt);
 	put_vnode_info(req->vinfo);
-	free(req->data);
-	free(req);
+	free_data_buffer(req->data, req->data_length);
+	mempool_free(request_pool, req);
 }
 
 main_fn void put_request(struct request *req)
@@ -714,8 +801,12 @@ main_fn void put_request(struct request *req)
 
 			switch (ci->type) {
 			case CLIENT_INFO_TYPE_DEFAULT:
-				if (ci->tx_req == NULL)
-					/* There is no request being sent. */
+				/*
+				 * There is no request being sent and nobody
+				 * has asked for EPOLLOUT yet.
+				 */
+				if (list_empty(&ci->tx_reqs) &&
+				    !(ci->conn.events & EPOLLOUT))
 					if (conn_tx_on(&ci->conn)) {
 						sd_err("switch on sending flag"
 						       " failure, connection"
@@ -749,157 +840,299 @@ main_fn void get_request(struct request *req)
 	refcount_inc(&req->refcnt);
 }
 
-static void rx_work(struct work *work)
+/*
+ * Read what is available on the socket into the receive buffer of the client.
+ * If 'wait' is false, return 0 instead of blocking when there is nothing to
+ * read.  Return a negative value if the connection is broken.
+ */
+static int client_rx_fill(struct client_info *ci, bool wait)
 {
-	struct client_info *ci = container_of(work, struct client_info,
-					      rx_work);
+	uint32_t len = ci->rx_tail - ci->rx_head;
 	int ret;
+
+	/* Only a part of a header is left, move it to the head of the buffer */
+	if (ci->rx_head) {
+		memmove(ci->rx_buf, ci->rx_buf + ci->rx_head, len);
+		ci->rx_head = 0;
+		ci->rx_tail = len;
+	}
+reread:
+	ret = recv(ci->conn.fd, ci->rx_buf + ci->rx_tail,
+		   CLIENT_RX_BUF_SIZE - ci->rx_tail, wait ? 0 : MSG_DONTWAIT);
+	if (ret == 0) {
+		sd_debug("connection is closed");
+		return -1;
+	}
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto reread;
+		/*
+		 * Since we set timeout for read, we'll get EAGAIN even for
+		 * blocking read.
+		 */
+		if (errno == EAGAIN) {
+			if (wait)
+				goto reread;
+			return 0;
+		}
+		sd_err("failed to read from socket: %m");
+		return -1;
+	}
+
+	ci->rx_tail += ret;
+	return ret;
+}
+
+/*
+ * Parse a request at the head of the receive buffer.  The data which isn't
+ * buffered yet is read from the socket directly into the request.
+ */
+static struct request *client_rx_request(struct client_info *ci)
+{
 	struct connection *conn = &ci->conn;
 	struct sd_req hdr;
 	struct request *req;
+	uint32_t copied;
+	int ret;
 
-	ret = do_read(conn->fd, &hdr, sizeof(hdr), NULL, 0, UINT32_MAX);
-	if (ret) {
-		sd_debug("failed to read a header");
-		conn->dead = true;
-		return;
-	}
+	memcpy(&hdr, ci->rx_buf + ci->rx_head, sizeof(hdr));
+	ci->rx_head += sizeof(hdr);
 
 	req = alloc_request(ci, hdr.data_length);
 	if (!req) {
 		sd_err("failed to allocate request");
 		conn->dead = true;
-		return;
+		return NULL;
 	}
-	ci->rx_req = req;
+	list_add_tail(&req->request_list, &ci->rx_reqs);
 
 	/* use le_to_cpu */
 	memcpy(&req->rq, &hdr, sizeof(req->rq));
 
 	if (hdr.data_length && hdr.flags & SD_FLAG_CMD_WRITE) {
-		ret = do_read(conn->fd, req->data, hdr.data_length, NULL, 0,
-			      UINT32_MAX);
-		if (ret) {
-			sd_err("failed to read data");
-			conn->dead = true;
+		copied = min(hdr.data_length, ci->rx_tail - ci->rx_head);
+		memcpy(req->data, ci->rx_buf + ci->rx_head, copied);
+		ci->rx_head += copied;
+
+		if (copied < hdr.data_length) {
+			ret = do_read(conn->fd, (char *)req->data + copied,
+				      hdr.data_length - copied, NULL, 0,
+				      UINT32_MAX);
+			if (ret) {
+				sd_err("failed to read data");
+				conn->dead = true;
+				return NULL;
+			}
 		}
 	}
 
-	tracepoint(request, rx_work, conn->fd, work, req, hdr.opcode);
+	tracepoint(request, rx_work, conn->fd, &ci->rx_work, req, hdr.opcode);
+
+	return req;
+}
+
+static inline bool client_rx_buffered(struct client_info *ci)
+{
+	return ci->rx_tail - ci->rx_head >= sizeof(struct sd_req);
+}
+
+/*
+ * Wait for one request and then take all the requests which are already
+ * available on the socket, so that a client which pipelines small requests
+ * costs one wakeup and a few reads per batch.
+ */
+static void rx_work(struct work *work)
+{
+	struct client_info *ci = container_of(work, struct client_info,
+					      rx_work);
+	int ret, nr = 0;
+
+	while (nr < CLIENT_RX_BATCH) {
+		if (!client_rx_buffered(ci)) {
+			ret = client_rx_fill(ci, nr == 0);
+			if (ret < 0) {
+				ci->conn.dead = true;
+				return;
+			}
+			if (ret == 0)
+				break;
+			continue;
+		}
+
+		if (!client_rx_request(ci))
+			return;
+		nr++;
+	}
 }
 
 static void rx_main(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
 					      rx_work);
-	struct request *req = ci->rx_req;
+	struct request *req;
+	LIST_HEAD(reqs);
 
-	ci->rx_req = NULL;
+	list_splice_init(&ci->rx_reqs, &reqs);
 
 	refcount_dec(&ci->refcnt);
 
 	if (ci->conn.dead) {
-		if (req)
+		list_for_each_entry(req, &reqs, request_list) {
+			list_del(&req->request_list);
 			free_request(req);
+		}
 
 		clear_client_info(ci);
 		return;
 	}
 
-	if (conn_rx_on(&ci->conn))
+	/*
+	 * If the batch was cut short, the rest of the requests are already in
+	 * the buffer and the socket might not become readable again.
+	 */
+	if (client_rx_buffered(ci)) {
+		refcount_inc(&ci->refcnt);
+		queue_work(sys->net_wqueue, &ci->rx_work);
+	} else if (conn_rx_on(&ci->conn))
 		sd_err("switch on receiving flag failure, "
 				"connection maybe closed");
 
-	if (is_logging_op(get_sd_op(req->rq.opcode))) {
-		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, data=%s",
-			req,
-			ci->conn.fd,
-			ci->conn.ipstr, ci->conn.port,
-			op_name(get_sd_op(req->rq.opcode)),
-			data_to_str(req->data, req->rq.data_length));
-	} else {
-		sd_debug("%d, %s:%d",
-			 ci->conn.fd,
-			 ci->conn.ipstr,
-			 ci->conn.port);
-	}
+	list_for_each_entry(req, &reqs, request_list) {
+		list_del(&req->request_list);
 
-	tracepoint(request, rx_main, ci->conn.fd, work, req);
-	queue_request(req);
+		if (is_logging_op(get_sd_op(req->rq.opcode))) {
+			sd_info("req=%p, fd=%d, client=%s:%d, op=%s, data=%s",
+				req,
+				ci->conn.fd,
+				ci->conn.ipstr, ci->conn.port,
+				op_name(get_sd_op(req->rq.opcode)),
+				data_to_str(req->data, req->rq.data_length));
+		} else {
+			sd_debug("%d, %s:%d",
+				 ci->conn.fd,
+				 ci->conn.ipstr,
+				 ci->conn.port);
+		}
+
+		tracepoint(request, rx_main, ci->conn.fd, work, req);
+		queue_request(req);
+	}
 }
 
 static void tx_work(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
 					      tx_work);
-	int ret;
+	int ret, nr = 0, iovcnt = 0;
 	struct connection *conn = &ci->conn;
-	struct sd_rsp rsp;
-	struct request *req = ci->tx_req;
-	void *data = NULL;
+	struct sd_rsp rsps[CLIENT_TX_BATCH];
+	struct iovec iov[CLIENT_TX_BATCH * 2];
+	struct request *req;
 
-	/* use cpu_to_le */
-	memcpy(&rsp, &req->rp, sizeof(rsp));
+	list_for_each_entry(req, &ci->tx_reqs, request_list) {
+		struct sd_rsp *rsp = rsps + nr++;
 
-	rsp.epoch = sys->cinfo.epoch;
-	rsp.opcode = req->rq.opcode;
-	rsp.id = req->rq.id;
+		/* use cpu_to_le */
+		memcpy(rsp, &req->rp, sizeof(*rsp));
 
-	if (rsp.data_length)
-		data = req->data;
+		rsp->epoch = sys->cinfo.epoch;
+		rsp->opcode = req->rq.opcode;
+		rsp->id = req->rq.id;
 
-	ret = send_req(conn->fd, (struct sd_req *)&rsp, data, rsp.data_length,
-		       NULL, 0, UINT32_MAX);
+		iov[iovcnt].iov_base = rsp;
+		iov[iovcnt].iov_len = sizeof(*rsp);
+		iovcnt++;
+		if (rsp->data_length) {
+			iov[iovcnt].iov_base = req->data;
+			iov[iovcnt].iov_len = rsp->data_length;
+			iovcnt++;
+		}
+
+		tracepoint(request, tx_work, conn->fd, work, req);
+	}
+
+	ret = do_writev(conn->fd, iov, iovcnt, UINT32_MAX);
 	if (ret != 0) {
-		sd_err("failed to send a request");
+		sd_err("failed to send %d responses", nr);
 		conn->dead = true;
 	}
-
-	tracepoint(request, tx_work, conn->fd, work, req);
 }
 
 static void tx_main(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
 					      tx_work);
-
-	tracepoint(request, tx_main, ci->conn.fd, work, ci->tx_req);
+	struct request *req;
 
 	refcount_dec(&ci->refcnt);
 
-	if (is_logging_op(ci->tx_req->op)) {
-		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, result=%02X",
-			ci->tx_req,
-			ci->conn.fd,
-			ci->conn.ipstr,
-			ci->conn.port,
-			op_name(ci->tx_req->op),
-			ci->tx_req->rp.result);
-	} else {
-		sd_debug("%d, %s:%d",
-			 ci->conn.fd,
-			 ci->conn.ipstr,
-			 ci->conn.port);
-	}
+	list_for_each_entry(req, &ci->tx_reqs, request_list) {
+		tracepoint(request, tx_main, ci->conn.fd, work, req);
+
+		if (is_logging_op(req->op)) {
+			sd_info("req=%p, fd=%d, client=%s:%d, op=%s, "
+				"result=%02X",
+				req,
+				ci->conn.fd,
+				ci->conn.ipstr,
+				ci->conn.port,
+				op_name(req->op),
+				req->rp.result);
+		} else {
+			sd_debug("%d, %s:%d",
+				 ci->conn.fd,
+				 ci->conn.ipstr,
+				 ci->conn.port);
+		}
 
-	free_request(ci->tx_req);
-	ci->tx_req = NULL;
+		list_del(&req->request_list);
+		free_request(req);
+	}
 
 	if (ci->conn.dead) {
 		clear_client_info(ci);
 		return;
 	}
 
+	/* Responses done while sending go out without waiting for EPOLLOUT */
 	if (!list_empty(&ci->done_reqs))
-		if (conn_tx_on(&ci->conn))
-			sd_err("switch on sending flag failure, "
-					"connection maybe closed");
+		client_tx_start(ci);
+}
+
+/* Send the done requests of the client in one batch */
+static void client_tx_start(struct client_info *ci)
+{
+	struct request *req;
+	size_t bytes = 0;
+	int nr = 0;
+
+	list_for_each_entry(req, &ci->done_reqs, request_list) {
+		if (nr == CLIENT_TX_BATCH ||
+		    (nr && bytes + req->rp.data_length > CLIENT_TX_BATCH_BYTES))
+			break;
+
+		list_del(&req->request_list);
+		list_add_tail(&req->request_list, &ci->tx_reqs);
+		bytes += sizeof(req->rp) + req->rp.data_length;
+		nr++;
+	}
+
+	/*
+	 * Increment refcnt so that the client_info isn't freed while
+	 * tx_work uses it.
+	 */
+	refcount_inc(&ci->refcnt);
+	ci->tx_work.fn = tx_work;
+	ci->tx_work.done = tx_main;
+	tracepoint(request, queue_request, ci->conn.fd, &ci->tx_work, 0);
+	queue_work(sys->net_wqueue, &ci->tx_work);
 }
 
 static void destroy_client(struct client_info *ci)
 {
 	sd_debug("connection from: %s:%d", ci->conn.ipstr, ci->conn.port);
 	close(ci->conn.fd);
+	free(ci->rx_buf);
 	free(ci);
 }
 
@@ -957,10 +1190,18 @@ static struct client_info *create_client(int fd)
 		break;
 	}
 
+	ci->rx_buf = malloc(CLIENT_RX_BUF_SIZE);
+	if (!ci->rx_buf) {
+		free(ci);
+		return NULL;
+	}
+
 	ci->conn.fd = fd;
 	ci->conn.events = EPOLLIN;
 	refcount_set(&ci->refcnt, 0);
 
+	INIT_LIST_HEAD(&ci->rx_reqs);
+	INIT_LIST_HEAD(&ci->tx_reqs);
 	INIT_LIST_HEAD(&ci->done_reqs);
 
 	tracepoint(request, create_client, fd);
@@ -1009,20 +1250,8 @@ static void client_handler(int fd, int events, void *data)
 			return;
 		}
 
-		sd_assert(ci->tx_req == NULL);
-		ci->tx_req = list_first_entry(&ci->done_reqs, struct request,
-					      request_list);
-		list_del(&ci->tx_req->request_list);
-
-		/*
-		 * Increment refcnt so that the client_info isn't freed while
-		 * tx_work uses it.
-		 */
-		refcount_inc(&ci->refcnt);
-		ci->tx_work.fn = tx_work;
-		ci->tx_work.done = tx_main;
-		tracepoint(request, queue_request, fd, &ci->tx_work, 0);
-		queue_work(sys->net_wqueue, &ci->tx_work);
+		sd_assert(list_empty(&ci->tx_reqs));
+		client_tx_start(ci);
 	}
 }
 
@@ -1165,6 +1394,20 @@ worker_fn int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr,
 
 	struct sockfd *sfd;
 
+	if (sys->mux_conns) {
+		if (mux_exec_req(nid, hdr, buf) != SD_RES_SUCCESS) {
+			sd_debug("remote node might have gone away");
+			return SD_RES_NETWORK_ERROR;
+		}
+		ret = rsp->result;
+		if (ret != SD_RES_SUCCESS)
+			sd_warn("failed %s, remote address: %s, op name: %s",
+				sd_strerror(ret),
+				addr_to_str(nid->addr, nid->port),
+				op_name(get_sd_op(hdr->opcode)));
+		return ret;
+	}
+
 	sfd = sockfd_cache_get(nid);
 	if (!sfd)
 		return SD_RES_NETWORK_ERROR;
@@ -23,6 +23,8 @@
 #define EPOLL_SIZE 4096
 #define DEFAULT_OBJECT_DIR "/tmp"
 #define LOG_FILE_NAME "sheep.log"
+#define DEFAULT_FD_CACHE_SIZE 4096
+#define MAX_MUX_CONNS 64
 
 LIST_HEAD(cluster_drivers);
 static const char program_name[] = "sheep";
@@ -59,6 +61,17 @@ static const char http_help[] =
 "communicate with http server, using 64MB buffer.\n";
 #endif
 
+#ifdef HAVE_LIBURING
+static const char uring_help[] =
+"Available arguments:\n"
+"\tdepth=: number of entries of each submission queue (default: 128)\n"
+"\trings=: number of rings, each of which is polled by a thread (default: 2)\n"
+"\nExample:\n\t$ sheep -U depth=256,rings=4 ...\n"
+"This tries to execute the peer read and write requests with io_uring, using\n"
+"4 rings of depth 256. The requests to the store drivers which don't support\n"
+"asynchronous I/O (pack and raw) are still processed by the worker threads.\n";
+#endif
+
 static const char myaddr_help[] =
 "Example:\n\t$ sheep -y 192.168.1.1 ...\n"
 "This tries to tell other nodes through what address they can talk to this\n"
@@ -117,7 +130,43 @@ static const char recovery_help[] =
 "Available arguments:\n"
 "\tmax=: object recovery process maximum count of each interval\n"
 "\tinterval=: object recovery interval time (millisec)\n"
-"Example:\n\t$ sheep -R max=50,interval=1000 ...\n";
+"\twindow=: maximum number of objects recovered in parallel without\n"
+"\t         throttling (default: twice the number of disks)\n"
+"\tlatency=: client I/O latency (microsec) that recovery narrows its\n"
+"\t          window to keep\n"
+"\tbandwidth=: recovery bandwidth (MB/s) of the node\n"
+"\tiops=: recovered objects per second of the node\n"
+"\tdisk_bandwidth=: recovery bandwidth (MB/s) of each disk\n"
+"\tyield=: pause recovery while more foreground requests are queued\n"
+"Example:\n\t$ sheep -R max=50,interval=1000 ...\n"
+"\t$ sheep -R window=64,latency=5000 ...\n"
+"\t$ sheep -R bandwidth=200,iops=100,yield=32 ...\n";
+
+static const char zerocopy_help[] =
+"Example:\n\t$ sheep -Z 64K ...\n"
+"\tforward the writes of 64KB or larger to the other nodes with\n"
+"\tMSG_ZEROCOPY instead of copying the payload into the socket buffer\n"
+"\tof every target. This requires Linux 4.14 or later, and can't be\n"
+"\tused with -M, whose shared connections always copy the payload.\n";
+
+#ifndef HAVE_ACCELIO
+static const char mux_help[] =
+"Example:\n\t$ sheep -M 2 ...\n"
+"\tsend the requests to each of the other nodes over 2 shared\n"
+"\tconnections instead of one cached connection per request.\n"
+"\tObject writes are then forwarded asynchronously, without\n"
+"\toccupying a gateway thread until the replicas respond.\n"
+"\tThe number must be between 1 and 64.\n";
+#endif
+
+static const char wq_help[] =
+"Example:\n\t$ sheep -w gway=8,peer=stealing ...\n"
+"Available workqueues:\n"
+"\tnet, gway, io, peer, reclaim, gway_fwd, remove, remove_peer,\n"
+"\trecovery and async\n"
+"\tA number makes the workqueue have the fixed number of threads.\n"
+"\t'stealing' gives it a thread per core, each with its own queue,\n"
+"\tand idle threads steal work from the others.\n";
 
 static const char vnodes_help[] =
 "Example:\n\t$ sheep -V 128\n"
@@ -131,6 +180,8 @@ static struct sd_option sheep_options[] = {
 	 cluster_help},
 	{'D', "directio", false, "use direct IO for backend store"},
 	{'f', "foreground", false, "make the program run in foreground"},
+	{'F', "fd-cache", true, "specify the max number of cached object "
+	 "file descriptors (default: 4096, 0: disabled)"},
 	{'g', "gateway", false, "make the program run as a gateway mode"},
 	{'h', "help", false, "display this help and exit"},
 	{'i', "ioaddr", true, "use separate network card to handle IO requests"
@@ -140,6 +191,10 @@ static struct sd_option sheep_options[] = {
 	{'l', "log", true,
 	 "specify the log level, the log directory and the log format"
 	 "(log level default: 6 [SDOG_INFO])", log_help},
+#ifndef HAVE_ACCELIO
+	{'M', "mux", true, "specify the number of multiplexed connections "
+	 "per node for the peer requests (default: disabled)", mux_help},
+#endif
 	{'n', "nosync", false, "drop O_SYNC for write of backend"},
 	{'p', "port", true, "specify the TCP port on which to listen "
 	 "(default: 7000)"},
@@ -151,9 +206,14 @@ static struct sd_option sheep_options[] = {
 	{'R', "recovery", true, "specify the recovery speed throttling",
 	 recovery_help},
 	{'u', "upgrade", false, "upgrade to the latest data layout"},
+#ifdef HAVE_LIBURING
+	{'U', "uring", true, "use io_uring for the peer I/O path "
+	 "(default: disabled)", uring_help},
+#endif
 	{'v', "version", false, "show the version"},
 	{'V', "vnodes", true, "set number of vnodes", vnodes_help},
-	{'w', "wq-threads", true, "specify a number of threads for workqueue"},
+	{'w', "wq-threads", true, "specify a number of threads for workqueue",
+	 wq_help},
 	{'W', "wildcard-recovery", false, "wildcard recovery for first time"},
 	{'x', "max-dynamic-threads", true,
 	 "specify the maximum number of threads for dynamic workqueue"},
@@ -162,6 +222,8 @@ static struct sd_option sheep_options[] = {
 	{'z', "zone", true,
 	 "specify the zone id (default: determined by listen address)",
 	 zone_help},
+	{'Z', "zerocopy", true, "specify the minimum size of the writes "
+	 "forwarded with MSG_ZEROCOPY (default: disabled)", zerocopy_help},
 	{ 0, NULL, false, NULL },
 };
 
@@ -348,73 +410,83 @@ static struct option_parser log_parsers[] = {
 	{ NULL, NULL },
 };
 
+#define WQ_THREADS_STEALING (-1)
+
+static int parse_wq_threads(const char *s)
+{
+	if (!strcmp(s, "stealing"))
+		return WQ_THREADS_STEALING;
+
+	return atoi(s);
+}
+
 static int wq_net_threads;
 static int wq_net_parser(const char *s)
 {
-	wq_net_threads = atoi(s);
+	wq_net_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_gway_threads;
 static int wq_gway_parser(const char *s)
 {
-	wq_gway_threads = atoi(s);
+	wq_gway_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_io_threads;
 static int wq_io_parser(const char *s)
 {
-	wq_io_threads = atoi(s);
+	wq_io_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_peer_threads;
 static int wq_peer_parser(const char *s)
 {
-	wq_peer_threads = atoi(s);
+	wq_peer_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_reclaim_threads;
 static int wq_reclaim_parser(const char *s)
 {
-	wq_reclaim_threads = atoi(s);
+	wq_reclaim_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_gway_fwd_threads;
 static int wq_gway_fwd_parser(const char *s)
 {
-	wq_gway_fwd_threads = atoi(s);
+	wq_gway_fwd_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_remove_threads;
 static int wq_remove_parser(const char *s)
 {
-	wq_remove_threads = atoi(s);
+	wq_remove_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_remove_peer_threads;
 static int wq_remove_peer_parser(const char *s)
 {
-	wq_remove_peer_threads = atoi(s);
+	wq_remove_peer_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_recovery_threads;
 static int wq_recovery_parser(const char *s)
 {
-	wq_recovery_threads = atoi(s);
+	wq_recovery_threads = parse_wq_threads(s);
 	return 0;
 }
 
 static int wq_async_threads;
 static int wq_async_parser(const char *s)
 {
-	wq_async_threads = atoi(s);
+	wq_async_threads = parse_wq_threads(s);
 	return 0;
 }
 
@@ -512,12 +584,104 @@ static int queue_work_interval_parser(const char *s)
 	return 0;
 }
 
+static int recovery_window_parser(const char *s)
+{
+	sys->rthrottling.window = str_to_u32(s);
+	if (errno != 0) {
+		sd_err("invalid recovery window '%s'", s);
+		return -1;
+	}
+	return 0;
+}
+
+static int recovery_latency_parser(const char *s)
+{
+	sys->rthrottling.target_latency = str_to_u32(s);
+	if (errno != 0) {
+		sd_err("invalid recovery latency '%s'", s);
+		return -1;
+	}
+	return 0;
+}
+
+static int recovery_budget_parser(const char *s, uint32_t *budget,
+				  const char *name)
+{
+	*budget = str_to_u32(s);
+	if (errno != 0) {
+		sd_err("invalid recovery %s '%s'", name, s);
+		return -1;
+	}
+	return 0;
+}
+
+static int recovery_bandwidth_parser(const char *s)
+{
+	return recovery_budget_parser(s, &sys->rthrottling.max_bandwidth,
+				      "bandwidth");
+}
+
+static int recovery_iops_parser(const char *s)
+{
+	return recovery_budget_parser(s, &sys->rthrottling.max_iops, "iops");
+}
+
+static int recovery_disk_bandwidth_parser(const char *s)
+{
+	return recovery_budget_parser(s, &sys->rthrottling.disk_bandwidth,
+				      "disk bandwidth");
+}
+
+static int recovery_yield_parser(const char *s)
+{
+	return recovery_budget_parser(s, &sys->rthrottling.yield_depth,
+				      "yield depth");
+}
+
 static struct option_parser recovery_parsers[] = {
 	{ "max=", max_exec_count_parser },
 	{ "interval=", queue_work_interval_parser },
+	{ "window=", recovery_window_parser },
+	{ "latency=", recovery_latency_parser },
+	{ "bandwidth=", recovery_bandwidth_parser },
+	{ "iops=", recovery_iops_parser },
+	{ "disk_bandwidth=", recovery_disk_bandwidth_parser },
+	{ "yield=", recovery_yield_parser },
 	{ NULL, NULL },
 };
 
+#ifdef HAVE_LIBURING
+static bool use_uring;
+static uint32_t uring_depth = 128;
+static int uring_rings = 2;
+
+static int uring_depth_parser(const char *s)
+{
+	uring_depth = str_to_u32(s);
+	if (errno != 0 || uring_depth < 1) {
+		sd_err("invalid io_uring depth '%s'", s);
+		return -1;
+	}
+	return 0;
+}
+
+static int uring_rings_parser(const char *s)
+{
+	uring_rings = atoi(s);
+	if (uring_rings < 1) {
+		sd_err("invalid number of io_uring rings '%s'", s);
+		return -1;
+	}
+	return 0;
+}
+
+static struct option_parser uring_parsers[] = {
+	{ "depth=", uring_depth_parser },
+	{ "rings=", uring_rings_parser },
+	{ NULL, NULL },
+};
+#endif
+
 static size_t get_nr_nodes(void)
 {
 	struct vnode_info *vinfo;
@@ -531,6 +695,25 @@ static size_t get_nr_nodes(void)
 	return nr;
 }
 
+/*
+ * Create a work queue with 'nr_threads' threads, or a dynamic one if it is
+ * zero, or a work stealing one if it is WQ_THREADS_STEALING.
+ */
+static struct work_queue *create_sheep_work_queue(const char *name,
+						  int nr_threads)
+{
+	if (nr_threads == WQ_THREADS_STEALING) {
+		sd_info("%s workqueue is created as work stealing", name);
+		return create_work_queue(name, WQ_STEALING);
+	} else if (nr_threads) {
+		sd_info("# of threads in %s workqueue: %d", name, nr_threads);
+		return create_fixed_work_queue(name, nr_threads);
+	}
+
+	sd_info("%s workqueue is created as dynamic", name);
+	return create_work_queue(name, WQ_DYNAMIC);
+}
+
 static int create_work_queues(void)
 {
 	struct work_queue *util_wq;
@@ -538,79 +721,25 @@ static int create_work_queues(void)
 	if (init_work_queue(get_nr_nodes))
 		return -1;
 
-	if (wq_net_threads) {
-		sd_info("# of threads in net workqueue: %d", wq_net_threads);
-		sys->net_wqueue = create_fixed_work_queue("net", wq_net_threads);
-	} else {
-		sd_info("net workqueue is created as dynamic");
-		sys->net_wqueue = create_work_queue("net", WQ_DYNAMIC);
-	}
-	if (wq_gway_threads) {
-		sd_info("# of threads in gway workqueue: %d", wq_gway_threads);
-		sys->gateway_wqueue = create_fixed_work_queue("gway", wq_gway_threads);
-	} else {
-		sd_info("gway workqueue is created as dynamic");
-		sys->gateway_wqueue = create_work_queue("gway", WQ_DYNAMIC);
-	}
-	if (wq_io_threads) {
-		sd_info("# of threads in io workqueue: %d", wq_io_threads);
-		sys->io_wqueue = create_fixed_work_queue("io", wq_io_threads);
-	} else {
-		sd_info("io workqueue is created as dynamic");
-		sys->io_wqueue = create_work_queue("io", WQ_DYNAMIC);
-	}
-	if (wq_peer_threads) {
-		sd_info("# of threads in peer workqueue: %d", wq_peer_threads);
-		sys->peer_wqueue = create_fixed_work_queue("peer", wq_peer_threads);
-	} else {
-		sd_info("peer workqueue is created as dynamic");
-		sys->peer_wqueue = create_work_queue("peer", WQ_DYNAMIC);
-	}
-	if (wq_reclaim_threads) {
-		sd_info("# of threads in reclaim workqueue: %d", wq_reclaim_threads);
-		sys->reclaim_wqueue = create_fixed_work_queue("reclaim", wq_reclaim_threads);
-	} else {
-		sd_info("reclaim workqueue is created as dynamic");
-		sys->reclaim_wqueue = create_work_queue("reclaim", WQ_DYNAMIC);
-	}
-	if (wq_gway_fwd_threads) {
-		sd_info("# of threads in gway_fwd workqueue: %d", wq_gway_fwd_threads);
-		sys->gateway_fwd_wqueue = create_fixed_work_queue("gway_fwd", wq_gway_fwd_threads);
-	} else {
-		sd_info("gway_fwd workqueue is created as dynamic");
-		sys->gateway_fwd_wqueue = create_work_queue("gway_fwd", WQ_DYNAMIC);
-	}
-	if (wq_remove_threads) {
-		sd_info("# of threads in remove workqueue: %d", wq_remove_threads);
-		sys->remove_wqueue = create_fixed_work_queue("remove", wq_remove_threads);
-	} else {
-		sd_info("remove workqueue is created as dynamic");
-		sys->remove_wqueue = create_work_queue("remove", WQ_DYNAMIC);
-	}
-	if (wq_remove_peer_threads) {
-		sd_info("# of threads in remove_peer workqueue: %d", wq_remove_peer_threads);
-		sys->remove_peer_wqueue = create_fixed_work_queue("remove_peer", wq_remove_peer_threads);
-	} else {
-		sd_info("remove_peer workqueue is created as dynamic");
-		sys->remove_peer_wqueue = create_work_queue("remove_peer", WQ_DYNAMIC);
-	}
-	if (wq_recovery_threads) {
-		sd_info("# of threads in rw workqueue: %d", wq_recovery_threads);
-		sys->recovery_wqueue = create_fixed_work_queue("rw", wq_recovery_threads);
-	} else {
-		sd_info("recovery workqueue is created as dynamic");
-		sys->recovery_wqueue = create_work_queue("rw", WQ_DYNAMIC);
-	}
+	sys->net_wqueue = create_sheep_work_queue("net", wq_net_threads);
+	sys->gateway_wqueue = create_sheep_work_queue("gway", wq_gway_threads);
+	sys->io_wqueue = create_sheep_work_queue("io", wq_io_threads);
+	sys->peer_wqueue = create_sheep_work_queue("peer", wq_peer_threads);
+	sys->reclaim_wqueue = create_sheep_work_queue("reclaim",
+						      wq_reclaim_threads);
+	sys->gateway_fwd_wqueue = create_sheep_work_queue("gway_fwd",
+							  wq_gway_fwd_threads);
+	sys->remove_wqueue = create_sheep_work_queue("remove",
+						     wq_remove_threads);
+	sys->remove_peer_wqueue = create_sheep_work_queue("remove_peer",
+							  wq_remove_peer_threads);
+	sys->recovery_wqueue = create_sheep_work_queue("rw",
+						       wq_recovery_threads);
 	sys->deletion_wqueue = create_ordered_work_queue("deletion");
 	sys->block_wqueue = create_ordered_work_queue("block");
 	sys->md_wqueue = create_ordered_work_queue("md");
-	if (wq_async_threads) {
-		sd_info("# of threads in async_req workqueue: %d", wq_async_threads);
-		sys->areq_wqueue = create_fixed_work_queue("async_req", wq_async_threads);
-	} else {
-		sd_info("async_req workqueue is created as dynamic");
-		sys->areq_wqueue = create_work_queue("async_req", WQ_DYNAMIC);
-	}
+	sys->areq_wqueue = create_sheep_work_queue("async_req",
+						   wq_async_threads);
 	if (!sys->gateway_wqueue || !sys->io_wqueue || !sys->recovery_wqueue ||
 	    !sys->deletion_wqueue || !sys->block_wqueue || !sys->md_wqueue ||
 	    !sys->areq_wqueue || !sys->peer_wqueue || !sys->reclaim_wqueue ||
@@ -782,6 +911,8 @@ int main(int argc, char **argv)
 	int32_t nr_vnodes = -1;
 	int64_t zone = -1;
 	uint32_t max_dynamic_threads = 0;
+	uint32_t fd_cache_size = DEFAULT_FD_CACHE_SIZE;
+	uint64_t zerocopy_size;
 	struct cluster_driver *cdrv;
 	struct option *long_options;
 #ifdef HAVE_HTTP
@@ -843,6 +974,15 @@ int main(int argc, char **argv)
 		case 'f':
 			daemonize = false;
 			break;
+		case 'F':
+			fd_cache_size = str_to_u32(optarg);
+			if (errno != 0) {
+				sd_err("Invalid fd cache size '%s': must be "
+				       "an integer between 0 and %"PRIu32,
+				       optarg, UINT32_MAX);
+				exit(1);
+			}
+			break;
 		case 'g':
 			if (nr_vnodes > 0) {
 				sd_err("Options '-g' and '-V' can not be both specified");
@@ -860,9 +1000,39 @@ int main(int argc, char **argv)
 			}
 			sys->this_node.zone = zone;
 			break;
+#ifndef HAVE_ACCELIO
+		case 'M':
+			sys->mux_conns = str_to_u32(optarg);
+			if (errno != 0 || sys->mux_conns < 1 ||
+			    sys->mux_conns > MAX_MUX_CONNS) {
+				sd_err("Invalid number of connections '%s': "
+				       "must be between 1 and %d", optarg,
+				       MAX_MUX_CONNS);
+				exit(1);
+			}
+			break;
+#endif
+		case 'Z':
+			if (option_parse_size(optarg, &zerocopy_size) < 0)
+				exit(1);
+			if (zerocopy_size == 0 || zerocopy_size > UINT32_MAX) {
+				sd_err("Invalid zerocopy size '%s': must be "
+				       "between 1 and %"PRIu32" bytes", optarg,
+				       UINT32_MAX);
+				exit(1);
+			}
+			sys->zerocopy_threshold = zerocopy_size;
+			break;
 		case 'u':
 			sys->upgrade = true;
 			break;
+#ifdef HAVE_LIBURING
+		case 'U':
+			if (option_parse(optarg, ",", uring_parsers) < 0)
+				exit(1);
+			use_uring = true;
+			break;
+#endif
 		case 'c':
 			sys->cdrv = find_cdrv(optarg);
 			if (!sys->cdrv) {
@@ -987,6 +1157,12 @@ int main(int argc, char **argv)
 	} else if (nr_vnodes == -1)
 		nr_vnodes = SD_DEFAULT_VNODES;
 
+	if (sys->mux_conns && sys->zerocopy_threshold) {
+		sd_err("zerocopy (-Z) can't be used with multiplexed "
+		       "connections (-M)");
+		exit(1);
+	}
+
 	if (optind != argc) {
 		argp = strdup(argv[optind]);
 		dirp = strtok(argv[optind], ",");
@@ -1148,6 +1324,8 @@ int main(int argc, char **argv)
 	}
 
 	init_fec();
+	fd_cache_init(fd_cache_size);
+	mempool_init();
 
 	/*
 	 * After this function, we are multi-threaded.
@@ -1164,10 +1342,21 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_journal;
 
+#ifndef HAVE_ACCELIO
+	if (sys->mux_conns && gateway_async_init() != 0)
+		goto cleanup_journal;
+#endif
+
 	ret = init_store_driver(sys->gateway_only);
 	if (ret)
 		goto cleanup_journal;
 
+#ifdef HAVE_LIBURING
+	if (use_uring && !sys->gateway_only &&
+	    uring_init(uring_depth, uring_rings) != 0)
+		goto cleanup_journal;
+#endif
+
 	ret = trace_init();
 	if (ret)
 		goto cleanup_journal;
@@ -1203,6 +1392,7 @@ int main(int argc, char **argv)
 
 	rc = 0;
 	sd_info("shutdown");
+	md_close_object_index();
 
 cleanup_pid_file:
 	if (pid_file)
@@ -76,10 +76,14 @@ struct client_info {
 
 	struct connection conn;
 
-	struct request *rx_req;
+	/* received bytes which are not parsed yet are in [rx_head, rx_tail) */
+	char *rx_buf;
+	uint32_t rx_head;
+	uint32_t rx_tail;
+	struct list_head rx_reqs;
 	struct work rx_work;
 
-	struct request *tx_req;
+	struct list_head tx_reqs;
 	struct work tx_work;
 
 	struct list_head done_reqs;
@@ -100,7 +104,9 @@ enum REQUST_STATUS {
 
 enum store_id {
 	PLAIN_STORE,
-	TREE_STORE
+	TREE_STORE,
+	PACK_STORE,
+	RAW_STORE
 };
 
 struct request_iocb {
@@ -109,6 +115,47 @@ struct request_iocb {
 	int result;
 };
 
+/*
+ * An object I/O prepared by the store driver for asynchronous execution.
+ * 'entry' holds the file descriptor of the object and must be put once the
+ * data transfer has finished.
+ */
+struct store_aio {
+	struct fd_cache_entry *entry;
+	void *buf;
+	uint32_t length;
+	uint64_t offset;
+};
+
+#ifdef HAVE_LIBURING
+struct uring_ring;
+
+/* State of a peer request which is executed on io_uring */
+struct uring_io {
+	struct store_aio aio;
+	bool write;
+	uint32_t done;		/* bytes transferred so far */
+	int result;		/* cqe->res of the last completion */
+	work_func_t end_io;	/* called in the main thread at the end */
+	struct uring_ring *ring;
+	struct list_node list;
+};
+#endif
+
+struct gateway_async;
+
+/* Per replica buffer of a gateway request */
+struct req_iter {
+	uint8_t *buf;
+	uint32_t wlen;
+	uint32_t dlen;
+	uint64_t off;
+	int idx;		/* ec_index of the forwarded request */
+	bool parity_delta;	/* XOR the data into the parity strip */
+	bool nowait;		/* don't wait for recovery of the strip */
+	int result;		/* of the forwarded request */
+};
+
 struct request {
 	struct sd_req rq;
 	struct sd_rsp rp;
@@ -133,6 +180,15 @@ struct request {
 	struct work work;
 	enum REQUST_STATUS status;
 	bool stat; /* true if this request is during stat */
+	uint64_t start_time; /* in ns, for the latency of gateway I/Os */
+	uint64_t blocked_time; /* in ns, when it began to wait for recovery */
+	bool ec_full_stripe; /* don't write erasure parity deltas */
+	bool parity_delta; /* the write is sent as parity deltas */
+
+#ifdef HAVE_LIBURING
+	struct uring_io uio;
+#endif
+	struct gateway_async *gw_async;
 };
 
 struct system_info {
@@ -182,8 +238,14 @@ struct system_info {
 
 	uatomic_bool use_journal;
 	bool backend_dio;
+	/* forward writes of at least this size with MSG_ZEROCOPY, 0: off */
+	uint32_t zerocopy_threshold;
+	/* number of multiplexed connections per peer, 0: use sockfd cache */
+	int mux_conns;
 	/* upgrade data layout before starting service if necessary*/
 	bool upgrade;
+	/* epoch of the objects moved to the stale directory on rejoin */
+	uint32_t purge_epoch;
 	struct sd_stat stat;
 };
 
@@ -191,6 +253,8 @@ struct disk {
 	struct rb_node rb;
 	char path[PATH_MAX];
 	uint64_t space;
+	struct obj_index *index;
+	bool raw;		/* a block device or a file, not a directory */
 };
 
 struct vdisk {
@@ -211,6 +275,16 @@ extern struct md md;
 
 void update_node_disks(void);
 
+struct fd_cache_entry {
+	struct hlist_node hash;
+	struct list_node lru;
+	uint64_t oid;
+	uint8_t ec_index;
+	int flags;
+	int fd;
+	refcnt_t refcnt;
+};
+
 struct siocb {
 	uint32_t epoch;
 	void *buf;
@@ -234,6 +308,7 @@ struct vdi_iocb {
 	uint8_t store_policy;
 	uint8_t nr_copies;
 	uint8_t block_size_shift;
+	uint8_t ec_stripe_shift;
 	uint64_t time;
 };
 
@@ -258,12 +333,22 @@ struct store_driver {
 	int (*format)(void);
 	int (*remove_object)(uint64_t oid, uint8_t ec_index);
 	int (*get_hash)(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+	int (*sync)(uint64_t oid, uint8_t ec_index);
 	/* Operations in recovery */
 	int (*link)(uint64_t oid, uint32_t tgt_epoch);
 	int (*update_epoch)(uint32_t epoch);
 	int (*purge_obj)(void);
 	/* Operations for snapshot */
 	int (*cleanup)(void);
+	/* Operations for asynchronous I/O */
+	int (*prepare_read)(uint64_t oid, const struct siocb *,
+			    struct store_aio *);
+	int (*prepare_write)(uint64_t oid, const struct siocb *,
+			     struct store_aio *);
+	int (*io_error)(uint64_t oid, const struct siocb *, bool write,
+			ssize_t result, int err);
+	/* Called after md removed the disk, by unplug or EIO */
+	void (*unplug)(const char *path);
 };
 
 /* backend store */
@@ -282,6 +367,13 @@ int default_format(void);
 int default_remove_object(uint64_t oid, uint8_t ec_index);
 int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
 int default_purge_obj(void);
+int default_sync(uint64_t oid, uint8_t ec_index);
+int default_prepare_read(uint64_t oid, const struct siocb *iocb,
+			 struct store_aio *aio);
+int default_prepare_write(uint64_t oid, const struct siocb *iocb,
+			  struct store_aio *aio);
+int default_io_error(uint64_t oid, const struct siocb *iocb, bool write,
+		     ssize_t result, int err);
 
 int tree_init(void);
 bool tree_exist(uint64_t oid, uint8_t ec_index);
@@ -295,6 +387,13 @@ int tree_format(void);
 int tree_remove_object(uint64_t oid, uint8_t ec_index);
 int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
 int tree_purge_obj(void);
+int tree_sync(uint64_t oid, uint8_t ec_index);
+int tree_prepare_read(uint64_t oid, const struct siocb *iocb,
+		      struct store_aio *aio);
+int tree_prepare_write(uint64_t oid, const struct siocb *iocb,
+		       struct store_aio *aio);
+int tree_io_error(uint64_t oid, const struct siocb *iocb, bool write,
+		  ssize_t result, int err);
 
 int for_each_object_in_wd(int (*func)(uint64_t, const char *, uint32_t,
 				      uint8_t, struct vnode_info *, void *),
@@ -304,6 +403,8 @@ int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 					 struct vnode_info *, void *arg),
 			     void *arg);
 int for_each_obj_path(int (*func)(const char *path));
+int md_load_objects(int (*func)(uint64_t, const char *, uint32_t, uint8_t,
+				struct vnode_info *, void *), void *);
 size_t get_store_objsize(uint64_t oid);
 
 extern struct list_head store_drivers;
@@ -360,6 +461,9 @@ int get_vdi_copy_number(uint32_t vid);
 int get_vdi_copy_policy(uint32_t vid);
 uint32_t get_vdi_object_size(uint32_t vid);
 uint8_t get_vdi_block_size_shift(uint32_t vid);
+uint8_t get_vdi_ec_stripe_shift(uint32_t vid);
+uint32_t get_vdi_ec_stripe_size(uint32_t vid);
+void set_vdi_ec_stripe_shift(uint32_t vid, uint8_t shift);
 int get_obj_copy_number(uint64_t oid, int nr_zones);
 int get_req_copy_number(struct request *req);
 int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
@@ -433,6 +537,24 @@ void queue_cluster_request(struct request *req);
 int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create);
 int err_to_sderr(const char *path, uint64_t oid, int err);
 int discard(int fd, uint64_t start, uint32_t end);
+
+/* helpers for the stores which keep an object in a file */
+typedef int (*obj_path_fn)(uint64_t oid, uint8_t ec_index, char *path);
+int file_store_prepare_write(obj_path_fn get_path, uint64_t oid,
+			     const struct siocb *iocb, struct store_aio *aio);
+int file_store_prepare_read(obj_path_fn get_path, uint64_t oid,
+			    const struct siocb *iocb, struct store_aio *aio);
+int file_store_io_error(obj_path_fn get_path, uint64_t oid,
+			const struct siocb *iocb, bool write, ssize_t result,
+			int err);
+int file_store_write(obj_path_fn get_path, uint64_t oid,
+		     const struct siocb *iocb);
+int file_store_read(obj_path_fn get_path, uint64_t oid,
+		    const struct siocb *iocb);
+int file_store_sync(obj_path_fn get_path, uint64_t oid, uint8_t ec_index);
+
+uint64_t get_raw_disk_size(int fd);
+int raw_plug_disk(const char *path);
 bool store_id_match(enum store_id id);
 
 int update_epoch_log(uint32_t epoch, struct sd_node *nodes, size_t nr_nodes);
@@ -461,6 +583,8 @@ void init_config_path(const char *base_path);
 int init_node_config_file(void);
 int init_config_file(void);
 int get_obj_list(const struct sd_req *, struct sd_rsp *, void *);
+int get_obj_list_page(const struct sd_req *, struct sd_rsp *, void *);
+int get_obj_list_delta(const struct sd_req *, struct sd_rsp *, void *);
 int objlist_cache_cleanup(uint32_t vid);
 void objlist_cache_format(void);
 
@@ -472,6 +596,16 @@ void get_recovery_state(struct recovery_state *state);
 void set_recovery(struct recovery_throttling *rthrottling);
 struct recovery_throttling get_recovery(void);
 
+/* granularity of the block hashes for the delta recovery */
+#define SD_DELTA_BLOCK_SIZE	(64 * 1024)
+int get_block_hash(uint64_t oid, const struct siocb *iocb, uint8_t *digest);
+
+void dirty_log_init(uint32_t epoch);
+void dirty_log_record(uint64_t oid, uint32_t epoch);
+int dirty_log_get(uint32_t from, uint64_t *oids, size_t nr_max,
+		  size_t *nr_oids);
+size_t sort_uniq_oids(uint64_t *oids, size_t nr);
+
 int sd_write_object(uint64_t oid, char *data, unsigned int datalen,
 		    uint64_t offset, bool create);
 int sd_write_object_fwd(uint64_t oid, char *data, unsigned int datalen,
@@ -551,6 +685,10 @@ int gateway_write_obj(struct request *req);
 int gateway_create_and_write_obj(struct request *req);
 int gateway_remove_obj(struct request *req);
 int gateway_decref_object(struct request *req);
+#ifndef HAVE_ACCELIO
+void setup_async_gateway_request(struct request *req);
+int gateway_async_init(void);
+#endif
 
 bool is_erasure_oid(uint64_t oid);
 uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid);
@@ -581,8 +719,8 @@ bool sheep_need_retry(uint32_t epoch);
 /* journal_file.c */
 int journal_file_init(const char *path, size_t size, bool skip);
 void clean_journal_file(const char *p);
-int
-journal_write_store(uint64_t oid, const char *buf, size_t size, off_t, bool);
+int journal_write_store(uint64_t oid, uint8_t ec_index, const char *buf,
+			size_t size, off_t, bool);
 int journal_remove_object(uint64_t oid);
 
 /* md.c */
@@ -597,6 +735,92 @@ int md_plug_disks(char *disks);
 int md_unplug_disks(char *disks);
 uint64_t md_get_size(uint64_t *used);
 uint32_t md_nr_disks(void);
+void md_index_object(const char *path, bool removed);
+void md_reset_object_index(void);
+void md_close_object_index(void);
+
+/* obj_index.c */
+struct obj_index_entry {
+	uint64_t oid;
+	uint8_t ec_index;
+};
+
+int obj_index_read(const char *dir, struct obj_index_entry **entries,
+		   size_t *nr_entries, uint64_t *generation);
+int obj_index_discard(const char *dir);
+struct obj_index *obj_index_start(const char *dir, uint64_t generation,
+				  const struct obj_index_entry *entries,
+				  size_t nr);
+void obj_index_record(struct obj_index *idx, uint64_t oid, uint8_t ec_index,
+		      bool removed);
+void obj_index_reset(struct obj_index *idx);
+void obj_index_close(struct obj_index *idx, bool clean);
+
+/* fd_cache.c */
+void fd_cache_init(size_t max_entries);
+struct fd_cache_entry *fd_cache_get(uint64_t oid, uint8_t ec_index, int flags,
+				    uint64_t *gen);
+struct fd_cache_entry *fd_cache_add(uint64_t oid, uint8_t ec_index, int flags,
+				    int fd, uint64_t gen);
+void fd_cache_put(struct fd_cache_entry *entry);
+void fd_cache_invalidate(uint64_t oid);
+void fd_cache_invalidate_all(void);
+
+/* mempool.c */
+struct mempool;
+extern struct mempool *request_pool, *req_iter_pool;
+void mempool_init(void);
+struct mempool *mempool_create(const char *name, size_t size);
+void *mempool_alloc(struct mempool *pool);
+void *mempool_zalloc(struct mempool *pool);
+void mempool_free(struct mempool *pool, void *obj);
+void *alloc_data_buffer(size_t len);
+void free_data_buffer(void *buf, size_t len);
+
+/* uring.c */
+#ifdef HAVE_LIBURING
+int uring_init(uint32_t depth, int nr_rings);
+bool queue_uring_request(struct request *req);
+#endif
+
+/* mux.c */
+struct mux_conn;
+
+/* A request sent over the multiplexed peer connections */
+struct mux_req {
+	/* set by the caller */
+	void *buf;		/* buffer for the response data */
+	uint32_t buflen;
+	void (*done)(struct mux_req *);
+	void *private;
+
+	/* valid when done() is called */
+	int result;		/* SD_RES_NETWORK_ERROR if the transport failed */
+	struct sd_rsp rsp;
+
+	bool completed;		/* protected by mux_waiter.lock */
+	uint32_t id;
+	struct mux_conn *conn;
+	struct hlist_node hash;
+};
+
+struct mux_waiter {
+	struct sd_mutex lock;
+	struct sd_cond cond;
+	int nr_pending;
+};
+
+void mux_submit(const struct node_id *nid, struct mux_req *mreq,
+		struct sd_req *hdr, void *data, uint32_t wlen);
+void mux_waiter_init(struct mux_waiter *w);
+void mux_submit_wait(const struct node_id *nid, struct mux_waiter *w,
+		     struct mux_req *mreq, struct sd_req *hdr, void *data,
+		     uint32_t wlen);
+void mux_wait(struct mux_waiter *w, struct mux_req *mreqs, int nr,
+	      uint32_t epoch);
+void mux_req_abort(struct mux_req *mreq);
+int mux_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf);
+void mux_del_node(const struct node_id *nid);
 
 static inline bool is_stale_path(const char *path)
 {
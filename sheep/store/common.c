@@ -98,6 +98,253 @@ int discard(int fd, uint64_t start, uint32_t end)
 	return ret;
 }
 
+/*
+ * The following helpers are shared by the stores which keep each object in a
+ * file, i.e. plain and tree.  They differ only in where the file is, which is
+ * told by 'get_path'.
+ */
+
+/*
+ * Get the file descriptor of the object from the fd cache, or open the object
+ * file and add it to the cache.  The returned entry must be released with
+ * fd_cache_put().
+ */
+static struct fd_cache_entry *file_store_open(obj_path_fn get_path,
+					      uint64_t oid, uint8_t ec_index,
+					      int flags)
+{
+	struct fd_cache_entry *entry;
+	char path[PATH_MAX];
+	uint64_t gen;
+	int fd;
+
+	entry = fd_cache_get(oid, ec_index, flags, &gen);
+	if (entry)
+		return entry;
+
+	get_path(oid, ec_index, path);
+
+	/*
+	 * Make sure oid is in the right place because oid might be misplaced
+	 * in a wrong place, due to 'shutdown/restart with less/more disks' or
+	 * any bugs. We need call err_to_sderr() to return EIO if disk is broken
+	 */
+	if (!md_exist(oid, ec_index, path))
+		return ERR_PTR(-err_to_sderr(path, oid, ENOENT));
+
+	fd = open(path, flags, sd_def_fmode);
+	if (unlikely(fd < 0))
+		return ERR_PTR(-err_to_sderr(path, oid, errno));
+
+	return fd_cache_add(oid, ec_index, flags, fd, gen);
+}
+
+/* Trim zero blocks of the beginning and end of the object. */
+static int file_store_trim(int fd, uint64_t oid, const struct siocb *iocb,
+			   uint64_t *poffset, uint32_t *plen)
+{
+	trim_zero_blocks(iocb->buf, poffset, plen);
+
+	if (iocb->offset < *poffset) {
+		sd_debug("discard between %d, %ld, %016" PRIx64, iocb->offset,
+			 *poffset, oid);
+
+		if (discard(fd, iocb->offset, *poffset) < 0)
+			return -1;
+	}
+
+	if (*poffset + *plen < iocb->offset + iocb->length) {
+		uint64_t end = iocb->offset + iocb->length;
+		uint32_t object_size = get_vdi_object_size(oid_to_vid(oid));
+		if (end == get_objsize(oid, object_size))
+			/* This is necessary to punch the last block */
+			end = round_up(end, BLOCK_SIZE);
+		sd_debug("discard between %ld, %ld, %016" PRIx64, *poffset + *plen,
+			 end, oid);
+
+		if (discard(fd, *poffset + *plen, end) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Prepare a write of the object.  Everything but the data transfer itself is
+ * done here: the epoch check, journaling, opening the object and discarding
+ * the zero blocks at both ends of the buffer.
+ */
+int file_store_prepare_write(obj_path_fn get_path, uint64_t oid,
+			     const struct siocb *iocb, struct store_aio *aio)
+{
+	int flags = prepare_iocb(oid, iocb, false);
+	struct fd_cache_entry *entry;
+	uint32_t len = iocb->length;
+	uint64_t offset = iocb->offset;
+	static bool trim_is_supported = true;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	if (uatomic_is_true(&sys->use_journal) &&
+	    unlikely(journal_write_store(oid, iocb->ec_index, iocb->buf,
+					 iocb->length, iocb->offset, false))
+	    != SD_RES_SUCCESS) {
+		sd_err("turn off journaling");
+		uatomic_set_false(&sys->use_journal);
+		flags |= O_DSYNC;
+		sync();
+	}
+
+	entry = file_store_open(get_path, oid, iocb->ec_index, flags);
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+
+	if (trim_is_supported && is_sparse_object(oid)) {
+		if (file_store_trim(entry->fd, oid, iocb, &offset, &len) < 0) {
+			trim_is_supported = false;
+			offset = iocb->offset;
+			len = iocb->length;
+		}
+	}
+
+	aio->entry = entry;
+	aio->buf = iocb->buf;
+	aio->length = len;
+	aio->offset = offset;
+
+	return SD_RES_SUCCESS;
+}
+
+/* Prepare a read of the object, i.e. open it */
+int file_store_prepare_read(obj_path_fn get_path, uint64_t oid,
+			    const struct siocb *iocb, struct store_aio *aio)
+{
+	int flags = prepare_iocb(oid, iocb, false);
+	struct fd_cache_entry *entry;
+
+	entry = file_store_open(get_path, oid, iocb->ec_index, flags);
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+
+	aio->entry = entry;
+	aio->buf = iocb->buf;
+	aio->length = iocb->length;
+	aio->offset = iocb->offset;
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Handle a failed data transfer of a prepared I/O.  The cached file descriptor
+ * is dropped because the object file might be gone or the disk be broken.
+ */
+int file_store_io_error(obj_path_fn get_path, uint64_t oid,
+			const struct siocb *iocb, bool write, ssize_t result,
+			int err)
+{
+	char path[PATH_MAX];
+
+	get_path(oid, iocb->ec_index, path);
+	sd_err("failed to %s object %016"PRIx64", path=%s, offset=%"PRId32
+	       ", size=%"PRId32", result=%zd, %s", write ? "write" : "read",
+	       oid, path, iocb->offset, iocb->length, result, strerror(err));
+	fd_cache_invalidate(oid);
+	return err_to_sderr(path, oid, err);
+}
+
+int file_store_write(obj_path_fn get_path, uint64_t oid,
+		     const struct siocb *iocb)
+{
+	struct store_aio aio = {};
+	ssize_t size;
+	int ret;
+
+	ret = file_store_prepare_write(get_path, oid, iocb, &aio);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	size = xpwrite(aio.entry->fd, aio.buf, aio.length, aio.offset);
+	if (unlikely(size != aio.length))
+		ret = file_store_io_error(get_path, oid, iocb, true, size,
+					  errno);
+
+	fd_cache_put(aio.entry);
+	return ret;
+}
+
+/* Read the object of the current epoch through the fd cache */
+int file_store_read(obj_path_fn get_path, uint64_t oid,
+		    const struct siocb *iocb)
+{
+	struct store_aio aio = {};
+	ssize_t size;
+	int ret;
+
+	ret = file_store_prepare_read(get_path, oid, iocb, &aio);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	size = xpread(aio.entry->fd, aio.buf, aio.length, aio.offset);
+	if (size < 0)
+		ret = file_store_io_error(get_path, oid, iocb, false, size,
+					  errno);
+
+	fd_cache_put(aio.entry);
+	return ret;
+}
+
+/* Flush the data of the object to the disk */
+int file_store_sync(obj_path_fn get_path, uint64_t oid, uint8_t ec_index)
+{
+	char path[PATH_MAX];
+	int fd, ret = SD_RES_SUCCESS;
+
+	get_path(oid, ec_index, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return SD_RES_NO_OBJ;
+		sd_err("failed to open %s, %m", path);
+		return SD_RES_EIO;
+	}
+
+	if (fdatasync(fd) < 0) {
+		sd_err("failed to sync %s, %m", path);
+		ret = SD_RES_EIO;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/* Return the size of a block device or a regular file, or 0 on error */
+uint64_t get_raw_disk_size(int fd)
+{
+	struct stat s;
+	off_t size;
+
+	if (fstat(fd, &s) < 0) {
+		sd_err("failed to stat, %m");
+		return 0;
+	}
+	if (!S_ISREG(s.st_mode) && !S_ISBLK(s.st_mode)) {
+		sd_err("not a block device or a regular file");
+		return 0;
+	}
+
+	/* works for the block devices too, unlike st_size */
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		sd_err("failed to get the size, %m");
+		return 0;
+	}
+
+	return size;
+}
+
 bool store_id_match(enum store_id id)
 {
 	return (sd_store->id == id);
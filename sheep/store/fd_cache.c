@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Object file descriptor cache
+ *
+ * Opening and closing an object file for every read and write request means a
+ * path lookup, an access(2) for the md placement check and an open/close pair
+ * per I/O. The store drivers keep the file descriptors of recently accessed
+ * objects here instead.
+ *
+ * The cache is split into FD_CACHE_SHARDS shards, each of which has its own
+ * lock, hash table and LRU list, so that worker threads touching different
+ * objects rarely contend. Entries are reference counted; the cache itself
+ * holds one reference while the entry is hashed, so an evicted or invalidated
+ * descriptor is closed only after the last user puts it.
+ *
+ * Any operation which changes the file an (oid, ec_index) pair resolves to
+ * (unlink, rename, moving between disks or to the stale directory) must
+ * invalidate the cached descriptors of the object.
+ *
+ * A descriptor opened on a cache miss can race with such an invalidation, so
+ * each shard counts its invalidations. fd_cache_get() returns the count on a
+ * miss and fd_cache_add() doesn't hash the descriptor if it has changed since.
+ */
+
+#include "sheep_priv.h"
+
+#define FD_CACHE_SHARDS		64
+#define FD_CACHE_HASH_SIZE	256
+
+struct fd_cache_shard {
+	struct sd_mutex lock;
+	struct hlist_head hash[FD_CACHE_HASH_SIZE];
+	struct list_head lru;
+	size_t nr_entries;
+	uint64_t gen;		/* bumped on every invalidation */
+};
+
+static struct fd_cache_shard shards[FD_CACHE_SHARDS];
+static size_t max_entries_per_shard;
+
+static inline uint64_t fd_cache_hash(uint64_t oid)
+{
+	return sd_hash_oid(oid);
+}
+
+static inline struct fd_cache_shard *oid_to_shard(uint64_t oid)
+{
+	return shards + (fd_cache_hash(oid) % FD_CACHE_SHARDS);
+}
+
+static inline struct hlist_head *oid_to_bucket(struct fd_cache_shard *shard,
+					       uint64_t oid)
+{
+	uint64_t hval = fd_cache_hash(oid) / FD_CACHE_SHARDS;
+
+	return shard->hash + (hval % FD_CACHE_HASH_SIZE);
+}
+
+static inline bool fd_cache_enabled(void)
+{
+	return max_entries_per_shard > 0;
+}
+
+static void fd_cache_entry_free(struct fd_cache_entry *entry)
+{
+	close(entry->fd);
+	free(entry);
+}
+
+void fd_cache_put(struct fd_cache_entry *entry)
+{
+	if (refcount_dec(&entry->refcnt) == 0)
+		fd_cache_entry_free(entry);
+}
+
+/* Must be called with the shard lock held */
+static void fd_cache_unlink(struct fd_cache_shard *shard,
+			    struct fd_cache_entry *entry)
+{
+	hlist_del(&entry->hash);
+	list_del(&entry->lru);
+	shard->nr_entries--;
+	fd_cache_put(entry);
+}
+
+static void fd_cache_shrink(struct fd_cache_shard *shard)
+{
+	struct fd_cache_entry *entry;
+
+	while (shard->nr_entries > max_entries_per_shard) {
+		entry = list_first_entry(&shard->lru, struct fd_cache_entry,
+					 lru);
+		fd_cache_unlink(shard, entry);
+		uatomic_inc(&sys->stat.fdc.evict_nr);
+	}
+}
+
+/*
+ * Look up the cached file descriptor of the object which was opened with
+ * 'flags'. Return NULL on a cache miss, and set 'gen' to be passed to
+ * fd_cache_add(). The returned entry must be released with fd_cache_put().
+ */
+struct fd_cache_entry *fd_cache_get(uint64_t oid, uint8_t ec_index, int flags,
+				    uint64_t *gen)
+{
+	struct fd_cache_shard *shard = oid_to_shard(oid);
+	struct fd_cache_entry *entry, *ret = NULL;
+	struct hlist_node *node;
+
+	*gen = 0;
+	if (!fd_cache_enabled())
+		return NULL;
+
+	sd_mutex_lock(&shard->lock);
+	hlist_for_each_entry(entry, node, oid_to_bucket(shard, oid), hash) {
+		if (entry->oid == oid && entry->ec_index == ec_index &&
+		    entry->flags == flags) {
+			refcount_inc(&entry->refcnt);
+			list_move_tail(&entry->lru, &shard->lru);
+			ret = entry;
+			break;
+		}
+	}
+	*gen = shard->gen;
+	sd_mutex_unlock(&shard->lock);
+
+	if (ret)
+		uatomic_inc(&sys->stat.fdc.hit_nr);
+	else
+		uatomic_inc(&sys->stat.fdc.miss_nr);
+
+	return ret;
+}
+
+/*
+ * Add a newly opened file descriptor to the cache. The ownership of 'fd' is
+ * passed to the cache. If another thread has cached the same object in the
+ * meantime, 'fd' is closed and the existing entry is returned instead.
+ *
+ * If the cache is disabled, or the object was invalidated after fd_cache_get()
+ * returned 'gen', the returned entry is not hashed and 'fd' is closed when the
+ * entry is put.
+ */
+struct fd_cache_entry *fd_cache_add(uint64_t oid, uint8_t ec_index, int flags,
+				    int fd, uint64_t gen)
+{
+	struct fd_cache_shard *shard = oid_to_shard(oid);
+	struct hlist_head *head = oid_to_bucket(shard, oid);
+	struct fd_cache_entry *new, *entry;
+	struct hlist_node *node;
+
+	new = xzalloc(sizeof(*new));
+	new->oid = oid;
+	new->ec_index = ec_index;
+	new->flags = flags;
+	new->fd = fd;
+	INIT_HLIST_NODE(&new->hash);
+	INIT_LIST_NODE(&new->lru);
+	refcount_set(&new->refcnt, 1);
+
+	if (!fd_cache_enabled())
+		return new;
+
+	sd_mutex_lock(&shard->lock);
+	if (shard->gen != gen) {
+		/* 'fd' might refer to the file which was unlinked or moved */
+		sd_mutex_unlock(&shard->lock);
+		return new;
+	}
+	hlist_for_each_entry(entry, node, head, hash) {
+		if (entry->oid == oid && entry->ec_index == ec_index &&
+		    entry->flags == flags) {
+			refcount_inc(&entry->refcnt);
+			list_move_tail(&entry->lru, &shard->lru);
+			sd_mutex_unlock(&shard->lock);
+
+			fd_cache_entry_free(new);
+			return entry;
+		}
+	}
+
+	/* one reference for the caller and one for the cache */
+	refcount_inc(&new->refcnt);
+	hlist_add_head(&new->hash, head);
+	list_add_tail(&new->lru, &shard->lru);
+	shard->nr_entries++;
+	fd_cache_shrink(shard);
+	sd_mutex_unlock(&shard->lock);
+
+	return new;
+}
+
+/* Drop all the cached file descriptors of the object */
+void fd_cache_invalidate(uint64_t oid)
+{
+	struct fd_cache_shard *shard = oid_to_shard(oid);
+	struct fd_cache_entry *entry;
+	struct hlist_node *node;
+
+	if (!fd_cache_enabled())
+		return;
+
+	sd_mutex_lock(&shard->lock);
+	shard->gen++;
+	hlist_for_each_entry(entry, node, oid_to_bucket(shard, oid), hash) {
+		if (entry->oid == oid)
+			fd_cache_unlink(shard, entry);
+	}
+	sd_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Drop every cached file descriptor. This is called when the object placement
+ * of the whole node changes, e.g. a disk is plugged or unplugged.
+ */
+void fd_cache_invalidate_all(void)
+{
+	struct fd_cache_shard *shard;
+	struct fd_cache_entry *entry;
+
+	if (!fd_cache_enabled())
+		return;
+
+	for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+		shard = shards + i;
+
+		sd_mutex_lock(&shard->lock);
+		shard->gen++;
+		while (!list_empty(&shard->lru)) {
+			entry = list_first_entry(&shard->lru,
+						 struct fd_cache_entry, lru);
+			fd_cache_unlink(shard, entry);
+		}
+		sd_mutex_unlock(&shard->lock);
+	}
+}
+
+void fd_cache_init(size_t max_entries)
+{
+	for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+		struct fd_cache_shard *shard = shards + i;
+
+		sd_init_mutex(&shard->lock);
+		for (int j = 0; j < FD_CACHE_HASH_SIZE; j++)
+			INIT_HLIST_HEAD(shard->hash + j);
+		INIT_LIST_HEAD(&shard->lru);
+		shard->nr_entries = 0;
+		shard->gen = 0;
+	}
+
+	max_entries_per_shard = DIV_ROUND_UP(max_entries, FD_CACHE_SHARDS);
+	sd_info("object fd cache %s, max %zu entries",
+		max_entries ? "enabled" : "disabled",
+		max_entries_per_shard * FD_CACHE_SHARDS);
+}
@@ -11,18 +11,61 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sched.h>
+
 #include "sheep_priv.h"
 
 #define MD_VDISK_SIZE ((uint64_t)1*1024*1024*1024) /* 1G */
 
 #define NONE_EXIST_PATH "/all/disks/are/broken/,ps/əʌo7/!"
 
+#define MD_NR_READER_SLOTS 64
+
 struct md md = {
 	.vroot = RB_ROOT,
 	.root = RB_ROOT,
 	.lock = SD_RW_LOCK_INITIALIZER,
 };
 
+/*
+ * Flat copy of md.vroot sorted by hash, which md_get_object_dir() searches
+ * without md.lock.  The writers hold md.lock, replace the table and wait for
+ * the readers of the old one before freeing it.
+ */
+struct vdisk_table {
+	int nr;
+	uint64_t *hashes;
+	const struct disk **disks;
+};
+
+static struct vdisk_table *vdisk_table;
+
+/*
+ * The readers of the vdisk table, counted per CPU in the current phase.  A
+ * writer flips the phase and waits until the count of the old phase drops
+ * to zero.
+ */
+static struct vdisk_readers {
+	unsigned long nr[2];
+} __attribute__((aligned(64))) vdisk_readers[MD_NR_READER_SLOTS];
+static unsigned long vdisk_phase;
+
+/*
+ * Objects are created only in the disk which they are hashed to, so an object
+ * can be found in another disk only if it was there when the disks were
+ * loaded, or if a disk was plugged after the object had been created.  The
+ * former ones are recorded by md_load_objects() and md_exist() doesn't scan
+ * the disks for the others until a disk is plugged.
+ */
+struct misplaced_obj {
+	struct rb_node rb;
+	uint64_t oid;
+};
+
+static struct rb_root misplaced_objs = RB_ROOT;
+static bool misplaced_known;
+static struct sd_rw_lock misplaced_lock = SD_RW_LOCK_INITIALIZER;
+
 static inline uint32_t nr_online_disks(void)
 {
 	uint32_t nr;
@@ -62,9 +105,93 @@ static struct vdisk *hval_to_vdisk(uint64_t hval)
 	return rb_nsearch(&md.vroot, &dummy, rb, vdisk_cmp);
 }
 
-static struct vdisk *oid_to_vdisk(uint64_t oid)
+/* Same as hval_to_vdisk(), but with the flat table */
+static const struct disk *vdisk_table_lookup(const struct vdisk_table *t,
+					     uint64_t hval)
+{
+	const uint64_t *base = t->hashes;
+	int n = t->nr, pos;
+
+	/* branch-free search of the first hash which is not less than hval */
+	while (n > 1) {
+		int half = n / 2;
+
+		base = base[half] < hval ? base + half : base;
+		n -= half;
+	}
+	pos = base - t->hashes + (*base < hval);
+
+	return t->disks[pos == t->nr ? 0 : pos];
+}
+
+static int vdisk_read_lock(void)
+{
+	int cpu = sched_getcpu();
+	int slot = (cpu < 0 ? 0 : cpu) % MD_NR_READER_SLOTS;
+	unsigned long phase;
+
+	for (;;) {
+		phase = uatomic_read(&vdisk_phase) & 1;
+		uatomic_inc(&vdisk_readers[slot].nr[phase]);
+		cmm_smp_mb();
+		/* the writer might have missed us, retry in the new phase */
+		if ((uatomic_read(&vdisk_phase) & 1) == phase)
+			return slot * 2 + phase;
+		uatomic_dec(&vdisk_readers[slot].nr[phase]);
+	}
+}
+
+static void vdisk_read_unlock(int token)
+{
+	cmm_smp_mb();
+	uatomic_dec(&vdisk_readers[token / 2].nr[token % 2]);
+}
+
+/* Wait until no one can be reading the previous vdisk table */
+static void vdisk_synchronize(void)
 {
-	return hval_to_vdisk(sd_hash_oid(oid));
+	unsigned long phase = uatomic_read(&vdisk_phase) & 1;
+
+	cmm_smp_mb();
+	uatomic_inc(&vdisk_phase);
+	cmm_smp_mb();
+	for (int i = 0; i < MD_NR_READER_SLOTS; i++)
+		while (uatomic_read(&vdisk_readers[i].nr[phase]))
+			sched_yield();
+	cmm_smp_mb();
+}
+
+static void free_vdisk_table(struct vdisk_table *t)
+{
+	if (!t)
+		return;
+	free(t->hashes);
+	free(t->disks);
+	free(t);
+}
+
+/* Rebuild the vdisk table from md.vroot, called with md.lock held */
+static void update_vdisk_table(void)
+{
+	struct vdisk_table *t = xzalloc(sizeof(*t));
+	const struct vdisk *v;
+	int i = 0;
+
+	rb_for_each_entry(v, &md.vroot, rb)
+		t->nr++;
+	t->hashes = xcalloc(t->nr, sizeof(*t->hashes));
+	t->disks = xcalloc(t->nr, sizeof(*t->disks));
+	rb_for_each_entry(v, &md.vroot, rb) {
+		t->hashes[i] = v->hash;
+		t->disks[i] = v->disk;
+		i++;
+	}
+
+	t = uatomic_xchg_ptr(&vdisk_table, t);
+	if (t) {
+		vdisk_synchronize();
+		free_vdisk_table(t);
+	}
 }
 
 static void create_vdisks(const struct disk *disk)
@@ -125,6 +252,50 @@ static void remove_vdisks(const struct disk *disk)
 	}
 }
 
+static int misplaced_cmp(const struct misplaced_obj *a,
+			 const struct misplaced_obj *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+/* Replace the misplaced objects with 'oids', which has all of them */
+static void set_misplaced_objects(const uint64_t *oids, size_t nr)
+{
+	sd_write_lock(&misplaced_lock);
+	rb_destroy(&misplaced_objs, struct misplaced_obj, rb);
+	for (size_t i = 0; i < nr; i++) {
+		struct misplaced_obj *obj = xmalloc(sizeof(*obj));
+
+		obj->oid = oids[i];
+		if (rb_insert(&misplaced_objs, obj, rb, misplaced_cmp))
+			free(obj);
+	}
+	misplaced_known = true;
+	sd_rw_unlock(&misplaced_lock);
+}
+
+static void forget_misplaced_objects(void)
+{
+	sd_write_lock(&misplaced_lock);
+	rb_destroy(&misplaced_objs, struct misplaced_obj, rb);
+	misplaced_known = false;
+	sd_rw_unlock(&misplaced_lock);
+}
+
+/* Return false if 'oid' can be only in the disk which it is hashed to */
+static bool may_be_misplaced(uint64_t oid)
+{
+	struct misplaced_obj key = { .oid = oid };
+	bool ret;
+
+	sd_read_lock(&misplaced_lock);
+	ret = !misplaced_known || rb_search(&misplaced_objs, &key, rb,
+					    misplaced_cmp);
+	sd_rw_unlock(&misplaced_lock);
+
+	return ret;
+}
+
 static inline void trim_last_slash(char *path)
 {
 	sd_assert(path[0]);
@@ -285,6 +456,15 @@ out:
 	return size;
 }
 
+/* The raw store doesn't report its usage, count the whole disk as free */
+static uint64_t disk_free_size(const struct disk *disk, uint64_t *used)
+{
+	if (disk->raw)
+		return disk->space;
+
+	return get_path_free_size(disk->path, used);
+}
+
 /*
  * If path is broken during initialization or not support xattr return 0. We can
  * safely use 0 to represent failure case  because 0 space path can be
@@ -335,35 +515,113 @@ broken_path:
 	return 0;
 }
 
+/*
+ * A raw disk is a block device, or a regular file for testing, which is
+ * managed by the raw store driver.  Its whole size is the space of the disk.
+ */
+static bool is_raw_path(const char *path)
+{
+	struct stat s;
+
+	return stat(path, &s) == 0 && !S_ISDIR(s.st_mode);
+}
+
+/*
+ * Only the raw store uses raw disks, and it can't use directories.  Either
+ * kind is accepted before the store is chosen.
+ */
+static bool disk_kind_match(const char *path, bool raw)
+{
+	const char *store = (const char *)sys->cinfo.default_store;
+	bool raw_store;
+
+	if (sd_store)
+		raw_store = store_id_match(RAW_STORE);
+	else if (store[0])
+		raw_store = !strncmp(store, "raw", STORE_LEN);
+	else
+		return true;
+
+	if (raw && !raw_store) {
+		sd_err("%s is not a directory, only the raw store uses it",
+		       path);
+		return false;
+	}
+	if (!raw && raw_store) {
+		sd_err("%s is not a raw disk, the raw store can't use it",
+		       path);
+		return false;
+	}
+
+	return true;
+}
+
+static uint64_t init_raw_space(const char *path, bool format)
+{
+	uint64_t size;
+	int fd;
+
+	if (format && raw_plug_disk(path) != SD_RES_SUCCESS) {
+		sd_err("failed to format %s", path);
+		return 0;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return 0;
+	}
+	size = get_raw_disk_size(fd);
+	close(fd);
+
+	return size;
+}
+
 /* We don't need lock at init stage */
 bool md_add_disk(const char *path, bool purge)
 {
 	struct disk *new;
+	bool raw = is_raw_path(path);
 
 	if (path_to_disk(path)) {
 		sd_err("duplicate path %s", path);
 		return false;
 	}
 
-	if (xmkdir(path, sd_def_dmode) < 0) {
+	if (!disk_kind_match(path, raw))
+		return false;
+
+	if (!raw && xmkdir(path, sd_def_dmode) < 0) {
 		sd_err("can't mkdir for %s, %m", path);
 		return false;
 	}
 
-	new = xmalloc(sizeof(*new));
+	new = xzalloc(sizeof(*new));
 	pstrcpy(new->path, PATH_MAX, path);
 	trim_last_slash(new->path);
-	new->space = init_path_space(new->path, purge);
+	new->raw = raw;
+	if (raw)
+		new->space = init_raw_space(new->path, purge);
+	else
+		new->space = init_path_space(new->path, purge);
 	if (!new->space) {
 		free(new);
 		return false;
 	}
 
+	/* A plugged disk is empty, the others are indexed at store init */
+	if (purge && !raw)
+		new->index = obj_index_start(new->path, 0, NULL, 0);
+
 	create_vdisks(new);
+	update_vdisk_table();
 	rb_insert(&md.root, new, rb, disk_cmp);
 	md.space += new->space;
 	md.nr_disks++;
 
+	/* some objects might be hashed to the new disk now */
+	forget_misplaced_objects();
+
 	sd_info("%s, vdisk nr %d, total disk %d", new->path, vdisk_number(new),
 		md.nr_disks);
 	return true;
@@ -372,9 +630,14 @@ bool md_add_disk(const char *path, bool purge)
 static inline void md_remove_disk(struct disk *disk)
 {
 	sd_info("%s from multi-disk array", disk->path);
+	if (disk->index)
+		obj_index_close(disk->index, false);
 	rb_erase(&disk->rb, &md.root);
 	md.nr_disks--;
 	remove_vdisks(disk);
+	update_vdisk_table();
+	if (sd_store && sd_store->unplug)
+		sd_store->unplug(disk->path);
 	free(disk);
 }
 
@@ -383,24 +646,17 @@ uint64_t md_init_space(void)
 	return md.space;
 }
 
-static const char *md_get_object_dir_nolock(uint64_t oid)
-{
-	const struct vdisk *vd;
-
-	if (unlikely(md.nr_disks == 0))
-		return NONE_EXIST_PATH; /* To generate EIO */
-
-	vd = oid_to_vdisk(oid);
-	return vd->disk->path;
-}
-
 const char *md_get_object_dir(uint64_t oid)
 {
-	const char *p;
+	const char *p = NONE_EXIST_PATH; /* To generate EIO */
+	const struct vdisk_table *t;
+	int token;
 
-	sd_read_lock(&md.lock);
-	p = md_get_object_dir_nolock(oid);
-	sd_rw_unlock(&md.lock);
+	token = vdisk_read_lock();
+	t = uatomic_read(&vdisk_table);
+	if (likely(t && t->nr))
+		p = vdisk_table_lookup(t, sd_hash_oid(oid))->path;
+	vdisk_read_unlock(token);
 
 	return p;
 }
@@ -444,7 +700,8 @@ main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
 	sd_read_lock(&md.lock);
 
 	rb_for_each_entry(disk, &md.root, rb) {
-		nr_thread++;
+		if (!disk->raw)
+			nr_thread++;
 	}
 
 	thread_args = xmalloc(nr_thread * sizeof(struct process_path_arg));
@@ -453,6 +710,8 @@ main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
 	vinfo = get_vnode_info();
 
 	rb_for_each_entry(disk, &md.root, rb) {
+		if (disk->raw)
+			continue;
 		thread_args[idx].path = disk->path;
 		thread_args[idx].vinfo = vinfo;
 		thread_args[idx].func = func;
@@ -497,6 +756,181 @@ main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
 	return ret;
 }
 
+struct load_objects_arg {
+	struct disk *disk;
+	struct vnode_info *vinfo;
+	int (*func)(uint64_t oid, const char *, uint32_t, uint8_t,
+		    struct vnode_info *, void *arg);
+	void *opaque;
+	struct obj_index_entry *entries;
+	size_t nr_entries, size;
+	uint64_t *misplaced;
+	size_t nr_misplaced;
+	int result;
+};
+
+static int collect_object(uint64_t oid, const char *path, uint32_t epoch,
+			  uint8_t ec_index, struct vnode_info *vinfo,
+			  void *arg)
+{
+	struct load_objects_arg *larg = arg;
+
+	if (larg->nr_entries == larg->size) {
+		larg->size = larg->size ? larg->size * 2 : 1024;
+		larg->entries = xrealloc(larg->entries,
+					 larg->size * sizeof(*larg->entries));
+	}
+	larg->entries[larg->nr_entries].oid = oid;
+	larg->entries[larg->nr_entries].ec_index = ec_index;
+	larg->nr_entries++;
+
+	return larg->func(oid, path, epoch, ec_index, vinfo, larg->opaque);
+}
+
+static void find_misplaced_objects(struct load_objects_arg *larg)
+{
+	for (size_t i = 0; i < larg->nr_entries; i++) {
+		uint64_t oid = larg->entries[i].oid;
+
+		if (md_get_object_dir(oid) == larg->disk->path)
+			continue;
+		larg->misplaced = xrealloc(larg->misplaced,
+					   (larg->nr_misplaced + 1) *
+					   sizeof(*larg->misplaced));
+		larg->misplaced[larg->nr_misplaced++] = oid;
+	}
+}
+
+static void *thread_load_objects(void *arg)
+{
+	struct load_objects_arg *larg = arg;
+	struct disk *disk = larg->disk;
+	uint64_t generation = 0;
+	int ret;
+
+	ret = obj_index_read(disk->path, &larg->entries, &larg->nr_entries,
+			     &generation);
+	if (ret == SD_RES_SUCCESS) {
+		sd_info("%s, %zu objects in the index", disk->path,
+			larg->nr_entries);
+		for (size_t i = 0; i < larg->nr_entries; i++) {
+			const struct obj_index_entry *e = larg->entries + i;
+
+			ret = larg->func(e->oid, disk->path, 0, e->ec_index,
+					 larg->vinfo, larg->opaque);
+			if (ret != SD_RES_SUCCESS)
+				break;
+		}
+	} else {
+		sd_info("%s, no usable index, scanning objects", disk->path);
+		ret = for_each_object_in_path(disk->path, collect_object, true,
+					      larg->vinfo, larg);
+	}
+
+	/* Don't index a partial list, the next startup will scan the disk */
+	if (ret == SD_RES_SUCCESS) {
+		disk->index = obj_index_start(disk->path, generation,
+					      larg->entries, larg->nr_entries);
+		find_misplaced_objects(larg);
+	} else {
+		larg->result = ret;
+		obj_index_discard(disk->path);
+	}
+	free(larg->entries);
+
+	return arg;
+}
+
+/*
+ * Call 'func' against all the objects in the working directory, like
+ * for_each_object_in_wd(), but use the object index of each disk if it is
+ * usable.  The temporary objects are removed only when the disk is scanned.
+ */
+main_fn int md_load_objects(int (*func)(uint64_t oid, const char *path,
+					uint32_t epoch, uint8_t ec_index,
+					struct vnode_info *vinfo, void *arg),
+			    void *arg)
+{
+	int ret = SD_RES_SUCCESS;
+	struct disk *disk;
+	struct load_objects_arg *thread_args, *larg;
+	struct vnode_info *vinfo;
+	void *ret_arg;
+	sd_thread_t *thread_array;
+	int nr_thread = 0, idx = 0;
+	uint64_t *misplaced = NULL;
+	size_t nr_misplaced = 0;
+	bool complete = true;
+
+	sd_read_lock(&md.lock);
+
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (!disk->raw)
+			nr_thread++;
+	}
+
+	thread_args = xcalloc(nr_thread, sizeof(struct load_objects_arg));
+	thread_array = xmalloc(nr_thread * sizeof(sd_thread_t));
+
+	vinfo = get_vnode_info();
+
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (disk->raw)
+			continue;
+		thread_args[idx].disk = disk;
+		thread_args[idx].vinfo = vinfo;
+		thread_args[idx].func = func;
+		thread_args[idx].opaque = arg;
+		thread_args[idx].result = SD_RES_SUCCESS;
+		ret = sd_thread_create_with_idx("load objects",
+						thread_array + idx,
+						thread_load_objects,
+						(void *)(thread_args + idx));
+		if (ret)
+			panic("Failed to create thread for path %s",
+			      disk->path);
+		idx++;
+	}
+
+	for (idx = 0; idx < nr_thread; idx++) {
+		ret = sd_thread_join(thread_array[idx], &ret_arg);
+		if (ret) {
+			sd_err("Failed to join thread");
+			complete = false;
+		}
+		if (ret_arg) {
+			larg = (struct load_objects_arg *)ret_arg;
+			if (larg->result != SD_RES_SUCCESS) {
+				sd_err("%s, %s", larg->disk->path,
+				       sd_strerror(larg->result));
+				complete = false;
+			}
+			misplaced = xrealloc(misplaced, (nr_misplaced +
+						larg->nr_misplaced) *
+					     sizeof(*misplaced));
+			memcpy(misplaced + nr_misplaced, larg->misplaced,
+			       larg->nr_misplaced * sizeof(*misplaced));
+			nr_misplaced += larg->nr_misplaced;
+			free(larg->misplaced);
+		}
+	}
+
+	/* a disk which failed to load might have any objects */
+	if (complete) {
+		sd_info("%zu objects are not in their disks", nr_misplaced);
+		set_misplaced_objects(misplaced, nr_misplaced);
+	} else
+		forget_misplaced_objects();
+	free(misplaced);
+
+	put_vnode_info(vinfo);
+	sd_rw_unlock(&md.lock);
+
+	free(thread_args);
+	free(thread_array);
+	return ret;
+}
+
 int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 					 uint32_t epoch, uint8_t,
 					 struct vnode_info *, void *arg),
@@ -508,6 +942,8 @@ int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 
 	sd_read_lock(&md.lock);
 	rb_for_each_entry(disk, &md.root, rb) {
+		if (disk->raw)
+			continue;
 		snprintf(path, sizeof(path), "%s/.stale", disk->path);
 		ret = for_each_object_in_path(path, func, false, NULL, arg);
 		if (ret != SD_RES_SUCCESS)
@@ -567,6 +1003,7 @@ out:
 	sd_rw_unlock(&md.lock);
 
 	if (disk) {
+		fd_cache_invalidate_all();
 		if (nr > 0) {
 			update_node_disks();
 			kick_recover();
@@ -614,12 +1051,12 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 		if (!is_erasure_oid(oid)) {
 			snprintf(old, PATH_MAX, "%s/%016" PRIx64, path, oid);
 			snprintf(new, PATH_MAX, "%s/%016" PRIx64,
-				 md_get_object_dir_nolock(oid), oid);
+				 md_get_object_dir(oid), oid);
 		} else {
 			snprintf(old, PATH_MAX, "%s/%016" PRIx64"_%d", path,
 				 oid, ec_index);
 			snprintf(new, PATH_MAX, "%s/%016" PRIx64"_%d",
-				 md_get_object_dir_nolock(oid), oid, ec_index);
+				 md_get_object_dir(oid), oid, ec_index);
 		}
 	} else {
 		if (!is_erasure_oid(oid)) {
@@ -628,14 +1065,14 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 				 oid, epoch);
 			snprintf(new, PATH_MAX,
 				 "%s/.stale/%016"PRIx64".%"PRIu32,
-				 md_get_object_dir_nolock(oid), oid, epoch);
+				 md_get_object_dir(oid), oid, epoch);
 		} else {
 			snprintf(old, PATH_MAX,
 				 "%s/.stale/%016"PRIx64"_%d.%"PRIu32, path,
 				 oid, ec_index, epoch);
 			snprintf(new, PATH_MAX,
 				 "%s/.stale/%016"PRIx64"_%d.%"PRIu32,
-				 md_get_object_dir_nolock(oid),
+				 md_get_object_dir(oid),
 				 oid, ec_index, epoch);
 		}
 	}
@@ -646,6 +1083,39 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 	return 0;
 }
 
+/* Same as md_index_object(), but the caller holds md.lock */
+static void index_object_locked(const char *path, bool removed)
+{
+	const struct disk *disk;
+	const char *name;
+	uint8_t ec_index = SD_MAX_COPIES;
+	uint64_t oid;
+	char *p;
+
+	name = strrchr(path, '/');
+	if (!name)
+		return;
+	name++;
+	oid = strtoull(name, &p, 16);
+	if (oid == 0 || oid == ULLONG_MAX)
+		return;
+	if (*p == '_')
+		ec_index = strtoul(p + 1, &p, 10);
+	/* temporary and stale objects have a suffix */
+	if (*p != '\0')
+		return;
+
+	rb_for_each_entry(disk, &md.root, rb) {
+		size_t len = strlen(disk->path);
+
+		if (strncmp(path, disk->path, len) || path[len] != '/')
+			continue;
+		if (disk->index && strncmp(path + len, "/.stale/", 8))
+			obj_index_record(disk->index, oid, ec_index, removed);
+		break;
+	}
+}
+
 static int md_move_object(uint64_t oid, const char *old, const char *new)
 {
 	struct strbuf buf = STRBUF_INIT;
@@ -674,6 +1144,9 @@ static int md_move_object(uint64_t oid, const char *old, const char *new)
 		}
 	}
 	unlink(old);
+	index_object_locked(old, true);
+	index_object_locked(new, false);
+	fd_cache_invalidate(oid);
 	ret = 0;
 out_close:
 	close(fd);
@@ -727,6 +1200,8 @@ bool md_exist(uint64_t oid, uint8_t ec_index, char *path)
 {
 	if (md_access(path))
 		return true;
+	if (!may_be_misplaced(oid))
+		return false;
 	/*
 	 * We have to iterate the WD because we don't have epoch-like history
 	 * track to locate the objects for multiple disk failure. Simply do
@@ -775,8 +1250,8 @@ uint32_t md_get_info(struct sd_md_info *info)
 		info->disk[i].idx = i;
 		pstrcpy(info->disk[i].path, PATH_MAX, disk->path);
 		/* FIXME: better handling failure case. */
-		info->disk[i].free = get_path_free_size(info->disk[i].path,
-							&info->disk[i].used);
+		info->disk[i].free = disk_free_size(disk,
+						    &info->disk[i].used);
 		i++;
 	}
 	info->nr = md.nr_disks;
@@ -823,6 +1298,8 @@ void update_node_disks(void)
 			remove_vdisks(disk);
 		create_vdisks(disk);
 	}
+	update_vdisk_table();
+	forget_misplaced_objects();
 	sd_rw_unlock(&md.lock);
 }
 #else
@@ -858,6 +1335,7 @@ out:
 	sd_rw_unlock(&md.lock);
 
 	if (ret == SD_RES_SUCCESS) {
+		fd_cache_invalidate_all();
 		if (new_nr > 0) {
 			update_node_disks();
 			kick_recover();
@@ -889,7 +1367,7 @@ uint64_t md_get_size(uint64_t *used)
 	*used = 0;
 	sd_read_lock(&md.lock);
 	rb_for_each_entry(disk, &md.root, rb) {
-		fsize += get_path_free_size(disk->path, used);
+		fsize += disk_free_size(disk, used);
 	}
 	sd_rw_unlock(&md.lock);
 
@@ -900,3 +1378,42 @@ uint32_t md_nr_disks(void)
 {
 	return nr_online_disks();
 }
+
+/*
+ * Record that the object at 'path' was created or removed in the index of its
+ * disk.  The objects in the stale directory are not indexed.
+ */
+void md_index_object(const char *path, bool removed)
+{
+	sd_read_lock(&md.lock);
+	index_object_locked(path, removed);
+	sd_rw_unlock(&md.lock);
+}
+
+/* The working directories were purged */
+void md_reset_object_index(void)
+{
+	const struct disk *disk;
+
+	sd_read_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (disk->index)
+			obj_index_reset(disk->index);
+	}
+	sd_rw_unlock(&md.lock);
+}
+
+/* Called at the clean shutdown, the indexes are trusted at next startup */
+void md_close_object_index(void)
+{
+	struct disk *disk;
+
+	sd_write_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (!disk->index)
+			continue;
+		obj_index_close(disk->index, true);
+		disk->index = NULL;
+	}
+	sd_rw_unlock(&md.lock);
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Persistent object index
+ *
+ * Every disk keeps the list of the objects in its working directory in the
+ * file '.objindex', so that sheep doesn't have to walk the directories at
+ * startup.  The file is a snapshot of the objects written at startup,
+ * followed by the records of the objects created and removed since then.
+ *
+ * The index is trusted only if sheep shut down cleanly.  The generation of
+ * the index is saved in the xattr of the disk when the index is closed, and
+ * the xattr is removed before the index is written again.  If the xattr is
+ * missing or doesn't match the file, the caller has to scan the disk.
+ */
+
+#include <sys/mman.h>
+#include <sys/xattr.h>
+
+#include "sheep_priv.h"
+
+#define OBJ_INDEX_MAGIC		0x5344494e44455831 /* "SDINDEX1" */
+#define OBJ_INDEX_VERSION	1
+#define OBJ_INDEX_FILE		".objindex"
+#define OBJ_INDEX_XATTR		"user.md.objindex"
+
+/* the directory name can take PATH_MAX bytes */
+#define OBJ_INDEX_PATH_MAX	(PATH_MAX + sizeof("/" OBJ_INDEX_FILE ".tmp"))
+
+struct obj_index_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t __pad;
+	uint64_t generation;
+};
+
+struct obj_index_record {
+	uint64_t oid;
+	uint8_t ec_index;
+	uint8_t removed;
+	uint8_t __pad[6];
+};
+
+struct obj_index {
+	char dir[PATH_MAX];
+	int fd;
+	bool broken;
+	uint64_t generation;
+	struct sd_mutex lock;
+};
+
+/* a record tagged with its position in the file */
+struct replay_entry {
+	uint64_t oid;
+	uint32_t seq;
+	uint8_t ec_index;
+	uint8_t removed;
+};
+
+static int replay_entry_cmp(const struct replay_entry *a,
+			    const struct replay_entry *b)
+{
+	return intcmp(a->oid, b->oid) ?: intcmp(a->ec_index, b->ec_index) ?:
+		intcmp(a->seq, b->seq);
+}
+
+static int sync_dir(const char *dir)
+{
+	int fd, ret;
+
+	fd = open(dir, O_DIRECTORY | O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", dir);
+		return -1;
+	}
+	ret = fsync(fd);
+	if (ret < 0)
+		sd_err("failed to sync %s, %m", dir);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Read the index of 'dir' and return the objects in it.  The caller must free
+ * '*entries'.
+ */
+int obj_index_read(const char *dir, struct obj_index_entry **entries,
+		   size_t *nr_entries, uint64_t *generation)
+{
+	struct obj_index_header *hdr;
+	struct obj_index_record *recs;
+	struct replay_entry *replay;
+	struct obj_index_entry *e;
+	char path[OBJ_INDEX_PATH_MAX];
+	uint64_t clean;
+	size_t nr, n = 0;
+	struct stat s;
+	void *map;
+	int fd;
+
+	if (getxattr(dir, OBJ_INDEX_XATTR, &clean, sizeof(clean)) !=
+	    sizeof(clean)) {
+		if (errno != ENODATA)
+			sd_err("failed to get xattr of %s, %m", dir);
+		return SD_RES_NOT_FOUND;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", dir, OBJ_INDEX_FILE);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return SD_RES_NOT_FOUND;
+	}
+	if (fstat(fd, &s) < 0 || s.st_size < sizeof(*hdr) ||
+	    (s.st_size - sizeof(*hdr)) % sizeof(*recs)) {
+		sd_err("invalid index %s", path);
+		close(fd);
+		return SD_RES_NOT_FOUND;
+	}
+
+	map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		sd_err("failed to map %s, %m", path);
+		return SD_RES_NOT_FOUND;
+	}
+
+	hdr = map;
+	if (hdr->magic != OBJ_INDEX_MAGIC ||
+	    hdr->version != OBJ_INDEX_VERSION || hdr->generation != clean) {
+		sd_err("stale index %s, generation %"PRIu64", expected %"PRIu64,
+		       path, hdr->generation, clean);
+		munmap(map, s.st_size);
+		return SD_RES_NOT_FOUND;
+	}
+
+	/* the last record of each object tells whether it exists */
+	recs = (struct obj_index_record *)(hdr + 1);
+	nr = (s.st_size - sizeof(*hdr)) / sizeof(*recs);
+	replay = xcalloc(nr, sizeof(*replay));
+	for (size_t i = 0; i < nr; i++) {
+		replay[i].oid = recs[i].oid;
+		replay[i].seq = i;
+		replay[i].ec_index = recs[i].ec_index;
+		replay[i].removed = recs[i].removed;
+	}
+	*generation = hdr->generation;
+	munmap(map, s.st_size);
+
+	xqsort(replay, nr, replay_entry_cmp);
+	e = xcalloc(nr, sizeof(*e));
+	for (size_t i = 0; i < nr; i++) {
+		if (i + 1 < nr && replay[i + 1].oid == replay[i].oid &&
+		    replay[i + 1].ec_index == replay[i].ec_index)
+			continue;
+		if (replay[i].removed)
+			continue;
+		e[n].oid = replay[i].oid;
+		e[n].ec_index = replay[i].ec_index;
+		n++;
+	}
+	free(replay);
+
+	*entries = e;
+	*nr_entries = n;
+	return SD_RES_SUCCESS;
+}
+
+/* Replace the index file with a snapshot of 'entries' */
+static int write_snapshot(struct obj_index *idx,
+			  const struct obj_index_entry *entries, size_t nr)
+{
+	struct obj_index_header *hdr;
+	struct obj_index_record *recs;
+	char path[OBJ_INDEX_PATH_MAX], tmp_path[OBJ_INDEX_PATH_MAX];
+	size_t len = sizeof(*hdr) + nr * sizeof(*recs);
+	int fd, ret = -1;
+	void *buf;
+
+	buf = xzalloc(len);
+	hdr = buf;
+	hdr->magic = OBJ_INDEX_MAGIC;
+	hdr->version = OBJ_INDEX_VERSION;
+	hdr->generation = idx->generation;
+	recs = (struct obj_index_record *)(hdr + 1);
+	for (size_t i = 0; i < nr; i++) {
+		recs[i].oid = entries[i].oid;
+		recs[i].ec_index = entries[i].ec_index;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", idx->dir, OBJ_INDEX_FILE);
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", idx->dir,
+		 OBJ_INDEX_FILE);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", tmp_path);
+		goto out;
+	}
+	if (xwrite(fd, buf, len) != len) {
+		sd_err("failed to write %s, %m", tmp_path);
+		goto out_close;
+	}
+	if (rename(tmp_path, path) < 0) {
+		sd_err("failed to rename %s, %m", tmp_path);
+		goto out_close;
+	}
+
+	/* the records are appended through the same descriptor */
+	idx->fd = fd;
+	ret = 0;
+	goto out;
+out_close:
+	close(fd);
+	unlink(tmp_path);
+out:
+	free(buf);
+	return ret;
+}
+
+/* Forget the index of 'dir'; the next startup will scan the disk */
+int obj_index_discard(const char *dir)
+{
+	if (removexattr(dir, OBJ_INDEX_XATTR) < 0) {
+		if (errno == ENODATA)
+			return 0;
+		sd_err("failed to remove xattr of %s, %m", dir);
+		return -1;
+	}
+
+	return sync_dir(dir);
+}
+
+/*
+ * Start recording the changes of 'dir' whose objects are 'entries'.
+ * 'generation' is the one of the previous index, or zero.
+ */
+struct obj_index *obj_index_start(const char *dir, uint64_t generation,
+				  const struct obj_index_entry *entries,
+				  size_t nr)
+{
+	struct obj_index *idx;
+
+	if (obj_index_discard(dir) < 0)
+		return NULL;
+
+	idx = xzalloc(sizeof(*idx));
+	pstrcpy(idx->dir, sizeof(idx->dir), dir);
+	idx->fd = -1;
+	idx->generation = generation + 1;
+	if (write_snapshot(idx, entries, nr) < 0) {
+		free(idx);
+		return NULL;
+	}
+	sd_init_mutex(&idx->lock);
+
+	sd_debug("%s, %zu objects, generation %"PRIu64, dir, nr,
+		 idx->generation);
+	return idx;
+}
+
+void obj_index_record(struct obj_index *idx, uint64_t oid, uint8_t ec_index,
+		      bool removed)
+{
+	struct obj_index_record rec = {
+		.oid = oid,
+		.ec_index = ec_index,
+		.removed = removed,
+	};
+
+	sd_mutex_lock(&idx->lock);
+	if (!idx->broken && xwrite(idx->fd, &rec, sizeof(rec)) != sizeof(rec)) {
+		sd_err("failed to update the index of %s, %m", idx->dir);
+		idx->broken = true;
+	}
+	sd_mutex_unlock(&idx->lock);
+}
+
+/* Drop all the objects, called after the working directory is purged */
+void obj_index_reset(struct obj_index *idx)
+{
+	sd_mutex_lock(&idx->lock);
+	if (idx->fd >= 0)
+		close(idx->fd);
+	idx->fd = -1;
+	idx->generation++;
+	idx->broken = write_snapshot(idx, NULL, 0) < 0;
+	sd_mutex_unlock(&idx->lock);
+}
+
+/*
+ * Stop recording.  If 'clean' is true, the index is marked as trusted for the
+ * next startup.
+ */
+void obj_index_close(struct obj_index *idx, bool clean)
+{
+	sd_mutex_lock(&idx->lock);
+	if (clean && !idx->broken) {
+		if (fsync(idx->fd) < 0)
+			sd_err("failed to sync the index of %s, %m", idx->dir);
+		else if (setxattr(idx->dir, OBJ_INDEX_XATTR, &idx->generation,
+				  sizeof(idx->generation), 0) < 0)
+			sd_err("failed to set xattr of %s, %m", idx->dir);
+		else
+			sync_dir(idx->dir);
+	}
+	if (idx->fd >= 0)
+		close(idx->fd);
+	sd_mutex_unlock(&idx->lock);
+
+	sd_destroy_mutex(&idx->lock);
+	free(idx);
+}
@@ -0,0 +1,1616 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pack store driver
+ *
+ * The plain and tree stores keep one file per object, so creating an object
+ * costs a temporary file, a rename and a directory sync, and the file system
+ * has to manage an inode for every object.  The pack store keeps the objects
+ * in large container files instead.  Each disk has the directory 'pack' which
+ * holds the containers 'cXXXXXXXX' and the index log 'index':
+ *
+ *  - Every object, live or stale, occupies one extent of a container.  The
+ *    extents are aligned to BLOCK_SIZE and never move.
+ *  - The index log is a sequence of fixed size records which set, delete or
+ *    move (change the epoch of) the objects.  It is replayed and compacted
+ *    when the disk is loaded.
+ *  - The free space of the containers is kept as holes, ordered by size for
+ *    the best fit allocation and by position for merging.  The holes are
+ *    punched out so that new extents read as zero.
+ *
+ * A new object is written to its extent before its record is synced to the
+ * index, and an extent is reused only after the record deleting its previous
+ * object is synced.  A crash can therefore lose only the objects whose
+ * records were not synced yet, like the tmp files of the plain store.
+ *
+ * Moving an object to the stale area only changes its epoch, and linking a
+ * stale object back shares the extent like a hard link does.
+ */
+
+#include "sheep_priv.h"
+#include "sha1.h"
+
+#define PACK_DIR		"pack"
+#define PACK_INDEX		"index"
+#define PACK_CONTAINER_SIZE	(UINT64_C(1) << 30) /* 1G */
+#define PACK_INDEX_BATCH	65536 /* records per read or write */
+/* pd->path takes up to PATH_MAX bytes, "/cXXXXXXXX" is as long as this */
+#define PACK_PATH_MAX		(PATH_MAX + sizeof("/" PACK_INDEX ".tmp"))
+#define PACK_CHUNK_CONTAINERS	1024
+#define PACK_MAX_CHUNKS		1024
+
+enum pack_op {
+	PACK_SET = 1,
+	PACK_DEL,
+	PACK_MOVE,
+};
+
+struct pack_record {
+	uint64_t oid;
+	uint64_t offset;
+	uint32_t epoch;
+	uint32_t new_epoch;	/* PACK_MOVE */
+	uint32_t container;
+	uint32_t length;
+	uint8_t ec_index;
+	uint8_t op;
+	uint8_t __pad[2];
+	uint32_t crc;
+};
+
+struct pack_extent {
+	struct rb_node rb;	/* in pack_disk->extents */
+	uint32_t container;
+	uint64_t offset;
+	uint32_t length;
+	refcnt_t refcnt;	/* the index entries and the I/O in flight */
+	struct pack_disk *disk;
+};
+
+struct pack_entry {
+	struct rb_node rb;
+	uint64_t oid;
+	uint32_t epoch;		/* zero for the live object */
+	uint8_t ec_index;
+	struct pack_extent *extent;
+};
+
+struct pack_hole {
+	struct rb_node size_rb;
+	struct rb_node pos_rb;
+	uint32_t container;
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct pack_container {
+	int fd;
+	int sync_fd;		/* opened with O_DSYNC */
+	uint64_t size;
+};
+
+struct pack_disk {
+	char dir[PATH_MAX];	/* the disk */
+	char path[PATH_MAX];	/* the pack directory in it */
+	struct sd_rw_lock lock;
+	struct rb_root entries;
+	struct rb_root extents;
+	struct rb_root holes_by_size;
+	struct rb_root holes_by_pos;
+	/*
+	 * The containers are allocated in chunks which never move, so the
+	 * I/O on a pinned extent can find its container without the lock.
+	 */
+	struct pack_container *containers[PACK_MAX_CHUNKS];
+	uint32_t nr_containers;
+	int index_fd;
+	bool loading;
+	refcnt_t refcnt;	/* pack_disks and the operations in progress */
+};
+
+static struct pack_disk **pack_disks;
+static int nr_pack_disks;
+static struct sd_rw_lock pack_disks_lock = SD_RW_LOCK_INITIALIZER;
+
+static int pack_entry_cmp(const struct pack_entry *a,
+			  const struct pack_entry *b)
+{
+	return intcmp(a->oid, b->oid) ?: intcmp(a->ec_index, b->ec_index) ?:
+		intcmp(a->epoch, b->epoch);
+}
+
+static int pack_extent_cmp(const struct pack_extent *a,
+			   const struct pack_extent *b)
+{
+	return intcmp(a->container, b->container) ?:
+		intcmp(a->offset, b->offset);
+}
+
+static int hole_pos_cmp(const struct pack_hole *a, const struct pack_hole *b)
+{
+	return intcmp(a->container, b->container) ?:
+		intcmp(a->offset, b->offset);
+}
+
+static int hole_size_cmp(const struct pack_hole *a, const struct pack_hole *b)
+{
+	return intcmp(a->length, b->length) ?: hole_pos_cmp(a, b);
+}
+
+/* Replicated objects have one copy per node, so ignore their ec index */
+static inline uint8_t pack_ec_index(uint64_t oid, uint8_t ec_index)
+{
+	return is_erasure_oid(oid) ? ec_index : 0;
+}
+
+static inline bool pack_need_sync(void)
+{
+	return !sys->nosync;
+}
+
+static inline struct pack_container *
+get_container(const struct pack_disk *pd, uint32_t i)
+{
+	return pd->containers[i / PACK_CHUNK_CONTAINERS] +
+		i % PACK_CHUNK_CONTAINERS;
+}
+
+/* Return the slot of the next container, which the caller fills */
+static struct pack_container *next_container(struct pack_disk *pd)
+{
+	struct pack_container **chunk;
+	uint32_t i = pd->nr_containers;
+
+	if (i / PACK_CHUNK_CONTAINERS >= PACK_MAX_CHUNKS) {
+		sd_err("too many containers in %s", pd->path);
+		return NULL;
+	}
+
+	chunk = pd->containers + i / PACK_CHUNK_CONTAINERS;
+	if (!*chunk)
+		*chunk = xcalloc(PACK_CHUNK_CONTAINERS, sizeof(**chunk));
+
+	return *chunk + i % PACK_CHUNK_CONTAINERS;
+}
+
+static int pack_err(const struct pack_disk *pd, uint64_t oid, int err)
+{
+	switch (err) {
+	case ENOSPC:
+		sd_err("diskfull, oid=%016"PRIx64, oid);
+		return SD_RES_NO_SPACE;
+	case EMFILE:
+	case ENFILE:
+	case EINTR:
+	case EAGAIN:
+		sd_err("%s, oid=%016"PRIx64, strerror(err), oid);
+		/* make gateway try again */
+		return SD_RES_NETWORK_ERROR;
+	default:
+		sd_err("oid=%016"PRIx64", %s, %s", oid, pd->path,
+		       strerror(err));
+		return md_handle_eio(pd->dir);
+	}
+}
+
+static int sync_dir(const char *dir)
+{
+	int fd, ret;
+
+	fd = open(dir, O_DIRECTORY | O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", dir);
+		return -1;
+	}
+	ret = fsync(fd);
+	if (ret < 0)
+		sd_err("failed to sync %s, %m", dir);
+	close(fd);
+	return ret;
+}
+
+static void add_hole(struct pack_disk *pd, uint32_t container,
+		     uint64_t offset, uint64_t length)
+{
+	struct pack_hole key = { .container = container, .offset = offset };
+	struct pack_hole *prev = NULL, *next, *hole;
+	struct rb_node *n;
+
+	next = rb_nsearch(&pd->holes_by_pos, &key, pos_rb, hole_pos_cmp);
+	if (next && hole_pos_cmp(next, &key) < 0)
+		/* rb_nsearch wrapped around */
+		next = NULL;
+	n = next ? rb_prev(&next->pos_rb) : rb_last(&pd->holes_by_pos);
+	if (n)
+		prev = rb_entry(n, struct pack_hole, pos_rb);
+
+	if (prev && prev->container == container &&
+	    prev->offset + prev->length == offset) {
+		offset = prev->offset;
+		length += prev->length;
+		rb_erase(&prev->pos_rb, &pd->holes_by_pos);
+		rb_erase(&prev->size_rb, &pd->holes_by_size);
+		free(prev);
+	}
+	if (next && next->container == container &&
+	    offset + length == next->offset) {
+		length += next->length;
+		rb_erase(&next->pos_rb, &pd->holes_by_pos);
+		rb_erase(&next->size_rb, &pd->holes_by_size);
+		free(next);
+	}
+
+	hole = xmalloc(sizeof(*hole));
+	hole->container = container;
+	hole->offset = offset;
+	hole->length = length;
+	rb_insert(&pd->holes_by_pos, hole, pos_rb, hole_pos_cmp);
+	rb_insert(&pd->holes_by_size, hole, size_rb, hole_size_cmp);
+}
+
+static int add_container(struct pack_disk *pd, uint64_t size)
+{
+	struct pack_container *c;
+	char path[PACK_PATH_MAX];
+	int fd, sync_fd;
+
+	c = next_container(pd);
+	if (!c)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/c%08"PRIx32, pd->path,
+		 pd->nr_containers);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", path);
+		return -1;
+	}
+	sync_fd = open(path, O_RDWR | O_DSYNC);
+	if (sync_fd < 0 || xftruncate(fd, size) < 0) {
+		sd_err("failed to set up %s, %m", path);
+		goto err;
+	}
+	if (pack_need_sync() && (fsync(fd) < 0 || sync_dir(pd->path) < 0))
+		goto err;
+
+	c->fd = fd;
+	c->sync_fd = sync_fd;
+	c->size = size;
+	add_hole(pd, pd->nr_containers++, 0, size);
+
+	sd_info("%s, %"PRIu64" bytes", path, size);
+	return 0;
+err:
+	if (sync_fd >= 0)
+		close(sync_fd);
+	close(fd);
+	unlink(path);
+	return -1;
+}
+
+/* Allocate an extent of 'length' bytes, pinned for the caller */
+static struct pack_extent *alloc_extent(struct pack_disk *pd, uint32_t length)
+{
+	struct pack_hole key = { .length = length }, *hole;
+	struct pack_extent *ext;
+
+	length = round_up(length, BLOCK_SIZE);
+	key.length = length;
+	hole = rb_nsearch(&pd->holes_by_size, &key, size_rb, hole_size_cmp);
+	if (!hole || hole->length < length) {
+		if (add_container(pd, max(PACK_CONTAINER_SIZE,
+					  (uint64_t)length)) < 0)
+			return NULL;
+		hole = rb_nsearch(&pd->holes_by_size, &key, size_rb,
+				  hole_size_cmp);
+	}
+
+	rb_erase(&hole->pos_rb, &pd->holes_by_pos);
+	rb_erase(&hole->size_rb, &pd->holes_by_size);
+
+	ext = xzalloc(sizeof(*ext));
+	ext->container = hole->container;
+	ext->offset = hole->offset;
+	ext->length = length;
+	ext->disk = pd;
+	refcount_set(&ext->refcnt, 1);
+	if (unlikely(rb_insert(&pd->extents, ext, rb, pack_extent_cmp)))
+		panic("extent %"PRIu32":%"PRIu64" is in use", ext->container,
+		      ext->offset);
+
+	if (hole->length > length) {
+		hole->offset += length;
+		hole->length -= length;
+		rb_insert(&pd->holes_by_pos, hole, pos_rb, hole_pos_cmp);
+		rb_insert(&pd->holes_by_size, hole, size_rb, hole_size_cmp);
+	} else
+		free(hole);
+
+	return ext;
+}
+
+static void release_extent(struct pack_disk *pd, struct pack_extent *ext)
+{
+	struct pack_container *c = get_container(pd, ext->container);
+
+	rb_erase(&ext->rb, &pd->extents);
+	/* the holes are rebuilt from the extents after loading */
+	if (!pd->loading) {
+		discard(c->fd, ext->offset, ext->offset + ext->length);
+		add_hole(pd, ext->container, ext->offset, ext->length);
+	}
+	free(ext);
+}
+
+/* Drop a reference with pd->lock held for write */
+static void put_extent_locked(struct pack_extent *ext)
+{
+	if (refcount_dec(&ext->refcnt) == 0)
+		release_extent(ext->disk, ext);
+}
+
+static void put_extent(struct pack_extent *ext)
+{
+	struct pack_disk *pd = ext->disk;
+
+	if (refcount_dec(&ext->refcnt) == 0) {
+		sd_write_lock(&pd->lock);
+		release_extent(pd, ext);
+		sd_rw_unlock(&pd->lock);
+	}
+}
+
+static struct pack_entry *lookup_entry(struct pack_disk *pd, uint64_t oid,
+				       uint8_t ec_index, uint32_t epoch)
+{
+	struct pack_entry key = {
+		.oid = oid,
+		.ec_index = ec_index,
+		.epoch = epoch,
+	};
+
+	return rb_search(&pd->entries, &key, rb, pack_entry_cmp);
+}
+
+/* Look up the object and pin its extent for I/O */
+static struct pack_extent *get_extent(struct pack_disk *pd, uint64_t oid,
+				      uint8_t ec_index, uint32_t epoch)
+{
+	struct pack_extent *ext = NULL;
+	struct pack_entry *entry;
+
+	sd_read_lock(&pd->lock);
+	entry = lookup_entry(pd, oid, ec_index, epoch);
+	if (entry) {
+		ext = entry->extent;
+		refcount_inc(&ext->refcnt);
+	}
+	sd_rw_unlock(&pd->lock);
+
+	return ext;
+}
+
+/*
+ * Insert 'entry' into the index.  An existing entry with the same key is
+ * replaced and returned; the caller must drop its extent after the index is
+ * synced.
+ */
+static struct pack_entry *insert_entry(struct pack_disk *pd,
+				       struct pack_entry *entry)
+{
+	struct pack_entry *old;
+
+	old = rb_insert(&pd->entries, entry, rb, pack_entry_cmp);
+	if (old) {
+		rb_replace_node(&old->rb, &entry->rb, &pd->entries);
+		rb_init_node(&old->rb);
+	}
+
+	return old;
+}
+
+static void fill_record(struct pack_record *rec,
+			const struct pack_entry *entry, enum pack_op op,
+			uint32_t new_epoch)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->oid = entry->oid;
+	rec->epoch = entry->epoch;
+	rec->new_epoch = new_epoch;
+	rec->ec_index = entry->ec_index;
+	rec->op = op;
+	if (op == PACK_SET) {
+		rec->container = entry->extent->container;
+		rec->offset = entry->extent->offset;
+		rec->length = entry->extent->length;
+	}
+	rec->crc = crc32c(0, rec, offsetof(struct pack_record, crc));
+}
+
+static int log_entry(struct pack_disk *pd, const struct pack_entry *entry,
+		     enum pack_op op, uint32_t new_epoch)
+{
+	struct pack_record rec;
+
+	fill_record(&rec, entry, op, new_epoch);
+	if (xwrite(pd->index_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+		sd_err("failed to update %s/%s, %m", pd->path, PACK_INDEX);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int sync_index(struct pack_disk *pd)
+{
+	if (pack_need_sync() && fdatasync(pd->index_fd) < 0) {
+		sd_err("failed to sync %s/%s, %m", pd->path, PACK_INDEX);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static void replay_record(struct pack_disk *pd, const struct pack_record *rec)
+{
+	struct pack_extent key = {
+		.container = rec->container,
+		.offset = rec->offset,
+	}, *ext;
+	struct pack_entry *entry, *old;
+
+	entry = lookup_entry(pd, rec->oid, rec->ec_index, rec->epoch);
+	switch (rec->op) {
+	case PACK_SET:
+		if (rec->container >= pd->nr_containers ||
+		    rec->offset + rec->length >
+		    get_container(pd, rec->container)->size) {
+			sd_err("invalid extent %"PRIu32":%"PRIu64" of %016"
+			       PRIx64, rec->container, rec->offset, rec->oid);
+			break;
+		}
+		ext = rb_search(&pd->extents, &key, rb, pack_extent_cmp);
+		if (!ext) {
+			ext = xzalloc(sizeof(*ext));
+			*ext = key;
+			ext->length = rec->length;
+			ext->disk = pd;
+			rb_insert(&pd->extents, ext, rb, pack_extent_cmp);
+		}
+		refcount_inc(&ext->refcnt);
+
+		entry = xzalloc(sizeof(*entry));
+		entry->oid = rec->oid;
+		entry->ec_index = rec->ec_index;
+		entry->epoch = rec->epoch;
+		entry->extent = ext;
+		old = insert_entry(pd, entry);
+		if (old) {
+			put_extent_locked(old->extent);
+			free(old);
+		}
+		break;
+	case PACK_DEL:
+		if (!entry)
+			break;
+		rb_erase(&entry->rb, &pd->entries);
+		put_extent_locked(entry->extent);
+		free(entry);
+		break;
+	case PACK_MOVE:
+		if (!entry)
+			break;
+		rb_erase(&entry->rb, &pd->entries);
+		entry->epoch = rec->new_epoch;
+		old = insert_entry(pd, entry);
+		if (old) {
+			put_extent_locked(old->extent);
+			free(old);
+		}
+		break;
+	default:
+		sd_err("unknown operation %d of %016"PRIx64, rec->op,
+		       rec->oid);
+		break;
+	}
+}
+
+static int open_containers(struct pack_disk *pd)
+{
+	struct pack_container *c;
+	char path[PACK_PATH_MAX];
+	struct stat s;
+	int fd, sync_fd;
+
+	for (;;) {
+		c = next_container(pd);
+		if (!c)
+			return -1;
+
+		snprintf(path, sizeof(path), "%s/c%08"PRIx32, pd->path,
+			 pd->nr_containers);
+		fd = open(path, O_RDWR);
+		if (fd < 0) {
+			if (errno == ENOENT)
+				return 0;
+			sd_err("failed to open %s, %m", path);
+			return -1;
+		}
+		sync_fd = open(path, O_RDWR | O_DSYNC);
+		if (sync_fd < 0 || fstat(fd, &s) < 0) {
+			sd_err("failed to open %s, %m", path);
+			if (sync_fd >= 0)
+				close(sync_fd);
+			close(fd);
+			return -1;
+		}
+
+		c->fd = fd;
+		c->sync_fd = sync_fd;
+		c->size = s.st_size;
+		pd->nr_containers++;
+	}
+}
+
+static int replay_index(struct pack_disk *pd)
+{
+	struct pack_record *recs;
+	char path[PACK_PATH_MAX];
+	uint64_t nr = 0;
+	ssize_t size;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", pd->path, PACK_INDEX);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		sd_err("failed to open %s, %m", path);
+		return -1;
+	}
+
+	recs = xmalloc(PACK_INDEX_BATCH * sizeof(*recs));
+	while ((size = xread(fd, recs, PACK_INDEX_BATCH * sizeof(*recs))) > 0) {
+		for (int i = 0; i < size / sizeof(*recs); i++) {
+			if (recs[i].crc != crc32c(0, recs + i,
+					offsetof(struct pack_record, crc))) {
+				/* a torn write at the crash */
+				sd_warn("%s is truncated at %"PRIu64, path,
+					nr);
+				goto out;
+			}
+			replay_record(pd, recs + i);
+			nr++;
+		}
+		if (size % sizeof(*recs))
+			break;
+	}
+	if (size < 0) {
+		sd_err("failed to read %s, %m", path);
+		free(recs);
+		close(fd);
+		return -1;
+	}
+out:
+	sd_debug("%s, %"PRIu64" records", path, nr);
+	free(recs);
+	close(fd);
+	return 0;
+}
+
+/* The free space is what the extents don't cover */
+static void build_holes(struct pack_disk *pd)
+{
+	struct pack_extent *ext;
+	uint32_t c = 0;
+	uint64_t end = 0;
+
+	rb_for_each_entry(ext, &pd->extents, rb) {
+		for (; c < ext->container; c++, end = 0)
+			if (end < get_container(pd, c)->size)
+				add_hole(pd, c, end,
+					 get_container(pd, c)->size - end);
+		if (end < ext->offset)
+			add_hole(pd, c, end, ext->offset - end);
+		end = max(end, ext->offset + ext->length);
+	}
+	for (; c < pd->nr_containers; c++, end = 0)
+		if (end < get_container(pd, c)->size)
+			add_hole(pd, c, end, get_container(pd, c)->size - end);
+}
+
+/* Rewrite the index with one record per object */
+static int compact_index(struct pack_disk *pd)
+{
+	char path[PACK_PATH_MAX], tmp_path[PACK_PATH_MAX];
+	struct pack_entry *entry;
+	struct pack_record *recs;
+	size_t nr = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", pd->path, PACK_INDEX);
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", pd->path, PACK_INDEX);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", tmp_path);
+		return -1;
+	}
+
+	recs = xmalloc(PACK_INDEX_BATCH * sizeof(*recs));
+	rb_for_each_entry(entry, &pd->entries, rb) {
+		fill_record(recs + nr++, entry, PACK_SET, 0);
+		if (nr < PACK_INDEX_BATCH)
+			continue;
+		if (xwrite(fd, recs, nr * sizeof(*recs)) != nr * sizeof(*recs))
+			goto err;
+		nr = 0;
+	}
+	if (xwrite(fd, recs, nr * sizeof(*recs)) != nr * sizeof(*recs) ||
+	    fdatasync(fd) < 0 || rename(tmp_path, path) < 0)
+		goto err;
+	if (sync_dir(pd->path) < 0)
+		goto err_free;
+
+	free(recs);
+	pd->index_fd = fd;
+	return 0;
+err:
+	sd_err("failed to write %s, %m", tmp_path);
+err_free:
+	free(recs);
+	close(fd);
+	unlink(tmp_path);
+	return -1;
+}
+
+/* Check that the extents of the removed objects can be zeroed */
+static bool punch_hole_supported(const char *dir)
+{
+	char path[PATH_MAX];
+	bool ret = false;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/.probe", dir);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", path);
+		return false;
+	}
+	if (xftruncate(fd, BLOCK_SIZE * 2) == 0 &&
+	    discard(fd, 0, BLOCK_SIZE) == 0)
+		ret = true;
+	close(fd);
+	unlink(path);
+
+	return ret;
+}
+
+static void free_pack_disk(struct pack_disk *pd)
+{
+	rb_destroy(&pd->entries, struct pack_entry, rb);
+	rb_destroy(&pd->extents, struct pack_extent, rb);
+	rb_destroy(&pd->holes_by_size, struct pack_hole, size_rb);
+	INIT_RB_ROOT(&pd->holes_by_pos);
+
+	for (uint32_t i = 0; i < pd->nr_containers; i++) {
+		close(get_container(pd, i)->fd);
+		close(get_container(pd, i)->sync_fd);
+	}
+	for (int i = 0; i < PACK_MAX_CHUNKS; i++)
+		free(pd->containers[i]);
+	if (pd->index_fd >= 0)
+		close(pd->index_fd);
+	sd_destroy_rw_lock(&pd->lock);
+	free(pd);
+}
+
+static struct pack_disk *load_pack_disk(const char *dir)
+{
+	struct pack_disk *pd = xzalloc(sizeof(*pd));
+
+	pstrcpy(pd->dir, sizeof(pd->dir), dir);
+	snprintf(pd->path, sizeof(pd->path), "%s/%s", dir, PACK_DIR);
+	sd_init_rw_lock(&pd->lock);
+	INIT_RB_ROOT(&pd->entries);
+	INIT_RB_ROOT(&pd->extents);
+	INIT_RB_ROOT(&pd->holes_by_size);
+	INIT_RB_ROOT(&pd->holes_by_pos);
+	pd->index_fd = -1;
+	pd->loading = true;
+	refcount_set(&pd->refcnt, 1);
+
+	if (xmkdir(pd->path, sd_def_dmode) < 0) {
+		sd_err("failed to create %s, %m", pd->path);
+		goto err;
+	}
+	if (!punch_hole_supported(pd->path)) {
+		sd_err("pack store needs FALLOC_FL_PUNCH_HOLE support, %s",
+		       pd->path);
+		goto err;
+	}
+	if (open_containers(pd) < 0 || replay_index(pd) < 0)
+		goto err;
+
+	build_holes(pd);
+	if (compact_index(pd) < 0)
+		goto err;
+	pd->loading = false;
+
+	sd_info("%s, %"PRIu32" containers", pd->path, pd->nr_containers);
+	return pd;
+err:
+	free_pack_disk(pd);
+	return NULL;
+}
+
+static struct pack_disk *find_pack_disk(const char *dir)
+{
+	for (int i = 0; i < nr_pack_disks; i++)
+		if (!strcmp(pack_disks[i]->dir, dir))
+			return pack_disks[i];
+
+	return NULL;
+}
+
+static void put_pack_disk(struct pack_disk *pd)
+{
+	if (refcount_dec(&pd->refcnt) == 0)
+		free_pack_disk(pd);
+}
+
+/*
+ * Get the disk of the object, the disks plugged later are loaded here.  The
+ * caller has to put the disk.
+ */
+static struct pack_disk *oid_to_pack_disk(uint64_t oid)
+{
+	const char *dir = md_get_object_dir(oid);
+	struct pack_disk *pd;
+
+	sd_read_lock(&pack_disks_lock);
+	pd = find_pack_disk(dir);
+	if (pd)
+		refcount_inc(&pd->refcnt);
+	sd_rw_unlock(&pack_disks_lock);
+	if (pd)
+		return pd;
+
+	sd_write_lock(&pack_disks_lock);
+	pd = find_pack_disk(dir);
+	if (!pd) {
+		pd = load_pack_disk(dir);
+		if (pd) {
+			pack_disks = xrealloc(pack_disks, (nr_pack_disks + 1) *
+					      sizeof(*pack_disks));
+			pack_disks[nr_pack_disks++] = pd;
+		}
+	}
+	if (pd)
+		refcount_inc(&pd->refcnt);
+	sd_rw_unlock(&pack_disks_lock);
+
+	if (!pd)
+		sd_err("no pack store for %016"PRIx64" in %s", oid, dir);
+	return pd;
+}
+
+static int pack_pread(uint64_t oid, struct pack_extent *ext, void *buf,
+		      uint32_t length, uint64_t offset)
+{
+	struct pack_disk *pd = ext->disk;
+	ssize_t size;
+
+	if (offset + length > ext->length) {
+		sd_err("out of extent %016"PRIx64", offset %"PRIu64
+		       ", length %"PRIu32, oid, offset, length);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	size = xpread(get_container(pd, ext->container)->fd, buf, length,
+		      ext->offset + offset);
+	if (size != length)
+		return pack_err(pd, oid, size < 0 ? errno : EIO);
+
+	return SD_RES_SUCCESS;
+}
+
+static int pack_pwrite(uint64_t oid, struct pack_extent *ext,
+		       const void *buf, uint32_t length, uint64_t offset)
+{
+	struct pack_disk *pd = ext->disk;
+	const struct pack_container *c = get_container(pd, ext->container);
+	ssize_t size;
+
+	if (offset + length > ext->length) {
+		sd_err("out of extent %016"PRIx64", offset %"PRIu64
+		       ", length %"PRIu32, oid, offset, length);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	size = xpwrite(pack_need_sync() ? c->sync_fd : c->fd, buf, length,
+		       ext->offset + offset);
+	if (size != length)
+		return pack_err(pd, oid, size < 0 ? errno : EIO);
+
+	return SD_RES_SUCCESS;
+}
+
+static int remove_object_disk(struct pack_disk *pd, uint64_t oid,
+			      uint8_t ec_index, uint32_t epoch)
+{
+	struct pack_entry *entry;
+	int ret;
+
+	sd_write_lock(&pd->lock);
+	entry = lookup_entry(pd, oid, ec_index, epoch);
+	if (!entry) {
+		sd_rw_unlock(&pd->lock);
+		return SD_RES_NO_OBJ;
+	}
+	ret = log_entry(pd, entry, PACK_DEL, 0);
+	if (ret == SD_RES_SUCCESS)
+		rb_erase(&entry->rb, &pd->entries);
+	sd_rw_unlock(&pd->lock);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* the extent can be reused only after the removal is persistent */
+	ret = sync_index(pd);
+	put_extent(entry->extent);
+	free(entry);
+
+	return ret;
+}
+
+/*
+ * Copy the object of 'epoch' from 'src' to 'dst' and remove it from 'src'.
+ * If 'dst' already has the object, only the copy in 'src' is removed.
+ */
+static int move_entry(struct pack_disk *dst, struct pack_disk *src,
+		      uint64_t oid, uint8_t ec_index, uint32_t epoch)
+{
+	struct pack_extent *sext, *ext = NULL;
+	struct pack_entry *entry;
+	uint64_t offset = 0;
+	uint32_t len;
+	bool exists;
+	void *buf;
+	int ret;
+
+	sext = get_extent(src, oid, ec_index, epoch);
+	if (!sext)
+		return SD_RES_NO_OBJ;
+
+	len = sext->length;
+	buf = xvalloc(len);
+	ret = pack_pread(oid, sext, buf, len, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	sd_write_lock(&dst->lock);
+	exists = !!lookup_entry(dst, oid, ec_index, epoch);
+	if (!exists)
+		ext = alloc_extent(dst, len);
+	sd_rw_unlock(&dst->lock);
+	if (exists)
+		goto remove;
+	if (!ext) {
+		ret = pack_err(dst, oid, errno);
+		goto out;
+	}
+
+	/* the new extent reads as zero */
+	if (is_sparse_object(oid))
+		trim_zero_blocks(buf, &offset, &len);
+	ret = pack_pwrite(oid, ext, buf, len, offset);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->oid = oid;
+	entry->ec_index = ec_index;
+	entry->epoch = epoch;
+	entry->extent = ext;
+
+	sd_write_lock(&dst->lock);
+	if (lookup_entry(dst, oid, ec_index, epoch)) {
+		/* moved by another thread */
+		sd_rw_unlock(&dst->lock);
+		free(entry);
+		goto remove;
+	}
+	ret = log_entry(dst, entry, PACK_SET, 0);
+	if (ret == SD_RES_SUCCESS) {
+		refcount_inc(&ext->refcnt);
+		insert_entry(dst, entry);
+	} else
+		free(entry);
+	sd_rw_unlock(&dst->lock);
+
+	if (ret == SD_RES_SUCCESS)
+		ret = sync_index(dst);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+remove:
+	ret = remove_object_disk(src, oid, ec_index, epoch);
+	if (ret == SD_RES_NO_OBJ)
+		ret = SD_RES_SUCCESS;
+	sd_debug("%016"PRIx64" epoch %"PRIu32" from %s to %s, %s", oid, epoch,
+		 src->dir, dst->dir, sd_strerror(ret));
+out:
+	if (ext)
+		put_extent(ext);
+	put_extent(sext);
+	free(buf);
+	return ret;
+}
+
+/*
+ * An object is looked up in the disk which it is hashed to, but it is left in
+ * another disk when the disks change.  Move it from there, like md_exist()
+ * does for the plain store, so that it is neither missed nor leaked.
+ */
+static bool find_misplaced(struct pack_disk *pd, uint64_t oid,
+			   uint8_t ec_index, uint32_t epoch)
+{
+	struct pack_disk *src = NULL;
+	int ret;
+
+	sd_read_lock(&pack_disks_lock);
+	for (int i = 0; i < nr_pack_disks && !src; i++) {
+		if (pack_disks[i] == pd)
+			continue;
+		sd_read_lock(&pack_disks[i]->lock);
+		if (lookup_entry(pack_disks[i], oid, ec_index, epoch)) {
+			src = pack_disks[i];
+			refcount_inc(&src->refcnt);
+		}
+		sd_rw_unlock(&pack_disks[i]->lock);
+	}
+	sd_rw_unlock(&pack_disks_lock);
+	if (!src)
+		return false;
+
+	ret = move_entry(pd, src, oid, ec_index, epoch);
+	put_pack_disk(src);
+
+	return ret == SD_RES_SUCCESS;
+}
+
+/* Same as get_extent(), but look for the misplaced object as well */
+static struct pack_extent *find_extent(struct pack_disk *pd, uint64_t oid,
+				       uint8_t ec_index, uint32_t epoch)
+{
+	struct pack_extent *ext = get_extent(pd, oid, ec_index, epoch);
+
+	if (!ext && find_misplaced(pd, oid, ec_index, epoch))
+		ext = get_extent(pd, oid, ec_index, epoch);
+
+	return ext;
+}
+
+static bool pack_exist(uint64_t oid, uint8_t ec_index)
+{
+	struct pack_disk *pd = oid_to_pack_disk(oid);
+	bool ret;
+
+	if (!pd)
+		return false;
+
+	ec_index = pack_ec_index(oid, ec_index);
+	sd_read_lock(&pd->lock);
+	ret = !!lookup_entry(pd, oid, ec_index, 0);
+	sd_rw_unlock(&pd->lock);
+	if (!ret)
+		ret = find_misplaced(pd, oid, ec_index, 0);
+	put_pack_disk(pd);
+
+	return ret;
+}
+
+static int pack_read(uint64_t oid, const struct siocb *iocb)
+{
+	uint8_t ec_index = pack_ec_index(oid, iocb->ec_index);
+	struct pack_disk *pd = oid_to_pack_disk(oid);
+	struct pack_extent *ext;
+	int ret;
+
+	if (!pd)
+		return SD_RES_EIO;
+
+	ext = find_extent(pd, oid, ec_index, 0);
+
+	/*
+	 * If the request is against the older epoch, try to read from
+	 * the stale objects
+	 */
+	if (!ext && (iocb->wildcard ||
+		     (0 < iocb->epoch && iocb->epoch < sys_epoch())))
+		ext = find_extent(pd, oid, ec_index, iocb->epoch);
+	if (!ext) {
+		put_pack_disk(pd);
+		return SD_RES_NO_OBJ;
+	}
+
+	ret = pack_pread(oid, ext, iocb->buf, iocb->length, iocb->offset);
+	put_extent(ext);
+	put_pack_disk(pd);
+
+	return ret;
+}
+
+static int pack_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct pack_disk *pd;
+	struct pack_extent *ext;
+	int ret;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	pd = oid_to_pack_disk(oid);
+	if (!pd)
+		return SD_RES_EIO;
+
+	ext = find_extent(pd, oid, pack_ec_index(oid, iocb->ec_index), 0);
+	if (!ext) {
+		put_pack_disk(pd);
+		return SD_RES_NO_OBJ;
+	}
+
+	ret = pack_pwrite(oid, ext, iocb->buf, iocb->length, iocb->offset);
+	put_extent(ext);
+	put_pack_disk(pd);
+
+	return ret;
+}
+
+static int create_and_write_disk(struct pack_disk *pd, uint64_t oid,
+				 const struct siocb *iocb)
+{
+	uint8_t ec_index = pack_ec_index(oid, iocb->ec_index);
+	size_t obj_size = get_store_objsize(oid);
+	uint64_t offset = iocb->offset;
+	uint32_t len = iocb->length;
+	struct pack_entry *entry;
+	struct pack_extent *ext;
+	int ret;
+
+	sd_write_lock(&pd->lock);
+	if (lookup_entry(pd, oid, ec_index, 0)) {
+		sd_rw_unlock(&pd->lock);
+		/* see default_create_and_write() */
+		sd_debug("%016"PRIx64" exists", oid);
+		return SD_RES_SUCCESS;
+	}
+	ext = alloc_extent(pd, obj_size);
+	sd_rw_unlock(&pd->lock);
+	if (!ext)
+		return pack_err(pd, oid, errno);
+
+	if (is_sparse_object(oid))
+		trim_zero_blocks(iocb->buf, &offset, &len);
+	else if (offset != 0 || len != obj_size)
+		xfallocate(get_container(pd, ext->container)->fd, 0,
+			   ext->offset, ext->length);
+
+	ret = pack_pwrite(oid, ext, iocb->buf, len, offset);
+	if (ret != SD_RES_SUCCESS) {
+		put_extent(ext);
+		return ret;
+	}
+
+	entry = xzalloc(sizeof(*entry));
+	entry->oid = oid;
+	entry->ec_index = ec_index;
+	entry->extent = ext;
+
+	sd_write_lock(&pd->lock);
+	if (lookup_entry(pd, oid, ec_index, 0)) {
+		/* recovery and the gateway created it at the same time */
+		sd_rw_unlock(&pd->lock);
+		free(entry);
+		put_extent(ext);
+		return SD_RES_SUCCESS;
+	}
+	ret = log_entry(pd, entry, PACK_SET, 0);
+	if (ret == SD_RES_SUCCESS) {
+		refcount_inc(&ext->refcnt);
+		insert_entry(pd, entry);
+	}
+	sd_rw_unlock(&pd->lock);
+
+	if (ret == SD_RES_SUCCESS)
+		ret = sync_index(pd);
+	else
+		free(entry);
+	put_extent(ext);
+
+	if (ret == SD_RES_SUCCESS)
+		objlist_cache_insert(oid);
+	return ret;
+}
+
+static int pack_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct pack_disk *pd = oid_to_pack_disk(oid);
+	int ret;
+
+	sd_debug("%016"PRIx64, oid);
+	if (!pd)
+		return SD_RES_EIO;
+
+	if (find_misplaced(pd, oid, pack_ec_index(oid, iocb->ec_index), 0))
+		/* see default_create_and_write() */
+		ret = SD_RES_SUCCESS;
+	else
+		ret = create_and_write_disk(pd, oid, iocb);
+	put_pack_disk(pd);
+
+	return ret;
+}
+
+static int pack_remove_object(uint64_t oid, uint8_t ec_index)
+{
+	struct pack_disk *pd = oid_to_pack_disk(oid);
+	int ret;
+
+	if (!pd)
+		return SD_RES_EIO;
+
+	ec_index = pack_ec_index(oid, ec_index);
+	ret = remove_object_disk(pd, oid, ec_index, 0);
+	if (ret == SD_RES_NO_OBJ && find_misplaced(pd, oid, ec_index, 0))
+		ret = remove_object_disk(pd, oid, ec_index, 0);
+	put_pack_disk(pd);
+
+	return ret;
+}
+
+static int link_disk(struct pack_disk *pd, uint64_t oid, uint32_t tgt_epoch)
+{
+	struct pack_entry *stale, *entry;
+	int ret;
+
+	sd_write_lock(&pd->lock);
+	if (lookup_entry(pd, oid, 0, 0)) {
+		sd_rw_unlock(&pd->lock);
+		return SD_RES_SUCCESS;
+	}
+	stale = lookup_entry(pd, oid, 0, tgt_epoch);
+	if (!stale) {
+		sd_rw_unlock(&pd->lock);
+		return SD_RES_NO_OBJ;
+	}
+
+	entry = xzalloc(sizeof(*entry));
+	entry->oid = oid;
+	entry->extent = stale->extent;
+	ret = log_entry(pd, entry, PACK_SET, 0);
+	if (ret == SD_RES_SUCCESS) {
+		refcount_inc(&entry->extent->refcnt);
+		insert_entry(pd, entry);
+	} else
+		free(entry);
+	sd_rw_unlock(&pd->lock);
+
+	if (ret == SD_RES_SUCCESS)
+		ret = sync_index(pd);
+	return ret;
+}
+
+static int pack_link(uint64_t oid, uint32_t tgt_epoch)
+{
+	struct pack_disk *pd = oid_to_pack_disk(oid);
+	int ret;
+
+	sd_debug("try link %016"PRIx64" from snapshot with epoch %d", oid,
+		 tgt_epoch);
+	if (!pd)
+		return SD_RES_EIO;
+
+	/* both the live and the stale object might be in another disk */
+	find_misplaced(pd, oid, 0, 0);
+	find_misplaced(pd, oid, 0, tgt_epoch);
+	ret = link_disk(pd, oid, tgt_epoch);
+	put_pack_disk(pd);
+
+	return ret;
+}
+
+/* See oid_stale() in plain_store.c */
+static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
+{
+	uint32_t i, nr_copies;
+	const struct sd_vnode *v;
+	bool ret = true;
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+
+	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
+	vinfo_oid_to_vnodes(oid, vinfo, nr_copies, obj_vnodes);
+	for (i = 0; i < nr_copies; i++) {
+		v = obj_vnodes[i];
+		if (vnode_is_local(v)) {
+			if (is_erasure_oid(oid)) {
+				if (i == ec_index)
+					ret = false;
+			} else {
+				ret = false;
+			}
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Move the live objects to the stale area of 'epoch'.  If 'vinfo' is NULL,
+ * all the objects are moved, otherwise only the ones which don't belong to
+ * this node any more.
+ */
+static int move_to_stale(struct pack_disk *pd, uint32_t epoch,
+			 struct vnode_info *vinfo)
+{
+	struct pack_entry *entry, *old, **moving = NULL;
+	struct pack_extent **dead = NULL;
+	size_t nr_moving = 0, nr_dead = 0;
+	int ret = SD_RES_SUCCESS;
+
+	sd_write_lock(&pd->lock);
+	/* moving changes the order of the entries, so collect them first */
+	rb_for_each_entry(entry, &pd->entries, rb) {
+		if (entry->epoch != 0)
+			continue;
+		if (vinfo && !oid_stale(entry->oid, entry->ec_index, vinfo))
+			continue;
+		moving = xrealloc(moving, (nr_moving + 1) * sizeof(*moving));
+		moving[nr_moving++] = entry;
+	}
+
+	for (size_t i = 0; i < nr_moving; i++) {
+		entry = moving[i];
+		ret = log_entry(pd, entry, PACK_MOVE, epoch);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		rb_erase(&entry->rb, &pd->entries);
+		entry->epoch = epoch;
+		old = insert_entry(pd, entry);
+		if (old) {
+			dead = xrealloc(dead, (nr_dead + 1) * sizeof(*dead));
+			dead[nr_dead++] = old->extent;
+			free(old);
+		}
+		sd_debug("moved object %016"PRIx64, entry->oid);
+	}
+	if (ret == SD_RES_SUCCESS)
+		ret = sync_index(pd);
+	if (ret == SD_RES_SUCCESS)
+		for (size_t i = 0; i < nr_dead; i++)
+			put_extent_locked(dead[i]);
+	sd_rw_unlock(&pd->lock);
+
+	free(moving);
+	free(dead);
+	return ret;
+}
+
+static int for_each_pack_disk(int (*func)(struct pack_disk *, void *),
+			      void *arg)
+{
+	int ret = SD_RES_SUCCESS;
+
+	sd_read_lock(&pack_disks_lock);
+	for (int i = 0; i < nr_pack_disks; i++) {
+		ret = func(pack_disks[i], arg);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+	sd_rw_unlock(&pack_disks_lock);
+
+	return ret;
+}
+
+static int update_epoch_disk(struct pack_disk *pd, void *arg)
+{
+	uint32_t epoch = *(uint32_t *)arg;
+	struct vnode_info *vinfo = get_vnode_info();
+	int ret;
+
+	ret = move_to_stale(pd, epoch, vinfo);
+	put_vnode_info(vinfo);
+
+	return ret;
+}
+
+static int pack_update_epoch(uint32_t epoch)
+{
+	sd_assert(epoch);
+	return for_each_pack_disk(update_epoch_disk, &epoch);
+}
+
+static int purge_obj_disk(struct pack_disk *pd, void *arg)
+{
+	return move_to_stale(pd, *(uint32_t *)arg, NULL);
+}
+
+static int pack_purge_obj(void)
+{
+	uint32_t tgt_epoch = get_latest_epoch();
+
+	return for_each_pack_disk(purge_obj_disk, &tgt_epoch);
+}
+
+/* Remove all the stale objects */
+static int cleanup_disk(struct pack_disk *pd, void *arg)
+{
+	struct pack_entry *entry;
+	struct pack_extent **dead = NULL;
+	size_t nr_dead = 0;
+	int ret = SD_RES_SUCCESS;
+
+	sd_write_lock(&pd->lock);
+	rb_for_each_entry(entry, &pd->entries, rb) {
+		if (entry->epoch == 0)
+			continue;
+
+		ret = log_entry(pd, entry, PACK_DEL, 0);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		rb_erase(&entry->rb, &pd->entries);
+		dead = xrealloc(dead, (nr_dead + 1) * sizeof(*dead));
+		dead[nr_dead++] = entry->extent;
+		free(entry);
+	}
+	if (ret == SD_RES_SUCCESS)
+		ret = sync_index(pd);
+	if (ret == SD_RES_SUCCESS)
+		for (size_t i = 0; i < nr_dead; i++)
+			put_extent_locked(dead[i]);
+	sd_rw_unlock(&pd->lock);
+
+	free(dead);
+	return ret;
+}
+
+static int pack_cleanup(void)
+{
+	return for_each_pack_disk(cleanup_disk, NULL);
+}
+
+static int pack_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+{
+	struct pack_disk *pd = oid_to_pack_disk(oid);
+	uint32_t length = get_store_objsize(oid);
+	struct pack_extent *ext;
+	void *buf;
+	int ret;
+
+	if (!pd)
+		return SD_RES_EIO;
+
+	ext = find_extent(pd, oid, 0, 0);
+	if (!ext)
+		ext = find_extent(pd, oid, 0, epoch);
+	if (!ext) {
+		put_pack_disk(pd);
+		return SD_RES_NO_OBJ;
+	}
+
+	buf = valloc(length);
+	if (buf == NULL) {
+		put_extent(ext);
+		put_pack_disk(pd);
+		return SD_RES_NO_MEM;
+	}
+
+	ret = pack_pread(oid, ext, buf, length, 0);
+	put_extent(ext);
+	put_pack_disk(pd);
+	if (ret != SD_RES_SUCCESS) {
+		free(buf);
+		return ret;
+	}
+
+	get_buffer_sha1(buf, length, sha1);
+	free(buf);
+
+	sd_debug("the message digest of %016"PRIx64" at epoch %d is %s", oid,
+		 epoch, sha1_to_hex(sha1));
+	return SD_RES_SUCCESS;
+}
+
+static int pack_sync(uint64_t oid, uint8_t ec_index)
+{
+	struct pack_disk *pd = oid_to_pack_disk(oid);
+	struct pack_extent *ext;
+	int ret = SD_RES_SUCCESS;
+
+	if (!pd)
+		return SD_RES_EIO;
+
+	ext = find_extent(pd, oid, pack_ec_index(oid, ec_index), 0);
+	if (!ext) {
+		put_pack_disk(pd);
+		return SD_RES_NO_OBJ;
+	}
+
+	if (fdatasync(get_container(pd, ext->container)->fd) < 0) {
+		sd_err("failed to sync %016"PRIx64", %m", oid);
+		ret = SD_RES_EIO;
+	}
+	put_extent(ext);
+	put_pack_disk(pd);
+
+	return ret;
+}
+
+static void free_pack_disks(void)
+{
+	sd_write_lock(&pack_disks_lock);
+	for (int i = 0; i < nr_pack_disks; i++)
+		put_pack_disk(pack_disks[i]);
+	free(pack_disks);
+	pack_disks = NULL;
+	nr_pack_disks = 0;
+	sd_rw_unlock(&pack_disks_lock);
+}
+
+static int purge_pack_dir(const char *path)
+{
+	char p[PATH_MAX];
+
+	snprintf(p, sizeof(p), "%s/%s", path, PACK_DIR);
+	if (purge_directory(p) < 0 && errno != ENOENT)
+		return SD_RES_EIO;
+
+	return SD_RES_SUCCESS;
+}
+
+/* Drop the disk, it is freed after the operations in progress */
+static void pack_unplug(const char *path)
+{
+	struct pack_disk *pd = NULL;
+
+	sd_write_lock(&pack_disks_lock);
+	for (int i = 0; i < nr_pack_disks; i++) {
+		if (strcmp(pack_disks[i]->dir, path))
+			continue;
+		pd = pack_disks[i];
+		pack_disks[i] = pack_disks[--nr_pack_disks];
+		break;
+	}
+	sd_rw_unlock(&pack_disks_lock);
+
+	if (pd) {
+		sd_info("%s", pd->path);
+		put_pack_disk(pd);
+	}
+}
+
+static int pack_format(void)
+{
+	sd_debug("try get a clean store");
+	free_pack_disks();
+	return for_each_obj_path(purge_pack_dir);
+}
+
+static int init_vdi_state(struct pack_entry *entry)
+{
+	struct sd_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
+	uint64_t oid = entry->oid;
+	int ret;
+
+	ret = pack_pread(oid, entry->extent, inode, SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read inode header %016" PRIx64 " %" PRId32,
+		       oid, entry->epoch);
+		goto out;
+	}
+	add_vdi_state_unordered(oid_to_vid(oid), inode->nr_copies,
+		      vdi_is_snapshot(inode), inode->copy_policy,
+		      inode->block_size_shift, inode->parent_vdi_id);
+	/* an old child VDI ID might be left there */
+	if (inode->copy_policy && ec_stripe_shift_valid(inode->ec_stripe_shift))
+		set_vdi_ec_stripe_shift(oid_to_vid(oid),
+					inode->ec_stripe_shift);
+
+	if (inode->name[0] == '\0')
+		atomic_set_bit(oid_to_vid(oid), sys->vdi_deleted);
+
+	atomic_set_bit(oid_to_vid(oid), sys->vdi_inuse);
+out:
+	free(inode);
+	return ret;
+}
+
+/* The stale objects first, so that the live ones win */
+static int init_objlist_and_vdi_bitmap(struct pack_disk *pd, void *arg)
+{
+	bool live = *(bool *)arg;
+	struct pack_entry *entry;
+	int ret;
+
+	rb_for_each_entry(entry, &pd->entries, rb) {
+		if (live != (entry->epoch == 0))
+			continue;
+
+		objlist_cache_insert(entry->oid);
+		if (!is_vdi_obj(entry->oid))
+			continue;
+		ret = init_vdi_state(entry);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int load_disk(const char *path)
+{
+	struct pack_disk *pd = load_pack_disk(path);
+
+	if (!pd)
+		return SD_RES_EIO;
+
+	sd_write_lock(&pack_disks_lock);
+	pack_disks = xrealloc(pack_disks, (nr_pack_disks + 1) *
+			      sizeof(*pack_disks));
+	pack_disks[nr_pack_disks++] = pd;
+	sd_rw_unlock(&pack_disks_lock);
+
+	return SD_RES_SUCCESS;
+}
+
+static int pack_init(void)
+{
+	bool live = false;
+	int ret;
+
+	sd_debug("use pack store driver");
+	if (uatomic_is_true(&sys->use_journal)) {
+		sd_warn("pack store doesn't support journaling, turn it off");
+		uatomic_set_false(&sys->use_journal);
+	}
+
+	free_pack_disks();
+	ret = for_each_obj_path(load_disk);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	for_each_pack_disk(init_objlist_and_vdi_bitmap, &live);
+	live = true;
+	return for_each_pack_disk(init_objlist_and_vdi_bitmap, &live);
+}
+
+static struct store_driver pack_store = {
+	.id = PACK_STORE,
+	.name = "pack",
+	.init = pack_init,
+	.exist = pack_exist,
+	.create_and_write = pack_create_and_write,
+	.write = pack_write,
+	.read = pack_read,
+	.link = pack_link,
+	.update_epoch = pack_update_epoch,
+	.cleanup = pack_cleanup,
+	.format = pack_format,
+	.remove_object = pack_remove_object,
+	.get_hash = pack_get_hash,
+	.sync = pack_sync,
+	.purge_obj = pack_purge_obj,
+	.unplug = pack_unplug,
+};
+
+add_store_driver(pack_store);
@@ -54,94 +54,28 @@ bool default_exist(uint64_t oid, uint8_t ec_index)
 	return md_exist(oid, ec_index, path);
 }
 
-/* Trim zero blocks of the beginning and end of the object. */
-static int default_trim(int fd, uint64_t oid, const struct siocb *iocb,
-			uint64_t *poffset, uint32_t *plen)
+int default_prepare_write(uint64_t oid, const struct siocb *iocb,
+			  struct store_aio *aio)
 {
-	trim_zero_blocks(iocb->buf, poffset, plen);
-
-	if (iocb->offset < *poffset) {
-		sd_debug("discard between %d, %ld, %016" PRIx64, iocb->offset,
-			 *poffset, oid);
-
-		if (discard(fd, iocb->offset, *poffset) < 0)
-			return -1;
-	}
+	return file_store_prepare_write(get_store_path, oid, iocb, aio);
+}
 
-	if (*poffset + *plen < iocb->offset + iocb->length) {
-		uint64_t end = iocb->offset + iocb->length;
-		uint32_t object_size = get_vdi_object_size(oid_to_vid(oid));
-		if (end == get_objsize(oid, object_size))
-			/* This is necessary to punch the last block */
-			end = round_up(end, BLOCK_SIZE);
-		sd_debug("discard between %ld, %ld, %016" PRIx64, *poffset + *plen,
-			 end, oid);
-
-		if (discard(fd, *poffset + *plen, end) < 0)
-			return -1;
-	}
+int default_prepare_read(uint64_t oid, const struct siocb *iocb,
+			 struct store_aio *aio)
+{
+	return file_store_prepare_read(get_store_path, oid, iocb, aio);
+}
 
-	return 0;
+int default_io_error(uint64_t oid, const struct siocb *iocb, bool write,
+		     ssize_t result, int err)
+{
+	return file_store_io_error(get_store_path, oid, iocb, write, result,
+				   err);
 }
 
 int default_write(uint64_t oid, const struct siocb *iocb)
 {
-	int flags = prepare_iocb(oid, iocb, false), fd,
-	    ret = SD_RES_SUCCESS;
-	char path[PATH_MAX];
-	ssize_t size;
-	uint32_t len = iocb->length;
-	uint64_t offset = iocb->offset;
-	static bool trim_is_supported = true;
-
-	if (iocb->epoch < sys_epoch()) {
-		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
-		return SD_RES_OLD_NODE_VER;
-	}
-
-	if (uatomic_is_true(&sys->use_journal) &&
-	    unlikely(journal_write_store(oid, iocb->buf, iocb->length,
-					 iocb->offset, false))
-	    != SD_RES_SUCCESS) {
-		sd_err("turn off journaling");
-		uatomic_set_false(&sys->use_journal);
-		flags |= O_DSYNC;
-		sync();
-	}
-
-	get_store_path(oid, iocb->ec_index, path);
-
-	/*
-	 * Make sure oid is in the right place because oid might be misplaced
-	 * in a wrong place, due to 'shutdown/restart with less/more disks' or
-	 * any bugs. We need call err_to_sderr() to return EIO if disk is broken
-	 */
-	if (!default_exist(oid, iocb->ec_index))
-		return err_to_sderr(path, oid, ENOENT);
-
-	fd = open(path, flags, sd_def_fmode);
-	if (unlikely(fd < 0))
-		return err_to_sderr(path, oid, errno);
-
-	if (trim_is_supported && is_sparse_object(oid)) {
-		if (default_trim(fd, oid, iocb, &offset, &len) < 0) {
-			trim_is_supported = false;
-			offset = iocb->offset;
-			len = iocb->length;
-		}
-	}
-
-	size = xpwrite(fd, iocb->buf, len, offset);
-	if (unlikely(size != len)) {
-		sd_err("failed to write object %016"PRIx64", path=%s, offset=%"
-		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
-		       iocb->offset, iocb->length, size);
-		ret = err_to_sderr(path, oid, errno);
-		goto out;
-	}
-out:
-	close(fd);
-	return ret;
+	return file_store_write(get_store_path, oid, iocb);
 }
 
 static int make_stale_dir(const char *path)
@@ -206,6 +140,10 @@ static int init_vdi_state(uint64_t oid, const char *wd, uint32_t epoch)
 	add_vdi_state_unordered(oid_to_vid(oid), inode->nr_copies,
 		      vdi_is_snapshot(inode), inode->copy_policy,
 		      inode->block_size_shift, inode->parent_vdi_id);
+	/* an old child VDI ID might be left there */
+	if (inode->copy_policy && ec_stripe_shift_valid(inode->ec_stripe_shift))
+		set_vdi_ec_stripe_shift(oid_to_vid(oid),
+					inode->ec_stripe_shift);
 
 	if (inode->name[0] == '\0')
 		atomic_set_bit(oid_to_vid(oid), sys->vdi_deleted);
@@ -247,7 +185,7 @@ int default_init(void)
 
 	for_each_object_in_stale(init_objlist_and_vdi_bitmap, NULL);
 
-	return for_each_object_in_wd(init_objlist_and_vdi_bitmap, true, NULL);
+	return md_load_objects(init_objlist_and_vdi_bitmap, NULL);
 }
 
 static int default_read_from_path(uint64_t oid, const char *path,
@@ -287,8 +225,7 @@ int default_read(uint64_t oid, const struct siocb *iocb)
 	int ret;
 	char path[PATH_MAX];
 
-	get_store_path(oid, iocb->ec_index, path);
-	ret = default_read_from_path(oid, path, iocb);
+	ret = file_store_read(get_store_path, oid, iocb);
 
 	/*
 	 * If the request is against the older epoch, try to read from
@@ -319,7 +256,7 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 	get_store_tmp_path(oid, iocb->ec_index, tmp_path);
 
 	if (uatomic_is_true(&sys->use_journal) &&
-	    journal_write_store(oid, iocb->buf, iocb->length,
+	    journal_write_store(oid, iocb->ec_index, iocb->buf, iocb->length,
 				iocb->offset, true)
 	    != SD_RES_SUCCESS) {
 		sd_err("turn off journaling");
@@ -376,6 +313,8 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
+	md_index_object(path, false);
+	fd_cache_invalidate(oid);
 
 	close(fd);
 
@@ -398,6 +337,8 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		close(fd);
 		if (unlink(path) != 0)
 			sd_err("failed to unlink %s: %m", path);
+		else
+			md_index_object(path, true);
 		return ret;
 	}
 	close(fd);
@@ -432,6 +373,7 @@ int default_link(uint64_t oid, uint32_t tgt_epoch)
 		sd_debug("failed to link from %s to %s, %m", stale_path, path);
 		return err_to_sderr(path, oid, errno);
 	}
+	md_index_object(path, false);
 out:
 	return SD_RES_SUCCESS;
 }
@@ -452,7 +394,7 @@ static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
 	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
 
 	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
-	oid_to_vnodes(oid, &vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(oid, vinfo, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (vnode_is_local(v)) {
@@ -495,6 +437,8 @@ static int move_object_to_stale_dir(uint64_t oid, const char *wd,
 		       path);
 		return SD_RES_EIO;
 	}
+	md_index_object(path, true);
+	fd_cache_invalidate(oid);
 
 	sd_debug("moved object %016"PRIx64, oid);
 	return SD_RES_SUCCESS;
@@ -519,8 +463,13 @@ int default_update_epoch(uint32_t epoch)
 
 int default_format(void)
 {
+	int ret;
+
 	sd_debug("try get a clean store");
-	return for_each_obj_path(purge_dir);
+	fd_cache_invalidate_all();
+	ret = for_each_obj_path(purge_dir);
+	md_reset_object_index();
+	return ret;
 }
 
 int default_remove_object(uint64_t oid, uint8_t ec_index)
@@ -539,6 +488,8 @@ int default_remove_object(uint64_t oid, uint8_t ec_index)
 		sd_err("failed, %s, %m", path);
 		return SD_RES_EIO;
 	}
+	md_index_object(path, true);
+	fd_cache_invalidate(oid);
 
 	return SD_RES_SUCCESS;
 }
@@ -637,6 +588,11 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	return ret;
 }
 
+int default_sync(uint64_t oid, uint8_t ec_index)
+{
+	return file_store_sync(get_store_path, oid, ec_index);
+}
+
 int default_purge_obj(void)
 {
 	uint32_t tgt_epoch = get_latest_epoch();
@@ -659,7 +615,11 @@ static struct store_driver plain_store = {
 	.format = default_format,
 	.remove_object = default_remove_object,
 	.get_hash = default_get_hash,
+	.sync = default_sync,
 	.purge_obj = default_purge_obj,
+	.prepare_read = default_prepare_read,
+	.prepare_write = default_prepare_write,
+	.io_error = default_io_error,
 };
 
 add_store_driver(plain_store);
@@ -0,0 +1,1391 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Raw store driver
+ *
+ * The raw store keeps the objects directly on block devices, without a file
+ * system.  Each disk of md is a block device, or a large regular file for
+ * testing, and is laid out as below:
+ *
+ *  - The superblock in the first block describes the layout.
+ *  - The object table has an entry for every slot.  The entry of the first
+ *    slot of an object holds its oid, ec index and epoch (zero for the live
+ *    object) and the number of the slots it occupies.  The other entries are
+ *    zero.
+ *  - The data area is an array of the fixed size slots.  A data object fits
+ *    in one slot, and larger objects like inodes occupy contiguous slots.
+ *
+ * The whole table is kept in memory and a block of it is written back
+ * whenever an entry in it changes.  A new object is written to its slots
+ * before its entry is synced, and slots are reused only after the entry of
+ * their previous object is cleared on the disk, so a crash can lose only the
+ * objects whose entries were not synced yet.
+ *
+ * All the I/O is done with O_DIRECT.  Requests which are not aligned to
+ * BLOCK_SIZE are bounced through the aligned buffers of the data buffer pool,
+ * and the partial blocks are read, modified and written under a lock.
+ *
+ * Since an entry describes one object, linking a stale object back copies
+ * its data to new slots.
+ *
+ * A device is formatted only by the cluster format and by the disk plug.  A
+ * device without a valid superblock fails to load, so a wrong path never
+ * gets overwritten at startup.
+ */
+
+#include <linux/falloc.h>
+
+#include "sheep_priv.h"
+#include "sha1.h"
+
+#define RAW_MAGIC		0x5344524157535431 /* "SDRAWST1" */
+#define RAW_VERSION		1
+#define RAW_SLOT_SIZE		SD_DATA_OBJ_SIZE
+#define RAW_DATA_ALIGN		(UINT64_C(1) << 20) /* 1M */
+#define RAW_ZERO_SIZE		(UINT64_C(1) << 20) /* 1M */
+#define RAW_NR_RMW_LOCKS	64
+
+struct raw_super {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint64_t nr_slots;
+	uint64_t table_offset;
+	uint64_t data_offset;
+	uint32_t __pad;
+	uint32_t crc;
+};
+
+struct raw_slot {
+	uint64_t oid;
+	uint32_t epoch;
+	uint32_t nr_slots;	/* zero for a free slot */
+	uint8_t ec_index;
+	uint8_t __pad[11];
+	uint32_t crc;
+};
+
+struct raw_entry {
+	struct rb_node rb;	/* in raw_disk->entries */
+	uint64_t oid;
+	uint32_t epoch;		/* zero for the live object */
+	uint8_t ec_index;
+	uint32_t slot;
+	uint32_t nr_slots;
+	refcnt_t refcnt;	/* the index and the I/O in flight */
+	struct raw_disk *disk;
+};
+
+struct raw_disk {
+	char path[PATH_MAX];
+	struct sd_rw_lock lock;
+	int fd;
+	int sync_fd;		/* opened with O_DSYNC */
+	struct raw_super *super;
+	struct raw_slot *table;
+	uint64_t table_size;
+	unsigned long *dirty;	/* the blocks of the table to be written */
+	unsigned long *used;	/* the allocated slots */
+	uint64_t nr_free;
+	uint64_t next_slot;	/* where the next fit allocation starts */
+	struct rb_root entries;
+	struct sd_mutex rmw_lock[RAW_NR_RMW_LOCKS];
+	bool offline;		/* unplugged, kept until it is plugged back */
+};
+
+static struct raw_disk **raw_disks;
+static int nr_raw_disks;
+static struct sd_rw_lock raw_disks_lock = SD_RW_LOCK_INITIALIZER;
+
+static int raw_entry_cmp(const struct raw_entry *a, const struct raw_entry *b)
+{
+	return intcmp(a->oid, b->oid) ?: intcmp(a->ec_index, b->ec_index) ?:
+		intcmp(a->epoch, b->epoch);
+}
+
+/* Replicated objects have one copy per node, so ignore their ec index */
+static inline uint8_t raw_ec_index(uint64_t oid, uint8_t ec_index)
+{
+	return is_erasure_oid(oid) ? ec_index : 0;
+}
+
+static inline bool raw_need_sync(void)
+{
+	return !sys->nosync;
+}
+
+static inline uint64_t slot_offset(const struct raw_disk *rd, uint32_t slot)
+{
+	return rd->super->data_offset + (uint64_t)slot * RAW_SLOT_SIZE;
+}
+
+static int raw_err(const struct raw_disk *rd, uint64_t oid, int err)
+{
+	switch (err) {
+	case ENOSPC:
+		sd_err("diskfull, oid=%016"PRIx64, oid);
+		return SD_RES_NO_SPACE;
+	case EINTR:
+	case EAGAIN:
+		sd_err("%s, oid=%016"PRIx64, strerror(err), oid);
+		/* make gateway try again */
+		return SD_RES_NETWORK_ERROR;
+	default:
+		sd_err("oid=%016"PRIx64", %s, %s", oid, rd->path,
+		       strerror(err));
+		return md_handle_eio(rd->path);
+	}
+}
+
+static uint32_t super_crc(const struct raw_super *sb)
+{
+	return crc32c(0, sb, offsetof(struct raw_super, crc));
+}
+
+static uint32_t slot_crc(const struct raw_slot *s)
+{
+	return crc32c(0, s, offsetof(struct raw_slot, crc));
+}
+
+/* Lay out a device of 'size' bytes, return false if it is too small */
+static bool init_super(struct raw_super *sb, uint64_t size)
+{
+	uint64_t nr, table_size, data_offset;
+
+	if (size < BLOCK_SIZE + RAW_DATA_ALIGN)
+		return false;
+
+	nr = (size - BLOCK_SIZE) / (RAW_SLOT_SIZE + sizeof(struct raw_slot));
+	table_size = round_up(nr * sizeof(struct raw_slot), BLOCK_SIZE);
+	data_offset = round_up(BLOCK_SIZE + table_size, RAW_DATA_ALIGN);
+	if (size <= data_offset)
+		return false;
+	nr = min(nr, (size - data_offset) / RAW_SLOT_SIZE);
+	if (nr == 0 || nr > INT32_MAX)
+		return false;
+
+	memset(sb, 0, sizeof(*sb));
+	sb->magic = RAW_MAGIC;
+	sb->version = RAW_VERSION;
+	sb->slot_size = RAW_SLOT_SIZE;
+	sb->nr_slots = nr;
+	sb->table_offset = BLOCK_SIZE;
+	sb->data_offset = data_offset;
+	sb->crc = super_crc(sb);
+	return true;
+}
+
+static bool super_valid(const struct raw_super *sb, uint64_t size)
+{
+	uint64_t table_size = sb->nr_slots * sizeof(struct raw_slot);
+
+	return sb->crc == super_crc(sb) && sb->version == RAW_VERSION &&
+		sb->slot_size == RAW_SLOT_SIZE && sb->nr_slots &&
+		sb->nr_slots <= INT32_MAX && sb->table_offset == BLOCK_SIZE &&
+		sb->table_offset + table_size <= sb->data_offset &&
+		sb->data_offset + sb->nr_slots * RAW_SLOT_SIZE <= size;
+}
+
+/* Write a fresh superblock and an empty object table */
+static int format_device(const char *path, int fd, uint64_t size)
+{
+	struct raw_super *sb = xvalloc(BLOCK_SIZE);
+	void *zero = xvalloc(RAW_ZERO_SIZE);
+	int ret = SD_RES_EIO;
+
+	if (!init_super(sb, size)) {
+		sd_err("%s is too small, %"PRIu64" bytes", path, size);
+		goto out;
+	}
+
+	for (uint64_t off = sb->table_offset; off < sb->data_offset;
+	     off += RAW_ZERO_SIZE) {
+		size_t len = min(RAW_ZERO_SIZE, sb->data_offset - off);
+
+		if (xpwrite(fd, zero, len, off) != len) {
+			sd_err("failed to clear the table of %s, %m", path);
+			goto out;
+		}
+	}
+	if (xpwrite(fd, sb, BLOCK_SIZE, 0) != BLOCK_SIZE ||
+	    fdatasync(fd) < 0) {
+		sd_err("failed to write the superblock of %s, %m", path);
+		goto out;
+	}
+
+	sd_info("%s, %"PRIu64" slots", path, sb->nr_slots);
+	ret = SD_RES_SUCCESS;
+out:
+	free(sb);
+	free(zero);
+	return ret;
+}
+
+/* Allocate 'nr' contiguous slots, return -1 if there is no room */
+static int64_t alloc_slots(struct raw_disk *rd, uint32_t nr)
+{
+	uint64_t total = rd->super->nr_slots, start = rd->next_slot, pos, end;
+	bool wrapped = false;
+
+	if (rd->nr_free < nr) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	for (pos = start;; pos = end) {
+		pos = find_next_zero_bit(rd->used, total, pos);
+		if (wrapped && pos >= start)
+			break;
+		if (pos + nr > total) {
+			if (wrapped)
+				break;
+			wrapped = true;
+			end = 0;
+			continue;
+		}
+		end = find_next_bit(rd->used, pos + nr, pos);
+		if (end < pos + nr)
+			continue;
+
+		for (uint32_t i = 0; i < nr; i++)
+			set_bit(pos + i, rd->used);
+		rd->nr_free -= nr;
+		rd->next_slot = pos + nr;
+		return pos;
+	}
+
+	errno = ENOSPC;
+	return -1;
+}
+
+static void release_entry(struct raw_disk *rd, struct raw_entry *entry)
+{
+	for (uint32_t i = 0; i < entry->nr_slots; i++)
+		clear_bit(entry->slot + i, rd->used);
+	rd->nr_free += entry->nr_slots;
+	free(entry);
+}
+
+static void put_entry_locked(struct raw_entry *entry)
+{
+	if (refcount_dec(&entry->refcnt) == 0)
+		release_entry(entry->disk, entry);
+}
+
+static void put_entry(struct raw_entry *entry)
+{
+	struct raw_disk *rd = entry->disk;
+
+	if (refcount_dec(&entry->refcnt) == 0) {
+		sd_write_lock(&rd->lock);
+		release_entry(rd, entry);
+		sd_rw_unlock(&rd->lock);
+	}
+}
+
+/* Allocate the slots of a new object, the entry is pinned for I/O */
+static struct raw_entry *alloc_entry(struct raw_disk *rd, uint64_t oid,
+				     uint8_t ec_index, size_t size)
+{
+	uint32_t nr = DIV_ROUND_UP(size, RAW_SLOT_SIZE);
+	struct raw_entry *entry;
+	int64_t slot;
+
+	slot = alloc_slots(rd, nr);
+	if (slot < 0)
+		return NULL;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->oid = oid;
+	entry->ec_index = ec_index;
+	entry->slot = slot;
+	entry->nr_slots = nr;
+	entry->disk = rd;
+	refcount_set(&entry->refcnt, 1);
+
+	return entry;
+}
+
+static struct raw_entry *lookup_entry(struct raw_disk *rd, uint64_t oid,
+				      uint8_t ec_index, uint32_t epoch)
+{
+	struct raw_entry key = {
+		.oid = oid,
+		.ec_index = ec_index,
+		.epoch = epoch,
+	};
+
+	return rb_search(&rd->entries, &key, rb, raw_entry_cmp);
+}
+
+/* Look up the object and pin it for I/O */
+static struct raw_entry *get_entry(struct raw_disk *rd, uint64_t oid,
+				   uint8_t ec_index, uint32_t epoch)
+{
+	struct raw_entry *entry;
+
+	sd_read_lock(&rd->lock);
+	entry = lookup_entry(rd, oid, ec_index, epoch);
+	if (entry)
+		refcount_inc(&entry->refcnt);
+	sd_rw_unlock(&rd->lock);
+
+	return entry;
+}
+
+/*
+ * Insert 'entry' into the index.  An existing entry with the same key is
+ * replaced and returned.
+ */
+static struct raw_entry *insert_entry(struct raw_disk *rd,
+				      struct raw_entry *entry)
+{
+	struct raw_entry *old;
+
+	old = rb_insert(&rd->entries, entry, rb, raw_entry_cmp);
+	if (old) {
+		rb_replace_node(&old->rb, &entry->rb, &rd->entries);
+		rb_init_node(&old->rb);
+	}
+
+	return old;
+}
+
+static inline void mark_dirty(struct raw_disk *rd, uint32_t slot)
+{
+	set_bit(slot * sizeof(struct raw_slot) / BLOCK_SIZE, rd->dirty);
+}
+
+static void set_slot(struct raw_disk *rd, const struct raw_entry *entry)
+{
+	struct raw_slot *s = rd->table + entry->slot;
+
+	memset(s, 0, sizeof(*s));
+	s->oid = entry->oid;
+	s->epoch = entry->epoch;
+	s->nr_slots = entry->nr_slots;
+	s->ec_index = entry->ec_index;
+	s->crc = slot_crc(s);
+	mark_dirty(rd, entry->slot);
+}
+
+static void clear_slot(struct raw_disk *rd, uint32_t slot)
+{
+	memset(rd->table + slot, 0, sizeof(struct raw_slot));
+	mark_dirty(rd, slot);
+}
+
+/* Write back the dirty blocks of the table, called with the lock held */
+static int flush_table(struct raw_disk *rd)
+{
+	unsigned long nr = rd->table_size / BLOCK_SIZE, start, end;
+	int fd = raw_need_sync() ? rd->sync_fd : rd->fd;
+
+	for (start = find_next_bit(rd->dirty, nr, 0); start < nr;
+	     start = find_next_bit(rd->dirty, nr, end)) {
+		uint64_t off = start * BLOCK_SIZE;
+		size_t len;
+
+		end = find_next_zero_bit(rd->dirty, nr, start);
+		len = (end - start) * BLOCK_SIZE;
+		if (xpwrite(fd, (char *)rd->table + off, len,
+			    rd->super->table_offset + off) != len) {
+			sd_err("failed to update the table of %s, %m",
+			       rd->path);
+			return SD_RES_EIO;
+		}
+		for (unsigned long i = start; i < end; i++)
+			clear_bit(i, rd->dirty);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/* Read or write a part of the object with O_DIRECT */
+static int raw_io(uint64_t oid, struct raw_entry *entry, void *buf,
+		  uint32_t length, uint64_t offset, bool write)
+{
+	struct raw_disk *rd = entry->disk;
+	uint64_t start = slot_offset(rd, entry->slot) + offset;
+	uint64_t end = start + length;
+	uint64_t astart = round_down(start, BLOCK_SIZE);
+	uint64_t aend = round_up(end, BLOCK_SIZE);
+	size_t alen = aend - astart;
+	int fd = write && raw_need_sync() ? rd->sync_fd : rd->fd;
+	struct sd_mutex *lock;
+	ssize_t size;
+	char *bounce;
+
+	if (offset + length > (uint64_t)entry->nr_slots * RAW_SLOT_SIZE) {
+		sd_err("out of slots %016"PRIx64", offset %"PRIu64
+		       ", length %"PRIu32, oid, offset, length);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	if (start == astart && end == aend &&
+	    ((uintptr_t)buf & (BLOCK_SIZE - 1)) == 0) {
+		if (write)
+			size = xpwrite(fd, buf, length, start);
+		else
+			size = xpread(fd, buf, length, start);
+		if (size != length)
+			return raw_err(rd, oid, size < 0 ? errno : EIO);
+		return SD_RES_SUCCESS;
+	}
+
+	bounce = alloc_data_buffer(alen);
+	if (!write) {
+		size = xpread(fd, bounce, alen, astart);
+		if (size == alen)
+			memcpy(buf, bounce + start - astart, length);
+		goto out;
+	}
+
+	/* read, modify and write the partial blocks at both ends */
+	lock = rd->rmw_lock + entry->slot % RAW_NR_RMW_LOCKS;
+	sd_mutex_lock(lock);
+	if ((start != astart &&
+	     xpread(rd->fd, bounce, BLOCK_SIZE, astart) != BLOCK_SIZE) ||
+	    (end != aend && (alen > BLOCK_SIZE || start == astart) &&
+	     xpread(rd->fd, bounce + alen - BLOCK_SIZE, BLOCK_SIZE,
+		    aend - BLOCK_SIZE) != BLOCK_SIZE))
+		size = -1;
+	else {
+		memcpy(bounce + start - astart, buf, length);
+		size = xpwrite(fd, bounce, alen, astart);
+	}
+	sd_mutex_unlock(lock);
+out:
+	free_data_buffer(bounce, alen);
+	if (size != alen)
+		return raw_err(rd, oid, size < 0 ? errno : EIO);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Fill the slots of a new object with zero */
+static int zero_entry(uint64_t oid, struct raw_entry *entry)
+{
+	struct raw_disk *rd = entry->disk;
+	void *zero;
+	int ret = SD_RES_SUCCESS;
+
+	if (xfallocate(rd->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		       slot_offset(rd, entry->slot),
+		       (uint64_t)entry->nr_slots * RAW_SLOT_SIZE) == 0) {
+		if (raw_need_sync() && fdatasync(rd->fd) < 0)
+			return raw_err(rd, oid, errno);
+		return SD_RES_SUCCESS;
+	}
+
+	zero = alloc_data_buffer(RAW_SLOT_SIZE);
+	memset(zero, 0, RAW_SLOT_SIZE);
+	for (uint32_t i = 0; i < entry->nr_slots; i++) {
+		ret = raw_io(oid, entry, zero, RAW_SLOT_SIZE,
+			     (uint64_t)i * RAW_SLOT_SIZE, true);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+	free_data_buffer(zero, RAW_SLOT_SIZE);
+
+	return ret;
+}
+
+/* Make a new object visible, its data must be written already */
+static int commit_entry(struct raw_disk *rd, struct raw_entry *entry)
+{
+	int ret;
+
+	sd_write_lock(&rd->lock);
+	if (lookup_entry(rd, entry->oid, entry->ec_index, entry->epoch)) {
+		/* recovery and the gateway created it at the same time */
+		put_entry_locked(entry);
+		sd_rw_unlock(&rd->lock);
+		return SD_RES_SUCCESS;
+	}
+	set_slot(rd, entry);
+	ret = flush_table(rd);
+	if (ret == SD_RES_SUCCESS) {
+		refcount_inc(&entry->refcnt);
+		insert_entry(rd, entry);
+	} else
+		/* the block stays dirty and is written at the next flush */
+		clear_slot(rd, entry->slot);
+	put_entry_locked(entry);
+	sd_rw_unlock(&rd->lock);
+
+	return ret;
+}
+
+static int load_table(struct raw_disk *rd)
+{
+	uint64_t nr = rd->super->nr_slots, nr_objs = 0;
+	struct raw_entry *entry, *old;
+
+	if (xpread(rd->fd, rd->table, rd->table_size,
+		   rd->super->table_offset) != rd->table_size) {
+		sd_err("failed to read the table of %s, %m", rd->path);
+		return SD_RES_EIO;
+	}
+
+	for (uint64_t slot = 0; slot < nr; slot++) {
+		const struct raw_slot *s = rd->table + slot;
+
+		if (s->nr_slots == 0)
+			continue;
+		if (s->crc != slot_crc(s) || slot + s->nr_slots > nr ||
+		    test_bit(slot, rd->used)) {
+			sd_err("invalid entry of slot %"PRIu64" in %s", slot,
+			       rd->path);
+			clear_slot(rd, slot);
+			continue;
+		}
+
+		entry = xzalloc(sizeof(*entry));
+		entry->oid = s->oid;
+		entry->epoch = s->epoch;
+		entry->ec_index = s->ec_index;
+		entry->slot = slot;
+		entry->nr_slots = s->nr_slots;
+		entry->disk = rd;
+		refcount_set(&entry->refcnt, 1);
+		old = rb_insert(&rd->entries, entry, rb, raw_entry_cmp);
+		if (old) {
+			/* a crash while moving an object, keep the first */
+			sd_debug("duplicate %016"PRIx64" in %s", s->oid,
+				 rd->path);
+			clear_slot(rd, slot);
+			free(entry);
+			continue;
+		}
+		for (uint32_t i = 0; i < entry->nr_slots; i++)
+			set_bit(slot + i, rd->used);
+		rd->nr_free -= entry->nr_slots;
+		nr_objs++;
+	}
+
+	sd_info("%s, %"PRIu64" objects, %"PRIu64" free slots", rd->path,
+		nr_objs, rd->nr_free);
+	return flush_table(rd);
+}
+
+static void free_raw_disk(struct raw_disk *rd)
+{
+	rb_destroy(&rd->entries, struct raw_entry, rb);
+	for (int i = 0; i < RAW_NR_RMW_LOCKS; i++)
+		sd_destroy_mutex(rd->rmw_lock + i);
+	if (rd->fd >= 0)
+		close(rd->fd);
+	if (rd->sync_fd >= 0)
+		close(rd->sync_fd);
+	free(rd->super);
+	free(rd->table);
+	free(rd->dirty);
+	free(rd->used);
+	sd_destroy_rw_lock(&rd->lock);
+	free(rd);
+}
+
+static struct raw_disk *load_raw_disk(const char *path)
+{
+	struct raw_disk *rd = xzalloc(sizeof(*rd));
+	uint64_t size;
+
+	pstrcpy(rd->path, sizeof(rd->path), path);
+	sd_init_rw_lock(&rd->lock);
+	for (int i = 0; i < RAW_NR_RMW_LOCKS; i++)
+		sd_init_mutex(rd->rmw_lock + i);
+	INIT_RB_ROOT(&rd->entries);
+	rd->super = xvalloc(BLOCK_SIZE);
+
+	rd->fd = open(path, O_RDWR | O_DIRECT);
+	rd->sync_fd = open(path, O_RDWR | O_DIRECT | O_DSYNC);
+	if (rd->fd < 0 || rd->sync_fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		goto err;
+	}
+	size = get_raw_disk_size(rd->fd);
+	if (!size) {
+		sd_err("%s is not a raw disk", path);
+		goto err;
+	}
+
+	if (xpread(rd->fd, rd->super, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+		sd_err("failed to read the superblock of %s, %m", path);
+		goto err;
+	}
+	/* only the cluster format and the disk plug format a device */
+	if (rd->super->magic != RAW_MAGIC) {
+		sd_err("%s is not formatted for the raw store", path);
+		goto err;
+	}
+	if (!super_valid(rd->super, size)) {
+		sd_err("invalid superblock of %s", path);
+		goto err;
+	}
+
+	rd->table_size = round_up(rd->super->nr_slots *
+				  sizeof(struct raw_slot), BLOCK_SIZE);
+	rd->table = xvalloc(rd->table_size);
+	rd->dirty = alloc_bitmap(NULL, 0, rd->table_size / BLOCK_SIZE);
+	rd->used = alloc_bitmap(NULL, 0, rd->super->nr_slots);
+	rd->nr_free = rd->super->nr_slots;
+	if (load_table(rd) != SD_RES_SUCCESS)
+		goto err;
+
+	return rd;
+err:
+	free_raw_disk(rd);
+	return NULL;
+}
+
+static struct raw_disk *find_raw_disk(const char *path)
+{
+	for (int i = 0; i < nr_raw_disks; i++)
+		if (!strcmp(raw_disks[i]->path, path))
+			return raw_disks[i];
+
+	return NULL;
+}
+
+/* Get the disk of the object, the disks plugged later are loaded here */
+static struct raw_disk *oid_to_raw_disk(uint64_t oid)
+{
+	const char *path = md_get_object_dir(oid);
+	struct raw_disk *rd;
+
+	sd_read_lock(&raw_disks_lock);
+	rd = find_raw_disk(path);
+	sd_rw_unlock(&raw_disks_lock);
+	if (rd)
+		return rd;
+
+	sd_write_lock(&raw_disks_lock);
+	rd = find_raw_disk(path);
+	if (!rd) {
+		rd = load_raw_disk(path);
+		if (rd) {
+			raw_disks = xrealloc(raw_disks, (nr_raw_disks + 1) *
+					     sizeof(*raw_disks));
+			raw_disks[nr_raw_disks++] = rd;
+		}
+	}
+	sd_rw_unlock(&raw_disks_lock);
+
+	if (!rd)
+		sd_err("no raw store for %016"PRIx64" in %s", oid, path);
+	return rd;
+}
+
+static int remove_object_disk(struct raw_disk *rd, uint64_t oid,
+			      uint8_t ec_index, uint32_t epoch)
+{
+	struct raw_entry *entry;
+	int ret;
+
+	sd_write_lock(&rd->lock);
+	entry = lookup_entry(rd, oid, ec_index, epoch);
+	if (!entry) {
+		sd_rw_unlock(&rd->lock);
+		return SD_RES_NO_OBJ;
+	}
+
+	/* the slots can be reused only after the removal is persistent */
+	clear_slot(rd, entry->slot);
+	ret = flush_table(rd);
+	if (ret == SD_RES_SUCCESS) {
+		rb_erase(&entry->rb, &rd->entries);
+		put_entry_locked(entry);
+	} else
+		set_slot(rd, entry);
+	sd_rw_unlock(&rd->lock);
+
+	return ret;
+}
+
+/* Copy the data of 'src' to the slots of the new 'dst' */
+static int copy_entry(uint64_t oid, struct raw_entry *src,
+		      struct raw_entry *dst)
+{
+	void *buf = alloc_data_buffer(RAW_SLOT_SIZE);
+	int ret = SD_RES_SUCCESS;
+
+	for (uint32_t i = 0; i < src->nr_slots; i++) {
+		uint64_t offset = (uint64_t)i * RAW_SLOT_SIZE;
+
+		ret = raw_io(oid, src, buf, RAW_SLOT_SIZE, offset, false);
+		if (ret == SD_RES_SUCCESS)
+			ret = raw_io(oid, dst, buf, RAW_SLOT_SIZE, offset,
+				     true);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+	free_data_buffer(buf, RAW_SLOT_SIZE);
+
+	return ret;
+}
+
+/*
+ * Copy the object of 'epoch' from 'src' to 'dst' and remove it from 'src'.
+ * If 'dst' already has the object, only the copy in 'src' is removed.
+ */
+static int move_entry(struct raw_disk *dst, struct raw_disk *src,
+		      uint64_t oid, uint8_t ec_index, uint32_t epoch)
+{
+	struct raw_entry *sentry, *entry = NULL;
+	bool exists;
+	int ret;
+
+	sentry = get_entry(src, oid, ec_index, epoch);
+	if (!sentry)
+		return SD_RES_NO_OBJ;
+
+	sd_write_lock(&dst->lock);
+	exists = !!lookup_entry(dst, oid, ec_index, epoch);
+	if (!exists)
+		entry = alloc_entry(dst, oid, ec_index,
+				    (size_t)sentry->nr_slots * RAW_SLOT_SIZE);
+	sd_rw_unlock(&dst->lock);
+	if (!exists) {
+		if (!entry) {
+			ret = raw_err(dst, oid, errno);
+			goto out;
+		}
+		entry->epoch = epoch;
+		ret = copy_entry(oid, sentry, entry);
+		if (ret == SD_RES_SUCCESS)
+			ret = commit_entry(dst, entry);
+		else
+			put_entry(entry);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	ret = remove_object_disk(src, oid, ec_index, epoch);
+	if (ret == SD_RES_NO_OBJ)
+		ret = SD_RES_SUCCESS;
+	sd_debug("%016"PRIx64" epoch %"PRIu32" from %s to %s, %s", oid, epoch,
+		 src->path, dst->path, sd_strerror(ret));
+out:
+	put_entry(sentry);
+	return ret;
+}
+
+/*
+ * An object is looked up in the disk which it is hashed to, but it is left in
+ * another disk when the disks change.  Move it from there, like md_exist()
+ * does for the plain store, so that it is neither missed nor leaked.
+ */
+static bool find_misplaced(struct raw_disk *rd, uint64_t oid,
+			   uint8_t ec_index, uint32_t epoch)
+{
+	struct raw_disk *src = NULL;
+
+	sd_read_lock(&raw_disks_lock);
+	for (int i = 0; i < nr_raw_disks && !src; i++) {
+		if (raw_disks[i] == rd || raw_disks[i]->offline)
+			continue;
+		sd_read_lock(&raw_disks[i]->lock);
+		if (lookup_entry(raw_disks[i], oid, ec_index, epoch))
+			src = raw_disks[i];
+		sd_rw_unlock(&raw_disks[i]->lock);
+	}
+	sd_rw_unlock(&raw_disks_lock);
+
+	return src && move_entry(rd, src, oid, ec_index, epoch) ==
+		SD_RES_SUCCESS;
+}
+
+/* Same as get_entry(), but look for the misplaced object as well */
+static struct raw_entry *find_entry(struct raw_disk *rd, uint64_t oid,
+				    uint8_t ec_index, uint32_t epoch)
+{
+	struct raw_entry *entry = get_entry(rd, oid, ec_index, epoch);
+
+	if (!entry && find_misplaced(rd, oid, ec_index, epoch))
+		entry = get_entry(rd, oid, ec_index, epoch);
+
+	return entry;
+}
+
+static bool raw_exist(uint64_t oid, uint8_t ec_index)
+{
+	struct raw_disk *rd = oid_to_raw_disk(oid);
+	bool ret;
+
+	if (!rd)
+		return false;
+
+	ec_index = raw_ec_index(oid, ec_index);
+	sd_read_lock(&rd->lock);
+	ret = !!lookup_entry(rd, oid, ec_index, 0);
+	sd_rw_unlock(&rd->lock);
+	if (!ret)
+		ret = find_misplaced(rd, oid, ec_index, 0);
+
+	return ret;
+}
+
+static int raw_read(uint64_t oid, const struct siocb *iocb)
+{
+	uint8_t ec_index = raw_ec_index(oid, iocb->ec_index);
+	struct raw_disk *rd = oid_to_raw_disk(oid);
+	struct raw_entry *entry;
+	int ret;
+
+	if (!rd)
+		return SD_RES_EIO;
+
+	entry = find_entry(rd, oid, ec_index, 0);
+
+	/*
+	 * If the request is against the older epoch, try to read from
+	 * the stale objects
+	 */
+	if (!entry && (iocb->wildcard ||
+		       (0 < iocb->epoch && iocb->epoch < sys_epoch())))
+		entry = find_entry(rd, oid, ec_index, iocb->epoch);
+	if (!entry)
+		return SD_RES_NO_OBJ;
+
+	ret = raw_io(oid, entry, iocb->buf, iocb->length, iocb->offset,
+		     false);
+	put_entry(entry);
+
+	return ret;
+}
+
+static int raw_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct raw_disk *rd = oid_to_raw_disk(oid);
+	struct raw_entry *entry;
+	int ret;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	if (!rd)
+		return SD_RES_EIO;
+
+	entry = find_entry(rd, oid, raw_ec_index(oid, iocb->ec_index), 0);
+	if (!entry)
+		return SD_RES_NO_OBJ;
+
+	ret = raw_io(oid, entry, iocb->buf, iocb->length, iocb->offset, true);
+	put_entry(entry);
+
+	return ret;
+}
+
+static int raw_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	uint8_t ec_index = raw_ec_index(oid, iocb->ec_index);
+	struct raw_disk *rd = oid_to_raw_disk(oid);
+	size_t obj_size = get_store_objsize(oid);
+	struct raw_entry *entry;
+	int ret;
+
+	sd_debug("%016"PRIx64, oid);
+	if (!rd)
+		return SD_RES_EIO;
+
+	if (find_misplaced(rd, oid, ec_index, 0))
+		/* see default_create_and_write() */
+		return SD_RES_SUCCESS;
+
+	sd_write_lock(&rd->lock);
+	if (lookup_entry(rd, oid, ec_index, 0)) {
+		sd_rw_unlock(&rd->lock);
+		/* see default_create_and_write() */
+		sd_debug("%016"PRIx64" exists", oid);
+		return SD_RES_SUCCESS;
+	}
+	entry = alloc_entry(rd, oid, ec_index, obj_size);
+	sd_rw_unlock(&rd->lock);
+	if (!entry)
+		return raw_err(rd, oid, errno);
+
+	/* the slots hold the data of the previous object */
+	ret = SD_RES_SUCCESS;
+	if (iocb->offset != 0 || iocb->length != obj_size)
+		ret = zero_entry(oid, entry);
+	if (ret == SD_RES_SUCCESS)
+		ret = raw_io(oid, entry, iocb->buf, iocb->length,
+			     iocb->offset, true);
+	if (ret != SD_RES_SUCCESS) {
+		put_entry(entry);
+		return ret;
+	}
+
+	ret = commit_entry(rd, entry);
+	if (ret == SD_RES_SUCCESS)
+		objlist_cache_insert(oid);
+	return ret;
+}
+
+static int raw_remove_object(uint64_t oid, uint8_t ec_index)
+{
+	struct raw_disk *rd = oid_to_raw_disk(oid);
+	int ret;
+
+	if (!rd)
+		return SD_RES_EIO;
+
+	ec_index = raw_ec_index(oid, ec_index);
+	ret = remove_object_disk(rd, oid, ec_index, 0);
+	if (ret == SD_RES_NO_OBJ && find_misplaced(rd, oid, ec_index, 0))
+		ret = remove_object_disk(rd, oid, ec_index, 0);
+
+	return ret;
+}
+
+static int raw_link(uint64_t oid, uint32_t tgt_epoch)
+{
+	struct raw_disk *rd = oid_to_raw_disk(oid);
+	struct raw_entry *stale, *entry;
+	int ret;
+
+	sd_debug("try link %016"PRIx64" from snapshot with epoch %d", oid,
+		 tgt_epoch);
+	if (!rd)
+		return SD_RES_EIO;
+
+	/* both the live and the stale object might be in another disk */
+	find_misplaced(rd, oid, 0, 0);
+	find_misplaced(rd, oid, 0, tgt_epoch);
+
+	sd_write_lock(&rd->lock);
+	if (lookup_entry(rd, oid, 0, 0)) {
+		sd_rw_unlock(&rd->lock);
+		return SD_RES_SUCCESS;
+	}
+	stale = lookup_entry(rd, oid, 0, tgt_epoch);
+	if (!stale) {
+		sd_rw_unlock(&rd->lock);
+		return SD_RES_NO_OBJ;
+	}
+	refcount_inc(&stale->refcnt);
+	entry = alloc_entry(rd, oid, 0, (size_t)stale->nr_slots *
+			    RAW_SLOT_SIZE);
+	sd_rw_unlock(&rd->lock);
+	if (!entry) {
+		put_entry(stale);
+		return raw_err(rd, oid, errno);
+	}
+
+	ret = copy_entry(oid, stale, entry);
+	put_entry(stale);
+
+	if (ret != SD_RES_SUCCESS) {
+		put_entry(entry);
+		return ret;
+	}
+
+	return commit_entry(rd, entry);
+}
+
+/* See oid_stale() in plain_store.c */
+static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
+{
+	uint32_t i, nr_copies;
+	const struct sd_vnode *v;
+	bool ret = true;
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+
+	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
+	vinfo_oid_to_vnodes(oid, vinfo, nr_copies, obj_vnodes);
+	for (i = 0; i < nr_copies; i++) {
+		v = obj_vnodes[i];
+		if (vnode_is_local(v)) {
+			if (is_erasure_oid(oid)) {
+				if (i == ec_index)
+					ret = false;
+			} else {
+				ret = false;
+			}
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Move the live objects to the stale area of 'epoch'.  If 'vinfo' is NULL,
+ * all the objects are moved, otherwise only the ones which don't belong to
+ * this node any more.
+ */
+static int move_to_stale(struct raw_disk *rd, uint32_t epoch,
+			 struct vnode_info *vinfo)
+{
+	struct raw_entry *entry, *old, **moving = NULL, **dead = NULL;
+	size_t nr_moving = 0, nr_dead = 0;
+	int ret;
+
+	sd_write_lock(&rd->lock);
+	/* moving changes the order of the entries, so collect them first */
+	rb_for_each_entry(entry, &rd->entries, rb) {
+		if (entry->epoch != 0)
+			continue;
+		if (vinfo && !oid_stale(entry->oid, entry->ec_index, vinfo))
+			continue;
+		moving = xrealloc(moving, (nr_moving + 1) * sizeof(*moving));
+		moving[nr_moving++] = entry;
+	}
+
+	for (size_t i = 0; i < nr_moving; i++) {
+		entry = moving[i];
+		rb_erase(&entry->rb, &rd->entries);
+		entry->epoch = epoch;
+		set_slot(rd, entry);
+		old = insert_entry(rd, entry);
+		if (old) {
+			clear_slot(rd, old->slot);
+			dead = xrealloc(dead, (nr_dead + 1) * sizeof(*dead));
+			dead[nr_dead++] = old;
+		}
+		sd_debug("moved object %016"PRIx64, entry->oid);
+	}
+
+	/* all the entries in a block of the table are written at once */
+	ret = flush_table(rd);
+	if (ret == SD_RES_SUCCESS)
+		for (size_t i = 0; i < nr_dead; i++)
+			put_entry_locked(dead[i]);
+	sd_rw_unlock(&rd->lock);
+
+	free(moving);
+	free(dead);
+	return ret;
+}
+
+static int for_each_raw_disk(int (*func)(struct raw_disk *, void *),
+			     void *arg)
+{
+	int ret = SD_RES_SUCCESS;
+
+	sd_read_lock(&raw_disks_lock);
+	for (int i = 0; i < nr_raw_disks; i++) {
+		ret = func(raw_disks[i], arg);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+	sd_rw_unlock(&raw_disks_lock);
+
+	return ret;
+}
+
+static int update_epoch_disk(struct raw_disk *rd, void *arg)
+{
+	uint32_t epoch = *(uint32_t *)arg;
+	struct vnode_info *vinfo = get_vnode_info();
+	int ret;
+
+	ret = move_to_stale(rd, epoch, vinfo);
+	put_vnode_info(vinfo);
+
+	return ret;
+}
+
+static int raw_update_epoch(uint32_t epoch)
+{
+	sd_assert(epoch);
+	return for_each_raw_disk(update_epoch_disk, &epoch);
+}
+
+static int purge_obj_disk(struct raw_disk *rd, void *arg)
+{
+	return move_to_stale(rd, *(uint32_t *)arg, NULL);
+}
+
+static int raw_purge_obj(void)
+{
+	uint32_t tgt_epoch = get_latest_epoch();
+
+	return for_each_raw_disk(purge_obj_disk, &tgt_epoch);
+}
+
+/* Remove the stale objects, or all the objects if 'live' is true */
+static int remove_entries(struct raw_disk *rd, bool live)
+{
+	struct raw_entry *entry, **dead = NULL;
+	size_t nr_dead = 0;
+	int ret;
+
+	sd_write_lock(&rd->lock);
+	rb_for_each_entry(entry, &rd->entries, rb) {
+		if (!live && entry->epoch == 0)
+			continue;
+
+		rb_erase(&entry->rb, &rd->entries);
+		clear_slot(rd, entry->slot);
+		dead = xrealloc(dead, (nr_dead + 1) * sizeof(*dead));
+		dead[nr_dead++] = entry;
+	}
+	ret = flush_table(rd);
+	if (ret == SD_RES_SUCCESS)
+		for (size_t i = 0; i < nr_dead; i++)
+			put_entry_locked(dead[i]);
+	sd_rw_unlock(&rd->lock);
+
+	free(dead);
+	return ret;
+}
+
+static int cleanup_disk(struct raw_disk *rd, void *arg)
+{
+	return remove_entries(rd, false);
+}
+
+static int raw_cleanup(void)
+{
+	return for_each_raw_disk(cleanup_disk, NULL);
+}
+
+static int raw_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+{
+	struct raw_disk *rd = oid_to_raw_disk(oid);
+	uint32_t length = get_store_objsize(oid);
+	struct raw_entry *entry;
+	void *buf;
+	int ret;
+
+	if (!rd)
+		return SD_RES_EIO;
+
+	entry = find_entry(rd, oid, 0, 0);
+	if (!entry)
+		entry = find_entry(rd, oid, 0, epoch);
+	if (!entry)
+		return SD_RES_NO_OBJ;
+
+	buf = alloc_data_buffer(length);
+	ret = raw_io(oid, entry, buf, length, 0, false);
+	put_entry(entry);
+	if (ret != SD_RES_SUCCESS) {
+		free_data_buffer(buf, length);
+		return ret;
+	}
+
+	get_buffer_sha1(buf, length, sha1);
+	free_data_buffer(buf, length);
+
+	sd_debug("the message digest of %016"PRIx64" at epoch %d is %s", oid,
+		 epoch, sha1_to_hex(sha1));
+	return SD_RES_SUCCESS;
+}
+
+static int raw_sync(uint64_t oid, uint8_t ec_index)
+{
+	struct raw_disk *rd = oid_to_raw_disk(oid);
+	struct raw_entry *entry;
+
+	if (!rd)
+		return SD_RES_EIO;
+
+	entry = find_entry(rd, oid, raw_ec_index(oid, ec_index), 0);
+	if (!entry)
+		return SD_RES_NO_OBJ;
+	put_entry(entry);
+
+	if (fdatasync(rd->fd) < 0) {
+		sd_err("failed to sync %016"PRIx64", %m", oid);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static void free_raw_disks(void)
+{
+	sd_write_lock(&raw_disks_lock);
+	for (int i = 0; i < nr_raw_disks; i++)
+		free_raw_disk(raw_disks[i]);
+	free(raw_disks);
+	raw_disks = NULL;
+	nr_raw_disks = 0;
+	sd_rw_unlock(&raw_disks_lock);
+}
+
+static int format_disk(const char *path)
+{
+	uint64_t size;
+	int fd, ret;
+
+	fd = open(path, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return SD_RES_EIO;
+	}
+	size = get_raw_disk_size(fd);
+	ret = size ? format_device(path, fd, size) : SD_RES_EIO;
+	close(fd);
+
+	return ret;
+}
+
+static int raw_format(void)
+{
+	sd_debug("try get a clean store");
+	free_raw_disks();
+	return for_each_obj_path(format_disk);
+}
+
+/*
+ * Clear a disk being plugged, as the directory of the plain store is purged.
+ * A disk which is still loaded since it was unplugged keeps its table, and
+ * its objects are removed after the I/O in flight.
+ */
+int raw_plug_disk(const char *path)
+{
+	struct raw_disk *rd;
+	int ret;
+
+	sd_read_lock(&raw_disks_lock);
+	rd = find_raw_disk(path);
+	sd_rw_unlock(&raw_disks_lock);
+
+	if (rd) {
+		ret = remove_entries(rd, true);
+		if (ret == SD_RES_SUCCESS) {
+			sd_write_lock(&raw_disks_lock);
+			rd->offline = false;
+			sd_rw_unlock(&raw_disks_lock);
+		}
+		return ret;
+	}
+
+	return format_disk(path);
+}
+
+/* Keep the disk for the I/O in flight, but don't look objects up in it */
+static void raw_unplug(const char *path)
+{
+	struct raw_disk *rd;
+
+	sd_write_lock(&raw_disks_lock);
+	rd = find_raw_disk(path);
+	if (rd)
+		rd->offline = true;
+	sd_rw_unlock(&raw_disks_lock);
+}
+
+static int init_vdi_state(struct raw_entry *entry)
+{
+	struct sd_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
+	uint64_t oid = entry->oid;
+	int ret;
+
+	ret = raw_io(oid, entry, inode, SD_INODE_HEADER_SIZE, 0, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read inode header %016" PRIx64 " %" PRId32,
+		       oid, entry->epoch);
+		goto out;
+	}
+	add_vdi_state_unordered(oid_to_vid(oid), inode->nr_copies,
+		      vdi_is_snapshot(inode), inode->copy_policy,
+		      inode->block_size_shift, inode->parent_vdi_id);
+	/* an old child VDI ID might be left there */
+	if (inode->copy_policy && ec_stripe_shift_valid(inode->ec_stripe_shift))
+		set_vdi_ec_stripe_shift(oid_to_vid(oid),
+					inode->ec_stripe_shift);
+
+	if (inode->name[0] == '\0')
+		atomic_set_bit(oid_to_vid(oid), sys->vdi_deleted);
+
+	atomic_set_bit(oid_to_vid(oid), sys->vdi_inuse);
+out:
+	free(inode);
+	return ret;
+}
+
+/* The stale objects first, so that the live ones win */
+static int init_objlist_and_vdi_bitmap(struct raw_disk *rd, void *arg)
+{
+	bool live = *(bool *)arg;
+	struct raw_entry *entry;
+	int ret;
+
+	rb_for_each_entry(entry, &rd->entries, rb) {
+		if (live != (entry->epoch == 0))
+			continue;
+
+		objlist_cache_insert(entry->oid);
+		if (!is_vdi_obj(entry->oid))
+			continue;
+		ret = init_vdi_state(entry);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int load_disk(const char *path)
+{
+	struct raw_disk *rd = load_raw_disk(path);
+
+	if (!rd)
+		return SD_RES_EIO;
+
+	sd_write_lock(&raw_disks_lock);
+	raw_disks = xrealloc(raw_disks, (nr_raw_disks + 1) *
+			     sizeof(*raw_disks));
+	raw_disks[nr_raw_disks++] = rd;
+	sd_rw_unlock(&raw_disks_lock);
+
+	return SD_RES_SUCCESS;
+}
+
+static int raw_init(void)
+{
+	bool live = false;
+	int ret;
+
+	sd_debug("use raw store driver");
+	if (uatomic_is_true(&sys->use_journal)) {
+		sd_warn("raw store doesn't support journaling, turn it off");
+		uatomic_set_false(&sys->use_journal);
+	}
+
+	free_raw_disks();
+	ret = for_each_obj_path(load_disk);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	for_each_raw_disk(init_objlist_and_vdi_bitmap, &live);
+	live = true;
+	return for_each_raw_disk(init_objlist_and_vdi_bitmap, &live);
+}
+
+static struct store_driver raw_store = {
+	.id = RAW_STORE,
+	.name = "raw",
+	.init = raw_init,
+	.exist = raw_exist,
+	.create_and_write = raw_create_and_write,
+	.write = raw_write,
+	.read = raw_read,
+	.link = raw_link,
+	.update_epoch = raw_update_epoch,
+	.cleanup = raw_cleanup,
+	.format = raw_format,
+	.remove_object = raw_remove_object,
+	.get_hash = raw_get_hash,
+	.sync = raw_sync,
+	.purge_obj = raw_purge_obj,
+	.unplug = raw_unplug,
+};
+
+add_store_driver(raw_store);
@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * io_uring based execution of the peer read and write requests
+ *
+ * Without io_uring, a worker thread of the peer work queue performs the whole
+ * request with pread/pwrite, so the number of outstanding I/Os on the disks is
+ * bounded by the number of worker threads.  With io_uring, a request is
+ * processed in three steps:
+ *
+ *  1. a worker thread prepares the I/O with the store driver (epoch check,
+ *     journaling, opening the object and discarding zero blocks), which can
+ *     sleep but doesn't transfer the data,
+ *  2. the main thread submits the data transfer to one of the rings and
+ *  3. the reaper thread of the ring collects the completions and passes them
+ *     back to the main thread, which ends the request.
+ *
+ * The object files are opened with the same flags as the synchronous path,
+ * so O_DSYNC, O_DIRECT and the nosync option keep their semantics.  Failed
+ * transfers are handed to a worker thread because error handling of the store
+ * driver might have to touch the disks.
+ */
+
+#include <liburing.h>
+
+#include "sheep_priv.h"
+
+struct uring_ring {
+	struct io_uring ring;
+	sd_thread_t reaper;
+
+	/* accessed only in the main thread */
+	uint32_t nr_inflight;
+	struct list_head backlog;
+
+	/* completed I/Os passed from the reaper to the main thread */
+	struct sd_mutex done_lock;
+	struct list_head done_list;
+};
+
+static struct uring_ring *rings;
+static int nr_rings;
+static uint32_t ring_depth;
+static int uring_efd;
+
+static void uring_fill_iocb(struct request *req, struct siocb *iocb)
+{
+	struct sd_req *hdr = &req->rq;
+
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->epoch = hdr->epoch;
+	iocb->buf = req->data;
+	iocb->length = hdr->data_length;
+	iocb->offset = hdr->obj.offset;
+	iocb->ec_index = hdr->obj.ec_index;
+	iocb->copy_policy = hdr->obj.copy_policy;
+	iocb->wildcard = !!(hdr->flags & SD_FLAG_CMD_WILDCARD);
+}
+
+static main_fn void uring_end_request(struct request *req)
+{
+	struct uring_io *uio = &req->uio;
+
+	if (uio->aio.entry) {
+		fd_cache_put(uio->aio.entry);
+		uio->aio.entry = NULL;
+	}
+
+	if (req->rp.result == SD_RES_SUCCESS && !uio->write)
+		req->rp.data_length = req->rq.data_length;
+
+	uio->end_io(&req->work);
+}
+
+static main_fn void uring_submit(struct uring_io *uio)
+{
+	struct uring_ring *r = uio->ring;
+	struct io_uring_sqe *sqe;
+	void *buf = (char *)uio->aio.buf + uio->done;
+	uint32_t len = uio->aio.length - uio->done;
+	uint64_t offset = uio->aio.offset + uio->done;
+	int ret;
+
+	/* Keep the number of the outstanding I/Os within the size of CQ */
+	if (r->nr_inflight >= ring_depth) {
+		list_add_tail(&uio->list, &r->backlog);
+		return;
+	}
+
+	sqe = io_uring_get_sqe(&r->ring);
+	if (unlikely(!sqe))
+		panic("no io_uring sqe available");
+
+	if (uio->write)
+		io_uring_prep_write(sqe, uio->aio.entry->fd, buf, len, offset);
+	else
+		io_uring_prep_read(sqe, uio->aio.entry->fd, buf, len, offset);
+	io_uring_sqe_set_data(sqe, uio);
+	r->nr_inflight++;
+
+	ret = io_uring_submit(&r->ring);
+	if (unlikely(ret < 0))
+		panic("failed to submit io_uring request, %s", strerror(-ret));
+}
+
+static worker_fn void uring_error_work(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	struct uring_io *uio = &req->uio;
+	struct siocb iocb;
+	/* A zero-length write means no space left, as xpwrite() assumes */
+	int err = uio->result < 0 ? -uio->result : ENOSPC;
+
+	uring_fill_iocb(req, &iocb);
+	req->rp.result = sd_store->io_error(req->rq.obj.oid, &iocb, uio->write,
+					    uio->result, err);
+}
+
+static main_fn void uring_error_done(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+
+	uring_end_request(req);
+}
+
+static main_fn void uring_complete(struct uring_io *uio)
+{
+	struct request *req = container_of(uio, struct request, uio);
+
+	if (uio->result > 0) {
+		uio->done += uio->result;
+		if (uio->done < uio->aio.length) {
+			/* short transfer, submit the rest of the buffer */
+			uring_submit(uio);
+			return;
+		}
+	} else if (uio->result < 0 || uio->write) {
+		req->work.fn = uring_error_work;
+		req->work.done = uring_error_done;
+		queue_work(sys->peer_wqueue, &req->work);
+		return;
+	}
+	/* a zero-length read means EOF, as xpread() assumes */
+
+	uring_end_request(req);
+}
+
+static main_fn void uring_done_handler(int fd, int events, void *data)
+{
+	struct uring_io *uio;
+	LIST_HEAD(list);
+
+	eventfd_xread(fd);
+
+	for (int i = 0; i < nr_rings; i++) {
+		struct uring_ring *r = rings + i;
+
+		sd_mutex_lock(&r->done_lock);
+		list_splice_init(&r->done_list, &list);
+		sd_mutex_unlock(&r->done_lock);
+
+		list_for_each_entry(uio, &list, list) {
+			list_del(&uio->list);
+			r->nr_inflight--;
+			uring_complete(uio);
+		}
+
+		while (!list_empty(&r->backlog) &&
+		       r->nr_inflight < ring_depth) {
+			uio = list_first_entry(&r->backlog, struct uring_io,
+					       list);
+			list_del(&uio->list);
+			uring_submit(uio);
+		}
+	}
+}
+
+static void *uring_reaper(void *arg)
+{
+	struct uring_ring *r = arg;
+	struct io_uring_cqe *cqe;
+	struct uring_io *uio;
+	unsigned head, nr;
+	int ret;
+	LIST_HEAD(list);
+
+	for (;;) {
+		ret = io_uring_wait_cqe(&r->ring, &cqe);
+		if (unlikely(ret < 0)) {
+			if (ret == -EINTR)
+				continue;
+			panic("failed to wait for io_uring completion, %s",
+			      strerror(-ret));
+		}
+
+		nr = 0;
+		io_uring_for_each_cqe(&r->ring, head, cqe) {
+			uio = io_uring_cqe_get_data(cqe);
+			uio->result = cqe->res;
+			list_add_tail(&uio->list, &list);
+			nr++;
+		}
+		io_uring_cq_advance(&r->ring, nr);
+
+		sd_mutex_lock(&r->done_lock);
+		list_splice_tail_init(&list, &r->done_list);
+		sd_mutex_unlock(&r->done_lock);
+
+		eventfd_xwrite(uring_efd, 1);
+	}
+
+	return NULL;
+}
+
+static worker_fn void uring_prepare_work(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	struct uring_io *uio = &req->uio;
+	uint64_t oid = req->rq.obj.oid;
+	struct siocb iocb;
+	int ret;
+
+	uring_fill_iocb(req, &iocb);
+	if (uio->write)
+		ret = sd_store->prepare_write(oid, &iocb, &uio->aio);
+	else {
+		ret = sd_store->prepare_read(oid, &iocb, &uio->aio);
+		/*
+		 * The object might be in the stale directory, let the
+		 * synchronous path look it up.
+		 */
+		if (ret == SD_RES_NO_OBJ)
+			ret = sd_store->read(oid, &iocb);
+	}
+
+	req->rp.result = ret;
+}
+
+static main_fn void uring_prepare_done(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	struct uring_io *uio = &req->uio;
+	static int next;
+
+	if (req->rp.result != SD_RES_SUCCESS || !uio->aio.entry ||
+	    uio->aio.length == 0) {
+		uring_end_request(req);
+		return;
+	}
+
+	uio->ring = rings + next;
+	next = (next + 1) % nr_rings;
+	uring_submit(uio);
+}
+
+/*
+ * The store driver can be changed by a cluster format, and isn't there at all
+ * on a node which is not formatted yet, so check it for every request.
+ */
+static inline bool store_supports_uring(void)
+{
+	return sd_store && sd_store->prepare_read && sd_store->prepare_write &&
+		sd_store->io_error;
+}
+
+/*
+ * Queue the peer request to the io_uring path.  Return false if the request
+ * has to be processed by the synchronous path.
+ */
+main_fn bool queue_uring_request(struct request *req)
+{
+	struct uring_io *uio = &req->uio;
+
+	if (!rings || sys->gateway_only || !store_supports_uring())
+		return false;
+
+	switch (req->rq.opcode) {
+	case SD_OP_READ_PEER:
+		break;
+	case SD_OP_WRITE_PEER:
+		/* a parity delta has to be read and written under a lock */
+		if (req->rq.flags & SD_FLAG_CMD_PARITY_DELTA)
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	memset(uio, 0, sizeof(*uio));
+	uio->write = req->rq.opcode == SD_OP_WRITE_PEER;
+	uio->end_io = req->work.done;
+	INIT_LIST_NODE(&uio->list);
+
+	req->work.fn = uring_prepare_work;
+	req->work.done = uring_prepare_done;
+	queue_work(sys->peer_wqueue, &req->work);
+
+	return true;
+}
+
+int uring_init(uint32_t depth, int nr)
+{
+	int ret;
+
+	uring_efd = eventfd(0, EFD_NONBLOCK);
+	if (uring_efd < 0) {
+		sd_err("failed to create event fd: %m");
+		return -1;
+	}
+
+	rings = xcalloc(nr, sizeof(*rings));
+	for (int i = 0; i < nr; i++) {
+		struct uring_ring *r = rings + i;
+
+		ret = io_uring_queue_init(depth, &r->ring, 0);
+		if (ret < 0) {
+			sd_err("failed to set up io_uring, %s", strerror(-ret));
+			return -1;
+		}
+
+		INIT_LIST_HEAD(&r->backlog);
+		INIT_LIST_HEAD(&r->done_list);
+		sd_init_mutex(&r->done_lock);
+
+		ret = sd_thread_create("uring", &r->reaper, uring_reaper, r);
+		if (ret) {
+			sd_err("failed to create reaper thread, %s",
+			       strerror(ret));
+			return -1;
+		}
+	}
+	nr_rings = nr;
+	ring_depth = depth;
+
+	ret = register_event(uring_efd, uring_done_handler, NULL);
+	if (ret) {
+		sd_err("failed to register uring event fd");
+		return -1;
+	}
+
+	sd_info("io_uring enabled, %d rings of depth %"PRIu32, nr, depth);
+	return 0;
+}
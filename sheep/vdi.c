@@ -18,6 +18,7 @@ struct vdi_state_entry {
 	bool snapshot;
 	bool deleted;
 	uint8_t copy_policy;
+	uint8_t ec_stripe_shift;
 	uint32_t parent_vid;
 	struct rb_node node;
 
@@ -312,6 +313,44 @@ uint8_t get_vdi_block_size_shift(uint32_t vid)
 	return entry->block_size_shift;
 }
 
+uint8_t get_vdi_ec_stripe_shift(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	sd_rw_unlock(&vdi_state_lock);
+
+	return entry ? entry->ec_stripe_shift : 0;
+}
+
+/* Data stripe size of the erasure coded objects of the VDI */
+uint32_t get_vdi_ec_stripe_size(uint32_t vid)
+{
+	return ec_stripe_size(get_vdi_ec_stripe_shift(vid));
+}
+
+/*
+ * The stripe size decides where the data of an erasure coded object lives, so
+ * it is set only when the VDI is registered and never changed afterwards.
+ */
+void set_vdi_ec_stripe_shift(uint32_t vid, uint8_t shift)
+{
+	struct vdi_state_entry *entry;
+
+	if (!ec_stripe_shift_valid(shift)) {
+		sd_err("invalid stripe shift %"PRIu8" of %"PRIx32", ignored",
+		       shift, vid);
+		return;
+	}
+
+	sd_write_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (entry)
+		entry->ec_stripe_shift = shift;
+	sd_rw_unlock(&vdi_state_lock);
+}
+
 int get_obj_copy_number(uint64_t oid, int nr_zones)
 {
 	return min(get_vdi_copy_number(oid_to_vid(oid)), nr_zones);
@@ -427,6 +466,7 @@ int fill_vdi_state_list(const struct sd_req *hdr,
 		vs[last].deleted = entry->deleted;
 		vs[last].copy_policy = entry->copy_policy;
 		vs[last].block_size_shift = entry->block_size_shift;
+		vs[last].ec_stripe_shift = entry->ec_stripe_shift;
 		vs[last].lock_state = entry->lock_state;
 		vs[last].lock_owner = entry->owner;
 		vs[last].nr_participants = entry->nr_participants;
@@ -1086,6 +1126,7 @@ static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 	new->store_policy = iocb->store_policy;
 	new->nr_copies = iocb->nr_copies;
 	new->block_size_shift = find_next_bit(&block_size, BITS_PER_LONG, 0);
+	new->ec_stripe_shift = iocb->ec_stripe_shift;
 	new->snap_id = new_snapid;
 	new->parent_vdi_id = iocb->base_vid;
 	if (data_vdi_id)
@@ -1577,7 +1618,8 @@ int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
 }
 
 static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid,
-			  uint8_t copy_policy, uint8_t block_size_shift)
+			  uint8_t copy_policy, uint8_t block_size_shift,
+			  uint8_t ec_stripe_shift)
 {
 	int ret;
 	struct sd_req hdr;
@@ -1589,6 +1631,7 @@ static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid,
 	hdr.vdi_state.set_bitmap = false;
 	hdr.vdi_state.copy_policy = copy_policy;
 	hdr.vdi_state.block_size_shift = block_size_shift;
+	hdr.vdi_state.ec_stripe_shift = ec_stripe_shift;
 
 	ret = exec_local_req(&hdr, NULL);
 	if (ret != SD_RES_SUCCESS)
@@ -1632,7 +1675,8 @@ int vdi_create(const struct vdi_iocb *iocb, uint32_t *new_vid)
 	*new_vid = info.free_bit;
 	ret = notify_vdi_add(*new_vid, iocb->nr_copies,
 			     iocb->base_vid == 0 ? info.vid : iocb->base_vid,
-			     iocb->copy_policy, iocb->block_size_shift);
+			     iocb->copy_policy, iocb->block_size_shift,
+			     iocb->ec_stripe_shift);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -1670,7 +1714,8 @@ int vdi_snapshot(const struct vdi_iocb *iocb, uint32_t *new_vid)
 	sd_assert(info.snapid > 0);
 	*new_vid = info.free_bit;
 	ret = notify_vdi_add(*new_vid, iocb->nr_copies, info.vid,
-			     iocb->copy_policy, iocb->block_size_shift);
+			     iocb->copy_policy, iocb->block_size_shift,
+			     iocb->ec_stripe_shift);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -2195,7 +2240,9 @@ static int clean_matched_obj(uint64_t oid, const char *path,
 		if (ret) {
 			sd_err("failed to unlink %s", path);
 			ret = SD_RES_EIO;
-		}
+		} else
+			md_index_object(path, true);
+		fd_cache_invalidate(oid);
 	}
 
 	return ret;
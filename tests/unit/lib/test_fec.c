@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <unity.h>
+#include <cmock.h>
+
+#include "fec.h"
+
+#define NR_DATA		4
+#define NR_PARITY	2
+#define STRIP_SIZE	(64 * 1024 + 13)	/* not a multiple of any vector */
+
+static const char * const kernels[] = { "scalar", "ssse3", "avx2", "avx512" };
+
+static struct fec *ctx;
+static uint8_t *strips[NR_DATA + NR_PARITY];
+static uint8_t *expected[NR_PARITY];
+static const int pidx[NR_PARITY] = { NR_DATA, NR_DATA + 1 };
+
+static void encode(void)
+{
+	fec_encode(ctx, (const uint8_t * const *)strips, strips + NR_DATA,
+		   pidx, NR_PARITY, STRIP_SIZE);
+}
+
+static void test_fec_kernels_encode(void)
+{
+	TEST_ASSERT_EQUAL_INT(0, fec_set_kernel("scalar"));
+	encode();
+	for (int i = 0; i < NR_PARITY; i++)
+		memcpy(expected[i], strips[NR_DATA + i], STRIP_SIZE);
+
+	for (int i = 0; i < ARRAY_SIZE(kernels); i++) {
+		if (fec_set_kernel(kernels[i]) < 0)
+			continue;
+
+		for (int j = 0; j < NR_PARITY; j++)
+			memset(strips[NR_DATA + j], 0, STRIP_SIZE);
+		encode();
+		for (int j = 0; j < NR_PARITY; j++)
+			TEST_ASSERT_EQUAL_MEMORY(expected[j],
+						 strips[NR_DATA + j],
+						 STRIP_SIZE);
+	}
+}
+
+static void test_fec_unknown_kernel(void)
+{
+	TEST_ASSERT_EQUAL_INT(-1, fec_set_kernel("none"));
+}
+
+static void test_fec_decode_buffer(void)
+{
+	/* Lose the first two data strips */
+	int idx[NR_DATA] = { 2, 3, 4, 5 };
+	uint8_t *input[NR_DATA];
+	char *out = malloc(STRIP_SIZE);
+
+	for (int i = 0; i < NR_DATA; i++)
+		input[i] = strips[idx[i]];
+
+	for (int i = 0; i < ARRAY_SIZE(kernels); i++) {
+		if (fec_set_kernel(kernels[i]) < 0)
+			continue;
+
+		for (int lost = 0; lost < 2; lost++) {
+			memset(out, 0, STRIP_SIZE);
+			fec_decode_buffer(ctx, input, idx, out, lost,
+					  STRIP_SIZE * NR_DATA);
+			TEST_ASSERT_EQUAL_MEMORY(strips[lost], out,
+						 STRIP_SIZE);
+		}
+	}
+	free(out);
+}
+
+int main(int argc, char **argv)
+{
+	init_fec();
+	ctx = fec_new(NR_DATA, NR_DATA + NR_PARITY);
+	for (int i = 0; i < NR_DATA + NR_PARITY; i++) {
+		strips[i] = malloc(STRIP_SIZE);
+		for (int j = 0; j < STRIP_SIZE; j++)
+			strips[i][j] = random();
+	}
+	for (int i = 0; i < NR_PARITY; i++)
+		expected[i] = malloc(STRIP_SIZE);
+
+	UNITY_BEGIN();
+
+	RUN_TEST(test_fec_kernels_encode);
+	RUN_TEST(test_fec_unknown_kernel);
+	/* Decode from the parity strips encoded above */
+	RUN_TEST(test_fec_decode_buffer);
+
+	return UNITY_END();
+}
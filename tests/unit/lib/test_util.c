@@ -223,6 +223,21 @@ static void test_str_to_u16_EINVAL(void)
 	assert_str_to_u16_EINVAL("42a");
 }
 
+/* crc32c */
+
+static void test_crc32c_check_value(void)
+{
+	TEST_ASSERT_EQUAL_HEX32(0x00000000, crc32c(0, "", 0));
+	TEST_ASSERT_EQUAL_HEX32(0xE3069283, crc32c(0, "123456789", 9));
+}
+
+static void test_crc32c_continues_over_buffers(void)
+{
+	uint32_t crc = crc32c(0, "1234", 4);
+
+	TEST_ASSERT_EQUAL_HEX32(0xE3069283, crc32c(crc, "56789", 5));
+}
+
 int main(int argc, char **argv)
 {
 	UNITY_BEGIN();
@@ -236,5 +251,7 @@ int main(int argc, char **argv)
 	RUN_TEST(test_str_to_u16_success);
 	RUN_TEST(test_str_to_u16_ERANGE);
 	RUN_TEST(test_str_to_u16_EINVAL);
+	RUN_TEST(test_crc32c_check_value);
+	RUN_TEST(test_crc32c_continues_over_buffers);
 	return UNITY_END();
 }
@@ -24,5 +24,8 @@ MOCK_METHOD(sd_write_object, int, 0,
 MOCK_METHOD(sd_remove_object, int, 0,
 	    uint64_t oid)
 
+/* sheep/store/fd_cache.c */
+MOCK_VOID_METHOD(fd_cache_invalidate, uint64_t oid)
+
 /* sheep/store/common.c */
 MOCK_METHOD(store_id_match, bool, false, enum store_id id)
@@ -337,6 +337,85 @@ START_TEST(test_nodes_dispersion)
 }
 END_TEST
 
+/* Number of the zones the nodes are spread to for the placement tests */
+#define NR_ZONES 8
+#define NR_LOOKUPS (1024 * 1024)
+
+static void gen_zoned_vnodes(struct sd_node *nodes, struct rb_root *vroot)
+{
+	int nr_nodes = gen_nodes(nodes, 0);
+
+	INIT_RB_ROOT(vroot);
+	for (int i = 0; i < nr_nodes; i++) {
+		nodes[i].zone = i % NR_ZONES;
+		node_to_vnodes(nodes + i, vroot);
+	}
+}
+
+/* the flat vnode table places the replicas as the vnode ring does */
+START_TEST(test_vnode_table)
+{
+	struct sd_node nodes[DATA_SIZE];
+	const struct sd_vnode *expected[SD_MAX_COPIES], *vnodes[SD_MAX_COPIES];
+	struct vnode_table vtable;
+	struct rb_root vroot;
+
+	gen_zoned_vnodes(nodes, &vroot);
+	build_vnode_table(&vtable, &vroot);
+
+	for (int i = 0; i < DATA_SIZE * 16; i++) {
+		uint64_t oid = vid_to_data_oid(i / 64, i);
+		int nr_copies = i % NR_ZONES + 1;
+
+		oid_to_vnodes(oid, &vroot, nr_copies, expected);
+		vtable_oid_to_vnodes(oid, &vtable, nr_copies, vnodes);
+		for (int j = 0; j < nr_copies; j++)
+			ck_assert_ptr_eq(vnodes[j], expected[j]);
+	}
+
+	free_vnode_table(&vtable);
+	rb_destroy(&vroot, struct sd_vnode, rb);
+}
+END_TEST
+
+static double lookup_rate(uint64_t start, int nr)
+{
+	return (double)nr * 1000000000 / (clock_get_time() - start);
+}
+
+/* compare the lookup rate of the vnode ring and the flat vnode table */
+START_TEST(bench_vnode_lookup)
+{
+	struct sd_node nodes[DATA_SIZE];
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	struct vnode_table vtable;
+	struct rb_root vroot;
+	uint64_t start;
+	double rb_rate, table_rate;
+
+	gen_zoned_vnodes(nodes, &vroot);
+	build_vnode_table(&vtable, &vroot);
+
+	start = clock_get_time();
+	for (int i = 0; i < NR_LOOKUPS; i++)
+		oid_to_vnodes(vid_to_data_oid(i / 1024, i), &vroot, 3,
+			      vnodes);
+	rb_rate = lookup_rate(start, NR_LOOKUPS);
+
+	start = clock_get_time();
+	for (int i = 0; i < NR_LOOKUPS; i++)
+		vtable_oid_to_vnodes(vid_to_data_oid(i / 1024, i), &vtable, 3,
+				     vnodes);
+	table_rate = lookup_rate(start, NR_LOOKUPS);
+
+	printf("3 copies: %.0f lookups/s with the vnode ring, %.0f lookups/s"
+	       " with the vnode table\n", rb_rate, table_rate);
+
+	free_vnode_table(&vtable);
+	rb_destroy(&vroot, struct sd_vnode, rb);
+}
+END_TEST
+
 static size_t (*gen_disks)(struct disk *disks, int idx);
 
 /* generate one disk who has many virtual disks */
@@ -566,6 +645,7 @@ static Suite *test_suite(void)
 	TCase *tc_disks3 = tcase_create("many disks with some vdisks");
 	TCase *tc_objects1 = tcase_create("many data objects");
 	TCase *tc_objects2 = tcase_create("many vdi objects");
+	TCase *tc_placement = tcase_create("vnode placement");
 
 	tcase_add_checked_fixture(tc_basic1, basic1_setup, NULL);
 	tcase_add_checked_fixture(tc_basic2, basic2_setup, NULL);
@@ -579,6 +659,7 @@ static Suite *test_suite(void)
 	tcase_add_checked_fixture(tc_disks3, disk3_setup, NULL);
 	tcase_add_checked_fixture(tc_objects1, object1_setup, NULL);
 	tcase_add_checked_fixture(tc_objects2, object2_setup, NULL);
+	tcase_add_checked_fixture(tc_placement, node5_setup, NULL);
 
 	tcase_add_test(tc_basic1, test_basic_dispersion);
 	tcase_add_test(tc_basic2, test_basic_dispersion);
@@ -598,6 +679,8 @@ static Suite *test_suite(void)
 	tcase_add_test(tc_disks3, test_disks_dispersion);
 	tcase_add_test(tc_objects1, test_objects_dispersion);
 	tcase_add_test(tc_objects2, test_objects_dispersion);
+	tcase_add_test(tc_placement, test_vnode_table);
+	tcase_add_test(tc_placement, bench_vnode_lookup);
 
 	suite_add_tcase(s, tc_basic1);
 	suite_add_tcase(s, tc_basic2);
@@ -608,6 +691,7 @@ static Suite *test_suite(void)
 	suite_add_tcase(s, tc_disks2);
 	suite_add_tcase(s, tc_objects1);
 	suite_add_tcase(s, tc_objects2);
+	suite_add_tcase(s, tc_placement);
 
 	return s;
 }